@@ -1,140 +1,15 @@
-#include "boost/asio/io_service.hpp"
-#include "boost/beast/http/verb.hpp"
+#import "HTTPClient.hpp"
+#import <algorithm>
 #import <arpa/inet.h>
 #include <ostream>
 #import <assert.h>
-#import <boost/beast.hpp>
-#import <boost/lexical_cast.hpp>
-#import <boost/property_tree/json_parser.hpp>
-#import <boost/property_tree/ptree.hpp>
-#import <boost/variant.hpp>
-#import <fstream>
+#import <chrono>
 #import <iostream>
-#import <sstream>
+#import <set>
 #import <sys/socket.h>
+#import <sys/stat.h>
+#import <thread>
 #import <tuple>
-#import <vector>
-
-namespace beast = boost::beast;     // from <boost/beast.hpp>
-namespace net = boost::asio;        // from <boost/asio.hpp>
-namespace http = beast::http;       // from <boost/beast/http.hpp>
-
-using tcp_type = net::ip::tcp;
-using socket_type = tcp_type::socket;
-using req_type = http::request<http::string_body>;
-using resp_type = http::response<http::string_body>;
-
-namespace ssvim {
-// Result is a variant where there can be a success or error case
-template <typename Success, typename Error>
-using Result = boost::variant<Success, Error>;
-
-namespace ResultStatus {
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-variable"
-const int Ok = 0;
-const int Error = 1;
-#pragma clang diagnostic pop
-
-template <typename T, typename R> auto Get(R v) {
-  return boost::get<T>(v);
-}
-} // namespace ResultStatus
-
-// Example usage:
-//    ssvim::Result<int, float> v;
-//    v = 12; // v contains int
-//    switch(v.which()) {
-//        case ssvim::ResultStatus::Ok:
-//            std::cout << "INT" << ssvim::ResultStatus::Get<int>(v);
-//            break;
-//        case ssvim::ResultStatus::Error:
-//            std::cout << "FLOAT" << ssvim::ResultStatus::Get<float>(v);
-//            break;
-//    }
-
-} // namespace ssvim
-
-template <class String>
-void err(beast::error_code const &ec, String const &what) {
-  std::cerr << what << ": " << ec.message() << std::endl;
-}
-
-typedef enum TestErrorCode {
-  TestErrorCodeUndefined,
-} TestErrorCode;
-
-static ssvim::Result<resp_type, TestErrorCode>
-PostRequest(std::string port, std::string path, std::string body) {
-  net::io_service ios;
-
-  // Run tests on localhost
-  auto host = "localhost";
-  try {
-    tcp_type::resolver r(ios);
-    auto it = r.resolve(tcp_type::resolver::query{host, port});
-    socket_type sock(ios);
-    connect(sock, it);
-    auto ep = sock.remote_endpoint();
-    req_type req;
-    req.method(http::verb::post);
-    req.target(path);
-    req.body() = body;
-    req.version(11);
-    req.insert("Host", host + std::string(":") + boost::lexical_cast<std::string>(ep.port()));
-    req.insert("User-Agent", "ssvim-integration_tests/http");
-    req.insert("Content-Type", "application/json");
-    req.prepare_payload();
-    http::write(sock, req);
-    resp_type res;
-    beast::flat_buffer buffer;
-    http::read(sock, buffer, res);
-    return res;
-  } catch (beast::system_error const &ec) {
-    std::cerr << host << ": " << ec.what();
-  } catch (...) {
-    std::cerr << host << ": unknown exception" << std::endl;
-  }
-  return TestErrorCodeUndefined;
-}
-
-std::string ReadFile(const std::string &fileName) {
-  std::ifstream ifs(fileName.c_str(),
-                    std::ios::in | std::ios::binary | std::ios::ate);
-
-  std::ifstream::pos_type fileSize = ifs.tellg();
-  ifs.seekg(0, std::ios::beg);
-
-  std::vector<char> bytes(fileSize);
-  ifs.read(&bytes[0], fileSize);
-  return std::string(&bytes[0], fileSize);
-}
-
-std::string MakeCompletionPostBody(int line, int column, std::string fileName,
-                                   std::string contents,
-                                   std::vector<std::string> flags) {
-  using boost::property_tree::ptree;
-  ptree out;
-  out.put("line", line);
-  out.put("column", column);
-  out.put("file_name", fileName);
-  out.put("contents", contents);
-  boost::property_tree::ptree flagsOut;
-  for (auto &f : flags)
-    flagsOut.put("", f);
-  out.add_child("flags", flagsOut);
-  std::ostringstream oss;
-  boost::property_tree::write_json(oss, out);
-  return oss.str();
-}
-
-std::string GetExamplesDir() {
-  char cwd[1024];
-  if (getcwd(cwd, sizeof(cwd)) != NULL) {
-    return std::string(std::string(cwd) + "/Examples/");
-  }
-  return "";
-}
 
 #pragma mark - IntegrationTestSuite
 
@@ -164,11 +39,139 @@ public:
     assert(res.result_int() == 200);
   }
 
+  void testCompletionWithContentReference() {
+    using namespace ssvim::ResultStatus;
+    auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+    struct stat info;
+    assert(stat(exampleName.c_str(), &info) == 0);
+    boost::property_tree::ptree request;
+    request.put("line", 19);
+    request.put("column", 15);
+    request.put("file_name", exampleName);
+    request.put("query", "");
+    request.put("contents_ref.path", exampleName);
+    request.put("contents_ref.mtime", (long long)info.st_mtime);
+    request.put("contents_ref.size", (long long)info.st_size);
+    std::ostringstream body;
+    boost::property_tree::write_json(body, request);
+    auto res = Get<resp_type>(PostRequest(_boundPort, "/completions",
+                                          body.str()));
+    assert(res.result_int() == 200);
+
+    // A reference to contents that changed is rejected
+    request.put("contents_ref.size", (long long)info.st_size + 1);
+    body.str("");
+    boost::property_tree::write_json(body, request);
+    res = Get<resp_type>(PostRequest(_boundPort, "/completions", body.str()));
+    assert(res.result_int() == 400);
+  }
+
+  // Generated sources can be larger than beast's default 1 MB body limit
+  void testLargeFileCompletion() {
+    using namespace ssvim::ResultStatus;
+    std::string contents;
+    while (contents.length() < (4 << 20)) {
+      contents += "let generated" + std::to_string(contents.length()) +
+                  " = \"\\(1)\"\n";
+    }
+    contents += "generated0.";
+    auto line = std::count(contents.begin(), contents.end(), '\n') + 1;
+    auto body = MakeCompletionPostBody(line, 11, "/tmp/Generated.swift",
+                                       contents, {});
+    auto res = Get<resp_type>(PostRequest(_boundPort, "/completions", body));
+    assert(res.result_int() == 200);
+  }
+
+  void testBatch() {
+    using namespace ssvim::ResultStatus;
+    auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+    boost::property_tree::ptree request, requests, completion, diagnostics;
+    request.put("file_name", exampleName);
+    request.put("contents", ReadFile(exampleName));
+    completion.put("kind", "completions");
+    completion.put("line", 19);
+    completion.put("column", 15);
+    diagnostics.put("kind", "diagnostics");
+    requests.push_back(std::make_pair("", completion));
+    requests.push_back(std::make_pair("", diagnostics));
+    request.add_child("requests", requests);
+    std::ostringstream body;
+    boost::property_tree::write_json(body, request);
+    auto res = Get<resp_type>(PostRequest(_boundPort, "/batch", body.str()));
+    assert(res.result_int() == 200);
+    assert(res.body().find("\"kind\": \"completions\"") <
+           res.body().find("\"kind\": \"diagnostics\""));
+  }
+
+  // Requests over a WebSocket are answered by ID, and diagnostics for the
+  // documents sent are pushed
+  void testWebSocketMessages() {
+    namespace websocket = beast::websocket;
+    auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+    net::io_context ioc;
+    net::ip::tcp::resolver resolver(ioc);
+    websocket::stream<beast::tcp_stream> ws(ioc);
+    beast::get_lowest_layer(ws).connect(
+        resolver.resolve("127.0.0.1", _boundPort));
+    ws.handshake("127.0.0.1", "/ws");
+
+    auto completion = MakeCompletionPostBody(19, 15, exampleName,
+                                             ReadFile(exampleName), {});
+    auto diagnostics =
+        MakeDiagnosticsPostBody(exampleName, ReadFile(exampleName), {});
+    ws.write(net::buffer("{\"id\": 1, \"method\": \"/completions\", "
+                         "\"params\": " + completion + "}"));
+    ws.write(net::buffer("{\"id\": 2, \"method\": \"/diagnostics\", "
+                         "\"params\": " + diagnostics + "}"));
+    ws.write(net::buffer(std::string("{\"id\": 3, \"method\": \"cancel\", "
+                                     "\"params\": {\"id\": 9}}")));
+
+    std::set<std::string> seen;
+    while (seen.size() < 4) {
+      beast::flat_buffer buffer;
+      ws.read(buffer);
+      std::istringstream is(beast::buffers_to_string(buffer.data()));
+      boost::property_tree::ptree message;
+      boost::property_tree::read_json(is, message);
+      if (message.get<std::string>("method", "") == "diagnostics") {
+        assert(message.get<std::string>("params.file_name") == exampleName);
+        seen.insert("push");
+        continue;
+      }
+      auto id = message.get<std::string>("id");
+      if (id == "9") {
+        assert(message.get<std::string>("cancelled") == "false");
+      } else {
+        assert(message.get<int>("status") == 200);
+        assert(message.get_child_optional("result"));
+      }
+      seen.insert(id);
+    }
+    ws.close(websocket::close_code::normal);
+  }
+
   void testStatus() {
     using namespace ssvim::ResultStatus;
     auto responseValue = PostRequest(_boundPort, "/status", "");
     auto res = Get<resp_type>(responseValue);
     assert(res.result_int() == 200);
+    assert(res.body().find("\"readiness\"") != std::string::npos);
+  }
+
+  // Warm-up's throwaway files aren't taken for editor buffers
+  void testWarmupLeavesNoBuffers() {
+    using namespace ssvim::ResultStatus;
+    for (int i = 0; i < 50; i++) {
+      auto status = Get<resp_type>(PostRequest(_boundPort, "/status", ""));
+      if (status.body().find("\"warm\"") != std::string::npos) {
+        break;
+      }
+      usleep(100 * 1000);
+    }
+    auto metrics =
+        Get<resp_type>(PostRequest(_boundPort, "/metrics", "")).body();
+    assert(metrics.find("ssvim_warm 1\n") != std::string::npos);
+    assert(metrics.find("\nssvim_module_buffers ") == std::string::npos);
   }
 
   void testRunningAfterGarbageJSON() {
@@ -192,29 +195,25 @@ std::tuple<std::string, int> testBind() {
   if (ret == 0) {
   }
 
-  int sock = 0;
   socklen_t len = sizeof(struct sockaddr);
   struct sockaddr_in addr;
-  getsockname(sock, (struct sockaddr *)&addr, &len);
+  getsockname(socket_desc, (struct sockaddr *)&addr, &len);
   auto ip = inet_ntoa(addr.sin_addr);
   auto port = ntohs(addr.sin_port);
   fprintf(stderr, "listening on %s:%d\n", ip, port);
+  // Free the port for the server
+  close(socket_desc);
   return std::tuple<std::string, int>(ip, (int)port);
 }
 
-int main(int, char const *[]) {
-  auto exampleDir = GetExamplesDir();
-  std::cout << "Running SSVIM integration tests with examples \n " << exampleDir
-            << std::endl;
-
-  // Here we start up the server on a port that we bind
-  // This emulates a user having an instance running for an editing
-  // session.
+// Start ./http_server with `args` on an unused port, and return the port
+std::string bootServer(std::string args) {
   auto bootInfo = testBind();
   auto boundPort = std::to_string(std::get<int>(bootInfo));
   auto startCmd = std::string("`./http_server");
   startCmd += " --port ";
   startCmd += boundPort;
+  startCmd += args;
   startCmd += " >/dev/null`&";
 
   std::cout << startCmd << std::endl;
@@ -223,6 +222,674 @@ int main(int, char const *[]) {
   int started = system(startCmd.c_str());
   assert(started == 0 && "Failed to start");
   sleep(1);
+  return boundPort;
+}
+
+void shutdownServer(std::string boundPort) {
+  using namespace ssvim::ResultStatus;
+  auto responseValue = PostRequest(boundPort, "/shutdown", "");
+  auto res = Get<resp_type>(responseValue);
+  assert(res.result_int() == 200 && "Failed to shutdown");
+}
+
+// A server replaying a recording answers like the recorded server
+void testReplaysRecordedCompletion() {
+  using namespace ssvim::ResultStatus;
+  auto logName = std::string("integration_tests_backend.log");
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto body = MakeCompletionPostBody(19, 15, exampleName,
+                                     ReadFile(exampleName), {});
+
+  auto recordPort = bootServer(" --record " + logName);
+  auto recorded =
+      Get<resp_type>(PostRequest(recordPort, "/completions", body));
+  assert(recorded.result_int() == 200);
+  shutdownServer(recordPort);
+
+  auto replayPort = bootServer(" --backend replay --replay " + logName);
+  auto replayed =
+      Get<resp_type>(PostRequest(replayPort, "/completions", body));
+  assert(replayed.result_int() == 200);
+  assert(replayed.body() == recorded.body());
+
+  // Diagnostics weren't recorded; the failed request stops waiting on them
+  auto diagnostics =
+      Get<resp_type>(PostRequest(replayPort, "/diagnostics", body));
+  assert(diagnostics.result_int() == 200);
+  assert(diagnostics.body() == "{\"key.diagnostics\": []}");
+  auto metrics = Get<resp_type>(PostRequest(replayPort, "/metrics", ""));
+  assert(metrics.body().find("ssvim_sema_pending_waiters 0\n") !=
+         std::string::npos);
+  shutdownServer(replayPort);
+  unlink(logName.c_str());
+}
+
+// Notifications that come before the response of their request are
+// replayed with it
+void testReplaysRecordedDiagnostics() {
+  using namespace ssvim::ResultStatus;
+  auto logName = std::string("integration_tests_diagnostics.log");
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto body = MakeCompletionPostBody(19, 15, exampleName,
+                                     ReadFile(exampleName), {});
+
+  auto recordPort = bootServer(" --no-warmup --record " + logName +
+                               " --standin-notification-delay-ms 0");
+  auto recorded =
+      Get<resp_type>(PostRequest(recordPort, "/diagnostics", body));
+  assert(recorded.result_int() == 200);
+  shutdownServer(recordPort);
+
+  auto replayPort =
+      bootServer(" --no-warmup --backend replay --replay " + logName);
+  auto replayed =
+      Get<resp_type>(PostRequest(replayPort, "/diagnostics", body));
+  assert(replayed.result_int() == 200);
+  assert(replayed.body() == recorded.body());
+  shutdownServer(replayPort);
+  unlink(logName.c_str());
+}
+
+// Completions on SDK modules are cached on disk across restarts, those on
+// the project's own modules aren't
+void testModuleCompletionCacheSurvivesRestart() {
+  using namespace ssvim::ResultStatus;
+  char cacheDir[] = "/tmp/ssvim_module_cache_XXXXXX";
+  assert(mkdtemp(cacheDir));
+  auto sdk = std::string(cacheDir) + "/SDK";
+  auto includes = std::string(cacheDir) + "/include";
+  assert(system(("mkdir -p " + sdk +
+                 "/System/Library/Frameworks/Foundation.framework " +
+                 includes + "/Mine.swiftmodule")
+                    .c_str()) == 0);
+  std::vector<std::string> flags = {"-sdk", sdk, "-I", includes};
+  auto fileName = std::string("/tmp/module_cache_test.swift");
+  auto body = MakeCompletionPostBody(2, 12, fileName,
+                                     "import Foundation\nFoundation.", flags);
+  auto project =
+      MakeCompletionPostBody(2, 6, fileName, "import Mine\nMine.", flags);
+  auto hit = std::string(
+      "ssvim_module_cache_requests_total{result=\"hit\"} 1\n");
+  auto args = std::string(" --no-warmup --module-cache-dir ") +
+              cacheDir + "/cache";
+
+  auto port = bootServer(args);
+  auto first = Get<resp_type>(PostRequest(port, "/completions", body));
+  assert(first.result_int() == 200);
+  assert(Get<resp_type>(PostRequest(port, "/completions", project))
+             .result_int() == 200);
+  shutdownServer(port);
+
+  port = bootServer(args);
+  auto cached = Get<resp_type>(PostRequest(port, "/completions", body));
+  assert(cached.result_int() == 200);
+  assert(cached.body() == first.body());
+  assert(Get<resp_type>(PostRequest(port, "/completions", project))
+             .result_int() == 200);
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  assert(metrics.body().find(hit) != std::string::npos);
+  shutdownServer(port);
+  system((std::string("rm -rf ") + cacheDir).c_str());
+}
+
+// Without flags in the request, flags come from the file's compile database
+void testFlagsFromCompileDatabase() {
+  using namespace ssvim::ResultStatus;
+  char projectDir[] = "/tmp/ssvim_compile_db_XXXXXX";
+  assert(mkdtemp(projectDir));
+  auto fileName = std::string(projectDir) + "/main.swift";
+  std::ofstream(std::string(projectDir) + "/compile_commands.json")
+      << "[{\"directory\": \"" << projectDir << "\", "
+      << "\"file\": \"main.swift\", "
+      << "\"command\": \"swiftc -c main.swift -o main.o "
+         "-target x86_64-apple-macosx10.12\"}]";
+  boost::property_tree::ptree request;
+  request.put("line", 1);
+  request.put("column", 1);
+  request.put("file_name", fileName);
+  request.put("contents", "let x = 1\n");
+  request.put("query", "");
+  std::ostringstream body;
+  boost::property_tree::write_json(body, request);
+  auto loaded = std::string("ssvim_stage_duration_seconds_count"
+                            "{stage=\"compile_database_load\"} 1\n");
+
+  auto port = bootServer(" --no-warmup");
+  auto res = Get<resp_type>(PostRequest(port, "/completions", body.str()));
+  assert(res.result_int() == 200);
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  assert(metrics.body().find(loaded) != std::string::npos);
+
+  // A malformed escape fails the database, not the request
+  std::ofstream(std::string(projectDir) + "/compile_commands.json")
+      << "[{\"directory\": \"" << projectDir << "\", "
+      << "\"file\": \"main.swift\", \"command\": \"swiftc \\uZZZZ\"}]";
+  res = Get<resp_type>(PostRequest(port, "/completions", body.str()));
+  assert(res.result_int() == 200);
+  shutdownServer(port);
+  system((std::string("rm -rf ") + projectDir).c_str());
+}
+
+// A project sweep streams a line per file of the compile database
+void testProjectDiagnostics() {
+  using namespace ssvim::ResultStatus;
+  char projectDir[] = "/tmp/ssvim_project_XXXXXX";
+  assert(mkdtemp(projectDir));
+  auto dir = std::string(projectDir);
+  std::string command = "swiftc -c";
+  for (auto name : {"A.swift", "B.swift", "C.swift"}) {
+    std::ofstream(dir + "/" + name) << "let x = 1\n";
+    command += std::string(" ") + name;
+  }
+  std::ofstream(dir + "/compile_commands.json")
+      << "[{\"directory\": \"" << dir << "\", \"file\": \"A.swift\", "
+      << "\"command\": \"" << command << "\"}]";
+
+  auto port = bootServer(" --no-warmup");
+  auto res = Get<resp_type>(PostRequest(port, "/diagnostics/project",
+                                        "{\"root\": \"" + dir + "\"}"));
+  assert(res.result_int() == 200);
+  auto body = res.body();
+  assert(std::count(body.begin(), body.end(), '\n') == 4);
+  assert(body.find("\"files\": 3") != std::string::npos);
+  // Swept files aren't taken for editor buffers, nor kept open
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", "")).body();
+  for (std::string gauge :
+       {"ssvim_module_buffers ", "ssvim_open_documents "}) {
+    auto found = metrics.find("\n" + gauge);
+    assert(found == std::string::npos ||
+           metrics.compare(found + gauge.length() + 1, 2, "0\n") == 0);
+  }
+  shutdownServer(port);
+
+  // A client that goes away stops the sweep, and its admission is released
+  command = "swiftc -c";
+  for (int i = 0; i < 20; i++) {
+    auto name = "F" + std::to_string(i) + ".swift";
+    std::ofstream(dir + "/" + name) << "let x = 1\n";
+    command += " " + name;
+  }
+  std::ofstream(dir + "/compile_commands.json")
+      << "[{\"directory\": \"" << dir << "\", \"file\": \"F0.swift\", "
+      << "\"command\": \"" << command << "\"}]";
+  port = bootServer(" --no-warmup --standin-notification-delay-ms 200");
+  {
+    net::io_context ioc;
+    net::ip::tcp::socket socket(ioc);
+    socket.connect(net::ip::tcp::endpoint(
+        net::ip::make_address("127.0.0.1"), std::stoi(port)));
+    auto request = "{\"root\": \"" + dir + "\", \"parallelism\": 1}";
+    net::write(socket, net::buffer("POST /diagnostics/project HTTP/1.1\r\n"
+                                   "Content-Type: application/json\r\n"
+                                   "Content-Length: " +
+                                   std::to_string(request.length()) +
+                                   "\r\n\r\n" + request));
+    std::string received;
+    while (received.find("file_name") == std::string::npos) {
+      char data[1024];
+      received.append(data, socket.read_some(net::buffer(data)));
+    }
+  }
+  auto sweptFiles = [&port] {
+    auto metrics = Get<resp_type>(PostRequest(port, "/metrics", "")).body();
+    std::string counter = "\nssvim_project_sweep_files_total ";
+    auto found = metrics.find(counter);
+    assert(found != std::string::npos);
+    assert(metrics.find("\nssvim_admission_jobs 0\n") != std::string::npos);
+    return std::stoi(metrics.substr(found + counter.length()));
+  };
+  usleep(1500 * 1000);
+  auto swept = sweptFiles();
+  assert(swept < 20);
+  usleep(1000 * 1000);
+  assert(sweptFiles() == swept);
+  shutdownServer(port);
+  system((std::string("rm -rf ") + projectDir).c_str());
+}
+
+// The endpoints are served on a Unix domain socket, and on stdio to a parent
+// process
+void testLocalTransports() {
+  using namespace ssvim::ResultStatus;
+  std::string socketPath = "/tmp/ssvim_test_" + std::to_string(getpid());
+  auto port = bootServer(" --no-warmup --socket " + socketPath);
+  auto res = Get<resp_type>(PostRequest(socketPath, "/status", ""));
+  assert(res.result_int() == 200);
+  assert(res.body().find("\"readiness\"") != std::string::npos);
+  shutdownServer(port);
+  unlink(socketPath.c_str());
+
+  std::string message = "{\"id\": 7, \"method\": \"/status\"}";
+  auto command = "printf 'Content-Length: " +
+                 std::to_string(message.length()) + "\\r\\n\\r\\n" +
+                 message + "' | ./http_server --stdio --no-warmup";
+  auto output = popen(command.c_str(), "r");
+  assert(output);
+  std::string framed;
+  char buffer[4096];
+  for (size_t read; (read = fread(buffer, 1, sizeof(buffer), output));) {
+    framed.append(buffer, read);
+  }
+  pclose(output);
+  assert(framed.find("Content-Length: ") == 0);
+  assert(framed.find("\"id\": 7, \"status\": 200") != std::string::npos);
+
+  // A message over the body limit is answered, and the next one served
+  auto inputName = "integration_tests_oversized.txt";
+  {
+    std::ofstream input(inputName);
+    std::string oversized((1 << 20) + 1, ' ');
+    input << "Content-Length: " << oversized.length() << "\r\n\r\n"
+          << oversized << "Content-Length: " << message.length()
+          << "\r\n\r\n"
+          << message;
+  }
+  output = popen((std::string("./http_server --stdio --no-warmup "
+                              "--body-limit-mb 1 < ") +
+                  inputName)
+                     .c_str(),
+                 "r");
+  assert(output);
+  framed.clear();
+  for (size_t read; (read = fread(buffer, 1, sizeof(buffer), output));) {
+    framed.append(buffer, read);
+  }
+  pclose(output);
+  std::remove(inputName);
+  assert(framed.find("\"id\": -1, \"status\": 413") != std::string::npos);
+  assert(framed.find("\"id\": 7, \"status\": 200") != std::string::npos);
+}
+
+// Requests over the limits get a 503 with a Retry-After estimate
+void testAdmissionLimits() {
+  using namespace ssvim::ResultStatus;
+  auto port = bootServer(" --no-warmup --max-sessions 1");
+  HTTPConnection held(port, true);
+  assert(Get<resp_type>(held.post("/status", "")).result_int() == 200);
+  auto rejected = Get<resp_type>(PostRequest(port, "/status", ""));
+  assert(rejected.result_int() == 503);
+  assert(std::stoi(std::string(rejected[http::field::retry_after])) >= 1);
+  assert(Get<resp_type>(held.post("/shutdown", "")).result_int() == 200);
+
+  // The second of two completions waits behind the first one
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto completion = "{\"id\": 1, \"method\": \"/completions\", "
+                    "\"params\": " +
+                    MakeCompletionPostBody(19, 15, exampleName,
+                                           ReadFile(exampleName), {}) +
+                    "}";
+  auto inputName = "integration_tests_admission.txt";
+  {
+    std::ofstream input(inputName);
+    for (int i = 0; i < 2; i++) {
+      input << "Content-Length: " << completion.length() << "\r\n\r\n"
+            << completion;
+    }
+  }
+  auto command = std::string("./http_server --stdio --no-warmup --max-jobs 1 "
+                             "--standin-latency-ms 300 < ") +
+                 inputName;
+  auto output = popen(command.c_str(), "r");
+  assert(output);
+  std::string framed;
+  char buffer[4096];
+  for (size_t read; (read = fread(buffer, 1, sizeof(buffer), output));) {
+    framed.append(buffer, read);
+  }
+  pclose(output);
+  std::remove(inputName);
+  assert(framed.find("\"status\": 200") != std::string::npos);
+  assert(framed.find("\"status\": 503") != std::string::npos);
+}
+
+// Over HTTP, semantic requests run off the io thread: other requests are
+// served meanwhile, and those over the job limit are turned away
+void testAdmissionLimitsOverHTTP() {
+  using namespace ssvim::ResultStatus;
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto body =
+      MakeCompletionPostBody(19, 15, exampleName, ReadFile(exampleName), {});
+  auto port =
+      bootServer(" --no-warmup --max-jobs 1 --standin-latency-ms 1000");
+  int slowStatus = 0;
+  std::thread slow([&] {
+    slowStatus =
+        Get<resp_type>(PostRequest(port, "/completions", body)).result_int();
+  });
+  usleep(300 * 1000);
+  auto start = std::chrono::steady_clock::now();
+  assert(Get<resp_type>(PostRequest(port, "/status", "")).result_int() ==
+         200);
+  assert(std::chrono::steady_clock::now() - start <
+         std::chrono::milliseconds(500));
+  auto rejected = Get<resp_type>(PostRequest(port, "/completions", body));
+  assert(rejected.result_int() == 503);
+  assert(std::stoi(std::string(rejected[http::field::retry_after])) >= 1);
+  slow.join();
+  assert(slowStatus == 200);
+  // The job's admission is released once it responded
+  assert(Get<resp_type>(PostRequest(port, "/completions", body))
+             .result_int() == 200);
+  shutdownServer(port);
+}
+
+// A crashed semantic worker is restarted, and serves the next request
+void testWorkerRestart() {
+  using namespace ssvim::ResultStatus;
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto body =
+      MakeCompletionPostBody(19, 15, exampleName, ReadFile(exampleName), {});
+  auto port = bootServer(" --no-warmup --workers 2");
+  assert(Get<resp_type>(PostRequest(port, "/completions", body))
+             .result_int() == 200);
+  assert(system("pkill -f '^./http_server --semantic-worker'") == 0);
+  usleep(300 * 1000);
+  auto res = Get<resp_type>(PostRequest(port, "/completions", body));
+  assert(res.result_int() == 200);
+  assert(res.body().find("key.results") != std::string::npos);
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  assert(metrics.body().find("ssvim_worker_restarts_total 1") !=
+         std::string::npos);
+  shutdownServer(port);
+
+  // A worker that doesn't answer in time is killed and restarted
+  port = bootServer(" --no-warmup --workers 1 --standin-latency-ms 3000 "
+                    "--worker-timeout-ms 300");
+  auto start = std::chrono::steady_clock::now();
+  assert(Get<resp_type>(PostRequest(port, "/completions", body))
+             .result_int() == 200);
+  assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+  usleep(300 * 1000);
+  metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  assert(metrics.body().find("ssvim_worker_timeouts_total 1") !=
+         std::string::npos);
+  assert(metrics.body().find("ssvim_worker_restarts_total 1") !=
+         std::string::npos);
+  shutdownServer(port);
+
+  // Diagnostics waiting on a worker that crashed before its notification
+  // aren't left hanging
+  port = bootServer(" --no-warmup --workers 1 "
+                    "--standin-notification-delay-ms 5000");
+  auto diagnostics =
+      MakeDiagnosticsPostBody(exampleName, ReadFile(exampleName), {});
+  int waitingStatus = 0;
+  start = std::chrono::steady_clock::now();
+  std::thread waiting([&] {
+    waitingStatus = Get<resp_type>(PostRequest(port, "/diagnostics",
+                                               diagnostics))
+                        .result_int();
+  });
+  usleep(500 * 1000);
+  assert(system("pkill -9 -f '^./http_server --semantic-worker'") == 0);
+  waiting.join();
+  assert(waitingStatus == 200);
+  assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(3));
+  metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  assert(metrics.body().find("ssvim_sema_pending_waiters 0\n") !=
+         std::string::npos);
+  assert(metrics.body().find("ssvim_admission_jobs 0\n") !=
+         std::string::npos);
+  shutdownServer(port);
+}
+
+// Over the memory budget, the least recently used documents are evicted
+void testMemoryBudget() {
+  using namespace ssvim::ResultStatus;
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto contents = ReadFile(exampleName);
+  auto port = bootServer(" --no-warmup --memory-budget-mb 1");
+  for (auto name : {"/tmp/ssvim_budget/A.swift", "/tmp/ssvim_budget/B.swift",
+                    "/tmp/ssvim_budget/C.swift"}) {
+    auto body = MakeCompletionPostBody(19, 15, name, contents, {});
+    assert(Get<resp_type>(PostRequest(port, "/completions", body))
+               .result_int() == 200);
+  }
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  auto evictions = std::string(
+      "ssvim_memory_evictions_total{pool=\"documents\"} ");
+  auto found = metrics.body().find(evictions);
+  assert(found != std::string::npos);
+  assert(metrics.body().compare(found + evictions.length(), 2, "0\n") != 0);
+  shutdownServer(port);
+}
+
+// Editor instances share a daemon, each with its own buffers, and it exits
+// once they are gone
+void testSharedDaemon() {
+  using namespace ssvim::ResultStatus;
+  auto socketPath = "/tmp/ssvim_daemon_" + std::to_string(getpid());
+  auto args = " --no-warmup --daemon --client-idle-timeout 2 --socket " +
+              socketPath;
+  bootServer(args);
+  // Another instance attaches to the running one
+  assert(system(("./http_server" + args + " >/dev/null").c_str()) == 0);
+
+  auto first = std::string("/tmp/ssvim_daemon/First.swift");
+  auto second = std::string("/tmp/ssvim_daemon/Second.swift");
+  std::vector<std::string> flags = {first, second};
+  HTTPConnection a(socketPath, false), b(socketPath, false);
+  a.setClient("a");
+  b.setClient("b");
+  auto edit = MakeCompletionPostBody(1, 1, first, "struct Unsaved {}\n", flags);
+  auto complete = MakeCompletionPostBody(1, 8, second, "Unsaved.\n", flags);
+  assert(Get<resp_type>(a.post("/completions", edit)).result_int() == 200);
+  // The buffer a edited isn't b's
+  assert(Get<resp_type>(b.post("/completions", complete)).result_int() ==
+         200);
+  auto metrics = Get<resp_type>(b.post("/metrics", "")).body();
+  assert(metrics.find("ssvim_module_buffer_syncs_total 0\n") !=
+         std::string::npos);
+  assert(metrics.find("ssvim_clients 2\n") != std::string::npos);
+  assert(Get<resp_type>(a.post("/completions", complete)).result_int() ==
+         200);
+  metrics = Get<resp_type>(a.post("/metrics", "")).body();
+  assert(metrics.find("ssvim_module_buffer_syncs_total 1\n") !=
+         std::string::npos);
+
+  // A client can't shut the daemon down for the others
+  assert(Get<resp_type>(b.post("/shutdown", "")).body() ==
+         "{\"detached\": true}");
+  assert(Get<resp_type>(a.post("/status", "")).result_int() == 200);
+  assert(Get<resp_type>(a.post("/detach", "")).body() ==
+         "{\"detached\": true}");
+  sleep(4);
+  assert(access(socketPath.c_str(), F_OK) != 0);
+  unlink((socketPath + ".lock").c_str());
+}
+
+// A document another client still has open isn't closed when one client's
+// buffer for it is evicted
+void testSharedDocuments() {
+  using namespace ssvim::ResultStatus;
+  auto socketPath = "/tmp/ssvim_documents_" + std::to_string(getpid());
+  // The server's resident memory is over 1 MB, so a step of the buffers is
+  // evicted at most once a second
+  bootServer(" --no-warmup --daemon --client-idle-timeout 1 "
+             "--memory-budget-mb 1 --socket " + socketPath);
+  HTTPConnection a(socketPath, false), b(socketPath, false),
+      c(socketPath, false);
+  a.setClient("a");
+  b.setClient("b");
+  c.setClient("c");
+  auto diagnostics = [](HTTPConnection &client, const std::string &name,
+                        std::size_t size) {
+    auto body = MakeDiagnosticsPostBody("/tmp/ssvim_documents/" + name,
+                                        std::string(size, ' ') + "\n", {});
+    assert(Get<resp_type>(client.post("/diagnostics", body)).result_int() ==
+           200);
+  };
+  // The first eviction, of W1
+  diagnostics(c, "W1.swift", 10);
+  diagnostics(c, "W2.swift", 10);
+  diagnostics(a, "X.swift", 1000);
+  diagnostics(b, "X.swift", 1000);
+  sleep(1);
+  usleep(200 * 1000);
+  // Evicts W2 and a's X, which b still has
+  diagnostics(c, "W3.swift", 3000);
+  auto metrics = Get<resp_type>(c.post("/metrics", "")).body();
+  assert(metrics.find(
+             "ssvim_memory_evictions_total{pool=\"documents\"} 3\n") !=
+         std::string::npos);
+  assert(metrics.find("ssvim_open_documents 2\n") != std::string::npos);
+
+  for (auto client : {&a, &b, &c}) {
+    assert(Get<resp_type>(client->post("/detach", "")).result_int() == 200);
+  }
+  sleep(3);
+  assert(access(socketPath.c_str(), F_OK) != 0);
+  unlink((socketPath + ".lock").c_str());
+}
+
+// Completions at the cursor of a diagnostics request are prefetched
+void testCompletionPrefetch() {
+  using namespace ssvim::ResultStatus;
+  auto fileName = std::string("/tmp/ssvim_prefetch.swift");
+  auto port = bootServer(" --no-warmup --prefetch");
+  auto update =
+      MakeCompletionPostBody(2, 6, fileName, "let value = 1\nvalue\n", {});
+  assert(Get<resp_type>(PostRequest(port, "/diagnostics", update))
+             .result_int() == 200);
+  usleep(300 * 1000);
+  auto complete =
+      MakeCompletionPostBody(2, 7, fileName, "let value = 1\nvalue.\n", {});
+  auto res = Get<resp_type>(PostRequest(port, "/completions", complete));
+  assert(res.result_int() == 200);
+  assert(res.body().find("key.results") != std::string::npos);
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  assert(metrics.body().find(
+             "ssvim_prefetch_requests_total{result=\"hit\"} 1\n") !=
+         std::string::npos);
+  shutdownServer(port);
+}
+
+// Successive completions on a position are sent as changes from the last
+// result set
+void testCompletionDeltas() {
+  using namespace ssvim::ResultStatus;
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto body =
+      MakeCompletionPostBody(19, 15, exampleName, ReadFile(exampleName), {});
+  auto port = bootServer(" --no-warmup");
+  auto first = Get<resp_type>(PostRequest(
+      port, "/completions", "{\"result_id\": 0, " + body.substr(1)));
+  assert(first.result_int() == 200);
+  assert(first.body().find("\"results\": ") != std::string::npos);
+  boost::property_tree::ptree firstJSON;
+  std::istringstream is(first.body());
+  boost::property_tree::read_json(is, firstJSON);
+  auto resultID = firstJSON.get<std::string>("result_id");
+
+  auto second = Get<resp_type>(
+      PostRequest(port, "/completions",
+                  "{\"result_id\": " + resultID + ", " + body.substr(1)));
+  assert(second.result_int() == 200);
+  assert(second.body().find("\"base\": " + resultID +
+                            ", \"removed\": [], \"inserted\": []") !=
+         std::string::npos);
+  assert(second.body().size() * 10 < first.body().size());
+  shutdownServer(port);
+}
+
+// A restarted server restores the documents, buffers and result sets of the
+// last one from its snapshot
+void testWarmRestart() {
+  using namespace ssvim::ResultStatus;
+  auto snapshot = "/tmp/ssvim_snapshot_" + std::to_string(getpid());
+  auto args = " --no-warmup --snapshot-interval 0 --snapshot " + snapshot;
+  auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+  auto body =
+      MakeCompletionPostBody(19, 15, exampleName, ReadFile(exampleName), {});
+  auto port = bootServer(args);
+  assert(Get<resp_type>(PostRequest(port, "/diagnostics", body))
+             .result_int() == 200);
+  auto first = Get<resp_type>(PostRequest(
+      port, "/completions", "{\"result_id\": 0, " + body.substr(1)));
+  assert(first.result_int() == 200);
+  boost::property_tree::ptree firstJSON;
+  std::istringstream is(first.body());
+  boost::property_tree::read_json(is, firstJSON);
+  auto resultID = firstJSON.get<std::string>("result_id");
+  shutdownServer(port);
+
+  port = bootServer(args);
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", "")).body();
+  assert(metrics.find("ssvim_reopened_documents_total 1\n") !=
+         std::string::npos);
+  assert(metrics.find("ssvim_module_buffers 1\n") != std::string::npos);
+  // Result IDs of the last server still work
+  auto second = Get<resp_type>(
+      PostRequest(port, "/completions",
+                  "{\"result_id\": " + resultID + ", " + body.substr(1)));
+  assert(second.result_int() == 200);
+  assert(second.body().find("\"base\": " + resultID) != std::string::npos);
+  shutdownServer(port);
+  // The snapshot is written at exit
+  usleep(300 * 1000);
+  unlink(snapshot.c_str());
+}
+
+// Editing one file of a module sends its buffer before requests on the
+// module's other files, and only once
+void testModuleBuffersAreShared() {
+  using namespace ssvim::ResultStatus;
+  auto first = std::string("/tmp/ssvim_module/First.swift");
+  auto second = std::string("/tmp/ssvim_module/Second.swift");
+  std::vector<std::string> flags = {first, second};
+  auto synced = std::string("ssvim_module_buffer_syncs_total 1\n");
+  auto logName = "/tmp/ssvim_module_" + std::to_string(getpid()) + ".log";
+
+  auto port = bootServer(" --no-warmup --record " + logName);
+  auto edit = MakeCompletionPostBody(1, 1, first, "struct Unsaved {}\n", flags);
+  assert(Get<resp_type>(PostRequest(port, "/completions", edit))
+             .result_int() == 200);
+  auto complete = MakeCompletionPostBody(1, 8, second, "Unsaved.\n", flags);
+  for (int i = 0; i < 2; i++) {
+    assert(Get<resp_type>(PostRequest(port, "/completions", complete))
+               .result_int() == 200);
+  }
+  auto metrics = Get<resp_type>(PostRequest(port, "/metrics", ""));
+  assert(metrics.body().find(synced) != std::string::npos);
+
+  // The buffer the backend has open is updated in place
+  edit = MakeCompletionPostBody(1, 1, first, "struct Edited {}\n", flags);
+  assert(Get<resp_type>(PostRequest(port, "/completions", edit))
+             .result_int() == 200);
+  assert(Get<resp_type>(PostRequest(port, "/completions", complete))
+             .result_int() == 200);
+  shutdownServer(port);
+
+  // Recorded requests are "R <kind> ...", followed by the document's name
+  std::istringstream log(ReadFile(logName));
+  std::string line, kind;
+  std::vector<std::string> firstKinds;
+  while (std::getline(log, line)) {
+    if (line.compare(0, 2, "R ") == 0) {
+      kind = line.substr(2, line.find(' ', 2) - 2);
+    } else if (!kind.empty()) {
+      if (line == std::to_string(first.length()) + ":" + first) {
+        firstKinds.push_back(kind);
+      }
+      kind.clear();
+    }
+  }
+  // Completions, then editor.open and editor.replacetext
+  assert(firstKinds.size() == 4);
+  assert(firstKinds[1] == "3");
+  assert(firstKinds[3] == "4");
+  unlink(logName.c_str());
+}
+
+int main(int, char const *[]) {
+  auto exampleDir = GetExamplesDir();
+  std::cout << "Running SSVIM integration tests with examples \n " << exampleDir
+            << std::endl;
+
+  // Here we start up the server on a port that we bind
+  // This emulates a user having an instance running for an editing
+  // session.
+  auto boundPort = bootServer("");
 
   // IntegrationTests Begin
   // NOTE: There should be no expected order to these test invocations, the
@@ -234,19 +901,102 @@ int main(int, char const *[]) {
   std::cout.flush();
   suite.testStatus();
 
+  // Before other requests add buffers
+  std::cout << "testWarmupLeavesNoBuffers" << std::endl;
+  std::cout.flush();
+  suite.testWarmupLeavesNoBuffers();
+
   std::cout << "testSuccessfulCompletion" << std::endl;
   std::cout.flush();
   suite.testSuccessfulCompletion();
 
+  std::cout << "testBatch" << std::endl;
+  std::cout.flush();
+  suite.testBatch();
+
+  std::cout << "testWebSocketMessages" << std::endl;
+  std::cout.flush();
+  suite.testWebSocketMessages();
+
+  std::cout << "testLargeFileCompletion" << std::endl;
+  std::cout.flush();
+  suite.testLargeFileCompletion();
+
+  std::cout << "testCompletionWithContentReference" << std::endl;
+  std::cout.flush();
+  suite.testCompletionWithContentReference();
+
   // TODO:
   // std::cout << "testRunningAfterGarbageJSON" << std::endl;
   // testRunningAfterGarbageJSON();
 
-  // IntegrationTests End
+  shutdownServer(boundPort);
 
-  using namespace ssvim::ResultStatus;
-  auto responseValue = PostRequest(boundPort, "/shutdown", "");
-  auto res = Get<resp_type>(responseValue);
-  assert(res.result_int() == 200 && "Failed to shutdown");
+  // These tests boot their own servers
+  std::cout << "testReplaysRecordedCompletion" << std::endl;
+  std::cout.flush();
+  testReplaysRecordedCompletion();
+
+  std::cout << "testReplaysRecordedDiagnostics" << std::endl;
+  std::cout.flush();
+  testReplaysRecordedDiagnostics();
+
+  std::cout << "testModuleCompletionCacheSurvivesRestart" << std::endl;
+  std::cout.flush();
+  testModuleCompletionCacheSurvivesRestart();
+
+  std::cout << "testFlagsFromCompileDatabase" << std::endl;
+  std::cout.flush();
+  testFlagsFromCompileDatabase();
+
+  std::cout << "testProjectDiagnostics" << std::endl;
+  std::cout.flush();
+  testProjectDiagnostics();
+
+  std::cout << "testLocalTransports" << std::endl;
+  std::cout.flush();
+  testLocalTransports();
+
+  std::cout << "testAdmissionLimits" << std::endl;
+  std::cout.flush();
+  testAdmissionLimits();
+
+  std::cout << "testAdmissionLimitsOverHTTP" << std::endl;
+  std::cout.flush();
+  testAdmissionLimitsOverHTTP();
+
+  std::cout << "testWorkerRestart" << std::endl;
+  std::cout.flush();
+  testWorkerRestart();
+
+  std::cout << "testMemoryBudget" << std::endl;
+  std::cout.flush();
+  testMemoryBudget();
+
+  std::cout << "testSharedDaemon" << std::endl;
+  std::cout.flush();
+  testSharedDaemon();
+
+  std::cout << "testSharedDocuments" << std::endl;
+  std::cout.flush();
+  testSharedDocuments();
+
+  std::cout << "testCompletionPrefetch" << std::endl;
+  std::cout.flush();
+  testCompletionPrefetch();
+
+  std::cout << "testCompletionDeltas" << std::endl;
+  std::cout.flush();
+  testCompletionDeltas();
+
+  std::cout << "testWarmRestart" << std::endl;
+  std::cout.flush();
+  testWarmRestart();
+
+  std::cout << "testModuleBuffersAreShared" << std::endl;
+  std::cout.flush();
+  testModuleBuffersAreShared();
+
+  // IntegrationTests End
   return 0;
 }
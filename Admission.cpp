@@ -0,0 +1,122 @@
+#import <algorithm>
+#import <chrono>
+#import <cmath>
+#import <mutex>
+
+#import "Admission.hpp"
+#import "Metrics.hpp"
+
+using namespace ssvim;
+
+static std::uint64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct AdmissionControl::Impl {
+  std::mutex mutex;
+  AdmissionLimits limits;
+  unsigned sessions = 0;
+  unsigned jobs = 0;
+  std::uint64_t queuedBytes = 0;
+  // Moving average of job durations, seeded with a typical completion
+  double jobSeconds = 0.05;
+
+  metrics::Gauge &jobsGauge = metrics::Registry::shared().gauge(
+      "ssvim_admission_jobs", "", "Semantic jobs running or waiting to run");
+  metrics::Gauge &bytesGauge = metrics::Registry::shared().gauge(
+      "ssvim_admission_queued_bytes", "",
+      "Request bytes held by admitted semantic jobs");
+};
+
+AdmissionControl &AdmissionControl::shared() {
+  static AdmissionControl *control = new AdmissionControl();
+  return *control;
+}
+
+AdmissionControl::AdmissionControl() : _impl(new Impl()) {
+}
+
+void AdmissionControl::setLimits(const AdmissionLimits &limits) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->limits = limits;
+}
+
+bool AdmissionControl::openSession() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto max = _impl->limits.maxSessions;
+  if (max && _impl->sessions >= max) {
+    return false;
+  }
+  _impl->sessions++;
+  return true;
+}
+
+void AdmissionControl::closeSession() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->sessions--;
+}
+
+std::unique_ptr<AdmissionTicket>
+AdmissionControl::admitJob(std::size_t bytes, std::string *reason) {
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    auto &limits = _impl->limits;
+    if (limits.maxJobs && _impl->jobs >= limits.maxJobs) {
+      *reason = "jobs";
+      return nullptr;
+    }
+    // A job larger than the limit is admitted when nothing else is queued,
+    // otherwise it could never run
+    if (limits.maxQueuedBytes && _impl->queuedBytes &&
+        _impl->queuedBytes + bytes > limits.maxQueuedBytes) {
+      *reason = "bytes";
+      return nullptr;
+    }
+    _impl->jobs++;
+    _impl->queuedBytes += bytes;
+  }
+  _impl->jobsGauge.add();
+  _impl->bytesGauge.add(bytes);
+  return std::unique_ptr<AdmissionTicket>(new AdmissionTicket(*this, bytes));
+}
+
+void AdmissionControl::finishJob(std::size_t bytes, double seconds) {
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    _impl->jobs--;
+    _impl->queuedBytes -= bytes;
+    _impl->jobSeconds = 0.9 * _impl->jobSeconds + 0.1 * seconds;
+  }
+  _impl->jobsGauge.sub();
+  _impl->bytesGauge.sub(bytes);
+}
+
+unsigned AdmissionControl::runningJobs() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  return _impl->jobs;
+}
+
+unsigned AdmissionControl::retryAfterSeconds() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  // The work ahead, if it ran one job at a time
+  auto seconds = _impl->jobSeconds * std::max(1u, _impl->jobs);
+  return std::max(1u, (unsigned)std::ceil(seconds));
+}
+
+void AdmissionControl::reject(const std::string &reason) {
+  metrics::Registry::shared()
+      .counter("ssvim_admission_rejections_total",
+               "reason=\"" + reason + "\"",
+               "Requests turned away because a limit was reached")
+      .increment();
+}
+
+AdmissionTicket::AdmissionTicket(AdmissionControl &control, std::size_t bytes)
+    : _control(control), _bytes(bytes), _start(NowMicros()) {
+}
+
+AdmissionTicket::~AdmissionTicket() {
+  _control.finishJob(_bytes, (NowMicros() - _start) / 1e6);
+}
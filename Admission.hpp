@@ -0,0 +1,73 @@
+#import <cstddef>
+#import <cstdint>
+#import <memory>
+#import <string>
+
+namespace ssvim {
+
+// Limits on the work the server takes on. 0 is unlimited.
+struct AdmissionLimits {
+  // Open HTTP connections
+  unsigned maxSessions = 64;
+  // Semantic requests running or waiting to run
+  unsigned maxJobs = 32;
+  // Request bodies held by those jobs
+  std::uint64_t maxQueuedBytes = 256 * 1024 * 1024;
+};
+
+class AdmissionControl;
+
+// A semantic job admitted to run. Releases its slot when destroyed.
+class AdmissionTicket {
+public:
+  AdmissionTicket(AdmissionControl &control, std::size_t bytes);
+  ~AdmissionTicket();
+
+private:
+  AdmissionControl &_control;
+  std::size_t _bytes;
+  std::uint64_t _start;
+};
+
+/**
+ * AdmissionControl bounds concurrent sessions, semantic jobs and the bytes
+ * they hold, so a burst of requests is turned away cheaply rather than
+ * piling up work and memory.
+ *
+ * Rejections are counted per reason and carry an estimate of when to retry,
+ * from the recent duration of jobs and the work ahead.
+ */
+class AdmissionControl {
+public:
+  static AdmissionControl &shared();
+
+  void setLimits(const AdmissionLimits &limits);
+
+  // Open a session, unless there are too many. Balanced by closeSession.
+  bool openSession();
+  void closeSession();
+
+  // Admit a job holding `bytes` of request, or return null with `reason`
+  // set.
+  std::unique_ptr<AdmissionTicket> admitJob(std::size_t bytes,
+                                            std::string *reason);
+
+  // Jobs admitted and not finished.
+  unsigned runningJobs();
+
+  // Seconds until a rejected request is likely to be admitted.
+  unsigned retryAfterSeconds();
+
+  // Count a rejection.
+  void reject(const std::string &reason);
+
+private:
+  friend class AdmissionTicket;
+  AdmissionControl();
+  void finishJob(std::size_t bytes, double seconds);
+
+  struct Impl;
+  Impl *_impl;
+};
+
+} // namespace ssvim
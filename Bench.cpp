@@ -0,0 +1,339 @@
+#import "FutureChannel.hpp"
+#import "Logging.hpp"
+#import "Metrics.hpp"
+#import "SemanticBackend.hpp"
+#import "SemanticHTTPServer.hpp"
+#import "SwiftCompleter.hpp"
+
+#import <algorithm>
+#import <boost/program_options.hpp>
+#import <boost/property_tree/json_parser.hpp>
+#import <chrono>
+#import <functional>
+#import <iostream>
+#import <sstream>
+#import <string>
+#import <thread>
+#import <vector>
+
+// ssvim_bench runs micro-benchmarks of the server's hot paths and prints the
+// results as JSON, so runs can be diffed.
+//
+// The logger benchmarks write to stderr, which is best sent to /dev/null.
+
+using namespace ssvim;
+using namespace ssvim::http;
+
+// Results are added here so the work can't be optimized away
+static volatile std::size_t Sink;
+
+#pragma mark - Runner
+
+struct BenchResult {
+  std::string name;
+  std::uint64_t iterations;
+  double nsPerOp;
+  double minNsPerOp;
+};
+
+class BenchRunner {
+  std::string _filter;
+  std::chrono::nanoseconds _minTime;
+  unsigned _repetitions;
+  std::vector<BenchResult> _results;
+
+  static std::chrono::nanoseconds time(std::function<void(std::uint64_t)> &fn,
+                                       std::uint64_t iterations) {
+    auto start = std::chrono::steady_clock::now();
+    fn(iterations);
+    return std::chrono::steady_clock::now() - start;
+  }
+
+public:
+  BenchRunner(std::string filter, std::chrono::milliseconds minTime,
+              unsigned repetitions)
+      : _filter(filter), _minTime(minTime), _repetitions(repetitions) {
+  }
+
+  // `fn` runs the benchmark `iterations` times.
+  //
+  // The iteration count grows until a run takes at least the minimum time,
+  // and then the run is repeated. Reported times are the median and the
+  // fastest of the repetitions.
+  void run(const std::string &name,
+           std::function<void(std::uint64_t iterations)> fn) {
+    if (name.find(_filter) == std::string::npos) {
+      return;
+    }
+    std::uint64_t iterations = 1;
+    for (;;) {
+      auto elapsed = time(fn, iterations);
+      if (elapsed >= _minTime || iterations >= (1ull << 40)) {
+        break;
+      }
+      // Aim past the minimum time, growing at most 10x per step
+      auto scale = elapsed.count() ? 1.5 * _minTime.count() / elapsed.count()
+                                   : 10.0;
+      iterations = std::max<std::uint64_t>(
+          iterations + 1, iterations * std::min(scale, 10.0));
+    }
+
+    std::vector<double> nsPerOp;
+    for (unsigned r = 0; r < _repetitions; r++) {
+      nsPerOp.push_back((double)time(fn, iterations).count() / iterations);
+    }
+    std::sort(nsPerOp.begin(), nsPerOp.end());
+    _results.push_back(
+        {name, iterations, nsPerOp[nsPerOp.size() / 2], nsPerOp.front()});
+    std::cerr << name << ": " << nsPerOp[nsPerOp.size() / 2] << " ns/op"
+              << std::endl;
+  }
+
+  // Written by hand, like ssvim_loadgen's report, to keep numbers as numbers.
+  std::string JSON() const {
+    std::ostringstream os;
+    os << "{\n";
+    os << "  \"min_time_ms\": "
+       << std::chrono::duration_cast<std::chrono::milliseconds>(_minTime)
+              .count()
+       << ",\n";
+    os << "  \"repetitions\": " << _repetitions << ",\n";
+    os << "  \"benchmarks\": [";
+    for (std::size_t i = 0; i < _results.size(); i++) {
+      auto &result = _results[i];
+      os << (i ? ",\n" : "\n");
+      os << "    {\"name\": \"" << result.name << "\""
+         << ", \"iterations\": " << result.iterations
+         << ", \"ns_per_op\": " << result.nsPerOp
+         << ", \"min_ns_per_op\": " << result.minNsPerOp
+         << ", \"ops_per_second\": " << 1e9 / result.nsPerOp << "}";
+    }
+    os << "\n  ]\n}\n";
+    return os.str();
+  }
+};
+
+// Split `iterations` across `threads` threads, and wait for them.
+static void RunOnThreads(unsigned threads, std::uint64_t iterations,
+                         std::function<void(unsigned, std::uint64_t)> fn) {
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    auto share = iterations / threads + (t < iterations % threads ? 1 : 0);
+    workers.emplace_back(fn, t, share);
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+#pragma mark - Inputs
+
+// Swift source with `lines` lines, ending with a member access.
+static std::string SwiftSource(unsigned lines) {
+  std::string source = "import Foundation\n\nclass Generated {\n";
+  for (unsigned i = 3; i + 2 < lines; i++) {
+    source += "    var property" + std::to_string(i) + ": Int = " +
+              std::to_string(i) + "\n";
+  }
+  source += "}\nGenerated().\n";
+  return source;
+}
+
+static std::vector<std::string> Flags(unsigned count) {
+  std::vector<std::string> flags = {"-sdk", "/Applications/Xcode.app/Contents/"
+                                            "Developer/Platforms/"
+                                            "iPhoneOS.platform/Developer/SDKs/"
+                                            "iPhoneOS.sdk",
+                                    "-target", "arm64-apple-ios14.3"};
+  for (unsigned i = flags.size(); i < count; i++) {
+    flags.push_back("-DFLAG_" + std::to_string(i));
+  }
+  return flags;
+}
+
+// A body like the ones editors post to /completions
+static std::string CompletionPostBody(const std::string &contents,
+                                      const std::vector<std::string> &flags) {
+  ptree out;
+  out.put("line", 1);
+  out.put("column", 1);
+  out.put("file_name", "/tmp/Generated.swift");
+  out.put("contents", contents);
+  out.put("query", "");
+  ptree flagsOut;
+  for (auto &f : flags) {
+    ptree flag;
+    flag.put("", f);
+    flagsOut.push_back(std::make_pair("", flag));
+  }
+  out.add_child("flags", flagsOut);
+  std::ostringstream oss;
+  boost::property_tree::write_json(oss, out);
+  return oss.str();
+}
+
+#pragma mark - Benchmarks
+
+static void BenchGetOffset(BenchRunner &runner) {
+  for (auto lines : {100u, 10000u, 100000u}) {
+    CompletionContext ctx;
+    ctx.sourceFilename = "/tmp/Generated.swift";
+    ctx.unsavedFiles.resize(1);
+    ctx.unsavedFiles[0].fileName = ctx.sourceFilename;
+    ctx.unsavedFiles[0].contents = SwiftSource(lines);
+    ctx.line = lines - 1;
+    ctx.column = 11;
+    runner.run("get_offset/" + std::to_string(lines) + "_lines",
+               [&](std::uint64_t iterations) {
+                 for (std::uint64_t i = 0; i < iterations; i++) {
+                   unsigned offset;
+                   std::string cleanFile;
+                   GetOffset(ctx, &offset, &cleanFile);
+                   Sink += offset;
+                 }
+               });
+  }
+}
+
+static void BenchRequestBodies(BenchRunner &runner) {
+  for (auto lines : {100u, 10000u}) {
+    auto body = CompletionPostBody(SwiftSource(lines), Flags(4));
+    runner.run("read_json_post_body/" + std::to_string(lines) + "_lines",
+               [&](std::uint64_t iterations) {
+                 for (std::uint64_t i = 0; i < iterations; i++) {
+                   Sink += readJSONPostBody(body).size();
+                 }
+               });
+  }
+
+  auto bodyJSON = readJSONPostBody(CompletionPostBody("", Flags(32)));
+  runner.run("as_vector/32_flags", [&](std::uint64_t iterations) {
+    for (std::uint64_t i = 0; i < iterations; i++) {
+      Sink += as_vector<std::string>(bodyJSON, "flags").size();
+    }
+  });
+}
+
+// The semantic response is copied into a response and serialized, as the
+// completions endpoint does. Without sourcekitd, responses come from the
+// stand-in.
+static void BenchResponseSerialization(BenchRunner &runner) {
+  namespace http = boost::beast::http;
+  for (auto candidates : {100u, 1000u}) {
+    StandInBackendOptions options;
+    options.candidateCount = candidates;
+    auto backend = MakeStandInBackend(LogLevelError, options);
+    auto JSON = backend->CompletionOpen(BackendRequest()).JSON;
+    runner.run("response_serialization/" + std::to_string(candidates) +
+                   "_candidates",
+               [&](std::uint64_t iterations) {
+                 for (std::uint64_t i = 0; i < iterations; i++) {
+                   http::response<http::string_body> res;
+                   res.result(http::status::ok);
+                   res.version(11);
+                   res.insert(http::field::server, "SSVIM");
+                   res.insert(http::field::content_type, "application/json");
+                   res.body() = JSON;
+                   res.prepare_payload();
+                   std::ostringstream os;
+                   os << res;
+                   Sink += os.tellp();
+                 }
+               });
+  }
+}
+
+static void BenchLogger(BenchRunner &runner) {
+  Logger disabled(LogLevelError);
+  runner.run("logger/disabled", [&](std::uint64_t iterations) {
+    for (std::uint64_t i = 0; i < iterations; i++) {
+      disabled << "not logged";
+    }
+  });
+
+  for (auto threads : {1u, 4u, 8u}) {
+    runner.run("logger/contended_" + std::to_string(threads) + "_threads",
+               [&](std::uint64_t iterations) {
+                 RunOnThreads(threads, iterations,
+                              [](unsigned t, std::uint64_t share) {
+                                Logger logger(LogLevelError, "BENCH");
+                                for (std::uint64_t i = 0; i < share; i++) {
+                                  logger.log(LogLevelError, "message ", i);
+                                }
+                              });
+               });
+  }
+  LogSink::shared().flush();
+}
+
+static void BenchFutureChannel(BenchRunner &runner) {
+  metrics::Gauge pending;
+  FutureChannel channel(pending);
+  std::string value = "{\"key.diagnostics\": []}";
+  for (auto threads : {1u, 4u}) {
+    runner.run("future_channel/set_future_" + std::to_string(threads) +
+                   "_threads",
+               [&](std::uint64_t iterations) {
+                 RunOnThreads(threads, iterations,
+                              [&](unsigned t, std::uint64_t share) {
+                                auto key = "/tmp/File" + std::to_string(t) +
+                                           ".swift";
+                                for (std::uint64_t i = 0; i < share; i++) {
+                                  auto future = channel.future(key);
+                                  channel.set(key, value);
+                                  Sink += future.get().size();
+                                }
+                              });
+               });
+  }
+}
+
+static void BenchRouting(BenchRunner &runner) {
+  // Each session builds its own endpoints before routing its first request
+  runner.run("session_routing/new_session", [&](std::uint64_t iterations) {
+    for (std::uint64_t i = 0; i < iterations; i++) {
+      auto endpoints = MakeEndpoints();
+      Sink += FindEndpoint(endpoints, "/completions") != endpoints.end();
+    }
+  });
+
+  auto endpoints = MakeEndpoints();
+  runner.run("session_routing/find", [&](std::uint64_t iterations) {
+    for (std::uint64_t i = 0; i < iterations; i++) {
+      Sink += FindEndpoint(endpoints, "/debug/trace?requests=4") !=
+              endpoints.end();
+    }
+  });
+}
+
+int main(int ac, char const *av[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "Show this message")(
+      "filter", po::value<std::string>()->default_value(""),
+      "Only run benchmarks whose name contains this")(
+      "min-time-ms", po::value<unsigned>()->default_value(200),
+      "Minimum time of each repetition")(
+      "repetitions", po::value<unsigned>()->default_value(5),
+      "Number of timed repetitions of each benchmark");
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  BenchRunner runner(
+      vm["filter"].as<std::string>(),
+      std::chrono::milliseconds(vm["min-time-ms"].as<unsigned>()),
+      std::max(1u, vm["repetitions"].as<unsigned>()));
+  BenchGetOffset(runner);
+  BenchRequestBodies(runner);
+  BenchResponseSerialization(runner);
+  BenchLogger(runner);
+  BenchFutureChannel(runner);
+  BenchRouting(runner);
+  std::cout << runner.JSON();
+  return 0;
+}
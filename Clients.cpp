@@ -0,0 +1,164 @@
+#import <atomic>
+#import <map>
+#import <mutex>
+#import <vector>
+
+#import "Clients.hpp"
+#import "Metrics.hpp"
+#import "ModuleContext.hpp"
+
+using namespace ssvim;
+
+const char *const ssvim::ClientHeader = "X-SSVIM-Client";
+
+static thread_local std::string CurrentClientName;
+static thread_local ModuleContext *CurrentContext = nullptr;
+
+struct ClientRegistry::Impl {
+  struct Client {
+    // Null for the default client
+    std::shared_ptr<ModuleContext> context;
+    unsigned active = 0;
+    std::chrono::steady_clock::time_point lastUsed;
+  };
+
+  std::mutex mutex;
+  std::map<std::string, Client> clients;
+  std::atomic<bool> daemon{false};
+
+  metrics::Gauge &clientsGauge = metrics::Registry::shared().gauge(
+      "ssvim_clients", "", "Editor instances attached to the server");
+
+  static void countDetach(const std::string &reason) {
+    metrics::Registry::shared()
+        .counter("ssvim_client_detaches_total", "reason=\"" + reason + "\"",
+                 "Clients detached, by reason")
+        .increment();
+  }
+};
+
+ClientRegistry &ClientRegistry::shared() {
+  static ClientRegistry *registry = new ClientRegistry();
+  return *registry;
+}
+
+ClientRegistry::ClientRegistry() : _impl(new Impl()) {
+}
+
+std::shared_ptr<ModuleContext>
+ClientRegistry::enter(const std::string &client) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto &entry = _impl->clients[client];
+  if (!entry.context && client.length()) {
+    entry.context = std::make_shared<ModuleContext>(client);
+  }
+  entry.active++;
+  entry.lastUsed = std::chrono::steady_clock::now();
+  _impl->clientsGauge.set(_impl->clients.size());
+  return entry.context;
+}
+
+void ClientRegistry::leave(const std::string &client) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto entry = _impl->clients.find(client);
+  if (entry != _impl->clients.end()) {
+    entry->second.active--;
+    entry->second.lastUsed = std::chrono::steady_clock::now();
+  }
+}
+
+bool ClientRegistry::detach(const std::string &client) {
+  // Buffers are released outside the lock
+  std::shared_ptr<ModuleContext> context;
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    auto entry = _impl->clients.find(client);
+    if (entry == _impl->clients.end()) {
+      return false;
+    }
+    context = entry->second.context;
+    _impl->clients.erase(entry);
+    _impl->clientsGauge.set(_impl->clients.size());
+  }
+  Impl::countDetach("request");
+  return true;
+}
+
+std::size_t
+ClientRegistry::expireIdle(std::chrono::steady_clock::duration idle) {
+  std::vector<std::shared_ptr<ModuleContext>> contexts;
+  std::size_t attached;
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    auto now = std::chrono::steady_clock::now();
+    for (auto entry = _impl->clients.begin();
+         entry != _impl->clients.end();) {
+      auto &client = entry->second;
+      if (client.active || now - client.lastUsed < idle) {
+        ++entry;
+        continue;
+      }
+      contexts.push_back(client.context);
+      entry = _impl->clients.erase(entry);
+      Impl::countDetach("idle");
+    }
+    attached = _impl->clients.size();
+    _impl->clientsGauge.set(attached);
+  }
+  return attached;
+}
+
+std::size_t ClientRegistry::size() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  return _impl->clients.size();
+}
+
+std::vector<std::string> ClientRegistry::names() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  std::vector<std::string> names;
+  for (auto &client : _impl->clients) {
+    if (client.first.length()) {
+      names.push_back(client.first);
+    }
+  }
+  return names;
+}
+
+std::shared_ptr<ModuleContext>
+ClientRegistry::context(const std::string &client) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto entry = _impl->clients.find(client);
+  if (entry == _impl->clients.end()) {
+    return nullptr;
+  }
+  return entry->second.context;
+}
+
+void ClientRegistry::setDaemon(bool daemon) {
+  _impl->daemon = daemon;
+}
+
+bool ClientRegistry::isDaemon() {
+  return _impl->daemon;
+}
+
+ClientScope::ClientScope(const std::string &client)
+    : _client(client), _context(ClientRegistry::shared().enter(client)),
+      _previousClient(CurrentClientName), _previousContext(CurrentContext) {
+  CurrentClientName = client;
+  CurrentContext = _context.get();
+}
+
+ClientScope::~ClientScope() {
+  CurrentClientName = _previousClient;
+  CurrentContext = _previousContext;
+  ClientRegistry::shared().leave(_client);
+}
+
+const std::string &ssvim::CurrentClient() {
+  return CurrentClientName;
+}
+
+ModuleContext *ssvim::CurrentClientContext() {
+  return CurrentContext;
+}
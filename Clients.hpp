@@ -0,0 +1,86 @@
+#import <chrono>
+#import <cstddef>
+#import <memory>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+class ModuleContext;
+
+// The header naming the editor instance a request comes from. Requests
+// without it belong to the default client.
+extern const char *const ClientHeader;
+
+/**
+ * ClientRegistry tracks the editor instances attached to a shared server.
+ *
+ * Each client has its own editor buffers, in a ModuleContext, so two vim
+ * instances never see each other's unsaved files. Flag sets, module caches
+ * and the backend are shared. A client is attached by its first request,
+ * and detached when it asks to or after it idles out; the default client
+ * uses the shared context.
+ */
+class ClientRegistry {
+public:
+  static ClientRegistry &shared();
+
+  // Detach `client` and drop its buffers. Returns false if it wasn't
+  // attached.
+  bool detach(const std::string &client);
+
+  // Detach the clients without a request running for longer than `idle`,
+  // and return the number still attached.
+  std::size_t expireIdle(std::chrono::steady_clock::duration idle);
+
+  std::size_t size();
+
+  // The attached clients, other than the default one.
+  std::vector<std::string> names();
+
+  // The buffers of an attached client, or null.
+  std::shared_ptr<ModuleContext> context(const std::string &client);
+
+  // A daemon is shared by editor instances, so a client asking it to shut
+  // down only detaches.
+  void setDaemon(bool daemon);
+  bool isDaemon();
+
+private:
+  friend class ClientScope;
+  ClientRegistry();
+  ClientRegistry(ClientRegistry const &) = delete;
+  ClientRegistry &operator=(ClientRegistry const &) = delete;
+
+  std::shared_ptr<ModuleContext> enter(const std::string &client);
+  void leave(const std::string &client);
+
+  struct Impl;
+  Impl *_impl;
+};
+
+// Work on the current thread within the scope is on behalf of `client`,
+// which is attached if it wasn't. Threads started for the work open their
+// own scope.
+class ClientScope {
+public:
+  explicit ClientScope(const std::string &client);
+  ~ClientScope();
+
+  ClientScope(ClientScope const &) = delete;
+  ClientScope &operator=(ClientScope const &) = delete;
+
+private:
+  std::string _client;
+  std::shared_ptr<ModuleContext> _context;
+  std::string _previousClient;
+  ModuleContext *_previousContext;
+};
+
+// The client of the current scope, or "" for the default client.
+const std::string &CurrentClient();
+
+// The module context of the current scope, or null for the default client.
+ModuleContext *CurrentClientContext();
+
+} // namespace ssvim
@@ -0,0 +1,568 @@
+#import <boost/filesystem.hpp>
+#import <fcntl.h>
+#import <set>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+#import "CompileDatabase.hpp"
+#import "Metrics.hpp"
+
+using namespace ssvim;
+
+#pragma mark - Commands
+
+std::vector<std::string> ssvim::SplitCommand(const std::string &command) {
+  std::vector<std::string> arguments;
+  std::string argument;
+  bool inArgument = false;
+  char quote = '\0';
+  for (std::size_t i = 0; i < command.length(); i++) {
+    char c = command[i];
+    if (quote) {
+      if (c == quote) {
+        quote = '\0';
+      } else if (c == '\\' && quote == '"' && i + 1 < command.length() &&
+                 (command[i + 1] == '"' || command[i + 1] == '\\')) {
+        argument += command[++i];
+      } else {
+        argument += c;
+      }
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      inArgument = true;
+    } else if (c == '\\' && i + 1 < command.length()) {
+      argument += command[++i];
+      inArgument = true;
+    } else if (isspace((unsigned char)c)) {
+      if (inArgument) {
+        arguments.push_back(argument);
+        argument.clear();
+        inArgument = false;
+      }
+    } else {
+      argument += c;
+      inArgument = true;
+    }
+  }
+  if (inArgument) {
+    arguments.push_back(argument);
+  }
+  return arguments;
+}
+
+// Flags that can't be part of a completion invocation. These may have a
+// value, which is skipped unless it starts with -.
+static const std::set<std::string> BasicFlagBlacklist = {
+    "-c",
+    "-MP",
+    "-MD",
+    "-MMD",
+    "--fcolor-diagnostics",
+    "-emit-reference-dependencies-path",
+    "-emit-dependencies-path",
+    "-emit-module-path",
+    "-serialize-diagnostics-path",
+    "-emit-module-doc-path",
+    "-frontend",
+    "-o",
+};
+
+// Flags which are always followed by a value, both of which are skipped.
+static const std::set<std::string> PairedFlagBlacklist = {
+    "-Xcc",
+    "-pch-output-dir",
+};
+
+std::vector<std::string>
+ssvim::FlagsForCommand(const std::vector<std::string> &arguments) {
+  std::vector<std::string> flags;
+  // Skip the compiler
+  for (std::size_t i = 1; i < arguments.size(); i++) {
+    auto &flag = arguments[i];
+    if (PairedFlagBlacklist.count(flag)) {
+      i++;
+    } else if (BasicFlagBlacklist.count(flag)) {
+      if (i + 1 < arguments.size() && arguments[i + 1][0] != '-') {
+        i++;
+      }
+    } else {
+      flags.push_back(flag);
+    }
+  }
+  return flags;
+}
+
+#pragma mark - Parsing
+
+static void AppendUTF8(std::string &out, unsigned code) {
+  if (code < 0x80) {
+    out += (char)code;
+  } else if (code < 0x800) {
+    out += (char)(0xC0 | (code >> 6));
+    out += (char)(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    out += (char)(0xE0 | (code >> 12));
+    out += (char)(0x80 | ((code >> 6) & 0x3F));
+    out += (char)(0x80 | (code & 0x3F));
+  } else {
+    out += (char)(0xF0 | (code >> 18));
+    out += (char)(0x80 | ((code >> 12) & 0x3F));
+    out += (char)(0x80 | ((code >> 6) & 0x3F));
+    out += (char)(0x80 | (code & 0x3F));
+  }
+}
+
+// Scans the JSON of a compile database in place.
+//
+// Only strings and arrays of strings are read, other values are skipped.
+class JSONScanner {
+  const char *_p;
+  const char *_end;
+
+public:
+  JSONScanner(const char *begin, const char *end) : _p(begin), _end(end) {
+  }
+
+  bool consume(char c) {
+    while (_p < _end && isspace((unsigned char)*_p)) {
+      _p++;
+    }
+    if (_p < _end && *_p == c) {
+      _p++;
+      return true;
+    }
+    return false;
+  }
+
+  // The 4 hex digits of a \u escape.
+  bool hexCode(unsigned &code) {
+    if (_end - _p < 4) {
+      return false;
+    }
+    code = 0;
+    for (auto end = _p + 4; _p < end; _p++) {
+      auto c = *_p;
+      code <<= 4;
+      if (c >= '0' && c <= '9') {
+        code |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        code |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        code |= c - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool string(std::string &out) {
+    out.clear();
+    if (!consume('"')) {
+      return false;
+    }
+    while (_p < _end && *_p != '"') {
+      if (*_p != '\\') {
+        out += *_p++;
+        continue;
+      }
+      if (++_p == _end) {
+        return false;
+      }
+      switch (*_p++) {
+      case 'n':
+        out += '\n';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'u': {
+        unsigned code;
+        if (!hexCode(code)) {
+          return false;
+        }
+        // Characters outside the BMP are escaped as a surrogate pair. A lone
+        // surrogate has no UTF-8 encoding, and is replaced.
+        if (code >= 0xD800 && code < 0xDC00) {
+          unsigned low;
+          if (_end - _p >= 2 && _p[0] == '\\' && _p[1] == 'u') {
+            _p += 2;
+            if (!hexCode(low)) {
+              return false;
+            }
+            if (low >= 0xDC00 && low < 0xE000) {
+              code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            } else {
+              AppendUTF8(out, 0xFFFD);
+              code = low;
+            }
+          } else {
+            code = 0xFFFD;
+          }
+        }
+        if (code >= 0xD800 && code < 0xE000) {
+          code = 0xFFFD;
+        }
+        AppendUTF8(out, code);
+        break;
+      }
+      default:
+        out += _p[-1];
+      }
+    }
+    return consume('"');
+  }
+
+  bool stringArray(std::vector<std::string> &out) {
+    out.clear();
+    if (!consume('[')) {
+      return false;
+    }
+    if (consume(']')) {
+      return true;
+    }
+    do {
+      std::string value;
+      if (!string(value)) {
+        return false;
+      }
+      out.push_back(value);
+    } while (consume(','));
+    return consume(']');
+  }
+
+  bool skipValue() {
+    std::string ignored;
+    if (consume('{') || consume('[')) {
+      // Skip to the matching bracket, stepping over strings
+      int depth = 1;
+      while (_p < _end && depth) {
+        if (*_p == '"') {
+          if (!string(ignored)) {
+            return false;
+          }
+          continue;
+        }
+        if (*_p == '{' || *_p == '[') {
+          depth++;
+        } else if (*_p == '}' || *_p == ']') {
+          depth--;
+        }
+        _p++;
+      }
+      return depth == 0;
+    }
+    if (_p < _end && *_p == '"') {
+      return string(ignored);
+    }
+    // Numbers, true, false and null
+    while (_p < _end && *_p != ',' && *_p != '}' && *_p != ']') {
+      _p++;
+    }
+    return true;
+  }
+};
+
+struct CompileCommand {
+  std::string directory;
+  std::string file;
+  std::string command;
+  std::vector<std::string> arguments;
+};
+
+static bool ParseCompileCommands(const char *begin, const char *end,
+                                 std::vector<CompileCommand> &commands) {
+  JSONScanner scanner(begin, end);
+  if (!scanner.consume('[')) {
+    return false;
+  }
+  if (scanner.consume(']')) {
+    return true;
+  }
+  do {
+    CompileCommand command;
+    if (!scanner.consume('{')) {
+      return false;
+    }
+    if (!scanner.consume('}')) {
+      do {
+        std::string key;
+        if (!scanner.string(key) || !scanner.consume(':')) {
+          return false;
+        }
+        bool ok;
+        if (key == "directory") {
+          ok = scanner.string(command.directory);
+        } else if (key == "file") {
+          ok = scanner.string(command.file);
+        } else if (key == "command") {
+          ok = scanner.string(command.command);
+        } else if (key == "arguments") {
+          ok = scanner.stringArray(command.arguments);
+        } else {
+          ok = scanner.skipValue();
+        }
+        if (!ok) {
+          return false;
+        }
+      } while (scanner.consume(','));
+      if (!scanner.consume('}')) {
+        return false;
+      }
+    }
+    commands.push_back(std::move(command));
+  } while (scanner.consume(','));
+  return scanner.consume(']');
+}
+
+static std::string NormalizedPath(const std::string &directory,
+                                  const std::string &file) {
+  boost::filesystem::path path(file);
+  if (path.is_relative() && directory.length()) {
+    path = boost::filesystem::path(directory) / path;
+  }
+  return path.lexically_normal().string();
+}
+
+static bool HasSuffix(const std::string &value, const std::string &suffix) {
+  return value.length() >= suffix.length() &&
+         value.compare(value.length() - suffix.length(), suffix.length(),
+                       suffix) == 0;
+}
+
+#pragma mark - CompileDatabase
+
+CompileDatabase::CompileDatabase(const std::string &path) : _path(path) {
+}
+
+bool CompileDatabase::refresh() {
+  struct stat info;
+  if (stat(_path.c_str(), &info) != 0) {
+    return false;
+  }
+#if __APPLE__
+  auto modificationTime = info.st_mtimespec;
+#else
+  auto modificationTime = info.st_mtim;
+#endif
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (modificationTime.tv_sec == _modificationTime.tv_sec &&
+      modificationTime.tv_nsec == _modificationTime.tv_nsec &&
+      info.st_size == _fileSize) {
+    return true;
+  }
+  if (!load()) {
+    return false;
+  }
+  _modificationTime = modificationTime;
+  _fileSize = info.st_size;
+  return true;
+}
+
+// Called with the lock held.
+bool CompileDatabase::load() {
+  static auto &loadTime = metrics::StageHistogram("compile_database_load");
+  metrics::ScopedTimer timer(loadTime);
+
+  int fd = open(_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  std::vector<CompileCommand> commands;
+  bool parsed = false;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    auto address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address != MAP_FAILED) {
+      auto begin = static_cast<const char *>(address);
+      parsed = ParseCompileCommands(begin, begin + info.st_size, commands);
+      munmap(address, info.st_size);
+    }
+  }
+  close(fd);
+  if (!parsed) {
+    return false;
+  }
+
+  std::unordered_map<std::string, Entry> entries;
+  std::unordered_map<std::string, std::string> inputs;
+  std::string firstFile;
+  for (auto &command : commands) {
+    auto file = NormalizedPath(command.directory, command.file);
+    auto arguments = command.arguments.size() ? command.arguments
+                                              : SplitCommand(command.command);
+    // Entries are keyed by their whole command, so flags are only rebuilt
+    // for the commands that changed.
+    std::string key;
+    for (auto &argument : arguments) {
+      key += argument;
+      key += '\0';
+    }
+    Entry entry;
+    entry.command = key;
+    auto existing = _entries.find(file);
+    if (existing != _entries.end() && existing->second.command == key) {
+      entry.flags = existing->second.flags;
+    } else {
+      entry.flags =
+          std::make_shared<const std::vector<std::string>>(
+              FlagsForCommand(arguments));
+    }
+    if (entries.empty()) {
+      firstFile = file;
+    }
+    // Like other tools, the first command for a file wins
+    entries.emplace(file, entry);
+
+    for (std::size_t i = 1; i < arguments.size(); i++) {
+      if (HasSuffix(arguments[i], ".swift")) {
+        inputs.emplace(NormalizedPath(command.directory, arguments[i]), file);
+      }
+    }
+  }
+  _entries.swap(entries);
+  _inputs.swap(inputs);
+  _firstFile = firstFile;
+  return true;
+}
+
+bool CompileDatabase::flagsForFile(const std::string &file,
+                                   std::vector<std::string> *flags) {
+  auto path = NormalizedPath("", file);
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto entry = _entries.find(path);
+  if (entry == _entries.end()) {
+    auto input = _inputs.find(path);
+    entry = _entries.find(input != _inputs.end() ? input->second : _firstFile);
+    if (entry == _entries.end()) {
+      return false;
+    }
+  }
+  *flags = *entry->second.flags;
+  return true;
+}
+
+std::vector<std::vector<std::string>>
+CompileDatabase::flagSets(std::size_t limit) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::set<std::vector<std::string>> seen;
+  std::vector<std::vector<std::string>> flagSets;
+  for (auto &entry : _entries) {
+    if (flagSets.size() == limit) {
+      break;
+    }
+    if (seen.insert(*entry.second.flags).second) {
+      flagSets.push_back(*entry.second.flags);
+    }
+  }
+  return flagSets;
+}
+
+std::vector<std::string> CompileDatabase::files() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::set<std::string> files;
+  for (auto &entry : _entries) {
+    if (HasSuffix(entry.first, ".swift")) {
+      files.insert(entry.first);
+    }
+  }
+  for (auto &input : _inputs) {
+    files.insert(input.first);
+  }
+  return std::vector<std::string>(files.begin(), files.end());
+}
+
+std::size_t CompileDatabase::size() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _entries.size();
+}
+
+#pragma mark - Lookup
+
+static std::mutex DatabasesMutex;
+static std::string DatabasePath;
+// Databases by path
+static std::map<std::string, std::shared_ptr<CompileDatabase>> Databases;
+
+std::shared_ptr<CompileDatabase>
+ssvim::CompileDatabaseAtPath(const std::string &path) {
+  std::shared_ptr<CompileDatabase> database;
+  {
+    std::lock_guard<std::mutex> lock(DatabasesMutex);
+    auto &entry = Databases[path];
+    if (!entry) {
+      entry = std::make_shared<CompileDatabase>(path);
+    }
+    database = entry;
+  }
+  if (!database->refresh()) {
+    return nullptr;
+  }
+  return database;
+}
+
+void ssvim::SetCompileDatabasePath(const std::string &path) {
+  std::lock_guard<std::mutex> lock(DatabasesMutex);
+  DatabasePath = path;
+}
+
+// The nearest compile_commands.json in the parent directories of `file`.
+static std::string FindDatabaseForFile(const std::string &file) {
+  {
+    std::lock_guard<std::mutex> lock(DatabasesMutex);
+    if (DatabasePath.length()) {
+      return DatabasePath;
+    }
+  }
+  auto folder = boost::filesystem::path(file).parent_path();
+  for (; !folder.empty(); folder = folder.parent_path()) {
+    auto candidate = (folder / "compile_commands.json").string();
+    struct stat info;
+    if (stat(candidate.c_str(), &info) == 0) {
+      return candidate;
+    }
+    if (folder == folder.root_path()) {
+      break;
+    }
+  }
+  return "";
+}
+
+std::vector<std::string> ssvim::CompileFlagsForFile(const std::string &file) {
+  static auto &lookupTime = metrics::StageHistogram("flag_lookup");
+  metrics::ScopedTimer timer(lookupTime);
+  std::vector<std::string> flags;
+  auto path = FindDatabaseForFile(file);
+  if (path.empty()) {
+    return flags;
+  }
+  if (auto database = CompileDatabaseAtPath(path)) {
+    database->flagsForFile(file, &flags);
+  }
+  return flags;
+}
+
+std::vector<std::vector<std::string>>
+ssvim::CompileDatabaseFlagSets(std::size_t limit) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(DatabasesMutex);
+    path = DatabasePath;
+  }
+  if (path.empty()) {
+    return {};
+  }
+  auto database = CompileDatabaseAtPath(path);
+  return database ? database->flagSets(limit)
+                  : std::vector<std::vector<std::string>>();
+}
@@ -0,0 +1,81 @@
+#import <ctime>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <string>
+#import <unordered_map>
+#import <vector>
+
+namespace ssvim {
+
+// Split a shell command into arguments, handling quotes and escapes.
+std::vector<std::string> SplitCommand(const std::string &command);
+
+// Completion flags for a compile command: the compiler and flags that
+// sourcekitd can't use are removed.
+std::vector<std::string>
+FlagsForCommand(const std::vector<std::string> &arguments);
+
+/**
+ * An index of a compile_commands.json, from file paths to completion flags.
+ *
+ * The database is memory mapped and parsed once. It is reloaded when its
+ * modification time or size changes, reusing the flags of unchanged entries.
+ * Safe to use from multiple threads.
+ */
+class CompileDatabase {
+public:
+  CompileDatabase(const std::string &path);
+
+  // Reload the database if it changed. Returns false if it can't be read.
+  bool refresh();
+
+  // Flags for `file`, which may also be an input of another file's command.
+  // Other files get the flags of the first command, since Swift targets
+  // usually compile every file with the same flags.
+  bool flagsForFile(const std::string &file,
+                    std::vector<std::string> *flags);
+
+  // Up to `limit` distinct sets of flags in the database.
+  std::vector<std::vector<std::string>> flagSets(std::size_t limit);
+
+  // The Swift files of the database: those with commands and their inputs.
+  std::vector<std::string> files();
+
+  std::size_t size();
+
+private:
+  struct Entry {
+    std::string command;
+    std::shared_ptr<const std::vector<std::string>> flags;
+  };
+
+  bool load();
+
+  std::string _path;
+  std::mutex _mutex;
+  struct timespec _modificationTime = {0, 0};
+  long long _fileSize = -1;
+  std::unordered_map<std::string, Entry> _entries;
+  // Inputs of commands, e.g. the other files of a module, to entries
+  std::unordered_map<std::string, std::string> _inputs;
+  std::string _firstFile;
+};
+
+// The database at `path`, refreshed, or null if it can't be read.
+// Databases are shared by path.
+std::shared_ptr<CompileDatabase> CompileDatabaseAtPath(const std::string &path);
+
+// Use the database at `path` for all files, instead of looking for a
+// compile_commands.json in their parent directories.
+void SetCompileDatabasePath(const std::string &path);
+
+// The flags for a file from its compile database, or none.
+std::vector<std::string> CompileFlagsForFile(const std::string &file);
+
+// Up to `limit` distinct flag sets from the database set with
+// SetCompileDatabasePath.
+std::vector<std::vector<std::string>>
+CompileDatabaseFlagSets(std::size_t limit);
+
+} // namespace ssvim
@@ -0,0 +1,232 @@
+#import <algorithm>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <string_view>
+#import <unordered_map>
+#import <vector>
+
+#import "CompletionDelta.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+
+using namespace ssvim;
+
+// Result sets kept for clients to refer to
+static const std::size_t MaxResultSets = 64;
+
+// Split the key.results array of a completion response into the JSON of
+// each candidate. Returns false if the response isn't one.
+static bool SplitResults(const std::string &JSON,
+                         std::vector<std::string> *items) {
+  auto key = JSON.find("\"key.results\"");
+  if (key == std::string::npos) {
+    return false;
+  }
+  auto i = JSON.find('[', key);
+  if (i == std::string::npos) {
+    return false;
+  }
+  int depth = 0;
+  bool inString = false;
+  std::size_t start = 0;
+  for (i++; i < JSON.length(); i++) {
+    auto c = JSON[i];
+    if (inString) {
+      if (c == '\\') {
+        i++;
+      } else if (c == '"') {
+        inString = false;
+      }
+      continue;
+    }
+    switch (c) {
+    case '"':
+      inString = true;
+      break;
+    case '{':
+    case '[':
+      if (depth++ == 0) {
+        start = i;
+      }
+      break;
+    case '}':
+    case ']':
+      if (depth == 0) {
+        // The end of the results
+        return c == ']';
+      }
+      if (--depth == 0) {
+        items->push_back(JSON.substr(start, i + 1 - start));
+      }
+      break;
+    }
+  }
+  return false;
+}
+
+static void AppendIndices(std::string &out, const char *name,
+                          const std::vector<std::size_t> &indices) {
+  out += ", \"";
+  out += name;
+  out += "\": [";
+  for (std::size_t i = 0; i < indices.size(); i++) {
+    if (i) {
+      out += ", ";
+    }
+    out += std::to_string(indices[i]);
+  }
+  out += "]";
+}
+
+// The changes from `base` to `items`, in the format of
+// CompletionResultSets.
+static std::string Delta(const std::vector<std::string> &base,
+                         const std::vector<std::string> &items) {
+  // Equal candidates are matched in order
+  std::unordered_map<std::string_view, std::vector<std::size_t>> positions;
+  for (std::size_t i = base.size(); i > 0; i--) {
+    positions[base[i - 1]].push_back(i - 1);
+  }
+  std::vector<bool> kept(base.size());
+  std::vector<std::size_t> order;
+  std::string inserted;
+  bool reranked = false;
+  for (std::size_t i = 0; i < items.size(); i++) {
+    auto position = positions.find(items[i]);
+    if (position == positions.end() || position->second.empty()) {
+      inserted += inserted.empty() ? "" : ", ";
+      inserted += "[" + std::to_string(i) + ", " + items[i] + "]";
+      continue;
+    }
+    auto index = position->second.back();
+    position->second.pop_back();
+    reranked |= order.size() && order.back() > index;
+    order.push_back(index);
+    kept[index] = true;
+  }
+  std::vector<std::size_t> removed;
+  for (std::size_t i = 0; i < base.size(); i++) {
+    if (!kept[i]) {
+      removed.push_back(i);
+    }
+  }
+
+  std::string out;
+  AppendIndices(out, "removed", removed);
+  out += ", \"inserted\": [" + inserted + "]";
+  if (reranked) {
+    AppendIndices(out, "order", order);
+  }
+  return out;
+}
+
+struct CompletionResultSets::Impl {
+  std::mutex mutex;
+  std::uint64_t nextID = 1;
+  // By ID, so the oldest comes first
+  std::map<std::uint64_t, std::shared_ptr<const std::vector<std::string>>>
+      sets;
+
+  static metrics::Counter &responses(const std::string &encoding) {
+    return metrics::Registry::shared().counter(
+        "ssvim_completion_responses_total",
+        "encoding=\"" + encoding + "\"",
+        "Completion responses with a result ID, by encoding");
+  }
+};
+
+CompletionResultSets &CompletionResultSets::shared() {
+  static CompletionResultSets *sets = new CompletionResultSets();
+  return *sets;
+}
+
+CompletionResultSets::CompletionResultSets() : _impl(new Impl()) {
+  MemoryBudget::shared().registerPool(
+      "result_sets", [this](const std::string &key) {
+        std::lock_guard<std::mutex> lock(_impl->mutex);
+        _impl->sets.erase(std::stoull(key));
+      });
+}
+
+std::vector<CompletionResultSets::SavedSet> CompletionResultSets::save() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  std::vector<SavedSet> sets;
+  for (auto &set : _impl->sets) {
+    sets.push_back({set.first, *set.second});
+  }
+  return sets;
+}
+
+void CompletionResultSets::restore(const std::vector<SavedSet> &sets) {
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    for (auto &saved : sets) {
+      _impl->sets[saved.ID] =
+          std::make_shared<std::vector<std::string>>(saved.items);
+      _impl->nextID = std::max(_impl->nextID, saved.ID + 1);
+    }
+  }
+  for (auto saved = sets.end() - std::min(sets.size(), MaxResultSets);
+       saved != sets.end(); ++saved) {
+    std::size_t size = 0;
+    for (auto &item : saved->items) {
+      size += item.size();
+    }
+    MemoryBudget::shared().touch("result_sets", std::to_string(saved->ID),
+                                 size);
+  }
+}
+
+std::string CompletionResultSets::encode(const std::string &JSON,
+                                         std::uint64_t baseID) {
+  static auto &full = Impl::responses("full");
+  static auto &delta = Impl::responses("delta");
+  static auto &saved = metrics::Registry::shared().counter(
+      "ssvim_completion_delta_saved_bytes_total", "",
+      "Bytes not sent because completions were sent as deltas");
+
+  auto items = std::make_shared<std::vector<std::string>>();
+  if (!SplitResults(JSON, items.get())) {
+    full.increment();
+    return "{\"result_id\": 0, \"results\": " + JSON + "}";
+  }
+  std::uint64_t ID;
+  std::shared_ptr<const std::vector<std::string>> base;
+  std::vector<std::uint64_t> dropped;
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    ID = _impl->nextID++;
+    auto entry = _impl->sets.find(baseID);
+    if (entry != _impl->sets.end()) {
+      base = entry->second;
+    }
+    _impl->sets[ID] = items;
+    while (_impl->sets.size() > MaxResultSets) {
+      dropped.push_back(_impl->sets.begin()->first);
+      _impl->sets.erase(_impl->sets.begin());
+    }
+  }
+  for (auto droppedID : dropped) {
+    MemoryBudget::shared().forget("result_sets", std::to_string(droppedID));
+  }
+  MemoryBudget::shared().touch("result_sets", std::to_string(ID),
+                               JSON.size());
+
+  auto fullResponse =
+      "{\"result_id\": " + std::to_string(ID) + ", \"results\": " + JSON + "}";
+  if (!base) {
+    full.increment();
+    return fullResponse;
+  }
+  auto deltaResponse = "{\"result_id\": " + std::to_string(ID) +
+                       ", \"base\": " + std::to_string(baseID) +
+                       Delta(*base, *items) + "}";
+  if (deltaResponse.length() >= fullResponse.length()) {
+    full.increment();
+    return fullResponse;
+  }
+  delta.increment();
+  saved.increment(fullResponse.length() - deltaResponse.length());
+  return deltaResponse;
+}
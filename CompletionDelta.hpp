@@ -0,0 +1,54 @@
+#import <cstdint>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+/**
+ * CompletionResultSets keeps recent completion responses, so a response can
+ * be sent as the difference from the client's last one.
+ *
+ * As the user narrows a query, successive responses on the same position
+ * carry nearly the same candidates. A client that sends the `result_id` it
+ * last received gets either the full response:
+ *
+ *   {"result_id": 13, "results": {"key.results": [...]}}
+ *
+ * or, when smaller, the changes against that result set:
+ *
+ *   {"result_id": 13, "base": 12, "removed": [3, 17],
+ *    "inserted": [[0, {...}]], "order": [...]}
+ *
+ * `removed` are indices of the base. The remaining base candidates keep
+ * their order, or follow `order`, a list of base indices, when re-ranked.
+ * `inserted` then places new candidates at their final index, ascending.
+ */
+class CompletionResultSets {
+public:
+  static CompletionResultSets &shared();
+
+  // Encode the completion response `JSON` as a new result set, relative to
+  // `baseID` if it is still kept. 0 is no base.
+  std::string encode(const std::string &JSON, std::uint64_t baseID);
+
+  // A result set in a snapshot: its ID and the JSON of its candidates
+  struct SavedSet {
+    std::uint64_t ID;
+    std::vector<std::string> items;
+  };
+
+  std::vector<SavedSet> save();
+
+  // Restore sets saved by another process, so its clients' IDs still work.
+  void restore(const std::vector<SavedSet> &sets);
+
+private:
+  CompletionResultSets();
+  CompletionResultSets(CompletionResultSets const &) = delete;
+  CompletionResultSets &operator=(CompletionResultSets const &) = delete;
+
+  struct Impl;
+  Impl *_impl;
+};
+
+} // namespace ssvim
@@ -0,0 +1,276 @@
+#import <chrono>
+#import <functional>
+#import <mutex>
+#import <sstream>
+#import <thread>
+#import <unordered_map>
+
+#import "Admission.hpp"
+#import "Clients.hpp"
+#import "CompletionPrefetch.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+
+using namespace ssvim;
+
+// Prefetches wait this long for the backend to be idle, and are skipped
+// otherwise
+static const auto IdleWait = std::chrono::seconds(1);
+
+struct CompletionPrefetcher::Impl {
+  struct Entry {
+    std::string file;
+    // The buffer up to the completion, which the results depend on
+    std::size_t prefixLength;
+    std::size_t prefixHash;
+    std::string JSON;
+  };
+
+  std::mutex mutex;
+  bool enabled = false;
+  std::unordered_map<std::string, Entry> entries;
+  // Increases with each update of a file, so prefetches of older buffers
+  // are abandoned
+  std::unordered_map<std::string, unsigned> generations;
+
+  metrics::Counter &hits = requests("hit");
+  metrics::Counter &misses = requests("miss");
+  metrics::Counter &computed = metrics::Registry::shared().counter(
+      "ssvim_prefetch_computed_total", "",
+      "Completions computed ahead of a request");
+  metrics::Counter &busy = metrics::Registry::shared().counter(
+      "ssvim_prefetch_busy_total", "",
+      "Prefetches skipped because the backend wasn't idle");
+
+  static metrics::Counter &requests(const std::string &result) {
+    return metrics::Registry::shared().counter(
+        "ssvim_prefetch_requests_total", "result=\"" + result + "\"",
+        "Completion requests served by a prefetch, or not");
+  }
+
+  // Drop the entries of `file` that an edit made stale.
+  void dropStale(const std::string &file, const std::string &contents) {
+    for (auto entry = entries.begin(); entry != entries.end();) {
+      auto &prefetched = entry->second;
+      if (prefetched.file != file ||
+          (contents.length() >= prefetched.prefixLength &&
+           std::hash<std::string>()(contents.substr(
+               0, prefetched.prefixLength)) == prefetched.prefixHash)) {
+        ++entry;
+        continue;
+      }
+      MemoryBudget::shared().forget("prefetch", entry->first);
+      entry = entries.erase(entry);
+    }
+  }
+};
+
+// Prefetched completions are keyed like their backend request: the file,
+// offset, buffer up to the offset and flags.
+static std::string RequestKey(CompletionContext &ctx,
+                              std::size_t *prefixLength,
+                              std::size_t *prefixHash) {
+  unsigned offset = 0;
+  std::string prefix;
+  GetOffset(ctx, &offset, &prefix);
+  *prefixLength = prefix.length();
+  *prefixHash = std::hash<std::string>()(prefix);
+  std::size_t flagsHash = 0;
+  for (auto &arg : ctx.compilerArgs()) {
+    flagsHash = flagsHash * 31 + std::hash<std::string>()(arg);
+  }
+  return ctx.sourceFilename + '\n' + std::to_string(offset) + '\n' +
+         std::to_string(*prefixHash) + '\n' + std::to_string(flagsHash);
+}
+
+static const std::string *ContextContents(const CompletionContext &ctx) {
+  for (auto &unsavedFile : ctx.unsavedFiles) {
+    if (unsavedFile.fileName == ctx.sourceFilename) {
+      return &unsavedFile.text();
+    }
+  }
+  return nullptr;
+}
+
+static bool IsIdentifierChar(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+// Completion contexts at the likely trigger points near the cursor of
+// `ctx`. Each only has the buffer up to its completion.
+static std::vector<CompletionContext>
+TriggerPoints(const CompletionContext &ctx) {
+  std::vector<CompletionContext> points;
+  auto contents = ContextContents(ctx);
+  if (!contents) {
+    return points;
+  }
+  std::istringstream lines(*contents);
+  std::string before, line;
+  for (unsigned i = 1; i < ctx.line && std::getline(lines, line); i++) {
+    before += line + "\n";
+  }
+  if (!std::getline(lines, line)) {
+    return points;
+  }
+
+  std::size_t cursor = std::min<std::size_t>(ctx.column, line.length());
+  auto start = cursor, end = cursor;
+  while (start > 0 && IsIdentifierChar(line[start - 1])) {
+    start--;
+  }
+  while (end < line.length() && IsIdentifierChar(line[end])) {
+    end++;
+  }
+  auto point = [&](const std::string &partialLine, unsigned column) {
+    CompletionContext pointCtx;
+    pointCtx.sourceFilename = ctx.sourceFilename;
+    pointCtx.line = ctx.line;
+    pointCtx.column = column;
+    pointCtx.flags = ctx.flags;
+    UnsavedFile unsaved;
+    unsaved.fileName = ctx.sourceFilename;
+    unsaved.contents = before + partialLine;
+    pointCtx.unsavedFiles.push_back(unsaved);
+    points.push_back(pointCtx);
+  };
+  // Member access on the identifier under the cursor, once `.` is typed
+  if (end > start && !isdigit((unsigned char)line[start])) {
+    point(line.substr(0, end) + ".", end);
+  }
+  // The member access the cursor is in
+  if (start > 0 && line[start - 1] == '.') {
+    point(line.substr(0, start), start - 1);
+  }
+  return points;
+}
+
+CompletionPrefetcher &CompletionPrefetcher::shared() {
+  static CompletionPrefetcher *prefetcher = new CompletionPrefetcher();
+  return *prefetcher;
+}
+
+CompletionPrefetcher::CompletionPrefetcher() : _impl(new Impl()) {
+  metrics::Registry::shared().gaugeFunction(
+      "ssvim_prefetch_hit_ratio", "",
+      "Share of completion requests served by a prefetch", [this] {
+        auto hits = (double)_impl->hits.value();
+        auto total = hits + _impl->misses.value();
+        return total ? hits / total : 0.0;
+      });
+  MemoryBudget::shared().registerPool(
+      "prefetch", [this](const std::string &key) {
+        std::lock_guard<std::mutex> lock(_impl->mutex);
+        _impl->entries.erase(key);
+      });
+}
+
+void CompletionPrefetcher::setEnabled(bool enabled) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->enabled = enabled;
+}
+
+void CompletionPrefetcher::documentUpdated(
+    LogLevel logLevel, const std::string &file, const std::string &contents,
+    const std::vector<std::string> &flags, int line, int column) {
+  unsigned generation;
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    if (!_impl->enabled) {
+      return;
+    }
+    generation = ++_impl->generations[file];
+    _impl->dropStale(file, contents);
+  }
+  CompletionContext ctx;
+  ctx.sourceFilename = file;
+  ctx.line = line;
+  ctx.column = column;
+  ctx.flags = flags;
+  UnsavedFile unsaved;
+  unsaved.fileName = file;
+  unsaved.contents = contents;
+  ctx.unsavedFiles.push_back(unsaved);
+
+  // Prefetches run on behalf of the client, with its buffers
+  auto client = CurrentClient();
+  std::thread([this, logLevel, ctx, generation, client] {
+    ClientScope scope(client);
+    prefetch(logLevel, ctx, generation);
+  }).detach();
+}
+
+void CompletionPrefetcher::prefetch(LogLevel logLevel, CompletionContext ctx,
+                                    unsigned generation) {
+  Logger logger(logLevel, "PREFETCH");
+  auto current = [&] {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    return _impl->generations[ctx.sourceFilename] == generation;
+  };
+  auto deadline = std::chrono::steady_clock::now() + IdleWait;
+  for (auto &point : TriggerPoints(ctx)) {
+    while (AdmissionControl::shared().runningJobs()) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        _impl->busy.increment();
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    if (!current()) {
+      return;
+    }
+    std::size_t prefixLength, prefixHash;
+    auto key = RequestKey(point, &prefixLength, &prefixHash);
+    {
+      std::lock_guard<std::mutex> lock(_impl->mutex);
+      if (_impl->entries.count(key)) {
+        continue;
+      }
+    }
+    std::string JSON;
+    SwiftCompleter completer(logLevel);
+    if (!completer.SpeculativeCandidates(point, &JSON)) {
+      continue;
+    }
+    auto size = JSON.size();
+    {
+      std::lock_guard<std::mutex> lock(_impl->mutex);
+      if (_impl->generations[ctx.sourceFilename] != generation) {
+        return;
+      }
+      _impl->entries[key] = {ctx.sourceFilename, prefixLength, prefixHash,
+                             std::move(JSON)};
+    }
+    MemoryBudget::shared().touch("prefetch", key, size);
+    _impl->computed.increment();
+    logger << "Prefetched " + ctx.sourceFilename + ":" +
+                  std::to_string(point.line) + ":" +
+                  std::to_string(point.column);
+  }
+}
+
+bool CompletionPrefetcher::take(CompletionContext &ctx, std::string *JSON) {
+  auto contents = ContextContents(ctx);
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    if (!_impl->enabled || !contents || contents->empty()) {
+      return false;
+    }
+    _impl->dropStale(ctx.sourceFilename, *contents);
+  }
+  std::size_t prefixLength, prefixHash;
+  auto key = RequestKey(ctx, &prefixLength, &prefixHash);
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    auto entry = _impl->entries.find(key);
+    if (entry == _impl->entries.end()) {
+      _impl->misses.increment();
+      return false;
+    }
+    *JSON = std::move(entry->second.JSON);
+    _impl->entries.erase(entry);
+    _impl->hits.increment();
+  }
+  MemoryBudget::shared().forget("prefetch", key);
+  return true;
+}
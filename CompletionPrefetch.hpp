@@ -0,0 +1,50 @@
+#import <string>
+#import <vector>
+
+#import "Logging.hpp"
+#import "SwiftCompleter.hpp"
+
+namespace ssvim {
+
+/**
+ * CompletionPrefetcher computes completions before the user asks for them.
+ *
+ * When a document is updated with the cursor position, e.g. by a
+ * diagnostics request, completions are computed at the likely trigger
+ * points near the cursor once the backend is idle: member access on the
+ * identifier under the cursor, and the member access the cursor is in.
+ *
+ * Results are kept in memory, keyed like the backend request, which only
+ * depends on the buffer up to the completion. They are dropped once an
+ * edit changes that part of the buffer, or after they are served.
+ */
+class CompletionPrefetcher {
+public:
+  static CompletionPrefetcher &shared();
+
+  // Prefetching is off until enabled.
+  void setEnabled(bool enabled);
+
+  // Schedule completions near `line` and `column`, 1-based and 0-based
+  // like SwiftCompleter, in `contents` of `file`.
+  void documentUpdated(LogLevel logLevel, const std::string &file,
+                       const std::string &contents,
+                       const std::vector<std::string> &flags, int line,
+                       int column);
+
+  // Take the prefetched completions of a request, if there are any.
+  bool take(CompletionContext &ctx, std::string *JSON);
+
+private:
+  CompletionPrefetcher();
+  CompletionPrefetcher(CompletionPrefetcher const &) = delete;
+  CompletionPrefetcher &operator=(CompletionPrefetcher const &) = delete;
+
+  void prefetch(LogLevel logLevel, CompletionContext ctx,
+                unsigned generation);
+
+  struct Impl;
+  Impl *_impl;
+};
+
+} // namespace ssvim
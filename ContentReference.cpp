@@ -0,0 +1,89 @@
+#import <boost/crc.hpp>
+#import <cstdio>
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+#import "ContentReference.hpp"
+#import "Metrics.hpp"
+#import "Trace.hpp"
+
+using namespace ssvim;
+
+static metrics::Counter &References(const char *result) {
+  return metrics::Registry::shared().counter(
+      "ssvim_content_references_total",
+      std::string("result=\"") + result + "\"",
+      "Requests with contents referenced by file or shared memory");
+}
+
+static bool Fail(const char *result, const std::string &message,
+                 std::string *error) {
+  References(result).increment();
+  *error = message;
+  return false;
+}
+
+bool ssvim::ReadContentReference(const ContentReference &reference,
+                                 std::string *contents, std::string *error) {
+  static auto &readTime = metrics::StageHistogram("content_reference");
+  metrics::ScopedTimer timer(readTime);
+  trace::Span span("content_reference");
+
+  int fd;
+  if (reference.sharedMemoryName.length()) {
+    fd = shm_open(reference.sharedMemoryName.c_str(), O_RDONLY, 0);
+  } else if (reference.path.length()) {
+    fd = open(reference.path.c_str(), O_RDONLY);
+  } else {
+    return Fail("error", "empty content reference", error);
+  }
+  if (fd < 0) {
+    return Fail("error", "cannot open referenced contents", error);
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return Fail("error", "cannot stat referenced contents", error);
+  }
+  if ((reference.size >= 0 && info.st_size != reference.size) ||
+      (reference.modificationTime >= 0 &&
+       info.st_mtime != reference.modificationTime)) {
+    close(fd);
+    return Fail("mismatch", "referenced contents changed", error);
+  }
+
+  const char *data = "";
+  void *address = nullptr;
+  if (info.st_size > 0) {
+    address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+      close(fd);
+      return Fail("error", "cannot map referenced contents", error);
+    }
+    data = static_cast<const char *>(address);
+  }
+  close(fd);
+
+  bool matches = true;
+  if (reference.crc32.length()) {
+    boost::crc_32_type crc;
+    crc.process_bytes(data, info.st_size);
+    char hex[9];
+    snprintf(hex, sizeof(hex), "%08x", (unsigned)crc.checksum());
+    matches = reference.crc32 == hex;
+  }
+  if (matches) {
+    contents->assign(data, info.st_size);
+  }
+  if (address) {
+    munmap(address, info.st_size);
+  }
+  if (!matches) {
+    return Fail("mismatch", "referenced contents don't match crc32", error);
+  }
+  References("mapped").increment();
+  return true;
+}
@@ -0,0 +1,31 @@
+#import <string>
+
+namespace ssvim {
+
+/**
+ * A reference to the contents of a file, sent in place of inline contents.
+ *
+ * Clean buffers reference the file on disk by `path`, checked against its
+ * modification time and size. Dirty buffers are written by the client to a
+ * POSIX shared memory object, `sharedMemoryName`, or a memfd, referenced by
+ * its /proc/<pid>/fd path, and are checked against their CRC-32.
+ */
+struct ContentReference {
+  std::string path;
+  std::string sharedMemoryName;
+  // Seconds since the epoch, or -1 to skip the check
+  long long modificationTime = -1;
+  // Bytes, or -1 to skip the check
+  long long size = -1;
+  // CRC-32 of the contents in lowercase hex, like zlib's crc32, or "" to
+  // skip the check
+  std::string crc32;
+};
+
+// Read the referenced contents. The file is memory mapped and copied once
+// into `contents`. Returns false with `error` set when the file can't be
+// read or doesn't match the reference.
+bool ReadContentReference(const ContentReference &reference,
+                          std::string *contents, std::string *error);
+
+} // namespace ssvim
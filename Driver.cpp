@@ -1,60 +1,447 @@
 #import "Logging.hpp"
+#import "Metrics.hpp"
+#import "SemanticBackend.hpp"
 #import "SwiftCompleter.hpp"
-#import <dispatch/dispatch.h>
+#import <atomic>
+#import <boost/program_options.hpp>
+#import <chrono>
+#import <fstream>
+#import <functional>
 #import <iostream>
+#import <map>
+#import <new>
+#import <sstream>
 #import <string>
-#import <functional>
+#import <sys/resource.h>
+#import <thread>
+#if SSVIM_WITH_SOURCEKITD
+#import <dispatch/dispatch.h>
+#endif
+
+// test_driver replays a scripted editing session directly against
+// SwiftCompleter, without HTTP, and reports latency per operation, peak RSS
+// and allocation counts as JSON. This measures the engine apart from the
+// transport; see ssvim_loadgen for the server as a whole.
+//
+// Session scripts are line based, and lines starting with # are comments:
+//
+//   file PATH               the edited document, read from disk
+//   flag ARG                a compiler flag, may be repeated
+//   wait MS                 think time before the next operation
+//   insert LINE COL TEXT    insert TEXT, where \n is a newline
+//   delete LINE COL COUNT   delete COUNT characters
+//   complete LINE COL [QUERY]
+//   diagnostics
+//
+// Lines and columns are 1 based.
 
 using namespace ssvim;
-using namespace std;
+
+#pragma mark - Allocation Counting
+
+static std::atomic<std::uint64_t> AllocationCount{0};
+static std::atomic<std::uint64_t> AllocatedBytes{0};
+
+void *operator new(std::size_t size) {
+  AllocationCount.fetch_add(1, std::memory_order_relaxed);
+  AllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  if (auto ptr = malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  free(ptr);
+}
+
+static std::uint64_t PeakRSSBytes() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#if __APPLE__
+  return usage.ru_maxrss;
+#else
+  // Linux reports kilobytes
+  return usage.ru_maxrss * 1024;
+#endif
+}
+
+#pragma mark - Sessions
+
+struct SessionStep {
+  std::string op;
+  unsigned line = 0;
+  unsigned column = 0;
+  // Text to insert, number of characters to delete, wait time or query
+  std::string argument;
+};
+
+struct EditingSession {
+  std::string fileName;
+  std::string contents;
+  std::vector<std::string> flags;
+  std::vector<SessionStep> steps;
+};
+
+static std::string Unescape(const std::string &text) {
+  std::string out;
+  for (std::size_t i = 0; i < text.length(); i++) {
+    if (text[i] == '\\' && i + 1 < text.length()) {
+      i++;
+      out += text[i] == 'n' ? '\n' : text[i] == 't' ? '\t' : text[i];
+    } else {
+      out += text[i];
+    }
+  }
+  return out;
+}
+
+static std::string ReadFile(const std::string &fileName) {
+  std::ifstream ifs(fileName, std::ios::in | std::ios::binary);
+  std::ostringstream os;
+  os << ifs.rdbuf();
+  return os.str();
+}
+
+static bool ParseSession(const std::string &path, EditingSession &session) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "Cannot read session: " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(file, line)) {
+    lineNumber++;
+    std::istringstream fields(line);
+    SessionStep step;
+    if (!(fields >> step.op) || step.op[0] == '#') {
+      continue;
+    }
+    bool ok = true;
+    if (step.op == "file") {
+      ok = bool(fields >> session.fileName);
+      session.contents = ReadFile(session.fileName);
+    } else if (step.op == "flag") {
+      std::string flag;
+      ok = bool(fields >> flag);
+      session.flags.push_back(flag);
+    } else if (step.op == "wait") {
+      ok = bool(fields >> step.argument);
+    } else if (step.op == "insert" || step.op == "delete" ||
+               step.op == "complete") {
+      ok = bool(fields >> step.line >> step.column);
+      fields >> std::ws;
+      std::getline(fields, step.argument);
+      step.argument = Unescape(step.argument);
+    } else if (step.op != "diagnostics") {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << path << ":" << lineNumber << ": bad step: " << line
+                << std::endl;
+      return false;
+    }
+    if (step.op != "file" && step.op != "flag") {
+      session.steps.push_back(step);
+    }
+  }
+  if (session.fileName.empty()) {
+    std::cerr << path << ": missing file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// A session typing out every member access in an existing file, as in
+// ssvim_loadgen: a completion right after the `.`, and then one per
+// character of the following identifier.
+static EditingSession KeystrokeSession(const std::string &fileName,
+                                       std::vector<std::string> flags,
+                                       unsigned maxQueryLength,
+                                       unsigned keystrokeMillis) {
+  EditingSession session;
+  session.fileName = fileName;
+  session.contents = ReadFile(fileName);
+  session.flags = flags;
+
+  SessionStep diagnostics;
+  diagnostics.op = "diagnostics";
+  session.steps.push_back(diagnostics);
+
+  std::istringstream lines(session.contents);
+  std::string line;
+  unsigned lineNumber = 0;
+  while (std::getline(lines, line)) {
+    lineNumber++;
+    for (std::size_t i = 0; i < line.length(); i++) {
+      if (line[i] != '.') {
+        continue;
+      }
+      std::string query;
+      for (unsigned typed = 0; typed <= maxQueryLength; typed++) {
+        auto end = i + typed;
+        if (typed > 0 && (end >= line.length() || !isalnum(line[end]))) {
+          break;
+        }
+        if (typed > 0) {
+          query += line[end];
+        }
+        SessionStep wait;
+        wait.op = "wait";
+        wait.argument = std::to_string(keystrokeMillis);
+        session.steps.push_back(wait);
+        SessionStep complete;
+        complete.op = "complete";
+        complete.line = lineNumber;
+        complete.column = (unsigned)end + 2;
+        complete.argument = query;
+        session.steps.push_back(complete);
+      }
+    }
+  }
+  return session;
+}
+
+// The byte offset of a 1 based line and column, clamped to the contents.
+static std::size_t OffsetOf(const std::string &contents, unsigned line,
+                            unsigned column) {
+  std::size_t offset = 0;
+  for (unsigned l = 1; l < line && offset < contents.length(); l++) {
+    auto newline = contents.find('\n', offset);
+    offset = newline == std::string::npos ? contents.length() : newline + 1;
+  }
+  return std::min(offset + (column ? column - 1 : 0), contents.length());
+}
+
+#pragma mark - Running
+
+#if SSVIM_WITH_SOURCEKITD
+static auto DefaultBackend = "sourcekitd";
+#else
+static auto DefaultBackend = "standin";
+#endif
+
+struct OperationStats {
+  metrics::Histogram latency;
+  std::uint64_t allocations = 0;
+  std::uint64_t allocatedBytes = 0;
+};
 
 struct Runner {
-  std::string complete(std::string fileName, std::string fileContents,
-                       std::vector<std::string> flags, unsigned line,
-                       unsigned column) {
-    auto completer = SwiftCompleter(LogLevelExtreme);
-    auto files = std::vector<UnsavedFile>();
-    auto unsavedFile = UnsavedFile();
-    unsavedFile.contents = fileContents;
-    unsavedFile.fileName = fileName;
+  SwiftCompleter completer{LogLevelError};
+  std::map<std::string, OperationStats> stats;
+  bool realtime = false;
 
-    files.push_back(unsavedFile);
+  void run(const EditingSession &session, bool record) {
+    std::vector<UnsavedFile> files(1);
+    files[0].fileName = session.fileName;
+    files[0].contents = session.contents;
+    auto &contents = files[0].contents;
 
-    std::cout << "in complete" << std::endl;
-    auto result = completer.CandidatesForLocationInFile(fileName, line, column,
-                                                        files, flags, std::string());
+    for (auto &step : session.steps) {
+      if (step.op == "wait") {
+        if (realtime) {
+          std::this_thread::sleep_for(
+              std::chrono::milliseconds(std::stoul(step.argument)));
+        }
+      } else if (step.op == "insert") {
+        contents.insert(OffsetOf(contents, step.line, step.column),
+                        step.argument);
+      } else if (step.op == "delete") {
+        contents.erase(OffsetOf(contents, step.line, step.column),
+                       std::stoul(step.argument));
+      } else if (step.op == "complete") {
+        // SwiftCompleter's columns are 0 based, as /completions passes them
+        measure("complete", record, [&] {
+          completer.CandidatesForLocationInFile(
+              session.fileName, step.line, (int)step.column - 1, files,
+              session.flags, step.argument);
+        });
+      } else if (step.op == "diagnostics") {
+        measure("diagnostics", record, [&] {
+          completer.DiagnosticsForFile(session.fileName, files, session.flags);
+        });
+      }
+    }
+  }
 
-    return result;
+  void measure(const std::string &op, bool record,
+               std::function<void()> operation) {
+    auto allocations = AllocationCount.load(std::memory_order_relaxed);
+    auto allocatedBytes = AllocatedBytes.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    operation();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (!record) {
+      return;
+    }
+    auto &opStats = stats[op];
+    opStats.latency.record(elapsed);
+    opStats.allocations +=
+        AllocationCount.load(std::memory_order_relaxed) - allocations;
+    opStats.allocatedBytes +=
+        AllocatedBytes.load(std::memory_order_relaxed) - allocatedBytes;
   }
 };
 
-std::string contents = "import UIKit; UIView.";
-using namespace ssvim;
-static ssvim::Logger logger(LogLevelInfo);
+// Written by hand, like ssvim_loadgen's report, to keep numbers as numbers.
+static std::string Report(Runner &runner, const EditingSession &session,
+                          unsigned iterations, double seconds) {
+  std::ostringstream os;
+  os << "{\n";
+  os << "  \"file\": \"" << session.fileName << "\",\n";
+  os << "  \"steps\": " << session.steps.size() << ",\n";
+  os << "  \"iterations\": " << iterations << ",\n";
+  os << "  \"duration_seconds\": " << seconds << ",\n";
+  os << "  \"peak_rss_bytes\": " << PeakRSSBytes() << ",\n";
+  os << "  \"allocations\": " << AllocationCount.load() << ",\n";
+  os << "  \"allocated_bytes\": " << AllocatedBytes.load() << ",\n";
+  os << "  \"operations\": {";
+  bool first = true;
+  for (auto &entry : runner.stats) {
+    auto &latency = entry.second.latency;
+    auto count = latency.count();
+    os << (first ? "\n" : ",\n");
+    first = false;
+    os << "    \"" << entry.first << "\": {"
+       << "\"count\": " << count
+       << ", \"p50_ms\": " << latency.percentile(0.5) / 1000.0
+       << ", \"p90_ms\": " << latency.percentile(0.9) / 1000.0
+       << ", \"p99_ms\": " << latency.percentile(0.99) / 1000.0
+       << ", \"max_ms\": " << latency.max() / 1000.0
+       << ", \"allocations_per_op\": " << entry.second.allocations / count
+       << ", \"allocated_bytes_per_op\": "
+       << entry.second.allocatedBytes / count;
+    // Cumulative counts, as in the prometheus histograms, from the first
+    // non empty bucket
+    os << ", \"histogram\": [";
+    bool firstBucket = true;
+    for (std::uint64_t bound = 1;; bound *= 2) {
+      auto atMost = latency.countAtMost(bound);
+      if (atMost == 0) {
+        continue;
+      }
+      os << (firstBucket ? "" : ", ") << "{\"le_ms\": " << bound / 1000.0
+         << ", \"count\": " << atMost << "}";
+      firstBucket = false;
+      if (atMost == count) {
+        break;
+      }
+    }
+    os << "]}";
+  }
+  os << "\n  }\n}\n";
+  return os.str();
+}
 
-int wrapped_main() {
-  Runner runner;
+static int DriverMain(int ac, char const *av[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "Show this message")(
+      "session,s", po::value<std::string>()->default_value(""),
+      "Session script to replay")(
+      "file,f", po::value<std::string>()->default_value(""),
+      "Replay typing every member access in a swift file")(
+      "flag", po::value<std::vector<std::string>>()->composing(),
+      "Compiler flag for --file, may be repeated")(
+      "max-query", po::value<unsigned>()->default_value(3),
+      "Characters typed after each member access for --file")(
+      "keystroke-ms", po::value<unsigned>()->default_value(100),
+      "Time between keystrokes for --file")(
+      "iterations,i", po::value<unsigned>()->default_value(10),
+      "Number of times the session is replayed")(
+      "warmup", po::value<unsigned>()->default_value(1),
+      "Number of replays before measuring")(
+      "realtime", po::bool_switch()->default_value(false),
+      "Honor wait steps instead of skipping them")(
+      "backend", po::value<std::string>()->default_value(DefaultBackend),
+      "Set the semantic backend: sourcekitd, standin or replay")(
+      "replay", po::value<std::string>()->default_value(""),
+      "Set a recorded file for the replay backend")(
+      "standin-latency-ms", po::value<unsigned>()->default_value(0),
+      "Set the time each stand-in backend request takes");
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
 
-  auto exampleFilePath = "CBCB056E-0FC3-403B-9D91-556A88BD3F61.swift";
-  vector<string> flags;
-  flags.push_back("-c");
-  flags.push_back(exampleFilePath);
-  flags.push_back("-sdk");
-  flags.push_back("/Applications/Xcode.app/Contents/Developer/Platforms/iPhoneSimulator.platform/Developer/SDKs/iPhoneSimulator.sdk");
-  flags.push_back("-target");
-  flags.push_back("x86_64-apple-ios12.1-simulator");
+  auto backend = vm["backend"].as<std::string>();
+  if (backend == "standin") {
+    StandInBackendOptions options;
+    options.latencyMillis = vm["standin-latency-ms"].as<unsigned>();
+    SetSharedSemanticBackend(MakeStandInBackend(LogLevelError, options));
+  } else if (backend == "replay") {
+    auto replay = MakeReplayBackend(LogLevelError,
+                                    vm["replay"].as<std::string>(),
+                                    ReplayBackendOptions());
+    if (!replay) {
+      std::cerr << "Cannot read backend log" << std::endl;
+      return 1;
+    }
+    SetSharedSemanticBackend(replay);
+#if SSVIM_WITH_SOURCEKITD
+  } else if (backend == "sourcekitd") {
+    SetSharedSemanticBackend(MakeSourceKitBackend(LogLevelError));
+#endif
+  } else {
+    std::cerr << "Unsupported backend: " << backend << std::endl;
+    return 1;
+  }
+
+  EditingSession session;
+  auto sessionPath = vm["session"].as<std::string>();
+  auto filePath = vm["file"].as<std::string>();
+  if (sessionPath.length()) {
+    if (!ParseSession(sessionPath, session)) {
+      return 1;
+    }
+  } else if (filePath.length()) {
+    std::vector<std::string> flags;
+    if (vm.count("flag")) {
+      flags = vm["flag"].as<std::vector<std::string>>();
+    }
+    session = KeystrokeSession(filePath, flags, vm["max-query"].as<unsigned>(),
+                               vm["keystroke-ms"].as<unsigned>());
+  } else {
+    std::cerr << "Either --session or --file is required" << std::endl;
+    return 1;
+  }
 
-  auto result = runner.complete(exampleFilePath, contents, flags, 1, 21);
-  std::cout << "complete done" << std::endl;
-  logger << result;
-  logger << "Done";
-  exit(0);
+  Runner runner;
+  runner.realtime = vm["realtime"].as<bool>();
+  for (unsigned i = 0; i < vm["warmup"].as<unsigned>(); i++) {
+    runner.run(session, false);
+  }
+  auto iterations = vm["iterations"].as<unsigned>();
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < iterations; i++) {
+    runner.run(session, true);
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << Report(runner, session, iterations, elapsed.count());
+  return 0;
 }
 
-int main() {
-  logger << "Running Test Driver";
+#if SSVIM_WITH_SOURCEKITD
+// sourcekitd delivers notifications on dispatch's main queue, so the driver
+// runs on another queue.
+int main(int ac, char const *av[]) {
   dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-    wrapped_main();
+    exit(DriverMain(ac, av));
   });
   dispatch_main();
 }
+#else
+int main(int ac, char const *av[]) {
+  return DriverMain(ac, av);
+}
+#endif
@@ -0,0 +1,92 @@
+#import "Metrics.hpp"
+#import <algorithm>
+#import <exception>
+#import <future>
+#import <map>
+#import <mutex>
+#import <string>
+#import <vector>
+
+using promise_ty = std::promise<std::string> *;
+
+// future channel sets values on registered futures.
+// it operates in a shared key space.
+//
+// usage:
+// in the example of working with the document update notifications,
+// a key would be formed based on the name and notification
+//
+// {
+//  key.notification: source.notification.editor.documentupdate,
+//  key.name: "/Users/aprilmarino/swiftyswiftvim/Examples/some_swift.swift"
+//  }
+
+class FutureChannel {
+  std::map<std::string, std::vector<promise_ty>> _promises;
+  std::mutex _shared_mutex;
+  ssvim::metrics::Gauge &_pending;
+
+public:
+  FutureChannel(ssvim::metrics::Gauge &pending) : _pending(pending) {
+  }
+
+  void set(std::string key, const std::string value) {
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    auto entries = _promises.find(key);
+    if (entries != _promises.end()) {
+      for (auto promise : entries->second) {
+        promise->set_value(value);
+        delete promise;
+      }
+      _pending.sub(entries->second.size());
+      _promises.erase(key);
+    }
+  }
+
+  // Fail the futures waiting on `key` with `error`.
+  void fail(const std::string &key, std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    auto entries = _promises.find(key);
+    if (entries != _promises.end()) {
+      for (auto promise : entries->second) {
+        promise->set_exception(error);
+        delete promise;
+      }
+      _pending.sub(entries->second.size());
+      _promises.erase(entries);
+    }
+  }
+
+  // `registration` is set to identify the future for `remove`.
+  std::future<std::string> future(std::string key,
+                                  promise_ty *registration = nullptr) {
+    auto promise = new std::promise<std::string>;
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    _promises[key].push_back(promise);
+    _pending.add();
+    if (registration) {
+      *registration = promise;
+    }
+    return promise->get_future();
+  }
+
+  // Stop waiting on a future that won't be read, unless it was set already.
+  void remove(const std::string &key, promise_ty registration) {
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    auto entries = _promises.find(key);
+    if (entries == _promises.end()) {
+      return;
+    }
+    auto &promises = entries->second;
+    auto entry = std::find(promises.begin(), promises.end(), registration);
+    if (entry == promises.end()) {
+      return;
+    }
+    delete *entry;
+    promises.erase(entry);
+    _pending.sub();
+    if (promises.empty()) {
+      _promises.erase(entries);
+    }
+  }
+};
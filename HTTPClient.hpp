@@ -0,0 +1,238 @@
+#include "boost/asio/io_service.hpp"
+#include "boost/beast/http/verb.hpp"
+#import <boost/asio/local/stream_protocol.hpp>
+#import <boost/beast.hpp>
+#import <boost/lexical_cast.hpp>
+#import <boost/property_tree/json_parser.hpp>
+#import <boost/property_tree/ptree.hpp>
+#import <boost/variant.hpp>
+#import <fstream>
+#import <iostream>
+#import <memory>
+#import <sstream>
+#import <unistd.h>
+#import <vector>
+
+// HTTP client code shared by the integration tests and the load generator.
+
+namespace beast = boost::beast;     // from <boost/beast.hpp>
+namespace net = boost::asio;        // from <boost/asio.hpp>
+namespace http = beast::http;       // from <boost/beast/http.hpp>
+
+using tcp_type = net::ip::tcp;
+using socket_type = tcp_type::socket;
+using local_socket_type = net::local::stream_protocol::socket;
+using req_type = http::request<http::string_body>;
+using resp_type = http::response<http::string_body>;
+
+namespace ssvim {
+// Result is a variant where there can be a success or error case
+template <typename Success, typename Error>
+using Result = boost::variant<Success, Error>;
+
+namespace ResultStatus {
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-variable"
+const int Ok = 0;
+const int Error = 1;
+#pragma clang diagnostic pop
+
+template <typename T, typename R> auto Get(R v) {
+  return boost::get<T>(v);
+}
+} // namespace ResultStatus
+
+// Example usage:
+//    ssvim::Result<int, float> v;
+//    v = 12; // v contains int
+//    switch(v.which()) {
+//        case ssvim::ResultStatus::Ok:
+//            std::cout << "INT" << ssvim::ResultStatus::Get<int>(v);
+//            break;
+//        case ssvim::ResultStatus::Error:
+//            std::cout << "FLOAT" << ssvim::ResultStatus::Get<float>(v);
+//            break;
+//    }
+
+} // namespace ssvim
+
+template <class String>
+void err(beast::error_code const &ec, String const &what) {
+  std::cerr << what << ": " << ec.message() << std::endl;
+}
+
+typedef enum TestErrorCode {
+  TestErrorCodeUndefined,
+} TestErrorCode;
+
+/**
+ * A client connection to the server on localhost.
+ *
+ * The connection is reused across requests when `keepAlive` is set, and
+ * transparently reconnects when the server closes it. A `port` starting
+ * with '/' is the path of a Unix domain socket.
+ */
+class HTTPConnection {
+  net::io_service _ios;
+  std::unique_ptr<socket_type> _sock;
+  std::unique_ptr<local_socket_type> _localSock;
+  std::string _port;
+  std::string _client;
+  bool _keepAlive;
+  beast::flat_buffer _buffer;
+
+public:
+  HTTPConnection(std::string port, bool keepAlive)
+      : _port(port), _keepAlive(keepAlive) {
+  }
+
+  // Name the editor instance requests come from, for a shared server
+  void setClient(const std::string &client) {
+    _client = client;
+  }
+
+  ssvim::Result<resp_type, TestErrorCode> post(std::string path,
+                                               std::string body) {
+    // Run tests on localhost
+    auto host = "localhost";
+    try {
+      if (_port.length() && _port[0] == '/') {
+        if (!_localSock) {
+          _localSock.reset(new local_socket_type(_ios));
+          _localSock->connect(net::local::stream_protocol::endpoint(_port));
+          _buffer.consume(_buffer.size());
+        }
+        return roundTrip(*_localSock, makeRequest(path, body, host));
+      }
+      if (!_sock) {
+        tcp_type::resolver r(_ios);
+        auto it = r.resolve(tcp_type::resolver::query{host, _port});
+        _sock.reset(new socket_type(_ios));
+        connect(*_sock, it);
+        _buffer.consume(_buffer.size());
+      }
+      auto ep = _sock->remote_endpoint();
+      return roundTrip(
+          *_sock,
+          makeRequest(path, body,
+                      host + std::string(":") +
+                          boost::lexical_cast<std::string>(ep.port())));
+    } catch (beast::system_error const &ec) {
+      std::cerr << host << ": " << ec.what();
+    } catch (...) {
+      std::cerr << host << ": unknown exception" << std::endl;
+    }
+    close();
+    return TestErrorCodeUndefined;
+  }
+
+  void close() {
+    beast::error_code ec;
+    if (_sock) {
+      _sock->shutdown(socket_type::shutdown_both, ec);
+      _sock.reset();
+    }
+    if (_localSock) {
+      _localSock->shutdown(local_socket_type::shutdown_both, ec);
+      _localSock.reset();
+    }
+  }
+
+private:
+  req_type makeRequest(const std::string &path, const std::string &body,
+                       const std::string &host) {
+    req_type req;
+    req.method(http::verb::post);
+    req.target(path);
+    req.body() = body;
+    req.version(11);
+    req.keep_alive(_keepAlive);
+    req.insert("Host", host);
+    req.insert("User-Agent", "ssvim-integration_tests/http");
+    req.insert("Content-Type", "application/json");
+    if (_client.length()) {
+      req.insert("X-SSVIM-Client", _client);
+    }
+    req.prepare_payload();
+    return req;
+  }
+
+  template <class Socket> resp_type roundTrip(Socket &sock, req_type req) {
+    http::write(sock, req);
+    resp_type res;
+    http::read(sock, _buffer, res);
+    if (!_keepAlive || res.need_eof()) {
+      close();
+    }
+    return res;
+  }
+};
+
+inline ssvim::Result<resp_type, TestErrorCode>
+PostRequest(std::string port, std::string path, std::string body) {
+  HTTPConnection connection(port, false);
+  return connection.post(path, body);
+}
+
+inline std::string ReadFile(const std::string &fileName) {
+  std::ifstream ifs(fileName.c_str(),
+                    std::ios::in | std::ios::binary | std::ios::ate);
+
+  std::ifstream::pos_type fileSize = ifs.tellg();
+  ifs.seekg(0, std::ios::beg);
+
+  std::vector<char> bytes(fileSize);
+  ifs.read(&bytes[0], fileSize);
+  return std::string(&bytes[0], fileSize);
+}
+
+inline std::string MakeCompletionPostBody(int line, int column,
+                                          std::string fileName,
+                                          std::string contents,
+                                          std::vector<std::string> flags,
+                                          std::string query = "") {
+  using boost::property_tree::ptree;
+  ptree out;
+  out.put("line", line);
+  out.put("column", column);
+  out.put("file_name", fileName);
+  out.put("contents", contents);
+  out.put("query", query);
+  boost::property_tree::ptree flagsOut;
+  for (auto &f : flags) {
+    boost::property_tree::ptree flag;
+    flag.put("", f);
+    flagsOut.push_back(std::make_pair("", flag));
+  }
+  out.add_child("flags", flagsOut);
+  std::ostringstream oss;
+  boost::property_tree::write_json(oss, out);
+  return oss.str();
+}
+
+inline std::string MakeDiagnosticsPostBody(std::string fileName,
+                                           std::string contents,
+                                           std::vector<std::string> flags) {
+  using boost::property_tree::ptree;
+  ptree out;
+  out.put("file_name", fileName);
+  out.put("contents", contents);
+  boost::property_tree::ptree flagsOut;
+  for (auto &f : flags) {
+    boost::property_tree::ptree flag;
+    flag.put("", f);
+    flagsOut.push_back(std::make_pair("", flag));
+  }
+  out.add_child("flags", flagsOut);
+  std::ostringstream oss;
+  boost::property_tree::write_json(oss, out);
+  return oss.str();
+}
+
+inline std::string GetExamplesDir() {
+  char cwd[1024];
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    return std::string(std::string(cwd) + "/Examples/");
+  }
+  return "";
+}
@@ -1,11 +1,25 @@
+#import "Admission.hpp"
+#import "Clients.hpp"
+#import "CompileDatabase.hpp"
+#import "CompletionPrefetch.hpp"
+#import "JobPool.hpp"
 #import "Logging.hpp"
+#import "MemoryBudget.hpp"
 #include <memory>
+#import "MessageTransport.hpp"
+#import "ModuleCache.hpp"
+#import "SemanticBackend.hpp"
 #import "SemanticHTTPServer.hpp"
+#import "Snapshot.hpp"
+#import "Trace.hpp"
+#import "Warmup.hpp"
 
 #import <boost/algorithm/string.hpp>
 #import <boost/program_options.hpp>
-#import <dispatch/dispatch.h>
+#import <fcntl.h>
 #import <iostream>
+#import <sys/file.h>
+#import <unistd.h>
 
 static auto LogLevelWithProgramOptionLog(std::string option) {
   using namespace ssvim;
@@ -19,6 +33,67 @@ static auto LogLevelWithProgramOptionLog(std::string option) {
   }
 }
 
+static std::string DefaultModuleCacheDirectory() {
+  auto home = getenv("HOME");
+  if (!home) {
+    return "";
+  }
+  return std::string(home) + "/.cache/ssvim/modules";
+}
+
+// The well-known socket of the shared server, one per user
+static std::string DefaultDaemonSocket() {
+  auto directory = getenv("XDG_RUNTIME_DIR");
+  return std::string(directory ? directory : "/tmp") + "/ssvim-" +
+         std::to_string(getuid()) + ".sock";
+}
+
+// Take the lock of the daemon serving `socketPath`, held until exit. Fails
+// when another daemon has it.
+static bool LockDaemon(const std::string &socketPath) {
+  auto fd = open((socketPath + ".lock").c_str(),
+                 O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  return fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+}
+
+static bool SocketAccepts(const std::string &socketPath) {
+  boost::asio::io_context ioc;
+  boost::asio::local::stream_protocol::socket socket(ioc);
+  boost::system::error_code ec;
+  socket.connect(boost::asio::local::stream_protocol::endpoint(socketPath),
+                 ec);
+  return !ec;
+}
+
+// Detach idle clients every second. A daemon stops once none is attached;
+// the first client gets as long to attach.
+static void ReapIdleClients(boost::asio::io_context &ioc,
+                            boost::asio::steady_timer &timer,
+                            std::chrono::seconds idle, bool daemon,
+                            std::chrono::steady_clock::time_point started) {
+  timer.expires_after(std::chrono::seconds(1));
+  timer.async_wait([&ioc, &timer, idle, daemon,
+                    started](const boost::system::error_code &ec) {
+    if (ec) {
+      return;
+    }
+    auto attached = ssvim::ClientRegistry::shared().expireIdle(idle);
+    if (daemon && !attached &&
+        std::chrono::steady_clock::now() - started >= idle) {
+      std::cout << "No clients left, exiting" << std::endl;
+      ioc.stop();
+      return;
+    }
+    ReapIdleClients(ioc, timer, idle, daemon, started);
+  });
+}
+
+#if SSVIM_WITH_SOURCEKITD
+static auto DefaultBackend = "sourcekitd";
+#else
+static auto DefaultBackend = "standin";
+#endif
+
 int main(int ac, char const *av[]) {
   namespace po = boost::program_options;
   po::options_description desc("Options");
@@ -29,13 +104,85 @@ int main(int ac, char const *av[]) {
       "Set the port number for the server")(
       "ip", po::value<std::string>()->default_value("127.0.0.1"),
       "Set the IP address to bind to, \"0.0.0.0\" for all")(
+      "socket", po::value<std::string>()->default_value(""),
+      "Also serve on a Unix domain socket at this path")(
+      "daemon", po::bool_switch()->default_value(false),
+      "Serve editor instances on a shared socket only, --socket or a "
+      "well-known one, or attach to the server already serving it")(
+      "client-idle-timeout", po::value<unsigned>()->default_value(600),
+      "Set the seconds without requests before a client is detached; a "
+      "daemon exits when none is left")(
+      "stdio", po::bool_switch()->default_value(false),
+      "Serve Content-Length framed messages on stdin and stdout instead of "
+      "listening")(
       "threads,n", po::value<std::size_t>()->default_value(4),
-      "Set the number of threads to use")
+      "Set the number of threads running semantic requests")
       // DEBUG, INFO, WARNING
       ("log,r", po::value<std::string>()->default_value("INFO"),
-       "Set the logging level")("hmac-file-secret,r",
-                                po::value<std::string>()->default_value("none"),
-                                "Set the hmac secret");
+       "Set the logging level")(
+      "trace-requests", po::value<std::size_t>()->default_value(64),
+      "Set the number of recent requests kept for /debug/trace")(
+      "body-limit-mb",
+      po::value<std::uint64_t>()->default_value(
+          ssvim::http::DefaultBodyLimit >> 20),
+      "Set the largest request body accepted, in MB")(
+      "max-sessions", po::value<unsigned>()->default_value(64),
+      "Set the most open connections, 0 for no limit")(
+      "max-jobs", po::value<unsigned>()->default_value(32),
+      "Set the most semantic requests running or waiting, 0 for no limit")(
+      "max-queued-mb", po::value<std::uint64_t>()->default_value(256),
+      "Set the most request data held by semantic requests, in MB, 0 for no "
+      "limit")(
+      "memory-budget-mb", po::value<std::uint64_t>()->default_value(1024),
+      "Set the memory for documents and caches before the least recently "
+      "used are evicted, in MB, 0 for no limit")(
+      "backend", po::value<std::string>()->default_value(DefaultBackend),
+      "Set the semantic backend: sourcekitd, standin or replay")(
+      "standin-latency-ms", po::value<unsigned>()->default_value(0),
+      "Set the time each stand-in backend request takes")(
+      "standin-candidates", po::value<unsigned>()->default_value(100),
+      "Set the number of stand-in completion results")(
+      "standin-notification-delay-ms",
+      po::value<unsigned>()->default_value(10),
+      "Set the time until stand-in semantic diagnostics are ready")(
+      "workers", po::value<unsigned>()->default_value(0),
+      "Set the number of semantic worker processes, each with its own "
+      "backend; 0 runs the backend in the server")(
+      "worker-timeout-ms", po::value<unsigned>()->default_value(30000),
+      "Set the time a semantic worker has to answer a request before it is "
+      "restarted; 0 waits forever")(
+      "semantic-worker", po::bool_switch()->default_value(false),
+      "Serve the backend to a server on stdin and stdout, used for workers")(
+      "record", po::value<std::string>()->default_value(""),
+      "Set a file to record semantic backend traffic to")(
+      "replay", po::value<std::string>()->default_value(""),
+      "Set a recorded file for the replay backend")(
+      "replay-timing", po::bool_switch()->default_value(false),
+      "Replay responses with their recorded latency")(
+      "module-cache-dir",
+      po::value<std::string>()->default_value(DefaultModuleCacheDirectory()),
+      "Set the directory of the module completion cache, \"\" to disable")(
+      "compile-commands", po::value<std::string>()->default_value(""),
+      "Set a compile_commands.json to look up flags in, instead of the one "
+      "nearest each file")(
+      "snapshot", po::value<std::string>()->default_value(""),
+      "Set a file to snapshot documents and caches to, restored at startup")(
+      "snapshot-interval", po::value<unsigned>()->default_value(60),
+      "Set the seconds between snapshots, 0 to only write one at exit")(
+      "prefetch", po::bool_switch()->default_value(false),
+      "Compute completions near the cursor of diagnostics requests while "
+      "the backend is idle")(
+      "no-warmup", po::bool_switch()->default_value(false),
+      "Skip initializing the backend and loading modules at startup")(
+      "warmup-module",
+      po::value<std::vector<std::string>>()->default_value(
+          {"Foundation"}, "Foundation"),
+      "Set a module to load at startup, may be repeated")(
+      "warmup-flags", po::value<std::vector<std::string>>()->composing(),
+      "Set space separated compiler flags to load modules with, may be "
+      "repeated")(
+      "hmac-file-secret,r", po::value<std::string>()->default_value("none"),
+      "Set the hmac secret");
   po::variables_map vm;
   po::store(po::parse_command_line(ac, av, desc), vm);
 
@@ -45,23 +192,190 @@ int main(int ac, char const *av[]) {
 
   std::string ip = vm["ip"].as<std::string>();
 
-  //std::size_t threads = vm["threads"].as<std::size_t>();
+  ssvim::JobPool::shared().setThreads(vm["threads"].as<std::size_t>());
   std::string log = vm["log"].as<std::string>();
 
+  ssvim::trace::SetRecentRequestLimit(vm["trace-requests"].as<std::size_t>());
+
   using endpoint_type = boost::asio::ip::tcp::endpoint;
   using address_type = boost::asio::ip::address;
   using namespace ssvim;
   using namespace ssvim::http;
 
-  std::cout << "__LISTENINGON: " << ip << ":" << port << std::endl;
-  std::cout.flush();
-  ServiceContext ctx("SomeSecret", LogLevelWithProgramOptionLog(
-                                       boost::to_upper_copy<std::string>(log)));
+  // Messages go to stdout, so logs must not
+  auto stdio = vm["stdio"].as<bool>();
+  auto semanticWorker = vm["semantic-worker"].as<bool>();
+  auto daemon = vm["daemon"].as<bool>();
+  auto socketPath = vm["socket"].as<std::string>();
+  if (daemon && socketPath.empty()) {
+    socketPath = DefaultDaemonSocket();
+  }
+  if (daemon && !LockDaemon(socketPath)) {
+    // Another instance serves the socket, or is starting to
+    for (int i = 0; i < 100 && !SocketAccepts(socketPath); i++) {
+      usleep(100 * 1000);
+    }
+    if (!SocketAccepts(socketPath)) {
+      std::cerr << "Cannot attach to the daemon at " << socketPath
+                << std::endl;
+      return 1;
+    }
+    std::cout << "__LISTENINGON: " << socketPath << std::endl;
+    return 0;
+  }
+  if (stdio || semanticWorker) {
+    LogSink::shared().writeToStderrOnly();
+  } else if (!daemon) {
+    std::cout << "__LISTENINGON: " << ip << ":" << port << std::endl;
+    std::cout.flush();
+  }
+  ServiceContext ctx("SomeSecret",
+                     LogLevelWithProgramOptionLog(
+                         boost::to_upper_copy<std::string>(log)),
+                     vm["body-limit-mb"].as<std::uint64_t>() << 20);
+
+  AdmissionLimits limits;
+  limits.maxSessions = vm["max-sessions"].as<unsigned>();
+  limits.maxJobs = vm["max-jobs"].as<unsigned>();
+  limits.maxQueuedBytes = vm["max-queued-mb"].as<std::uint64_t>() << 20;
+  AdmissionControl::shared().setLimits(limits);
+  MemoryBudget::shared().setLimit(vm["memory-budget-mb"].as<std::uint64_t>()
+                                  << 20);
+
+  auto backend = vm["backend"].as<std::string>();
+  std::shared_ptr<SemanticBackend> semanticBackend;
+  if (backend == "standin") {
+    StandInBackendOptions options;
+    options.latencyMillis = vm["standin-latency-ms"].as<unsigned>();
+    options.candidateCount = vm["standin-candidates"].as<unsigned>();
+    options.notificationDelayMillis =
+        vm["standin-notification-delay-ms"].as<unsigned>();
+    semanticBackend = MakeStandInBackend(ctx.logLevel, options);
+  } else if (backend == "replay") {
+    ReplayBackendOptions options;
+    options.originalTiming = vm["replay-timing"].as<bool>();
+    auto replay = vm["replay"].as<std::string>();
+    semanticBackend = MakeReplayBackend(ctx.logLevel, replay, options);
+    if (!semanticBackend) {
+      std::cerr << "Cannot read backend log: " << replay << std::endl;
+      return 1;
+    }
+#if SSVIM_WITH_SOURCEKITD
+  } else if (backend == "sourcekitd") {
+    semanticBackend = MakeSourceKitBackend(ctx.logLevel);
+#endif
+  } else {
+    std::cerr << "Unsupported backend: " << backend << std::endl;
+    return 1;
+  }
+
+  if (semanticWorker) {
+    ServeSemanticWorker(semanticBackend);
+    return 0;
+  }
+
+  // Workers run the backend configured above
+  auto workers = vm["workers"].as<unsigned>();
+  if (workers) {
+    WorkerPoolOptions pool;
+    pool.workers = workers;
+    pool.requestTimeout =
+        std::chrono::milliseconds(vm["worker-timeout-ms"].as<unsigned>());
+    pool.command = {av[0], "--semantic-worker", "--log", log, "--backend",
+                    backend};
+    for (auto option : {"standin-latency-ms", "standin-candidates",
+                        "standin-notification-delay-ms"}) {
+      pool.command.push_back(std::string("--") + option);
+      pool.command.push_back(std::to_string(vm[option].as<unsigned>()));
+    }
+    if (backend == "replay") {
+      pool.command.push_back("--replay");
+      pool.command.push_back(vm["replay"].as<std::string>());
+      if (vm["replay-timing"].as<bool>()) {
+        pool.command.push_back("--replay-timing");
+      }
+    }
+    semanticBackend = MakeWorkerPoolBackend(ctx.logLevel, pool);
+  }
+
+  auto record = vm["record"].as<std::string>();
+  if (record.length()) {
+    semanticBackend =
+        MakeRecordingBackend(ctx.logLevel, semanticBackend, record);
+    if (!semanticBackend) {
+      std::cerr << "Cannot write backend log: " << record << std::endl;
+      return 1;
+    }
+  }
+  SetSharedSemanticBackend(semanticBackend);
+
+  // Each backend gets its own cache, so stand-in results are never served
+  // for sourcekitd
+  auto moduleCacheDirectory = vm["module-cache-dir"].as<std::string>();
+  if (moduleCacheDirectory.length()) {
+    SetSharedModuleCache(
+        std::make_shared<ModuleCache>(moduleCacheDirectory + "/" + backend));
+  }
+
+  // Restored before serving, and written from then on
+  auto snapshot = vm["snapshot"].as<std::string>();
+  if (snapshot.length()) {
+    RestoreSnapshot(ctx.logLevel, snapshot);
+    StartSnapshots(
+        ctx.logLevel, snapshot,
+        std::chrono::seconds(vm["snapshot-interval"].as<unsigned>()));
+  }
+
+  CompletionPrefetcher::shared().setEnabled(vm["prefetch"].as<bool>());
+
+  auto compileCommands = vm["compile-commands"].as<std::string>();
+  if (compileCommands.length()) {
+    SetCompileDatabasePath(compileCommands);
+  }
+
+  if (!vm["no-warmup"].as<bool>()) {
+    WarmupOptions warmup;
+    warmup.modules = vm["warmup-module"].as<std::vector<std::string>>();
+    if (vm.count("warmup-flags")) {
+      for (auto &flags : vm["warmup-flags"].as<std::vector<std::string>>()) {
+        std::vector<std::string> flagSet;
+        boost::split(flagSet, flags, boost::is_any_of(" "),
+                     boost::token_compress_on);
+        warmup.flagSets.push_back(flagSet);
+      }
+    } else if (compileCommands.length()) {
+      // Load modules with some of the project's configurations
+      warmup.flagSets = CompileDatabaseFlagSets(4);
+    }
+    StartWarmup(ctx.logLevel, warmup);
+  }
+
+  if (stdio) {
+    ServeStandardIO(ctx);
+    return 0;
+  }
+
   endpoint_type ep{address_type::from_string(ip), port};
   boost::asio::io_context ioc{1};
-  std::make_shared<SemanticHTTPServer>(ioc, ep, root, ctx)->run();
-  ioc.run();
+  // Clients of a daemon reach it through its socket only
+  if (!daemon) {
+    std::make_shared<SemanticHTTPServer>(ioc, ep, root, ctx)->run();
+  }
+  if (socketPath.length()) {
+    // A socket left by a previous run would fail the bind
+    unlink(socketPath.c_str());
+    std::make_shared<LocalSemanticHTTPServer>(
+        ioc, net::local::stream_protocol::endpoint(socketPath), root, ctx)
+        ->run();
+    std::cout << "__LISTENINGON: " << socketPath << std::endl;
+  }
+  ClientRegistry::shared().setDaemon(daemon);
+  std::chrono::seconds idle(vm["client-idle-timeout"].as<unsigned>());
+  boost::asio::steady_timer reaper(ioc);
+  ReapIdleClients(ioc, reaper, idle, daemon,
+                  std::chrono::steady_clock::now());
 
+  // Stopping returns from main, so the snapshot is written at exit
   net::signal_set signals(ioc, SIGINT, SIGTERM);
   signals.async_wait([&](beast::error_code const&, int) {
       // Stop the `io_context`. This will cause `run()`
@@ -69,5 +383,9 @@ int main(int ac, char const *av[]) {
       // `io_context` and all of the sockets in it.
       ioc.stop();
   });
+  ioc.run();
+  if (daemon) {
+    unlink(socketPath.c_str());
+  }
   return 0;
 }
@@ -0,0 +1,19 @@
+#import "JSON.hpp"
+#import <cstdio>
+
+std::string ssvim::JSONString(const std::string &value) {
+  std::string out = "\"";
+  for (auto c : value) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
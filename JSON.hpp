@@ -0,0 +1,8 @@
+#import <string>
+
+namespace ssvim {
+
+// `value` quoted as a JSON string. Control characters are escaped.
+std::string JSONString(const std::string &value);
+
+} // namespace ssvim
@@ -0,0 +1,78 @@
+#import <algorithm>
+#import <chrono>
+#import <condition_variable>
+#import <deque>
+#import <mutex>
+#import <thread>
+
+#import "JobPool.hpp"
+#import "Metrics.hpp"
+
+using namespace ssvim;
+
+struct JobPool::Impl {
+  struct Job {
+    std::function<void()> run;
+    std::chrono::steady_clock::time_point submitted;
+  };
+
+  std::mutex mutex;
+  std::condition_variable available;
+  std::deque<Job> queue;
+  unsigned threads = 4;
+  bool started = false;
+
+  metrics::Gauge &queued = metrics::Registry::shared().gauge(
+      "ssvim_job_queue_depth", "", "Semantic jobs waiting for a thread");
+
+  void work() {
+    static auto &waitTime = metrics::StageHistogram("job_queue");
+    for (;;) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this] { return !queue.empty(); });
+        job = std::move(queue.front());
+        queue.pop_front();
+      }
+      queued.sub();
+      waitTime.record(std::chrono::steady_clock::now() - job.submitted);
+      // Jobs answer their own errors; one that throws anyway mustn't take
+      // the thread down with it
+      try {
+        job.run();
+      } catch (...) {
+      }
+    }
+  }
+};
+
+JobPool &JobPool::shared() {
+  static JobPool *pool = new JobPool();
+  return *pool;
+}
+
+JobPool::JobPool() : _impl(new Impl()) {
+}
+
+void JobPool::setThreads(unsigned threads) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->threads = std::max(1u, threads);
+}
+
+void JobPool::submit(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    // Threads start with the first job, so tools that never submit any
+    // don't pay for them
+    if (!_impl->started) {
+      _impl->started = true;
+      for (unsigned i = 0; i < _impl->threads; i++) {
+        std::thread([this] { _impl->work(); }).detach();
+      }
+    }
+    _impl->queue.push_back({std::move(job), std::chrono::steady_clock::now()});
+  }
+  _impl->queued.add();
+  _impl->available.notify_one();
+}
@@ -0,0 +1,32 @@
+#import <functional>
+
+namespace ssvim {
+
+/**
+ * JobPool runs semantic jobs on a fixed set of threads, in the order they
+ * are submitted, so the io thread only parses requests and writes
+ * responses.
+ *
+ * The queue isn't bounded here: callers admit each job through
+ * AdmissionControl first, which bounds the jobs running or waiting.
+ */
+class JobPool {
+public:
+  static JobPool &shared();
+
+  // Set the number of threads. Call before the first job is submitted.
+  void setThreads(unsigned threads);
+
+  // Run `job` on a pool thread. Jobs must not wait on other jobs.
+  void submit(std::function<void()> job);
+
+private:
+  JobPool();
+  JobPool(JobPool const &) = delete;
+  JobPool &operator=(JobPool const &) = delete;
+
+  struct Impl;
+  Impl *_impl;
+};
+
+} // namespace ssvim
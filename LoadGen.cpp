@@ -0,0 +1,251 @@
+#import "HTTPClient.hpp"
+#import <algorithm>
+#import <boost/program_options.hpp>
+#import <chrono>
+#import <dirent.h>
+#import <map>
+#import <mutex>
+#import <thread>
+
+// ssvim_loadgen drives a running http_server with concurrent clients
+// replaying keystroke sequences over the files in Examples/, and reports
+// latency per endpoint as JSON.
+
+struct LoadRequest {
+  std::string endpoint;
+  std::string body;
+};
+
+struct Sample {
+  std::string endpoint;
+  double millis;
+  bool ok;
+};
+
+// Build the requests an editor would send while typing in `fileName`.
+//
+// For every member access, the sequence completes right after the `.` and
+// then once per character of the following identifier, up to `maxQueryLength`
+// characters. Every file is preceded by a diagnostics request, like ycmd's
+// OnFileReadyToParse.
+static std::vector<LoadRequest>
+KeystrokeSequence(const std::string &fileName, const std::string &contents,
+                  const std::vector<std::string> &flags,
+                  unsigned maxQueryLength, bool diagnostics) {
+  std::vector<LoadRequest> requests;
+  if (diagnostics) {
+    requests.push_back({"/diagnostics",
+                        MakeDiagnosticsPostBody(fileName, contents, flags)});
+  }
+
+  std::istringstream lines(contents);
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(lines, line)) {
+    lineNumber++;
+    for (std::size_t i = 0; i < line.length(); i++) {
+      if (line[i] != '.') {
+        continue;
+      }
+      // Columns are 1 based, and point after the typed character
+      std::string query;
+      for (unsigned typed = 0; typed <= maxQueryLength; typed++) {
+        auto end = i + typed;
+        if (typed > 0 && (end >= line.length() || !isalnum(line[end]))) {
+          break;
+        }
+        if (typed > 0) {
+          query += line[end];
+        }
+        requests.push_back(
+            {"/completions",
+             MakeCompletionPostBody(lineNumber, (int)end + 2, fileName,
+                                    contents, flags, query)});
+      }
+    }
+  }
+  return requests;
+}
+
+static std::vector<std::string> SwiftFilesInDirectory(std::string dir) {
+  std::vector<std::string> files;
+  if (auto handle = opendir(dir.c_str())) {
+    while (auto entry = readdir(handle)) {
+      std::string name = entry->d_name;
+      auto suffix = std::string(".swift");
+      if (name.length() > suffix.length() &&
+          name.compare(name.length() - suffix.length(), suffix.length(),
+                       suffix) == 0) {
+        files.push_back(dir + "/" + name);
+      }
+    }
+    closedir(handle);
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+static std::string UnusedLocalPort() {
+  net::io_service ios;
+  tcp_type::acceptor acceptor(ios, tcp_type::endpoint(tcp_type::v4(), 0));
+  return std::to_string(acceptor.local_endpoint().port());
+}
+
+static double Percentile(const std::vector<double> &sorted, double quantile) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto rank = static_cast<std::size_t>(quantile * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+int main(int ac, char const *av[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "Show this message")(
+      "port,p", po::value<std::string>()->default_value(""),
+      "Port of a running http_server")(
+      "socket", po::value<std::string>()->default_value(""),
+      "Unix domain socket of the http_server, used instead of the port")(
+      "boot", po::bool_switch()->default_value(false),
+      "Start ./http_server on an unused port for the run")(
+      "clients,c", po::value<unsigned>()->default_value(4),
+      "Number of concurrent clients")(
+      "iterations,i", po::value<unsigned>()->default_value(1),
+      "Number of times each client replays the sequence")(
+      "keep-alive", po::bool_switch()->default_value(false),
+      "Reuse one connection per client instead of connecting per request")(
+      "examples", po::value<std::string>()->default_value(GetExamplesDir()),
+      "Directory of .swift files to replay")(
+      "max-query", po::value<unsigned>()->default_value(3),
+      "Characters typed after each member access")(
+      "no-diagnostics", po::bool_switch()->default_value(false),
+      "Skip the diagnostics request before each file")(
+      "flag", po::value<std::vector<std::string>>()->composing(),
+      "Compiler flag to send with each request, may be repeated");
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  auto port = vm["port"].as<std::string>();
+  auto socketPath = vm["socket"].as<std::string>();
+  auto boot = vm["boot"].as<bool>();
+  auto clientCount = vm["clients"].as<unsigned>();
+  auto iterations = vm["iterations"].as<unsigned>();
+  auto keepAlive = vm["keep-alive"].as<bool>();
+  auto examplesDir = vm["examples"].as<std::string>();
+  std::vector<std::string> flags;
+  if (vm.count("flag")) {
+    flags = vm["flag"].as<std::vector<std::string>>();
+  }
+
+  if (boot) {
+    port = UnusedLocalPort();
+    auto startCmd = std::string("`./http_server --log WARNING --port ") +
+                    port +
+                    (socketPath.length() ? " --socket " + socketPath : "") +
+                    " >/dev/null`&";
+    if (system(startCmd.c_str()) != 0) {
+      std::cerr << "Failed to start http_server" << std::endl;
+      return 1;
+    }
+    sleep(1);
+  } else if (port.empty() && socketPath.empty()) {
+    std::cerr << "Either --port, --socket or --boot is required" << std::endl;
+    return 1;
+  }
+  // Requests go to the socket when there is one
+  auto address = socketPath.length() ? socketPath : port;
+
+  std::vector<LoadRequest> sequence;
+  for (auto &fileName : SwiftFilesInDirectory(examplesDir)) {
+    auto requests = KeystrokeSequence(fileName, ReadFile(fileName), flags,
+                                      vm["max-query"].as<unsigned>(),
+                                      !vm["no-diagnostics"].as<bool>());
+    sequence.insert(sequence.end(), requests.begin(), requests.end());
+  }
+  if (sequence.empty()) {
+    std::cerr << "No requests for examples in " << examplesDir << std::endl;
+    return 1;
+  }
+
+  std::mutex samplesMutex;
+  std::vector<Sample> samples;
+  auto runStart = std::chrono::steady_clock::now();
+  std::vector<std::thread> clients;
+  for (unsigned c = 0; c < clientCount; c++) {
+    clients.emplace_back([&, c] {
+      std::vector<Sample> clientSamples;
+      HTTPConnection connection(address, keepAlive);
+      for (unsigned i = 0; i < iterations; i++) {
+        // Stagger clients so they don't request the same file in lockstep
+        for (std::size_t r = 0; r < sequence.size(); r++) {
+          auto &request = sequence[(r + c) % sequence.size()];
+          auto start = std::chrono::steady_clock::now();
+          auto response = connection.post(request.endpoint, request.body);
+          std::chrono::duration<double, std::milli> elapsed =
+              std::chrono::steady_clock::now() - start;
+          bool ok = response.which() == ssvim::ResultStatus::Ok &&
+                    boost::get<resp_type>(response).result_int() == 200;
+          clientSamples.push_back({request.endpoint, elapsed.count(), ok});
+        }
+      }
+      std::lock_guard<std::mutex> lock(samplesMutex);
+      samples.insert(samples.end(), clientSamples.begin(),
+                     clientSamples.end());
+    });
+  }
+  for (auto &client : clients) {
+    client.join();
+  }
+  std::chrono::duration<double> runTime =
+      std::chrono::steady_clock::now() - runStart;
+
+  if (boot) {
+    PostRequest(address, "/shutdown", "");
+  }
+
+  // Report
+  std::map<std::string, std::vector<double>> latencies;
+  std::map<std::string, unsigned> errors;
+  for (auto &sample : samples) {
+    latencies[sample.endpoint].push_back(sample.millis);
+    errors[sample.endpoint] += sample.ok ? 0 : 1;
+  }
+
+  // property_tree writes every value as a string, so the report is written
+  // by hand to keep numbers as numbers.
+  std::ostringstream os;
+  os << "{\n";
+  os << "  \"clients\": " << clientCount << ",\n";
+  os << "  \"iterations\": " << iterations << ",\n";
+  os << "  \"keep_alive\": " << (keepAlive ? "true" : "false") << ",\n";
+  os << "  \"transport\": \"" << (socketPath.length() ? "unix" : "tcp")
+     << "\",\n";
+  os << "  \"duration_seconds\": " << runTime.count() << ",\n";
+  os << "  \"requests\": " << samples.size() << ",\n";
+  os << "  \"throughput_rps\": " << samples.size() / runTime.count() << ",\n";
+  os << "  \"endpoints\": {";
+  bool first = true;
+  for (auto &entry : latencies) {
+    auto &sorted = entry.second;
+    std::sort(sorted.begin(), sorted.end());
+    os << (first ? "\n" : ",\n");
+    first = false;
+    os << "    \"" << entry.first << "\": {"
+       << "\"requests\": " << sorted.size()
+       << ", \"errors\": " << errors[entry.first]
+       << ", \"throughput_rps\": " << sorted.size() / runTime.count()
+       << ", \"p50_ms\": " << Percentile(sorted, 0.5)
+       << ", \"p90_ms\": " << Percentile(sorted, 0.9)
+       << ", \"p99_ms\": " << Percentile(sorted, 0.99)
+       << ", \"max_ms\": " << sorted.back() << "}";
+  }
+  os << "\n  }\n}\n";
+  std::cout << os.str();
+  return 0;
+}
@@ -1,11 +1,181 @@
 #import "Logging.hpp"
+#import <atomic>
+#import <chrono>
+#import <condition_variable>
+#import <cstdio>
+#import <cstdlib>
 #import <mutex>
-std::mutex ioMutex;
+#import <thread>
+#import <vector>
 
-void ssvim::Logger::writeLock() {
-  ioMutex.lock();
+using namespace ssvim;
+
+// Number of lines the ring holds. Must be a power of 2.
+static const std::size_t LogRingSize = 4096;
+
+// The writer flushes once it has batched this many bytes.
+static const std::size_t LogBatchBytes = 64 * 1024;
+
+// A bounded multi producer queue based on Dmitry Vyukov's design.
+//
+// Each cell carries a sequence number which tells a producer when the cell is
+// free and the consumer when it is full. Producers only contend on `tail`.
+struct LogSink::Impl {
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    LogLevel level;
+    std::string line;
+  };
+
+  std::vector<Cell> cells;
+  std::atomic<std::size_t> tail;
+  std::size_t head; // Only the writer thread touches this
+
+  std::atomic<std::uint64_t> enqueued;
+  std::atomic<std::uint64_t> written;
+  std::atomic<std::uint64_t> dropped;
+
+  // The writer parks here when there is nothing to do.
+  std::mutex idleMutex;
+  std::condition_variable idleCondition;
+  std::atomic<bool> idle;
+
+  // stdout carries something else, like framed messages
+  std::atomic<bool> stderrOnly{false};
+
+  Impl() : cells(LogRingSize), tail(0), head(0) {
+    for (std::size_t i = 0; i < LogRingSize; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueued = 0;
+    written = 0;
+    dropped = 0;
+    idle = false;
+  }
+
+  bool push(LogLevel level, std::string &&line) {
+    auto pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      auto &cell = cells[pos & (LogRingSize - 1)];
+      auto seq = cell.sequence.load(std::memory_order_acquire);
+      auto diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          cell.level = level;
+          cell.line = std::move(line);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        // Full
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool pop(LogLevel &level, std::string &line) {
+    auto &cell = cells[head & (LogRingSize - 1)];
+    auto seq = cell.sequence.load(std::memory_order_acquire);
+    if ((intptr_t)seq - (intptr_t)(head + 1) < 0) {
+      // Empty
+      return false;
+    }
+    level = cell.level;
+    line = std::move(cell.line);
+    cell.line.clear();
+    cell.sequence.store(head + LogRingSize, std::memory_order_release);
+    head++;
+    return true;
+  }
+};
+
+LogSink &LogSink::shared() {
+  // Never torn down: lines may be logged during static destruction.
+  static LogSink *sink = new LogSink();
+  return *sink;
+}
+
+LogSink::LogSink() : _impl(new Impl()) {
+  std::thread([this] { drain(); }).detach();
+  std::atexit([] { LogSink::shared().flush(); });
 }
 
-void ssvim::Logger::writeUnLock() {
-  ioMutex.unlock();
+void LogSink::enqueue(LogLevel level, std::string &&line) {
+  if (!_impl->push(level, std::move(line))) {
+    _impl->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  _impl->enqueued.fetch_add(1, std::memory_order_relaxed);
+  if (_impl->idle.exchange(false)) {
+    _impl->idleCondition.notify_one();
+  }
+}
+
+void LogSink::writeToStderrOnly() {
+  _impl->stderrOnly = true;
+}
+
+std::uint64_t LogSink::droppedCount() {
+  return _impl->dropped.load(std::memory_order_relaxed);
+}
+
+void LogSink::flush() {
+  auto target = _impl->enqueued.load();
+  // Don't hang the process at exit if the writer is wedged.
+  for (int i = 0; i < 1000 && _impl->written.load() < target; i++) {
+    _impl->idleCondition.notify_one();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+static void WriteBatch(std::string &batch, FILE *stream) {
+  if (batch.size()) {
+    fwrite(batch.data(), 1, batch.size(), stream);
+    fflush(stream);
+    batch.clear();
+  }
+}
+
+void LogSink::drain() {
+  std::string outBatch;
+  std::string errBatch;
+  LogLevel level;
+  std::string line;
+  std::uint64_t reportedDrops = 0;
+  for (;;) {
+    std::uint64_t count = 0;
+    while (_impl->pop(level, line)) {
+      auto &batch =
+          level == LogLevelError || _impl->stderrOnly ? errBatch : outBatch;
+      batch += line;
+      count++;
+      if (batch.size() > LogBatchBytes) {
+        break;
+      }
+    }
+
+    auto drops = droppedCount();
+    if (drops != reportedDrops) {
+      errBatch += "__LOG: dropped " + std::to_string(drops - reportedDrops) +
+                  " messages\n";
+      reportedDrops = drops;
+    }
+
+    WriteBatch(errBatch, stderr);
+    WriteBatch(outBatch, stdout);
+    _impl->written.fetch_add(count);
+    if (count) {
+      continue;
+    }
+
+    // Park until a producer wakes us up. The timeout covers the race where a
+    // line lands between the last pop and setting `idle`.
+    std::unique_lock<std::mutex> lock(_impl->idleMutex);
+    _impl->idle = true;
+    _impl->idleCondition.wait_for(lock, std::chrono::milliseconds(50));
+    _impl->idle = false;
+  }
 }
@@ -1,4 +1,8 @@
+#import <algorithm>
+#import <cstdint>
 #import <iostream>
+#import <streambuf>
+#import <string>
 
 namespace ssvim {
 
@@ -8,8 +12,86 @@ typedef enum LogLevel {
   LogLevelExtreme
 } LogLevel;
 
-class Logger : public std::enable_shared_from_this<Logger> {
-  LogLevel const _level;
+// Messages are truncated to this many bytes before they are queued.
+//
+// At LogLevelExtreme, whole request bodies and completion responses are
+// logged, and those can be several megabytes.
+static const std::size_t LogMessageSizeCap = 16 * 1024;
+
+/**
+ * LogSink writes log lines on a background thread.
+ *
+ * Producers push formatted lines into a bounded, lock-free ring and return
+ * immediately. A single writer thread drains the ring and batches the writes
+ * to stdout / stderr. When the ring is full the line is dropped and counted,
+ * so logging never blocks a caller on I/O.
+ */
+class LogSink {
+public:
+  static LogSink &shared();
+
+  // Queue a line for writing. Never blocks.
+  void enqueue(LogLevel level, std::string &&line);
+
+  // Wait until everything queued so far has been written.
+  // This is called at exit and may block.
+  void flush();
+
+  std::uint64_t droppedCount();
+
+  // Write every line to stderr, when stdout is used for messages.
+  void writeToStderrOnly();
+
+private:
+  LogSink();
+  LogSink(LogSink const &) = delete;
+  LogSink &operator=(LogSink const &) = delete;
+
+  void drain();
+
+  struct Impl;
+  Impl *_impl;
+};
+
+/**
+ * A string buffer which keeps at most `cap` bytes, but counts everything that
+ * was written to it.
+ */
+class CappedStringBuf : public std::streambuf {
+  std::string &_output;
+  std::size_t _cap;
+  std::size_t _written;
+
+public:
+  CappedStringBuf(std::string &output, std::size_t cap)
+      : _output(output), _cap(cap), _written(0) {
+  }
+
+  std::size_t truncatedBytes() const {
+    return _written > _cap ? _written - _cap : 0;
+  }
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (ch != traits_type::eof()) {
+      char c = traits_type::to_char_type(ch);
+      xsputn(&c, 1);
+    }
+    return ch;
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize count) override {
+    auto n = static_cast<std::size_t>(count);
+    if (_written < _cap) {
+      _output.append(s, std::min(n, _cap - _written));
+    }
+    _written += n;
+    return count;
+  }
+};
+
+class Logger {
+  LogLevel _level;
   std::string _messagePrefix;
 
 public:
@@ -17,45 +99,49 @@ public:
       : _level(level), _messagePrefix("__" + channel + ": ") {
   }
 
-  template <class... Args> Logger log(LogLevel level, Args const &... args) {
-    if (level <= _level) {
-      return logArgs(level, args...);
+  // Each argument is written on its own line.
+  //
+  // Nothing is formatted unless the level is enabled.
+  template <class... Args> Logger &log(LogLevel level, Args const &... args) {
+    if (enabled(level)) {
+      std::string message;
+      logArgs(message, args...);
+      LogSink::shared().enqueue(level, std::move(message));
     }
     return *this;
   }
 
   // By default this logs debugging messages
-  template <class Args> Logger &operator<<(Args args) {
-    log(LogLevelInfo, args);
-    return *this;
+  template <class Arg> Logger &operator<<(Arg const &arg) {
+    return log(LogLevelInfo, arg);
+  }
+
+  // Callers should check this before building expensive log arguments.
+  bool enabled(LogLevel level) const {
+    return level <= _level;
   }
 
-  auto level() {
+  LogLevel level() const {
     return _level;
   };
 
 private:
-  Logger &logArgs(LogLevel level) {
-    return *this;
+  void logArgs(std::string &message) {
   }
 
   template <class Arg, class... Args>
-  Logger &logArgs(LogLevel level, Arg const &arg, Args const &... args) {
-    if (level == LogLevelError) {
-      writeLock();
-      std::cerr << _messagePrefix << arg << std::endl;
-      writeUnLock();
-    } else {
-      writeLock();
-      std::cout << _messagePrefix << arg << std::endl;
-      writeUnLock();
+  void logArgs(std::string &message, Arg const &arg, Args const &... args) {
+    message += _messagePrefix;
+    CappedStringBuf buf(message, LogMessageSizeCap);
+    std::ostream os(&buf);
+    os << arg;
+    if (buf.truncatedBytes()) {
+      message += "...<truncated ";
+      message += std::to_string(buf.truncatedBytes());
+      message += " bytes>";
     }
-    logArgs(level, args...);
-    return *this;
+    message += '\n';
+    logArgs(message, args...);
   }
-
-  void writeLock();
-
-  void writeUnLock();
 };
 } // namespace ssvim
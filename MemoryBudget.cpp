@@ -0,0 +1,211 @@
+#import <algorithm>
+#import <chrono>
+#import <fstream>
+#import <list>
+#import <map>
+#import <mutex>
+#import <unistd.h>
+#import <unordered_map>
+#import <vector>
+
+#if __APPLE__
+#import <libproc.h>
+#import <mach/mach.h>
+#endif
+
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+
+using namespace ssvim;
+
+std::uint64_t ssvim::ResidentMemoryBytes() {
+#if __APPLE__
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                (task_info_t)&info, &count) != KERN_SUCCESS) {
+    return 0;
+  }
+  return info.resident_size;
+#else
+  std::ifstream statm("/proc/self/statm");
+  std::uint64_t size = 0, resident = 0;
+  if (!(statm >> size >> resident)) {
+    return 0;
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+std::uint64_t ssvim::ResidentMemoryBytes(int pid) {
+#if __APPLE__
+  proc_taskinfo info;
+  if (proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &info, sizeof(info)) !=
+      sizeof(info)) {
+    return 0;
+  }
+  return info.pti_resident_size;
+#else
+  std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+  std::uint64_t size = 0, resident = 0;
+  if (!(statm >> size >> resident)) {
+    return 0;
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Resident memory is read, and may evict a step of entries, at most this
+// often. Evictions take a while to show in resident memory, if they do.
+static const auto ResidentMemoryInterval = std::chrono::seconds(1);
+
+// The part of the tracked bytes evicted in a step over resident memory
+static const std::uint64_t ResidentEvictionFraction = 8;
+
+struct MemoryBudget::Impl {
+  struct Entry {
+    std::string pool;
+    std::string key;
+    std::uint64_t bytes;
+  };
+
+  struct Pool {
+    EvictFn evict;
+    metrics::Gauge *bytes;
+    metrics::Counter *evictions;
+  };
+
+  std::mutex mutex;
+  std::uint64_t limit = 0;
+  std::uint64_t tracked = 0;
+  // Most recently used first
+  std::list<Entry> entries;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  std::map<std::string, Pool> pools;
+  std::vector<std::function<std::uint64_t()>> residentSources;
+  std::chrono::steady_clock::time_point residentTime;
+
+  std::uint64_t resident() {
+    auto bytes = ResidentMemoryBytes();
+    for (auto &source : residentSources) {
+      bytes += source();
+    }
+    return bytes;
+  }
+
+  Pool &pool(const std::string &name) {
+    auto entry = pools.find(name);
+    if (entry != pools.end()) {
+      return entry->second;
+    }
+    auto labels = "pool=\"" + name + "\"";
+    auto &registry = metrics::Registry::shared();
+    auto &created = pools[name];
+    created.bytes = &registry.gauge("ssvim_memory_tracked_bytes", labels,
+                                    "Bytes held by documents and caches");
+    created.evictions = &registry.counter(
+        "ssvim_memory_evictions_total", labels,
+        "Entries evicted to stay within the memory budget");
+    return created;
+  }
+
+  void remove(std::list<Entry>::iterator entry) {
+    tracked -= entry->bytes;
+    pool(entry->pool).bytes->sub(entry->bytes);
+    index.erase(entry->pool + '\0' + entry->key);
+    entries.erase(entry);
+  }
+};
+
+MemoryBudget &MemoryBudget::shared() {
+  static MemoryBudget *budget = new MemoryBudget();
+  return *budget;
+}
+
+MemoryBudget::MemoryBudget() : _impl(new Impl()) {
+  metrics::Registry::shared().gaugeFunction(
+      "ssvim_memory_resident_bytes", "", "Resident memory of the server",
+      [] { return (double)ResidentMemoryBytes(); });
+}
+
+void MemoryBudget::setLimit(std::uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->limit = bytes;
+}
+
+void MemoryBudget::registerPool(const std::string &pool, EvictFn evict) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->pool(pool).evict = evict;
+}
+
+void MemoryBudget::addResidentSource(std::function<std::uint64_t()> bytes) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->residentSources.push_back(bytes);
+}
+
+void MemoryBudget::touch(const std::string &pool, const std::string &key,
+                         std::uint64_t bytes) {
+  struct Victim {
+    std::string key;
+    EvictFn evict;
+  };
+  std::vector<Victim> victims;
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    auto id = pool + '\0' + key;
+    auto existing = _impl->index.find(id);
+    if (existing != _impl->index.end()) {
+      _impl->remove(existing->second);
+    }
+    _impl->entries.push_front({pool, key, bytes});
+    _impl->index[id] = _impl->entries.begin();
+    _impl->tracked += bytes;
+    _impl->pool(pool).bytes->add(bytes);
+
+    auto limit = _impl->limit;
+    if (!limit) {
+      return;
+    }
+    std::uint64_t excess = 0;
+    if (_impl->tracked > limit) {
+      excess = _impl->tracked - limit;
+    }
+    // Over the budget in resident memory, release a step of what is tracked
+    auto now = std::chrono::steady_clock::now();
+    if (_impl->entries.size() > 1 &&
+        now - _impl->residentTime > ResidentMemoryInterval) {
+      _impl->residentTime = now;
+      if (_impl->resident() > limit) {
+        excess = std::max(
+            excess, std::max<std::uint64_t>(
+                        1, _impl->tracked / ResidentEvictionFraction));
+      }
+    }
+    while (excess && _impl->entries.size() > 1) {
+      auto oldest = std::prev(_impl->entries.end());
+      auto &victimPool = _impl->pool(oldest->pool);
+      victimPool.evictions->increment();
+      victims.push_back({oldest->key, victimPool.evict});
+      excess -= std::min(excess, oldest->bytes);
+      _impl->remove(oldest);
+    }
+  }
+  for (auto &victim : victims) {
+    if (victim.evict) {
+      victim.evict(victim.key);
+    }
+  }
+}
+
+void MemoryBudget::forget(const std::string &pool, const std::string &key) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto existing = _impl->index.find(pool + '\0' + key);
+  if (existing != _impl->index.end()) {
+    _impl->remove(existing->second);
+  }
+}
+
+std::uint64_t MemoryBudget::trackedBytes() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  return _impl->tracked;
+}
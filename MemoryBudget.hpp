@@ -0,0 +1,61 @@
+#import <cstdint>
+#import <functional>
+#import <string>
+
+namespace ssvim {
+
+/**
+ * MemoryBudget accounts for the bytes held by documents and caches, and
+ * evicts their least recently used entries when over a budget.
+ *
+ * Each pool of entries, e.g. the editor's buffers, registers how to evict
+ * one of its entries, and reports entries as they are used. Entries are
+ * evicted until the tracked bytes are within the budget. Since sourcekitd's
+ * memory isn't accounted otherwise, resident memory over the budget also
+ * evicts a small step of the oldest entries, at most once per interval, so
+ * memory that doesn't shrink with evictions doesn't empty every pool.
+ *
+ * Pools must not hold their own locks while calling into the budget, as
+ * eviction calls back into them.
+ */
+class MemoryBudget {
+public:
+  using EvictFn = std::function<void(const std::string &key)>;
+
+  static MemoryBudget &shared();
+
+  // 0 disables eviction
+  void setLimit(std::uint64_t bytes);
+
+  void registerPool(const std::string &pool, EvictFn evict);
+
+  // Count the resident memory of other processes against the budget, e.g.
+  // of semantic workers.
+  void addResidentSource(std::function<std::uint64_t()> bytes);
+
+  // Record a use of an entry holding `bytes`, and evict others if over the
+  // budget. The entry itself is never evicted here.
+  void touch(const std::string &pool, const std::string &key,
+             std::uint64_t bytes);
+
+  // The entry was removed by its pool.
+  void forget(const std::string &pool, const std::string &key);
+
+  std::uint64_t trackedBytes();
+
+private:
+  MemoryBudget();
+  MemoryBudget(MemoryBudget const &) = delete;
+  MemoryBudget &operator=(MemoryBudget const &) = delete;
+
+  struct Impl;
+  Impl *_impl;
+};
+
+// The resident memory of the process, or 0 if unknown.
+std::uint64_t ResidentMemoryBytes();
+
+// The resident memory of another process, or 0 if unknown.
+std::uint64_t ResidentMemoryBytes(int pid);
+
+} // namespace ssvim
@@ -0,0 +1,422 @@
+#import <boost/algorithm/string/predicate.hpp>
+#import <boost/property_tree/json_parser.hpp>
+#import <chrono>
+#import <cstdio>
+#import <cstdlib>
+#import <deque>
+#import <iostream>
+#import <thread>
+
+#import "Admission.hpp"
+#import "JobPool.hpp"
+#import "Metrics.hpp"
+#import "MessageTransport.hpp"
+#import "SwiftCompleter.hpp"
+
+namespace ssvim {
+namespace http {
+
+static auto HeaderValueContentTypeJSON = "application/json";
+
+#pragma mark - MessageSession
+
+// A request received as a message. Responses are sent as messages through
+// the dispatcher.
+class MessageSession : public Session {
+  std::shared_ptr<MessageDispatcher> _dispatcher;
+  long long _id;
+  req_type _request;
+  ptree _params;
+
+public:
+  MessageSession(std::shared_ptr<MessageDispatcher> dispatcher, long long id,
+                 req_type request, ptree params = ptree())
+      : _dispatcher(dispatcher), _id(id), _request(std::move(request)),
+        _params(std::move(params)) {
+  }
+
+  const req_type &request() override {
+    return _request;
+  }
+
+  // The params were parsed with the message
+  ptree JSONBody() override {
+    return std::move(_params);
+  }
+
+  Logger &logger() override {
+    return _dispatcher->logger();
+  }
+
+  void write(resp_type res) override {
+    auto status = res.result_int();
+    auto isJSON = res[http::field::content_type] == HeaderValueContentTypeJSON;
+    // JSON results are embedded as is, anything else as a string
+    auto embedded = status < 300 && isJSON && res.body().length()
+                        ? res.body()
+                        : JSONString(res.body());
+    auto message = "{\"id\": " + std::to_string(_id) +
+                   ", \"status\": " + std::to_string(status) +
+                   (status < 300 ? ", \"result\": " : ", \"error\": ") +
+                   embedded + "}";
+    _dispatcher->respond(_id, message, true);
+    releaseTicket();
+  }
+
+  void writeChunkedHeader(const char *contentType) override {
+  }
+
+  // Chunks are lines of JSON
+  bool writeChunk(const std::string &data) override {
+    auto end = data.find_last_not_of('\n');
+    auto chunk = end == std::string::npos ? "null" : data.substr(0, end + 1);
+    return _dispatcher->respond(
+        _id, "{\"id\": " + std::to_string(_id) + ", \"chunk\": " + chunk + "}",
+        false);
+  }
+
+  void finishChunks() override {
+    _dispatcher->respond(_id,
+                         "{\"id\": " + std::to_string(_id) +
+                             ", \"status\": 200, \"done\": true}",
+                         true);
+    releaseTicket();
+  }
+};
+
+#pragma mark - MessageDispatcher
+
+MessageDispatcher::MessageDispatcher(ServiceContext context, SendFn send)
+    : _context(context), _send(send), _logger(context.logLevel, "MESSAGE"),
+      _endpoints(MakeEndpoints()) {
+}
+
+MessageDispatcher::~MessageDispatcher() {
+  if (_listenerToken) {
+    RemoveSemanticListener(_listenerToken);
+  }
+}
+
+void MessageDispatcher::start() {
+  std::weak_ptr<MessageDispatcher> weakSelf = shared_from_this();
+  _listenerToken = AddSemanticListener(
+      [weakSelf](const std::string &name, const std::string &JSON) {
+        auto self = weakSelf.lock();
+        if (!self) {
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> lock(self->_mutex);
+          if (!self->_documents.count(name)) {
+            return;
+          }
+        }
+        self->_send("{\"method\": \"diagnostics\", \"params\": "
+                    "{\"file_name\": " +
+                    JSONString(name) + ", \"diagnostics\": " + JSON + "}}");
+      });
+}
+
+void MessageDispatcher::receive(const std::string &message) {
+  ptree messageJSON;
+  try {
+    messageJSON = readJSONPostBody(message);
+  } catch (std::exception &e) {
+    _logger << "Invalid message: " << e.what();
+    return;
+  }
+  auto id = messageJSON.get<long long>("id", -1);
+  auto method = messageJSON.get<std::string>("method", "");
+  auto params = messageJSON.get_child_optional("params");
+  if (method == "cancel") {
+    cancel(id, params ? params->get<long long>("id", -1) : -1);
+    return;
+  }
+
+  auto endpoint = FindEndpoint(_endpoints, method);
+  if (endpoint == _endpoints.end()) {
+    respond(id,
+            "{\"id\": " + std::to_string(id) +
+                ", \"status\": 404, \"error\": " +
+                JSONString("Endpoint: '" + method + "' not found") + "}",
+            true);
+    return;
+  }
+  std::shared_ptr<AdmissionTicket> ticket;
+  if (IsSemanticEndpoint(endpoint->first)) {
+    std::string reason;
+    ticket = AdmissionControl::shared().admitJob(message.size(), &reason);
+    if (!ticket) {
+      AdmissionControl::shared().reject(reason);
+      MessageSession(shared_from_this(), id, req_type())
+          .write(overloadedResponse(req_type(), reason));
+      return;
+    }
+  }
+  metrics::Registry::shared()
+      .counter("ssvim_message_requests_total",
+               "endpoint=\"" + endpoint->first + "\"",
+               "Number of requests per endpoint over message transports")
+      .increment();
+
+  req_type request;
+  request.method(http::verb::post);
+  request.target(method);
+  request.version(11);
+  ptree body;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (params) {
+      auto fileName = params->get<std::string>("file_name", "");
+      if (fileName.length()) {
+        _documents.insert(fileName);
+      }
+      body.swap(*params);
+    }
+    _inFlight.insert(id);
+  }
+
+  auto session = std::make_shared<MessageSession>(shared_from_this(), id,
+                                                  request, std::move(body));
+  session->holdTicket(ticket);
+  auto impl = &endpoint->second;
+  auto self = shared_from_this();
+  JobPool::shared().submit([self, session, impl, id] {
+    // Cancelled while queued, there's no one to answer
+    if (self->cancelled(id)) {
+      self->respond(id, "", true);
+      return;
+    }
+    try {
+      impl->handleRequest(session);
+    } catch (std::exception &e) {
+      self->respond(id,
+                    "{\"id\": " + std::to_string(id) +
+                        ", \"status\": 500, \"error\": " +
+                        JSONString(e.what()) + "}",
+                    true);
+    }
+  });
+}
+
+bool MessageDispatcher::cancelled(long long id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _cancelled.count(id);
+}
+
+bool MessageDispatcher::respond(long long id, const std::string &message,
+                                bool last) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto cancelled = _cancelled.count(id);
+    if (last) {
+      _inFlight.erase(id);
+      _cancelled.erase(id);
+    }
+    if (cancelled) {
+      return false;
+    }
+  }
+  _send(message);
+  return true;
+}
+
+void MessageDispatcher::cancel(long long id, long long cancelled) {
+  bool inFlight;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    inFlight = _inFlight.count(cancelled);
+    if (inFlight) {
+      _cancelled.insert(cancelled);
+    }
+  }
+  _send("{\"id\": " + std::to_string(cancelled) +
+        ", \"cancelled\": " + (inFlight ? "true" : "false") + "}");
+}
+
+#pragma mark - WebSocketSession
+
+template <class Stream>
+class WebSocketSession
+    : public std::enable_shared_from_this<WebSocketSession<Stream>> {
+  websocket::stream<Stream> _ws;
+  beast::flat_buffer _buffer;
+  ServiceContext _context;
+  std::shared_ptr<MessageDispatcher> _dispatcher;
+  // Messages waiting to be written, the first one is being written
+  std::deque<std::string> _queue;
+
+public:
+  WebSocketSession(Stream &&stream, ServiceContext context)
+      : _ws(std::move(stream)), _context(context) {
+  }
+
+  void run(req_type request) {
+    std::weak_ptr<WebSocketSession> weakSelf = this->shared_from_this();
+    _dispatcher = std::make_shared<MessageDispatcher>(
+        _context, [weakSelf](const std::string &message) {
+          if (auto self = weakSelf.lock()) {
+            self->send(message);
+          }
+        });
+    _dispatcher->start();
+
+    // The websocket stream has its own timeouts
+    beast::get_lowest_layer(_ws).expires_never();
+    _ws.set_option(
+        websocket::stream_base::timeout::suggested(beast::role_type::server));
+    _ws.read_message_max(_context.bodyLimit);
+    _ws.async_accept(request,
+                     beast::bind_front_handler(&WebSocketSession::onAccept,
+                                               this->shared_from_this()));
+  }
+
+  // Send a message. May be called from any thread.
+  void send(const std::string &message) {
+    net::post(_ws.get_executor(),
+              beast::bind_front_handler(&WebSocketSession::enqueue,
+                                        this->shared_from_this(), message));
+  }
+
+private:
+  void onAccept(beast::error_code ec) {
+    if (ec) {
+      _dispatcher->logger() << "accept: " << ec.message();
+      return;
+    }
+    doRead();
+  }
+
+  void doRead() {
+    _ws.async_read(_buffer,
+                   beast::bind_front_handler(&WebSocketSession::onRead,
+                                             this->shared_from_this()));
+  }
+
+  void onRead(beast::error_code ec, std::size_t bytes) {
+    if (ec) {
+      // Closed, or failed
+      return;
+    }
+    auto message = beast::buffers_to_string(_buffer.data());
+    _buffer.consume(_buffer.size());
+    _dispatcher->receive(message);
+    doRead();
+  }
+
+  void enqueue(std::string message) {
+    _queue.push_back(std::move(message));
+    if (_queue.size() == 1) {
+      doWrite();
+    }
+  }
+
+  void doWrite() {
+    _ws.text(true);
+    _ws.async_write(net::buffer(_queue.front()),
+                    beast::bind_front_handler(&WebSocketSession::onWrite,
+                                              this->shared_from_this()));
+  }
+
+  void onWrite(beast::error_code ec, std::size_t bytes) {
+    if (ec) {
+      _queue.clear();
+      return;
+    }
+    _queue.pop_front();
+    if (!_queue.empty()) {
+      doWrite();
+    }
+  }
+};
+
+template <class Stream>
+static void StartWebSocket(Stream &&stream, ServiceContext context,
+                           req_type request) {
+  static auto &upgrades = metrics::Registry::shared().counter(
+      "ssvim_websocket_sessions_total", "", "WebSocket connections");
+  upgrades.increment();
+  std::make_shared<WebSocketSession<Stream>>(std::move(stream), context)
+      ->run(std::move(request));
+}
+
+void StartWebSocketSession(beast::tcp_stream &&stream, ServiceContext context,
+                           req_type request) {
+  StartWebSocket(std::move(stream), context, std::move(request));
+}
+
+void StartWebSocketSession(local_stream &&stream, ServiceContext context,
+                           req_type request) {
+  StartWebSocket(std::move(stream), context, std::move(request));
+}
+
+#pragma mark - Standard IO
+
+// Read the headers of a framed message, and return its Content-Length, or -1
+// at the end of input.
+static long long ReadFrameHeader(std::istream &in) {
+  long long length = -1;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.length() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty()) {
+      if (length >= 0) {
+        return length;
+      }
+      // Tolerate blank lines between messages
+      continue;
+    }
+    auto colon = line.find(':');
+    if (colon != std::string::npos &&
+        boost::iequals(line.substr(0, colon), "Content-Length")) {
+      length = std::strtoll(line.c_str() + colon + 1, nullptr, 10);
+    }
+  }
+  return -1;
+}
+
+void ServeStandardIO(ServiceContext context) {
+  std::mutex outputMutex;
+  auto dispatcher = std::make_shared<MessageDispatcher>(
+      context, [&outputMutex](const std::string &message) {
+        auto header =
+            "Content-Length: " + std::to_string(message.length()) + "\r\n\r\n";
+        std::lock_guard<std::mutex> lock(outputMutex);
+        fwrite(header.data(), 1, header.length(), stdout);
+        fwrite(message.data(), 1, message.length(), stdout);
+        fflush(stdout);
+      });
+  dispatcher->start();
+
+  std::ios::sync_with_stdio(false);
+  for (;;) {
+    auto length = ReadFrameHeader(std::cin);
+    if (length < 0) {
+      break;
+    }
+    // Skip a message over the limit, its ID is unknown without reading it
+    if ((std::uint64_t)length > context.bodyLimit) {
+      if (!std::cin.ignore(length)) {
+        break;
+      }
+      MessageSession(dispatcher, -1, req_type())
+          .write(payloadTooLargeResponse(req_type()));
+      continue;
+    }
+    std::string message(length, '\0');
+    if (!std::cin.read(&message[0], length)) {
+      break;
+    }
+    dispatcher->receive(message);
+  }
+
+  // Requests in flight hold the dispatcher; let them answer before exiting
+  while (dispatcher.use_count() > 1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+}
+
+} // namespace http
+} // namespace ssvim
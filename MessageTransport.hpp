@@ -0,0 +1,90 @@
+#import "SemanticHTTPServer.hpp"
+#import <functional>
+#import <mutex>
+#import <set>
+#import <string>
+
+namespace ssvim {
+namespace http {
+
+/**
+ * MessageDispatcher serves endpoints over JSON messages, for transports
+ * other than one-shot HTTP.
+ *
+ * Requests carry an ID, so many can be in flight at once:
+ *
+ * {"id": 1, "method": "/completions", "params": {...the endpoint's body}}
+ *
+ * and are answered with {"id", "status", "result"}, or {"id", "status",
+ * "error"} on failure. Streaming endpoints send {"id", "chunk"} messages
+ * followed by {"id", "status", "done": true}.
+ *
+ * {"id": 2, "method": "cancel", "params": {"id": 1}} drops the response of
+ * a request in flight, and is acknowledged with {"id": 1, "cancelled"}. A
+ * request still waiting for a job thread is skipped, but one that started
+ * runs to the end, as backends can't stop a request.
+ *
+ * A message over the body limit on stdio is answered with {"id": -1,
+ * "status": 413, "error"}, since its ID isn't read.
+ *
+ * Semantic diagnostics for the documents the client sent are pushed as
+ * {"method": "diagnostics", "params": {"file_name", "diagnostics"}} as soon
+ * as the backend has them.
+ */
+class MessageDispatcher
+    : public std::enable_shared_from_this<MessageDispatcher> {
+public:
+  using SendFn = std::function<void(const std::string &message)>;
+
+  MessageDispatcher(ServiceContext context, SendFn send);
+  ~MessageDispatcher();
+
+  // Start pushing diagnostics. Call once, before receiving.
+  void start();
+
+  // Handle a message from the client. Requests run on the job pool.
+  void receive(const std::string &message);
+
+  // Send a message to the client, unless it was a response to a cancelled
+  // request. Returns false if it was.
+  bool respond(long long id, const std::string &message, bool last);
+
+  Logger &logger() {
+    return _logger;
+  }
+
+private:
+  void cancel(long long id, long long cancelled);
+  bool cancelled(long long id);
+
+  ServiceContext _context;
+  SendFn _send;
+  Logger _logger;
+  EndpointMap _endpoints;
+  unsigned _listenerToken = 0;
+
+  std::mutex _mutex;
+  std::set<long long> _inFlight;
+  std::set<long long> _cancelled;
+  std::set<std::string> _documents;
+};
+
+// Serve a WebSocket connection upgraded from `request`, with messages in
+// the format of MessageDispatcher.
+void StartWebSocketSession(beast::tcp_stream &&stream, ServiceContext context,
+                           req_type request);
+void StartWebSocketSession(local_stream &&stream, ServiceContext context,
+                           req_type request);
+
+// Serve messages framed by a Content-Length header on stdin and stdout,
+// for clients that run the server as a child process:
+//
+// Content-Length: 44\r\n
+// \r\n
+// {"id": 1, "method": "/status", "params": {}}
+//
+// Returns at the end of input, once the requests in flight are answered.
+void ServeStandardIO(ServiceContext context);
+
+} // namespace http
+} // namespace ssvim
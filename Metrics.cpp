@@ -0,0 +1,223 @@
+#import "Metrics.hpp"
+#import <algorithm>
+#import <deque>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <sstream>
+#import <vector>
+
+using namespace ssvim::metrics;
+
+#pragma mark - Histogram
+
+// Buckets hold the values above the previous bucket's upper bound, up to and
+// including their own, like prometheus buckets.
+int Histogram::bucketIndex(std::uint64_t micros) {
+  if (micros) {
+    micros--;
+  }
+  if (micros < SubBucketCount) {
+    return static_cast<int>(micros);
+  }
+  int exponent = 63 - __builtin_clzll(micros);
+  int sub = (micros >> (exponent - SubBucketBits)) & (SubBucketCount - 1);
+  int index = SubBucketCount * (exponent - SubBucketBits + 1) + sub;
+  return index < BucketCount ? index : BucketCount - 1;
+}
+
+std::uint64_t Histogram::bucketUpperBound(int index) {
+  if (index < SubBucketCount) {
+    return index + 1;
+  }
+  int exponent = index / SubBucketCount + SubBucketBits - 1;
+  std::uint64_t sub = index % SubBucketCount;
+  return (SubBucketCount + sub + 1) << (exponent - SubBucketBits);
+}
+
+void Histogram::record(std::uint64_t micros) {
+  _buckets[bucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(micros, std::memory_order_relaxed);
+  auto current = _max.load(std::memory_order_relaxed);
+  while (micros > current &&
+         !_max.compare_exchange_weak(current, micros,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+std::uint64_t Histogram::countAtMost(std::uint64_t micros) const {
+  auto last = bucketIndex(micros);
+  std::uint64_t total = 0;
+  for (int i = 0; i <= last; i++) {
+    total += _buckets[i].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+std::uint64_t Histogram::percentile(double quantile) const {
+  auto total = count();
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = static_cast<std::uint64_t>(quantile * total);
+  std::uint64_t seen = 0;
+  for (int i = 0; i < BucketCount; i++) {
+    seen += _buckets[i].load(std::memory_order_relaxed);
+    if (seen > rank) {
+      return std::min(bucketUpperBound(i), max());
+    }
+  }
+  return max();
+}
+
+#pragma mark - Registry
+
+namespace {
+enum class MetricType { Counter, Gauge, Histogram };
+
+struct Series {
+  std::string labels;
+  std::unique_ptr<Counter> counter;
+  std::unique_ptr<Gauge> gauge;
+  std::unique_ptr<Histogram> histogram;
+  std::function<double()> sample;
+};
+
+struct Family {
+  MetricType type;
+  std::string help;
+  std::deque<Series> series;
+};
+} // namespace
+
+struct Registry::Impl {
+  std::mutex mutex;
+  std::map<std::string, Family> families;
+
+  Series &series(const std::string &name, const std::string &labels,
+                 const std::string &help, MetricType type) {
+    auto &family = families[name];
+    if (family.series.empty()) {
+      family.type = type;
+      family.help = help;
+    }
+    for (auto &s : family.series) {
+      if (s.labels == labels) {
+        return s;
+      }
+    }
+    family.series.emplace_back();
+    family.series.back().labels = labels;
+    return family.series.back();
+  }
+};
+
+Registry &Registry::shared() {
+  static Registry *registry = new Registry();
+  return *registry;
+}
+
+Registry::Registry() : _impl(new Impl()) {
+}
+
+Counter &Registry::counter(const std::string &name, const std::string &labels,
+                           const std::string &help) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto &s = _impl->series(name, labels, help, MetricType::Counter);
+  if (!s.counter) {
+    s.counter.reset(new Counter());
+  }
+  return *s.counter;
+}
+
+Gauge &Registry::gauge(const std::string &name, const std::string &labels,
+                       const std::string &help) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto &s = _impl->series(name, labels, help, MetricType::Gauge);
+  if (!s.gauge) {
+    s.gauge.reset(new Gauge());
+  }
+  return *s.gauge;
+}
+
+Histogram &Registry::histogram(const std::string &name,
+                               const std::string &labels,
+                               const std::string &help) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  auto &s = _impl->series(name, labels, help, MetricType::Histogram);
+  if (!s.histogram) {
+    s.histogram.reset(new Histogram());
+  }
+  return *s.histogram;
+}
+
+void Registry::gaugeFunction(const std::string &name,
+                             const std::string &labels,
+                             const std::string &help,
+                             std::function<double()> fn) {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  _impl->series(name, labels, help, MetricType::Gauge).sample = fn;
+}
+
+// Label sets with an extra label appended.
+static std::string JoinLabels(const std::string &labels,
+                              const std::string &extra) {
+  if (labels.empty()) {
+    return "{" + extra + "}";
+  }
+  if (extra.empty()) {
+    return "{" + labels + "}";
+  }
+  return "{" + labels + "," + extra + "}";
+}
+
+static void WriteHistogram(std::ostringstream &os, const std::string &name,
+                           const std::string &labels, const Histogram &h) {
+  // Export powers of 2 from 64us to ~67s, in seconds.
+  for (int exponent = 6; exponent <= 26; exponent++) {
+    std::uint64_t bound = 1ULL << exponent;
+    os << name << "_bucket"
+       << JoinLabels(labels, "le=\"" + std::to_string(bound / 1e6) + "\"")
+       << " " << h.countAtMost(bound) << "\n";
+  }
+  os << name << "_bucket" << JoinLabels(labels, "le=\"+Inf\"") << " "
+     << h.count() << "\n";
+  // Fixed point, as the default 6 significant digits round sums over 1000s
+  os << name << "_sum" << JoinLabels(labels, "") << " "
+     << std::to_string(h.sum() / 1e6) << "\n";
+  os << name << "_count" << JoinLabels(labels, "") << " " << h.count()
+     << "\n";
+}
+
+std::string Registry::prometheusText() {
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+  std::ostringstream os;
+  for (auto &entry : _impl->families) {
+    auto &name = entry.first;
+    auto &family = entry.second;
+    static const char *TypeNames[] = {"counter", "gauge", "histogram"};
+    os << "# HELP " << name << " " << family.help << "\n";
+    os << "# TYPE " << name << " "
+       << TypeNames[static_cast<int>(family.type)] << "\n";
+    for (auto &s : family.series) {
+      auto labels = s.labels.empty() ? "" : "{" + s.labels + "}";
+      if (s.counter) {
+        os << name << labels << " " << s.counter->value() << "\n";
+      } else if (s.gauge) {
+        os << name << labels << " " << s.gauge->value() << "\n";
+      } else if (s.sample) {
+        os << name << labels << " " << s.sample() << "\n";
+      } else if (s.histogram) {
+        WriteHistogram(os, name, s.labels, *s.histogram);
+      }
+    }
+  }
+  return os.str();
+}
+
+Histogram &ssvim::metrics::StageHistogram(const std::string &stage) {
+  return Registry::shared().histogram(
+      "ssvim_stage_duration_seconds", "stage=\"" + stage + "\"",
+      "Time spent in each internal stage of a request");
+}
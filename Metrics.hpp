@@ -0,0 +1,156 @@
+#import <atomic>
+#import <chrono>
+#import <cstdint>
+#import <functional>
+#import <string>
+
+namespace ssvim {
+namespace metrics {
+
+/**
+ * A monotonically increasing count.
+ */
+class Counter {
+  std::atomic<std::uint64_t> _value{0};
+
+public:
+  void increment(std::uint64_t n = 1) {
+    _value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  std::uint64_t value() const {
+    return _value.load(std::memory_order_relaxed);
+  }
+};
+
+/**
+ * A value that goes up and down, like a queue depth.
+ */
+class Gauge {
+  std::atomic<std::int64_t> _value{0};
+
+public:
+  void add(std::int64_t n = 1) {
+    _value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void sub(std::int64_t n = 1) {
+    _value.fetch_sub(n, std::memory_order_relaxed);
+  }
+
+  void set(std::int64_t n) {
+    _value.store(n, std::memory_order_relaxed);
+  }
+
+  std::int64_t value() const {
+    return _value.load(std::memory_order_relaxed);
+  }
+};
+
+/**
+ * A latency histogram in microseconds.
+ *
+ * Buckets are log-linear, like HdrHistogram: every power of 2 is split into
+ * 4 sub buckets, which keeps the relative error under 25% from 1us to 2^41us,
+ * about 25 days, with a fixed 160 slots. Recording is a few relaxed atomic
+ * adds.
+ */
+class Histogram {
+public:
+  static const int SubBucketBits = 2;
+  static const int SubBucketCount = 1 << SubBucketBits;
+  static const int BucketCount = 160;
+
+  void record(std::uint64_t micros);
+
+  template <class Duration> void record(Duration duration) {
+    record(static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(duration)
+            .count()));
+  }
+
+  std::uint64_t count() const {
+    return _count.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t sum() const {
+    return _sum.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t max() const {
+    return _max.load(std::memory_order_relaxed);
+  }
+
+  // Number of recorded values less than or equal to `micros`, where
+  // `micros` is a power of 2.
+  std::uint64_t countAtMost(std::uint64_t micros) const;
+
+  // The upper bound of the bucket holding the given quantile.
+  std::uint64_t percentile(double quantile) const;
+
+  static int bucketIndex(std::uint64_t micros);
+  static std::uint64_t bucketUpperBound(int index);
+
+private:
+  std::atomic<std::uint64_t> _buckets[BucketCount] = {};
+  std::atomic<std::uint64_t> _count{0};
+  std::atomic<std::uint64_t> _sum{0};
+  std::atomic<std::uint64_t> _max{0};
+};
+
+/**
+ * Records the lifetime of the timer into a histogram.
+ */
+class ScopedTimer {
+  Histogram &_histogram;
+  std::chrono::steady_clock::time_point _start;
+
+public:
+  ScopedTimer(Histogram &histogram)
+      : _histogram(histogram), _start(std::chrono::steady_clock::now()) {
+  }
+
+  ~ScopedTimer() {
+    _histogram.record(std::chrono::steady_clock::now() - _start);
+  }
+};
+
+/**
+ * The process wide set of metrics.
+ *
+ * Lookups take a lock, so callers should hold on to the returned reference,
+ * typically in a function local static. Metrics are never removed.
+ *
+ * `labels` is the inner part of a prometheus label set, for example
+ * `stage="body_parse"`.
+ */
+class Registry {
+public:
+  static Registry &shared();
+
+  Counter &counter(const std::string &name, const std::string &labels,
+                   const std::string &help);
+  Gauge &gauge(const std::string &name, const std::string &labels,
+               const std::string &help);
+  Histogram &histogram(const std::string &name, const std::string &labels,
+                       const std::string &help);
+
+  // A gauge which is sampled when metrics are rendered.
+  void gaugeFunction(const std::string &name, const std::string &labels,
+                     const std::string &help, std::function<double()> fn);
+
+  // Render all metrics in the prometheus text exposition format.
+  std::string prometheusText();
+
+private:
+  Registry();
+  struct Impl;
+  Impl *_impl;
+};
+
+// Time spent in an internal stage of handling a request, for example
+// "body_parse" or "sourcekitd_send".
+Histogram &StageHistogram(const std::string &stage);
+
+} // namespace metrics
+} // namespace ssvim
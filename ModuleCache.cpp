@@ -0,0 +1,250 @@
+#import <boost/filesystem.hpp>
+#import <cstdint>
+#import <cstdio>
+#import <cstring>
+#import <fcntl.h>
+#import <sstream>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+#import "ModuleCache.hpp"
+
+using namespace ssvim;
+
+// Entries are the header, the key and then the JSON.
+static const char EntryMagic[8] = {'S', 'S', 'V', 'I', 'M', 'M', 'C', '1'};
+
+struct EntryHeader {
+  char magic[8];
+  std::int64_t sdkModificationTime;
+  std::uint64_t keyLength;
+  std::uint64_t JSONLength;
+};
+
+static std::string KeyString(const ModuleCacheKey &key) {
+  return key.sdkPath + '\n' + key.target + '\n' + key.module;
+}
+
+// 0 if the SDK can't be read.
+static std::int64_t SDKModificationTime(const std::string &sdkPath) {
+  struct stat info;
+  if (sdkPath.empty() || stat(sdkPath.c_str(), &info) != 0) {
+    return 0;
+  }
+  return info.st_mtime;
+}
+
+// Whether a module is in `directory`, as a Swift module or a framework.
+static bool ModuleInDirectory(const std::string &directory,
+                              const std::string &module) {
+  struct stat info;
+  for (auto suffix : {".swiftmodule", ".swiftinterface", ".framework"}) {
+    if (stat((directory + "/" + module + suffix).c_str(), &info) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The -I and -F search paths of the args, separate or joined.
+static std::vector<std::string>
+SearchPaths(const std::vector<std::string> &args) {
+  std::vector<std::string> paths;
+  for (std::size_t i = 0; i < args.size(); i++) {
+    auto &arg = args[i];
+    if (arg == "-I" || arg == "-F" || arg == "-Fsystem") {
+      if (i + 1 < args.size()) {
+        paths.push_back(args[++i]);
+      }
+    } else if (arg.length() > 2 && (arg.compare(0, 2, "-I") == 0 ||
+                                    arg.compare(0, 2, "-F") == 0)) {
+      paths.push_back(arg.substr(2));
+    }
+  }
+  return paths;
+}
+
+bool ssvim::IsSDKModule(const ModuleCacheKey &key,
+                        const std::vector<std::string> &compilerArgs) {
+  if (key.sdkPath.empty()) {
+    return false;
+  }
+  for (auto &path : SearchPaths(compilerArgs)) {
+    if (ModuleInDirectory(path, key.module)) {
+      return false;
+    }
+  }
+  return ModuleInDirectory(key.sdkPath + "/System/Library/Frameworks",
+                           key.module) ||
+         ModuleInDirectory(key.sdkPath + "/usr/lib/swift", key.module);
+}
+
+static metrics::Counter &CacheRequests(const char *result) {
+  return metrics::Registry::shared().counter(
+      "ssvim_module_cache_requests_total",
+      std::string("result=\"") + result + "\"",
+      "Module completion cache lookups");
+}
+
+struct ModuleCache::Mapping {
+  void *address = MAP_FAILED;
+  std::size_t length = 0;
+
+  ~Mapping() {
+    if (address != MAP_FAILED) {
+      munmap(address, length);
+    }
+  }
+
+  const EntryHeader &header() const {
+    return *static_cast<const EntryHeader *>(address);
+  }
+
+  const char *key() const {
+    return static_cast<const char *>(address) + sizeof(EntryHeader);
+  }
+
+  const char *JSON() const {
+    return key() + header().keyLength;
+  }
+
+  static std::shared_ptr<Mapping> open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    auto mapping = std::make_shared<Mapping>();
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(EntryHeader)) {
+      mapping->length = info.st_size;
+      mapping->address =
+          mmap(nullptr, mapping->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping->address == MAP_FAILED) {
+      return nullptr;
+    }
+    auto &header = mapping->header();
+    if (memcmp(header.magic, EntryMagic, sizeof(EntryMagic)) != 0 ||
+        sizeof(EntryHeader) + header.keyLength + header.JSONLength !=
+            mapping->length) {
+      return nullptr;
+    }
+    return mapping;
+  }
+};
+
+ModuleCache::ModuleCache(const std::string &directory)
+    : _directory(directory) {
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(directory, ec);
+  MemoryBudget::shared().registerPool("module_cache",
+                                      [](const std::string &path) {
+                                        if (auto cache = SharedModuleCache()) {
+                                          cache->evict(path);
+                                        }
+                                      });
+}
+
+ModuleCache::~ModuleCache() {
+}
+
+std::string ModuleCache::pathForKey(const std::string &key) {
+  std::ostringstream os;
+  os << _directory << "/" << std::hex << std::hash<std::string>()(key)
+     << ".ssvimcache";
+  return os.str();
+}
+
+bool ModuleCache::lookup(const ModuleCacheKey &cacheKey, std::string *JSON) {
+  auto key = KeyString(cacheKey);
+  auto path = pathForKey(key);
+  auto modificationTime = SDKModificationTime(cacheKey.sdkPath);
+
+  std::shared_ptr<Mapping> mapping;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto entry = _mappings.find(path);
+    if (entry != _mappings.end()) {
+      mapping = entry->second;
+    } else if ((mapping = Mapping::open(path))) {
+      _mappings[path] = mapping;
+    }
+    if (mapping &&
+        mapping->header().sdkModificationTime != modificationTime) {
+      // The SDK changed
+      _mappings.erase(path);
+      unlink(path.c_str());
+      mapping = nullptr;
+    }
+  }
+  if (mapping) {
+    MemoryBudget::shared().touch("module_cache", path, mapping->length);
+  } else {
+    MemoryBudget::shared().forget("module_cache", path);
+  }
+
+  if (!mapping || key.compare(0, key.length(), mapping->key(),
+                              mapping->header().keyLength) != 0) {
+    static auto &misses = CacheRequests("miss");
+    misses.increment();
+    return false;
+  }
+  static auto &hits = CacheRequests("hit");
+  hits.increment();
+  JSON->assign(mapping->JSON(), mapping->header().JSONLength);
+  return true;
+}
+
+void ModuleCache::store(const ModuleCacheKey &cacheKey,
+                        const std::string &JSON) {
+  auto key = KeyString(cacheKey);
+  auto path = pathForKey(key);
+  EntryHeader header;
+  memcpy(header.magic, EntryMagic, sizeof(EntryMagic));
+  header.sdkModificationTime = SDKModificationTime(cacheKey.sdkPath);
+  header.keyLength = key.length();
+  header.JSONLength = JSON.length();
+
+  // Write to a temporary file and rename it into place, so readers in other
+  // servers never see a partial entry.
+  auto temporaryPath = path + "." + std::to_string(getpid()) + ".tmp";
+  auto file = fopen(temporaryPath.c_str(), "wb");
+  if (!file) {
+    return;
+  }
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(key.data(), 1, key.length(), file) == key.length() &&
+                 fwrite(JSON.data(), 1, JSON.length(), file) == JSON.length();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0) {
+    unlink(temporaryPath.c_str());
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _mappings.erase(path);
+  }
+  MemoryBudget::shared().forget("module_cache", path);
+}
+
+void ModuleCache::evict(const std::string &path) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _mappings.erase(path);
+}
+
+static std::mutex SharedModuleCacheMutex;
+static std::shared_ptr<ModuleCache> SharedCache;
+
+std::shared_ptr<ModuleCache> ssvim::SharedModuleCache() {
+  std::lock_guard<std::mutex> lock(SharedModuleCacheMutex);
+  return SharedCache;
+}
+
+void ssvim::SetSharedModuleCache(std::shared_ptr<ModuleCache> cache) {
+  std::lock_guard<std::mutex> lock(SharedModuleCacheMutex);
+  SharedCache = cache;
+}
@@ -0,0 +1,58 @@
+#import <map>
+#import <memory>
+#import <mutex>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+// Completions on an SDK module are the same for every file using the same
+// SDK and target.
+struct ModuleCacheKey {
+  std::string sdkPath;
+  std::string target;
+  std::string module;
+};
+
+/**
+ * ModuleCache persists completion results on modules, e.g. `UIKit.`, so
+ * they survive server restarts.
+ *
+ * Each entry is a file holding a small header and the response JSON, which
+ * is memory mapped and served without asking the backend. Entries are
+ * invalidated when the modification time of the SDK changes, so only SDK
+ * modules are cached; see IsSDKModule.
+ */
+class ModuleCache {
+public:
+  ModuleCache(const std::string &directory);
+  ~ModuleCache();
+
+  bool lookup(const ModuleCacheKey &key, std::string *JSON);
+  void store(const ModuleCacheKey &key, const std::string &JSON);
+
+  // Unmap the entry at `path`, to save memory. It is mapped again on its
+  // next lookup.
+  void evict(const std::string &path);
+
+private:
+  struct Mapping;
+
+  std::string pathForKey(const std::string &key);
+
+  std::string _directory;
+  std::mutex _mutex;
+  std::map<std::string, std::shared_ptr<Mapping>> _mappings;
+};
+
+// Whether the key's module is found in its SDK, and not in the search paths
+// of `compilerArgs`, which come first. Only SDK modules may be cached, as
+// entries are only invalidated with the SDK.
+bool IsSDKModule(const ModuleCacheKey &key,
+                 const std::vector<std::string> &compilerArgs);
+
+// The cache used by SwiftCompleter, or null if disabled.
+std::shared_ptr<ModuleCache> SharedModuleCache();
+void SetSharedModuleCache(std::shared_ptr<ModuleCache> cache);
+
+} // namespace ssvim
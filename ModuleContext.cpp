@@ -0,0 +1,218 @@
+#import <algorithm>
+
+#import "Clients.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+#import "ModuleContext.hpp"
+
+using namespace ssvim;
+
+static bool IsSwiftFile(const std::string &arg) {
+  static const std::string suffix = ".swift";
+  return arg.length() > suffix.length() && arg[0] != '-' &&
+         arg.compare(arg.length() - suffix.length(), suffix.length(),
+                     suffix) == 0;
+}
+
+std::vector<std::string>
+ssvim::ModuleFiles(const std::string &file,
+                   const std::vector<std::string> &compilerArgs) {
+  std::vector<std::string> files = {file};
+  for (auto &arg : compilerArgs) {
+    if (IsSwiftFile(arg) && arg != file) {
+      files.push_back(arg);
+    }
+  }
+  return files;
+}
+
+static metrics::Gauge &BuffersGauge() {
+  static auto &buffers = metrics::Registry::shared().gauge(
+      "ssvim_module_buffers", "", "Editor buffers tracked for modules");
+  return buffers;
+}
+
+// Buffers are accounted per client in the memory budget
+static const char DocumentKeySeparator = '\n';
+
+ModuleContext::ModuleContext(const std::string &client) : _client(client) {
+}
+
+ModuleContext::~ModuleContext() {
+  BuffersGauge().sub(_buffers.size());
+  for (auto &buffer : _buffers) {
+    MemoryBudget::shared().forget("documents", budgetKey(buffer.first));
+  }
+}
+
+std::string ModuleContext::budgetKey(const std::string &file) {
+  return _client.empty() ? file : _client + DocumentKeySeparator + file;
+}
+
+void ModuleContext::update(const std::string &file,
+                           std::shared_ptr<const std::string> contents,
+                           bool sent) {
+  auto size = contents->size();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto inserted = _buffers.emplace(file, Buffer());
+    if (inserted.second) {
+      BuffersGauge().add();
+    }
+    auto &buffer = inserted.first->second;
+    if (buffer.version == 0 || *buffer.contents != *contents) {
+      if (buffer.version) {
+        buffer.editVersion = _nextVersion;
+      }
+      buffer.contents = std::move(contents);
+      buffer.version = _nextVersion++;
+    }
+    if (sent) {
+      buffer.sentVersion = buffer.version;
+    }
+  }
+  MemoryBudget::shared().touch("documents", budgetKey(file), size);
+}
+
+std::vector<UnsavedFile>
+ModuleContext::takeChanged(const std::string &file,
+                           const std::vector<std::string> &moduleFiles) {
+  std::vector<UnsavedFile> changed;
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto &moduleFile : moduleFiles) {
+    if (moduleFile == file) {
+      continue;
+    }
+    auto buffer = _buffers.find(moduleFile);
+    if (buffer == _buffers.end() ||
+        buffer->second.sentVersion == buffer->second.version) {
+      continue;
+    }
+    buffer->second.sentVersion = buffer->second.version;
+    UnsavedFile unsaved;
+    unsaved.fileName = moduleFile;
+    unsaved.sharedContents = buffer->second.contents;
+    changed.push_back(std::move(unsaved));
+  }
+  return changed;
+}
+
+bool ModuleContext::contents(const std::string &file, std::string *contents) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto buffer = _buffers.find(file);
+  if (buffer == _buffers.end()) {
+    return false;
+  }
+  *contents = *buffer->second.contents;
+  return true;
+}
+
+bool ModuleContext::contains(const std::string &file) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _buffers.count(file);
+}
+
+std::uint64_t ModuleContext::lastEdit(const std::string &file) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto buffer = _buffers.find(file);
+  return buffer == _buffers.end() ? 0 : buffer->second.editVersion;
+}
+
+std::size_t ModuleContext::size() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _buffers.size();
+}
+
+void ModuleContext::evict(const std::string &file) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_buffers.erase(file)) {
+    BuffersGauge().sub();
+  }
+}
+
+std::vector<ModuleContext::SavedBuffer> ModuleContext::save() {
+  std::vector<std::pair<std::uint64_t, SavedBuffer>> byEdit;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &buffer : _buffers) {
+      byEdit.push_back({buffer.second.editVersion,
+                        {buffer.first, *buffer.second.contents,
+                         buffer.second.editVersion != 0}});
+    }
+  }
+  std::sort(byEdit.begin(), byEdit.end(),
+            [](const std::pair<std::uint64_t, SavedBuffer> &a,
+               const std::pair<std::uint64_t, SavedBuffer> &b) {
+              return a.first > b.first;
+            });
+  std::vector<SavedBuffer> buffers;
+  for (auto &buffer : byEdit) {
+    buffers.push_back(std::move(buffer.second));
+  }
+  return buffers;
+}
+
+void ModuleContext::restore(const std::vector<SavedBuffer> &buffers) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // Restored in reverse, so the most recently edited stays the most recent
+    for (auto saved = buffers.rbegin(); saved != buffers.rend(); ++saved) {
+      auto inserted = _buffers.emplace(saved->file, Buffer());
+      if (!inserted.second) {
+        continue;
+      }
+      BuffersGauge().add();
+      auto &buffer = inserted.first->second;
+      buffer.contents = std::make_shared<const std::string>(saved->contents);
+      buffer.version = _nextVersion++;
+      if (saved->edited) {
+        buffer.editVersion = buffer.version;
+      }
+    }
+  }
+  for (auto saved = buffers.rbegin(); saved != buffers.rend(); ++saved) {
+    MemoryBudget::shared().touch("documents", budgetKey(saved->file),
+                                 saved->contents.size());
+  }
+}
+
+static ModuleContext &DefaultModuleContext() {
+  static ModuleContext context;
+  return context;
+}
+
+ModuleContext &ssvim::SharedModuleContext() {
+  if (auto context = CurrentClientContext()) {
+    return *context;
+  }
+  return DefaultModuleContext();
+}
+
+bool ssvim::EvictModuleBuffer(const std::string &key, std::string *file) {
+  auto separator = key.find(DocumentKeySeparator);
+  if (separator == std::string::npos) {
+    *file = key;
+    DefaultModuleContext().evict(key);
+    return true;
+  }
+  auto context = ClientRegistry::shared().context(key.substr(0, separator));
+  if (!context) {
+    return false;
+  }
+  *file = key.substr(separator + 1);
+  context->evict(*file);
+  return true;
+}
+
+bool ssvim::ModuleBufferIsHeld(const std::string &file) {
+  if (DefaultModuleContext().contains(file)) {
+    return true;
+  }
+  for (auto &client : ClientRegistry::shared().names()) {
+    auto context = ClientRegistry::shared().context(client);
+    if (context && context->contains(file)) {
+      return true;
+    }
+  }
+  return false;
+}
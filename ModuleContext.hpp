@@ -0,0 +1,104 @@
+#import <cstdint>
+#import <memory>
+#import <mutex>
+#import <string>
+#import <unordered_map>
+#import <vector>
+
+#import "SwiftCompleter.hpp"
+
+namespace ssvim {
+
+// The Swift files of the module `file` is compiled in: `file` and the .swift
+// inputs in its compiler args.
+std::vector<std::string>
+ModuleFiles(const std::string &file,
+            const std::vector<std::string> &compilerArgs);
+
+/**
+ * ModuleContext tracks the editor's buffers and which of them the backend
+ * has seen.
+ *
+ * Every request carries the buffer of its file. Before the backend handles
+ * a request, the buffers of the other files in the module which changed
+ * since it last saw them are sent to it, so unsaved symbols are visible
+ * across the module. An edit only invalidates the modules containing the
+ * edited file; unchanged buffers are never resent.
+ *
+ * Each client of a shared server has its own context.
+ */
+class ModuleContext {
+public:
+  explicit ModuleContext(const std::string &client = "");
+  ~ModuleContext();
+
+  // Record the editor's buffer for `file`, sharing the request's string.
+  // `sent` is set when the request sends the whole buffer to the backend
+  // anyway.
+  void update(const std::string &file,
+              std::shared_ptr<const std::string> contents, bool sent);
+
+  // The buffers of `moduleFiles`, other than `file`, that the backend
+  // hasn't seen. They are considered seen once returned.
+  std::vector<UnsavedFile>
+  takeChanged(const std::string &file,
+              const std::vector<std::string> &moduleFiles);
+
+  // The editor's buffer for `file`, if there is one.
+  bool contents(const std::string &file, std::string *contents);
+
+  bool contains(const std::string &file);
+
+  // Increases with each edit; 0 if `file` wasn't edited since it was first
+  // seen.
+  std::uint64_t lastEdit(const std::string &file);
+
+  std::size_t size();
+
+  // Forget the buffer of `file`, to save memory.
+  void evict(const std::string &file);
+
+  // A buffer in a snapshot of the context
+  struct SavedBuffer {
+    std::string file;
+    std::string contents;
+    bool edited;
+  };
+
+  // The buffers, least recently edited last.
+  std::vector<SavedBuffer> save();
+
+  // Restore buffers saved by another process, whose backend saw them and
+  // this one's didn't.
+  void restore(const std::vector<SavedBuffer> &buffers);
+
+private:
+  struct Buffer {
+    std::shared_ptr<const std::string> contents;
+    std::uint64_t version = 0;
+    std::uint64_t sentVersion = 0;
+    std::uint64_t editVersion = 0;
+  };
+
+  std::string budgetKey(const std::string &file);
+
+  std::string _client;
+  std::mutex _mutex;
+  std::unordered_map<std::string, Buffer> _buffers;
+  std::uint64_t _nextVersion = 1;
+};
+
+// The context shared by all SwiftCompleter instances, like the backend, or
+// the context of the current client.
+ModuleContext &SharedModuleContext();
+
+// Evict a buffer by its key in the memory budget, and return its file.
+// Returns false if its client is gone.
+bool EvictModuleBuffer(const std::string &key, std::string *file);
+
+// Whether the default context or an attached client has a buffer for
+// `file`. The backend's documents are shared, so one is in use as long as
+// any client has its buffer.
+bool ModuleBufferIsHeld(const std::string &file);
+
+} // namespace ssvim
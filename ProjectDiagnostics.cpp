@@ -0,0 +1,182 @@
+#import <algorithm>
+#import <atomic>
+#import <chrono>
+#import <condition_variable>
+#import <fstream>
+#import <mutex>
+#import <sstream>
+#import <sys/stat.h>
+#import <vector>
+
+#import "Clients.hpp"
+#import "CompileDatabase.hpp"
+#import "JobPool.hpp"
+#import "Metrics.hpp"
+#import "ModuleContext.hpp"
+#import "ProjectDiagnostics.hpp"
+#import "SwiftCompleter.hpp"
+
+using namespace ssvim;
+
+static std::mutex InteractiveMutex;
+static std::condition_variable InteractiveFinished;
+static int InteractiveRequests = 0;
+
+InteractiveRequestScope::InteractiveRequestScope() {
+  std::lock_guard<std::mutex> lock(InteractiveMutex);
+  InteractiveRequests++;
+}
+
+InteractiveRequestScope::~InteractiveRequestScope() {
+  std::lock_guard<std::mutex> lock(InteractiveMutex);
+  if (--InteractiveRequests == 0) {
+    InteractiveFinished.notify_all();
+  }
+}
+
+// Returns false if interactive requests are still running after `timeout`.
+static bool WaitForInteractiveRequests(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(InteractiveMutex);
+  return InteractiveFinished.wait_for(
+      lock, timeout, [] { return InteractiveRequests == 0; });
+}
+
+static bool ReadContents(const std::string &file, std::string *contents) {
+  std::ifstream stream(file, std::ios::in | std::ios::binary);
+  if (!stream) {
+    return false;
+  }
+  std::ostringstream os;
+  os << stream.rdbuf();
+  *contents = os.str();
+  return true;
+}
+
+struct SweepFile {
+  std::string name;
+  std::uint64_t lastEdit;
+  long long modificationTime;
+};
+
+// Files edited in the editor come first, then by modification time on disk.
+static std::vector<SweepFile>
+OrderByRecentEdits(const std::vector<std::string> &names) {
+  std::vector<SweepFile> files;
+  for (auto &name : names) {
+    struct stat info;
+    auto modificationTime =
+        stat(name.c_str(), &info) == 0 ? (long long)info.st_mtime : 0;
+    files.push_back(
+        {name, SharedModuleContext().lastEdit(name), modificationTime});
+  }
+  std::stable_sort(files.begin(), files.end(),
+                   [](const SweepFile &a, const SweepFile &b) {
+                     if (a.lastEdit != b.lastEdit) {
+                       return a.lastEdit > b.lastEdit;
+                     }
+                     return a.modificationTime > b.modificationTime;
+                   });
+  return files;
+}
+
+// A sweep in progress. Each of its chains checks a file per job, and
+// submits the next file as a new job.
+struct Sweep {
+  Logger logger;
+  ProjectSweepOptions options;
+  std::shared_ptr<CompileDatabase> database;
+  std::vector<SweepFile> files;
+  ProjectSweepHandler handler;
+  ProjectSweepDone done;
+
+  std::atomic<std::size_t> next{0};
+  std::atomic<unsigned> chains{0};
+  std::atomic<bool> stopped{false};
+  std::mutex handlerMutex;
+  unsigned checked = 0;
+
+  Sweep(LogLevel logLevel) : logger(logLevel, "SWEEP") {
+  }
+};
+
+static void CheckNextFile(std::shared_ptr<Sweep> sweep) {
+  static auto &checked = metrics::Registry::shared().counter(
+      "ssvim_project_sweep_files_total", "",
+      "Files checked by project diagnostics sweeps");
+  static auto &fileTime = metrics::StageHistogram("project_sweep_file");
+  // Interactive requests go first. The thread is given back meanwhile, as
+  // they may be waiting for it.
+  if (!WaitForInteractiveRequests(std::chrono::milliseconds(5))) {
+    JobPool::shared().submit([sweep] { CheckNextFile(sweep); });
+    return;
+  }
+  auto i = sweep->next++;
+  if (sweep->stopped || i >= sweep->files.size()) {
+    if (--sweep->chains == 0) {
+      sweep->done(sweep->checked);
+    }
+    return;
+  }
+
+  ClientScope scope(sweep->options.client);
+  auto &file = sweep->files[i].name;
+  std::vector<UnsavedFile> unsavedFiles(1);
+  auto &unsaved = unsavedFiles[0];
+  unsaved.fileName = file;
+  if (SharedModuleContext().contents(file, &unsaved.contents) ||
+      ReadContents(file, &unsaved.contents)) {
+    metrics::ScopedTimer timer(fileTime);
+    std::vector<std::string> flags;
+    sweep->database->flagsForFile(file, &flags);
+    SwiftCompleter completer(sweep->logger.level());
+    auto diagnostics = completer.BackgroundDiagnostics(
+        file, std::move(unsavedFiles), flags);
+    checked.increment();
+    std::lock_guard<std::mutex> lock(sweep->handlerMutex);
+    if (!sweep->stopped) {
+      sweep->checked++;
+      if (!sweep->handler(file, diagnostics)) {
+        sweep->logger << "Stopped after " << sweep->checked << " files";
+        sweep->stopped = true;
+      }
+    }
+  } else {
+    sweep->logger << "Cannot read " << file;
+  }
+  JobPool::shared().submit([sweep] { CheckNextFile(sweep); });
+}
+
+bool ssvim::SweepProjectDiagnostics(LogLevel logLevel,
+                                    const ProjectSweepOptions &options,
+                                    ProjectSweepHandler handler,
+                                    ProjectSweepDone done,
+                                    std::string *error) {
+  auto path = options.root;
+  if (path.length() < 5 || path.compare(path.length() - 5, 5, ".json") != 0) {
+    path += "/compile_commands.json";
+  }
+  auto database = CompileDatabaseAtPath(path);
+  if (!database) {
+    *error = "Cannot read compile database: " + path;
+    return false;
+  }
+
+  auto sweep = std::make_shared<Sweep>(logLevel);
+  sweep->options = options;
+  sweep->database = database;
+  sweep->handler = handler;
+  sweep->done = done;
+  {
+    ClientScope scope(options.client);
+    sweep->files = OrderByRecentEdits(database->files());
+  }
+  sweep->logger << "Checking " << sweep->files.size() << " files in " << path;
+
+  auto parallelism = std::max<std::size_t>(
+      1, std::min<std::size_t>(options.parallelism, sweep->files.size()));
+  sweep->chains = parallelism;
+  for (std::size_t chain = 0; chain < parallelism; chain++) {
+    JobPool::shared().submit([sweep] { CheckNextFile(sweep); });
+  }
+  return true;
+}
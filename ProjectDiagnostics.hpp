@@ -0,0 +1,48 @@
+#import "Logging.hpp"
+#import <functional>
+#import <string>
+
+namespace ssvim {
+
+struct ProjectSweepOptions {
+  // A compile_commands.json, or the directory containing it
+  std::string root;
+  // Files checked at once
+  unsigned parallelism = 2;
+  // The client whose editor buffers are checked
+  std::string client;
+};
+
+// Returns false to stop the sweep, e.g. when the client is gone.
+using ProjectSweepHandler = std::function<bool(const std::string &file,
+                                               const std::string &JSON)>;
+
+// Called once the sweep ended, with the number of files checked.
+using ProjectSweepDone = std::function<void(unsigned files)>;
+
+/**
+ * Check every Swift file of a compile database, as jobs on the job pool.
+ *
+ * Files are checked most recently edited first, using the editor's buffer
+ * when there is one and the file on disk otherwise. `handler` is called
+ * with the diagnostics of each file as it completes, one call at a time,
+ * from pool threads, and `done` after the last one. A file waits while
+ * interactive requests are running, giving its thread back, so a sweep
+ * doesn't delay editing.
+ *
+ * Returns false with `error` set if the database can't be read, before
+ * anything is checked; neither `handler` nor `done` is called then.
+ */
+bool SweepProjectDiagnostics(LogLevel logLevel,
+                             const ProjectSweepOptions &options,
+                             ProjectSweepHandler handler,
+                             ProjectSweepDone done, std::string *error);
+
+// Marks an interactive request as running for its lifetime.
+class InteractiveRequestScope {
+public:
+  InteractiveRequestScope();
+  ~InteractiveRequestScope();
+};
+
+} // namespace ssvim
@@ -0,0 +1,454 @@
+#import <algorithm>
+#import <chrono>
+#import <deque>
+#import <fstream>
+#import <map>
+#import <mutex>
+#import <sstream>
+#import <string>
+#import <thread>
+#import <vector>
+
+#import "Logging.hpp"
+#import "Metrics.hpp"
+#import "SemanticBackend.hpp"
+
+// Backend traffic logs
+//
+// A log starts with a header line, followed by records. Records are a line
+// of space separated fields and then length prefixed strings, so payloads
+// can be written without escaping:
+//
+// ssvim-backend-log 1
+// R <kind> <latency_us> <is_error> <offset> <arg_count>
+// <len>:<name>
+// <len>:<arg>             (arg_count times)
+// <len>:<source_text>
+// <len>:<response_json>
+// N <delay_us>
+// <len>:<name>
+// <len>:<notification_json>
+//
+// A notification follows the editor.open or editor.replacetext request it
+// answers. Notifications that arrive while such a request for the document
+// is in flight, like those editor.open fires, belong to it and are written
+// after its record. Their delay is the time since the request was sent.
+
+using namespace ssvim;
+
+static const char *LogHeader = "ssvim-backend-log 1";
+
+using clock_type = std::chrono::steady_clock;
+
+enum RequestKind {
+  RequestKindCompletionOpen,
+  RequestKindCompletionUpdate,
+  RequestKindCompletionClose,
+  RequestKindEditorOpen,
+  RequestKindEditorReplaceText,
+};
+
+static void WriteString(std::ostream &os, const std::string &value) {
+  os << value.length() << ':' << value << '\n';
+}
+
+static bool ReadString(std::istream &is, std::string &value) {
+  std::size_t length;
+  char separator;
+  if (!(is >> length) || !is.get(separator) || separator != ':') {
+    return false;
+  }
+  value.resize(length);
+  is.read(&value[0], length);
+  return is.get(separator) && separator == '\n';
+}
+
+// Requests are replayed by their content. Hashing is done when reading a
+// log, so it doesn't need to be stable across builds.
+static std::string RequestKey(RequestKind kind, const BackendRequest &request) {
+  std::string contents = request.sourceText;
+  for (auto &arg : request.compilerArgs) {
+    contents += '\0';
+    contents += arg;
+  }
+  return std::to_string(kind) + ":" + request.name + ":" +
+         std::to_string(request.offset) + ":" +
+         std::to_string(std::hash<std::string>()(contents));
+}
+
+static std::string DocumentKey(RequestKind kind, const std::string &name) {
+  return std::to_string(kind) + ":" + name;
+}
+
+namespace ssvim {
+
+#pragma mark - RecordingBackend
+
+class RecordingBackend : public SemanticBackend {
+  // An editor request being sent, and the notifications that arrived
+  // meanwhile
+  struct EditorRequest {
+    clock_type::time_point start;
+    std::string notifications;
+  };
+
+  Logger _logger;
+  std::shared_ptr<SemanticBackend> _backend;
+  std::mutex _fileMutex;
+  std::ofstream _file;
+  // Guarded by _fileMutex: the editor requests in flight per document, and
+  // the time of the last one sent
+  std::map<std::string, std::vector<EditorRequest *>> _inFlight;
+  std::map<std::string, clock_type::time_point> _editTimes;
+
+  template <typename Send>
+  BackendResponse record(RequestKind kind, const BackendRequest &request,
+                         Send send) {
+    auto isEdit = kind == RequestKindEditorOpen ||
+                  kind == RequestKindEditorReplaceText;
+    EditorRequest edit;
+    edit.start = clock_type::now();
+    if (isEdit) {
+      std::lock_guard<std::mutex> lock(_fileMutex);
+      _inFlight[request.name].push_back(&edit);
+      _editTimes[request.name] = edit.start;
+    }
+    auto response = send();
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+        clock_type::now() - edit.start);
+
+    std::lock_guard<std::mutex> lock(_fileMutex);
+    if (isEdit) {
+      auto &requests = _inFlight[request.name];
+      requests.erase(std::find(requests.begin(), requests.end(), &edit));
+      if (requests.empty()) {
+        _inFlight.erase(request.name);
+      }
+    }
+    _file << "R " << kind << ' ' << latency.count() << ' '
+          << response.isError << ' ' << request.offset << ' '
+          << request.compilerArgs.size() << '\n';
+    WriteString(_file, request.name);
+    for (auto &arg : request.compilerArgs) {
+      WriteString(_file, arg);
+    }
+    WriteString(_file, request.sourceText);
+    WriteString(_file, response.JSON);
+    _file << edit.notifications;
+    _file.flush();
+    return response;
+  }
+
+  void recordNotification(const std::string &name, const std::string &JSON) {
+    std::lock_guard<std::mutex> lock(_fileMutex);
+    // The latest request in flight for the document gets the notification
+    auto requests = _inFlight.find(name);
+    auto request =
+        requests != _inFlight.end() ? requests->second.back() : nullptr;
+    std::chrono::microseconds delay(0);
+    auto sent = _editTimes.find(name);
+    if (request) {
+      delay = std::chrono::duration_cast<std::chrono::microseconds>(
+          clock_type::now() - request->start);
+    } else if (sent != _editTimes.end()) {
+      delay = std::chrono::duration_cast<std::chrono::microseconds>(
+          clock_type::now() - sent->second);
+    }
+    std::ostringstream record;
+    record << "N " << delay.count() << '\n';
+    WriteString(record, name);
+    WriteString(record, JSON);
+    if (request) {
+      request->notifications += record.str();
+      return;
+    }
+    _file << record.str();
+    _file.flush();
+  }
+
+public:
+  RecordingBackend(LogLevel logLevel, std::shared_ptr<SemanticBackend> backend,
+                   const std::string &path)
+      : _logger(logLevel, "RECORD"), _backend(backend),
+        _file(path, std::ios::out | std::ios::binary | std::ios::trunc) {
+    _file << LogHeader << '\n';
+    _logger << "Recording backend traffic to " << path;
+  }
+
+  bool good() const {
+    return _file.good();
+  }
+
+  void Initialize() override {
+    _backend->Initialize();
+  }
+
+  BackendResponse CompletionOpen(const BackendRequest &request) override {
+    return record(RequestKindCompletionOpen, request,
+                  [&] { return _backend->CompletionOpen(request); });
+  }
+
+  BackendResponse CompletionUpdate(const BackendRequest &request) override {
+    return record(RequestKindCompletionUpdate, request,
+                  [&] { return _backend->CompletionUpdate(request); });
+  }
+
+  BackendResponse CompletionClose(const BackendRequest &request) override {
+    return record(RequestKindCompletionClose, request,
+                  [&] { return _backend->CompletionClose(request); });
+  }
+
+  BackendResponse EditorOpen(const BackendRequest &request) override {
+    return record(RequestKindEditorOpen, request,
+                  [&] { return _backend->EditorOpen(request); });
+  }
+
+  BackendResponse EditorReplaceText(const BackendRequest &request) override {
+    return record(RequestKindEditorReplaceText, request,
+                  [&] { return _backend->EditorReplaceText(request); });
+  }
+
+  // Closes only free memory, so they aren't recorded
+  BackendResponse EditorClose(const BackendRequest &request) override {
+    return _backend->EditorClose(request);
+  }
+
+  void SetNotificationHandler(SemanticNotificationHandler handler) override {
+    _backend->SetNotificationHandler(
+        [this, handler](const std::string &name, const std::string &JSON) {
+          recordNotification(name, JSON);
+          if (handler) {
+            handler(name, JSON);
+          }
+        });
+  }
+
+  void SetFailureHandler(SemanticFailureHandler handler) override {
+    _backend->SetFailureHandler(handler);
+  }
+};
+
+std::shared_ptr<SemanticBackend>
+MakeRecordingBackend(LogLevel logLevel,
+                     std::shared_ptr<SemanticBackend> backend,
+                     const std::string &path) {
+  auto recorder = std::make_shared<RecordingBackend>(logLevel, backend, path);
+  if (!recorder->good()) {
+    return nullptr;
+  }
+  return recorder;
+}
+
+#pragma mark - ReplayBackend
+
+struct RecordedNotification {
+  std::chrono::microseconds delay;
+  std::string name;
+  std::string JSON;
+};
+
+struct RecordedResponse {
+  std::chrono::microseconds latency;
+  BackendResponse response;
+  // The notification that followed an editor request, if any
+  int notification = -1;
+};
+
+class ReplayBackend : public SemanticBackend {
+  Logger _logger;
+  ReplayBackendOptions _options;
+  std::vector<RecordedResponse> _responses;
+  std::vector<RecordedNotification> _notifications;
+
+  // Responses in recorded order, by request contents, and by document for
+  // requests whose contents don't match the recording.
+  std::mutex _queueMutex;
+  std::map<std::string, std::deque<std::size_t>> _byRequest;
+  std::map<std::string, std::deque<std::size_t>> _byDocument;
+
+  std::mutex _handlerMutex;
+  SemanticNotificationHandler _handler;
+
+  // Take the next response in the queue. The last one is kept, so that
+  // repeating a request gets the same response.
+  static bool next(std::map<std::string, std::deque<std::size_t>> &queues,
+                   const std::string &key, std::size_t &index) {
+    auto queue = queues.find(key);
+    if (queue == queues.end() || queue->second.empty()) {
+      return false;
+    }
+    index = queue->second.front();
+    if (queue->second.size() > 1) {
+      queue->second.pop_front();
+    }
+    return true;
+  }
+
+  BackendResponse replay(RequestKind kind, const BackendRequest &request) {
+    auto start = clock_type::now();
+    std::size_t index;
+    bool found;
+    {
+      std::lock_guard<std::mutex> lock(_queueMutex);
+      found = next(_byRequest, RequestKey(kind, request), index) ||
+              next(_byDocument, DocumentKey(kind, request.name), index);
+    }
+    if (!found) {
+      static auto &misses = metrics::Registry::shared().counter(
+          "ssvim_replay_misses_total", "",
+          "Backend requests with no recorded response");
+      misses.increment();
+      _logger << "REPLAY_MISS: " << request.name;
+      BackendResponse out;
+      out.isError = true;
+      out.JSON = "no recorded response";
+      return out;
+    }
+
+    auto &recorded = _responses[index];
+    if (_options.originalTiming) {
+      std::this_thread::sleep_for(recorded.latency);
+    }
+    if (recorded.notification >= 0) {
+      notify(_notifications[recorded.notification], start);
+    }
+    return recorded.response;
+  }
+
+  // Notify at the recorded delay since the request started, like the
+  // recording measured it.
+  void notify(const RecordedNotification &notification,
+              clock_type::time_point start) {
+    SemanticNotificationHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(_handlerMutex);
+      handler = _handler;
+    }
+    if (!handler) {
+      return;
+    }
+    auto at = _options.originalTiming ? start + notification.delay : start;
+    std::thread([handler, at, notification] {
+      std::this_thread::sleep_until(at);
+      handler(notification.name, notification.JSON);
+    }).detach();
+  }
+
+public:
+  ReplayBackend(LogLevel logLevel, ReplayBackendOptions options)
+      : _logger(logLevel, "REPLAY"), _options(options) {
+  }
+
+  // Read a log written by the recording backend.
+  bool load(const std::string &path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    std::string header;
+    if (!std::getline(file, header) || header != LogHeader) {
+      _logger << "Not a backend log: " << path;
+      return false;
+    }
+
+    // The last editor request per document, for pairing notifications
+    std::map<std::string, std::size_t> lastEdit;
+    char type;
+    while (file >> type) {
+      if (type == 'R') {
+        int kind, isError;
+        long long latency;
+        unsigned offset;
+        std::size_t argCount;
+        if (!(file >> kind >> latency >> isError >> offset >> argCount)) {
+          break;
+        }
+        file.ignore(1);
+        BackendRequest request;
+        request.offset = offset;
+        request.compilerArgs.resize(argCount);
+        RecordedResponse recorded;
+        recorded.latency = std::chrono::microseconds(latency);
+        recorded.response.isError = isError;
+        bool ok = ReadString(file, request.name);
+        for (auto &arg : request.compilerArgs) {
+          ok = ok && ReadString(file, arg);
+        }
+        ok = ok && ReadString(file, request.sourceText) &&
+             ReadString(file, recorded.response.JSON);
+        if (!ok) {
+          break;
+        }
+        auto index = _responses.size();
+        _responses.push_back(std::move(recorded));
+        _byRequest[RequestKey((RequestKind)kind, request)].push_back(index);
+        _byDocument[DocumentKey((RequestKind)kind, request.name)].push_back(
+            index);
+        if (kind == RequestKindEditorOpen ||
+            kind == RequestKindEditorReplaceText) {
+          lastEdit[request.name] = index;
+        }
+      } else if (type == 'N') {
+        long long delay;
+        if (!(file >> delay)) {
+          break;
+        }
+        file.ignore(1);
+        RecordedNotification notification;
+        notification.delay = std::chrono::microseconds(delay);
+        if (!ReadString(file, notification.name) ||
+            !ReadString(file, notification.JSON)) {
+          break;
+        }
+        auto edit = lastEdit.find(notification.name);
+        if (edit != lastEdit.end()) {
+          _responses[edit->second].notification = _notifications.size();
+          lastEdit.erase(edit);
+        }
+        _notifications.push_back(std::move(notification));
+      } else {
+        break;
+      }
+    }
+    if (!file.eof()) {
+      _logger << "Truncated backend log: " << path;
+    }
+    _logger << "Replaying " << _responses.size() << " responses and "
+            << _notifications.size() << " notifications from " << path;
+    return true;
+  }
+
+  BackendResponse CompletionOpen(const BackendRequest &request) override {
+    return replay(RequestKindCompletionOpen, request);
+  }
+
+  BackendResponse CompletionUpdate(const BackendRequest &request) override {
+    return replay(RequestKindCompletionUpdate, request);
+  }
+
+  BackendResponse CompletionClose(const BackendRequest &request) override {
+    return replay(RequestKindCompletionClose, request);
+  }
+
+  BackendResponse EditorOpen(const BackendRequest &request) override {
+    return replay(RequestKindEditorOpen, request);
+  }
+
+  BackendResponse EditorReplaceText(const BackendRequest &request) override {
+    return replay(RequestKindEditorReplaceText, request);
+  }
+
+  void SetNotificationHandler(SemanticNotificationHandler handler) override {
+    std::lock_guard<std::mutex> lock(_handlerMutex);
+    _handler = handler;
+  }
+};
+
+std::shared_ptr<SemanticBackend> MakeReplayBackend(LogLevel logLevel,
+                                                   const std::string &path,
+                                                   ReplayBackendOptions options) {
+  auto replay = std::make_shared<ReplayBackend>(logLevel, options);
+  if (!replay->load(path)) {
+    return nullptr;
+  }
+  return replay;
+}
+
+} // namespace ssvim
@@ -0,0 +1,147 @@
+#import "Logging.hpp"
+#import <chrono>
+#import <functional>
+#import <memory>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+/**
+ * A request to a semantic backend.
+ *
+ * `sourceText` is the text sent for the document; for completions this is
+ * the clean file produced by GetOffset.
+ */
+struct BackendRequest {
+  std::string name;
+  std::string sourceText;
+  unsigned offset = 0;
+  std::vector<std::string> compilerArgs;
+};
+
+struct BackendResponse {
+  bool isError = false;
+  // JSON in the format of sourcekitd's responses
+  std::string JSON;
+};
+
+// Called once the backend has finished a semantic pass over a document,
+// with the name of the document and its semantic info.
+using SemanticNotificationHandler =
+    std::function<void(const std::string &name, const std::string &JSON)>;
+
+// Called when the backend lost the semantic pass of a document, e.g. its
+// worker exited, so no notification for it is coming.
+using SemanticFailureHandler =
+    std::function<void(const std::string &name, const std::string &error)>;
+
+/**
+ * SemanticBackend is the engine behind SwiftCompleter.
+ *
+ * Requests mirror sourcekitd's code completion and editor requests.
+ * Implementations must be safe to call from multiple threads.
+ */
+class SemanticBackend {
+public:
+  virtual ~SemanticBackend() {
+  }
+
+  // Prepare the backend for requests. This may be slow, so it is called
+  // during warm-up; backends must also initialize on the first request if
+  // warm-up didn't run.
+  virtual void Initialize() {
+  }
+
+  virtual BackendResponse CompletionOpen(const BackendRequest &request) = 0;
+  virtual BackendResponse CompletionUpdate(const BackendRequest &request) = 0;
+  virtual BackendResponse CompletionClose(const BackendRequest &request) = 0;
+  virtual BackendResponse EditorOpen(const BackendRequest &request) = 0;
+  virtual BackendResponse EditorReplaceText(const BackendRequest &request) = 0;
+
+  // Close a document to free its memory. Only `name` is set.
+  virtual BackendResponse EditorClose(const BackendRequest &request) {
+    return BackendResponse();
+  }
+
+  // There is a single handler per backend. It may be called on any thread.
+  virtual void SetNotificationHandler(SemanticNotificationHandler handler) = 0;
+
+  // Only backends that can lose a semantic pass call the handler.
+  virtual void SetFailureHandler(SemanticFailureHandler handler) {
+  }
+};
+
+// The backend used by all SwiftCompleter instances.
+//
+// If none was set, this is sourcekitd when the build has it, and the
+// stand-in otherwise.
+std::shared_ptr<SemanticBackend> SharedSemanticBackend();
+void SetSharedSemanticBackend(std::shared_ptr<SemanticBackend> backend);
+
+#if SSVIM_WITH_SOURCEKITD
+// The backend based on the sourcekitd C API. There is a single sourcekitd
+// session per process.
+std::shared_ptr<SemanticBackend> MakeSourceKitBackend(LogLevel logLevel);
+#endif
+
+struct StandInBackendOptions {
+  // Time each request takes
+  unsigned latencyMillis = 0;
+  // Number of results for each completion request
+  unsigned candidateCount = 100;
+  // Time from editor.replacetext until the semantic notification; 0 sends
+  // it before the response
+  unsigned notificationDelayMillis = 10;
+};
+
+// A deterministic, in-process backend with canned completion and
+// diagnostics payloads. It has no dependencies, which makes it possible to
+// run and benchmark the server without a Swift toolchain.
+std::shared_ptr<SemanticBackend>
+MakeStandInBackend(LogLevel logLevel, StandInBackendOptions options);
+
+// Wraps `backend`, writing each request, its response and latency, and each
+// notification to a log file at `path`. Returns null if the file can't be
+// written.
+std::shared_ptr<SemanticBackend>
+MakeRecordingBackend(LogLevel logLevel,
+                     std::shared_ptr<SemanticBackend> backend,
+                     const std::string &path);
+
+struct ReplayBackendOptions {
+  // Wait for the recorded latency of each response and notification
+  bool originalTiming = false;
+};
+
+// A backend serving the responses of a log written by the recording backend.
+// Requests are matched by their contents, and then by document in recorded
+// order. Returns null if the log can't be read.
+std::shared_ptr<SemanticBackend> MakeReplayBackend(LogLevel logLevel,
+                                                   const std::string &path,
+                                                   ReplayBackendOptions options);
+
+struct WorkerPoolOptions {
+  // Number of worker processes
+  unsigned workers = 2;
+  // Runs a worker, serving ServeSemanticWorker on stdin and stdout
+  std::vector<std::string> command;
+  // A worker that doesn't answer a request in time is killed and restarted;
+  // 0 waits forever
+  std::chrono::milliseconds requestTimeout{30000};
+};
+
+// A backend which runs requests in worker processes, each with its own
+// backend, e.g. its own sourcekitd.
+//
+// Requests are routed by their flags, so a configuration keeps using the
+// caches of one worker. A worker that crashes or hangs fails its requests in
+// flight and is restarted with the documents it had open.
+std::shared_ptr<SemanticBackend>
+MakeWorkerPoolBackend(LogLevel logLevel, WorkerPoolOptions options);
+
+// Serve requests of a worker pool supervisor with `backend`, on stdin and
+// stdout. Returns at the end of input.
+void ServeSemanticWorker(std::shared_ptr<SemanticBackend> backend);
+
+} // namespace ssvim
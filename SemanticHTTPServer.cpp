@@ -6,18 +6,31 @@
 #include "boost/asio/placeholders.hpp"
 #include "boost/beast/http/status.hpp"
 #include "boost/asio/streambuf.hpp"
+#import "Admission.hpp"
+#import "Clients.hpp"
+#import "CompileDatabase.hpp"
+#import "CompletionDelta.hpp"
+#import "CompletionPrefetch.hpp"
+#import "ContentReference.hpp"
+#import "JobPool.hpp"
 #import "Logging.hpp"
+#import "MessageTransport.hpp"
+#import "Metrics.hpp"
+#import "ProjectDiagnostics.hpp"
 #import "SwiftCompleter.hpp"
+#import "Trace.hpp"
+#import "Warmup.hpp"
 
 #import <boost/beast.hpp>
 #import <boost/asio.hpp>
 #import <boost/property_tree/json_parser.hpp>
 #import <boost/property_tree/ptree.hpp>
 
-#import <dispatch/dispatch.h>
-
+#import <algorithm>
+#import <atomic>
 #import <cstddef>
 #import <cstdio>
+#import <cstdlib>
 #import <functional>
 #import <iostream>
 #import <map>
@@ -33,73 +46,74 @@ using namespace ssvim;
 namespace ssvim {
 namespace http {
 
-namespace http = beast::http;       // from <boost/beast/http.hpp>
-using socket_type = net::ip::tcp::socket;
-using req_type = http::request<http::string_body>;
-using resp_type = http::response<http::string_body>;
-
 static auto HeaderValueContentTypeJSON = "application/json";
 static auto HeaderKeyContentType = http::field::content_type;
 static auto HeaderKeyServer = http::field::server;
 static auto HeaderValueServer = "SSVIM";
 
-/**
- * Session is an instance of an HTTP Session.
- *
- * The server will allocate a new instance for each accepted
- * request.
- */
-class Session;
-
-using EndpointFn = std::function<void(std::shared_ptr<Session>)>;
-
-class EndpointImpl : public std::enable_shared_from_this<EndpointImpl> {
-  EndpointFn _start;
-
-public:
-  EndpointImpl(EndpointFn start);
-  void handleRequest(std::shared_ptr<Session> session);
-};
-
 using namespace ssvim;
 
 EndpointImpl makeSlowTestEndpoint();
 EndpointImpl makeStatusEndpoint();
+EndpointImpl makeMetricsEndpoint();
+EndpointImpl makeTraceEndpoint();
 EndpointImpl makeShutdownEndpoint();
+EndpointImpl makeDetachEndpoint();
 EndpointImpl makeCompletionsEndpoint();
 EndpointImpl makeDiagnosticsEndpoint();
+EndpointImpl makeProjectDiagnosticsEndpoint();
+EndpointImpl makeBatchEndpoint();
 
-resp_type notFoundResponse(req_type request);
-resp_type errorResponse(req_type request, std::string message);
+resp_type notFoundResponse(const req_type &request);
+resp_type errorResponse(const req_type &request, std::string message);
+resp_type badRequestResponse(const req_type &request, std::string message);
+
+/**
+ * HTTPSession is an instance of an HTTP Session.
+ *
+ * The server will allocate a new instance for each accepted
+ * request.
+ */
+template <class Protocol> class HTTPSession : public Session {
+  using socket_type = typename Protocol::socket;
 
-class Session : public std::enable_shared_from_this<Session> {
   net::streambuf _streambuf;
-  beast::tcp_stream _socket;
+  beast::basic_stream<Protocol> _socket;
   ServiceContext _context;
+  boost::optional<http::request_parser<http::string_body>> _parser;
   req_type _request;
-  std::map<std::string, EndpointImpl> _endpoints;
+  EndpointMap _endpoints;
   EndpointImpl *_endpoint;
   Logger _logger;
+  // Sessions over the limit answer their request with a 503
+  bool _admitted;
 
 public:
-  Session &operator=(Session &&) = delete;
-  Session &operator=(Session const &) = delete;
+  HTTPSession &operator=(HTTPSession &&) = delete;
+  HTTPSession &operator=(HTTPSession const &) = delete;
 
-  Session(socket_type &&sock, ServiceContext ctx) : _socket(std::move(sock)), _context(ctx), _logger(ctx.logLevel, "HTTP") {
+  HTTPSession(socket_type &&sock, ServiceContext ctx)
+      : _socket(std::move(sock)), _context(ctx), _logger(ctx.logLevel, "HTTP"),
+        _admitted(AdmissionControl::shared().openSession()) {
     _endpoint = NULL;
+    OpenSessions().add();
     _logger.log(LogLevelInfo, "Secret:", _context.secret);
     // Setup Endpoints.
     // TODO: Perhaps this can be done statically
-    _endpoints = std::map<std::string, EndpointImpl>();
-    auto insert_endpoint = [&](std::string named, EndpointImpl impl) {
-      _endpoints.insert(std::pair<std::string, EndpointImpl>(named, impl));
-    };
+    _endpoints = MakeEndpoints();
+  }
 
-    insert_endpoint("/status", makeStatusEndpoint());
-    insert_endpoint("/shutdown", makeShutdownEndpoint());
-    insert_endpoint("/completions", makeCompletionsEndpoint());
-    insert_endpoint("/diagnostics", makeDiagnosticsEndpoint());
-    insert_endpoint("/slow_test", makeSlowTestEndpoint());
+  ~HTTPSession() {
+    OpenSessions().sub();
+    if (_admitted) {
+      AdmissionControl::shared().closeSession();
+    }
+  }
+
+  static metrics::Gauge &OpenSessions() {
+    static auto &gauge = metrics::Registry::shared().gauge(
+        "ssvim_http_open_sessions", "", "Number of open HTTP sessions");
+    return gauge;
   }
 
 public:
@@ -107,21 +121,25 @@ public:
     net::dispatch(
         _socket.get_executor(),
         beast::bind_front_handler(
-            &Session::doRead,
-            this->shared_from_this()));
+            &HTTPSession::doRead,
+            self()));
   }
 
-  Logger logger() {
+  Logger &logger() override {
     return _logger;
   }
 
+  std::shared_ptr<HTTPSession> self() {
+    return std::static_pointer_cast<HTTPSession>(shared_from_this());
+  }
+
   std::shared_ptr<Session> detach() {
     return shared_from_this();
   }
 
   void doClose() {
       beast::error_code ec;
-      _socket.socket().shutdown(tcp::socket::shutdown_send, ec);
+      _socket.socket().shutdown(net::socket_base::shutdown_send, ec);
   }
 
   void doRead() {
@@ -129,11 +147,16 @@ public:
     // otherwise the operation behavior is undefined.
     _request = {};
 
+    // Bodies are read into a string reserved to their Content-Length, so a
+    // large file is read in place rather than regrown.
+    _parser.emplace();
+    _parser->body_limit(_context.bodyLimit);
+
     // Set the timeout.
     _socket.expires_after(std::chrono::seconds(30));
 
-    http::async_read(_socket, _streambuf, _request,
-      boost::bind(&Session::onRead, shared_from_this(), net::placeholders::error, net::placeholders::bytes_transferred)
+    http::async_read(_socket, _streambuf, *_parser,
+      boost::bind(&HTTPSession::onRead, self(), net::placeholders::error, net::placeholders::bytes_transferred)
     );
   }
 
@@ -145,10 +168,31 @@ public:
         return doClose();
     }
 
+    if (ec == http::error::body_limit) {
+      _logger << "BODY_LIMIT";
+      _request.version(_parser->get().version());
+      _request.keep_alive(false);
+      return write(payloadTooLargeResponse(_request));
+    }
+
     if (ec)
       return fail(ec, "read");
 
-    auto path = _request.target();
+    _request = _parser->release();
+
+    if (!_admitted) {
+      AdmissionControl::shared().reject("sessions");
+      _request.keep_alive(false);
+      return write(overloadedResponse(_request, "sessions"));
+    }
+
+    // Message transport: the connection is handed over to the WebSocket
+    if (websocket::is_upgrade(_request) &&
+        _request.target().substr(0, _request.target().find('?')) == "/ws") {
+      _logger << "UPGRADE";
+      return StartWebSocketSession(std::move(_socket), _context,
+                                   std::move(_request));
+    }
 
     // Typical flow of handling a response
     // - Detach and retain - necessary to keep this alive.
@@ -157,35 +201,98 @@ public:
     // - Schedule write for the response body
     auto detachedSession = detach();
 
-    auto endpointImpl = _endpoints.find(std::string(path));
+    auto endpointImpl = FindEndpoint(_endpoints, _request.target());
     if (endpointImpl != _endpoints.end()) {
       _logger << "GOTEP:";
       _endpoint = &endpointImpl->second;
-      _endpoint->handleRequest(detachedSession);
+      auto &path = endpointImpl->first;
+      if (!IsSemanticEndpoint(path)) {
+        return serve(path);
+      }
+      // Semantic work runs on the job pool, and keeps its admission until
+      // the response is written
+      std::string reason;
+      std::shared_ptr<AdmissionTicket> ticket =
+          AdmissionControl::shared().admitJob(_request.body().size(), &reason);
+      if (!ticket) {
+        AdmissionControl::shared().reject(reason);
+        return detachedSession->write(overloadedResponse(_request, reason));
+      }
+      holdTicket(ticket);
+      // Jobs may wait in the queue for longer than the read timeout
+      _socket.expires_never();
+      auto self = this->self();
+      JobPool::shared().submit([self, path] { self->serve(path); });
       return;
     }
 
-    _logger << "not found: " << path;
+    metrics::Registry::shared()
+        .counter("ssvim_http_requests_total", "endpoint=\"not_found\"",
+                 "Number of requests per endpoint")
+        .increment();
+
+    _logger << "not found: " << _request.target();
     // Schedule not found response
     detachedSession->write(notFoundResponse(_request));
   }
 
+  // Run the endpoint of the request, on the io thread or a pool thread.
+  void serve(const std::string &path) {
+    auto labels = "endpoint=\"" + path + "\"";
+    auto &registry = metrics::Registry::shared();
+    registry
+        .counter("ssvim_http_requests_total", labels,
+                 "Number of requests per endpoint")
+        .increment();
+    metrics::ScopedTimer timer(registry.histogram(
+        "ssvim_http_request_duration_seconds", labels,
+        "Time from a parsed request until its endpoint returns"));
+    trace::RequestScope traceScope(path);
+    try {
+      _endpoint->handleRequest(detach());
+    } catch (std::exception &e) {
+      // Malformed bodies fail in the endpoint's parsing
+      _logger << "Endpoint failed: " << e.what();
+      write(errorResponse(_request, e.what()));
+    }
+  }
+
 #pragma mark - State
 
-  req_type request() {
+  const req_type &request() override {
     return _request;
   }
 
 #pragma mark - Writing messages
 
   // Schedule a write
-  void write(resp_type res) {
-    std::cout << "write" << std::endl;
-    std::cout.flush();
+  void write(resp_type res) override {
+    _logger << "WRITE";
+
+    auto self = this->self();
+
+    res.keep_alive(_request.keep_alive());
+    res.prepare_payload();
+    auto close = res.need_eof();
+    // Responses are written from pool threads, where a client that went
+    // away mustn't throw
+    beast::error_code ec;
+    {
+      static auto &writeTime = metrics::StageHistogram("write");
+      metrics::ScopedTimer timer(writeTime);
+      trace::Span span("write");
+      http::write(_socket, std::move(res), ec);
+    }
+    releaseTicket();
 
-    auto self = shared_from_this();
+    if (close || ec) {
+      return doClose();
+    }
 
-    http::write(_socket, std::move(res));
+    // Wait for the next request on this connection. This is posted, rather
+    // than called, so the endpoint that is writing finishes first.
+    net::post(_socket.get_executor(),
+              beast::bind_front_handler(&HTTPSession::doRead, self));
 
     //http::async_write(
             //self->_socket,
@@ -196,6 +303,37 @@ public:
                 //res.need_eof()));
   }
 
+  void writeChunkedHeader(const char *contentType) override {
+    _logger << "WRITE_CHUNKED";
+    http::response<http::empty_body> res{http::status::ok,
+                                         _request.version()};
+    res.set(HeaderKeyServer, HeaderValueServer);
+    res.set(HeaderKeyContentType, contentType);
+    res.keep_alive(_request.keep_alive());
+    res.chunked(true);
+    http::response_serializer<http::empty_body> serializer{res};
+    beast::error_code ec;
+    http::write_header(_socket, serializer, ec);
+  }
+
+  bool writeChunk(const std::string &data) override {
+    beast::error_code ec;
+    net::write(_socket, http::make_chunk(net::buffer(data)), ec);
+    return !ec;
+  }
+
+  // End a chunked response, and wait for the next request.
+  void finishChunks() override {
+    beast::error_code ec;
+    net::write(_socket, http::make_chunk_last(), ec);
+    releaseTicket();
+    if (ec || !_request.keep_alive()) {
+      return doClose();
+    }
+    net::post(_socket.get_executor(),
+              beast::bind_front_handler(&HTTPSession::doRead, self()));
+  }
+
   void fail(beast::error_code ec, const std::string &what) {
     auto message = what + " and: " + ec.message();
     _logger << message;
@@ -203,8 +341,7 @@ public:
 
   // Schedule an error message
   void error(const std::string &message) {
-    std::cout << "error" << std::endl;
-    std::cout.flush();
+    _logger << "ERROR";
     auto res = errorResponse(_request, message);
     http::write(_socket, std::move(res));
   }
@@ -213,53 +350,160 @@ public:
 #pragma mark - Server
 
 
-void SemanticHTTPServer::run() {
+template <class Protocol> void BasicSemanticHTTPServer<Protocol>::run() {
+    metrics::Registry::shared().gaugeFunction(
+        "ssvim_log_dropped_messages", "",
+        "Log messages dropped because the log ring was full",
+        [] { return (double)LogSink::shared().droppedCount(); });
     net::dispatch(
         _acceptor.get_executor(),
         beast::bind_front_handler(
-            &SemanticHTTPServer::doAccept,
+            &BasicSemanticHTTPServer::doAccept,
             this->shared_from_this()));
 }
 
-void SemanticHTTPServer::doAccept() {
+template <class Protocol> void BasicSemanticHTTPServer<Protocol>::doAccept() {
     // The new connection gets its own strand
     _acceptor.async_accept(
         net::make_strand(ioc_),
         beast::bind_front_handler(
-            &SemanticHTTPServer::onAccept,
-            shared_from_this()));
+            &BasicSemanticHTTPServer::onAccept,
+            this->shared_from_this()));
 }
 
-void SemanticHTTPServer::onAccept(beast::error_code ec, socket_type socket) {
+template <class Protocol>
+void BasicSemanticHTTPServer<Protocol>::onAccept(beast::error_code ec,
+                                                 socket_type socket) {
   if (ec) {
-    std::cerr << ec.message() << "accept";
+    Logger(_context.logLevel, "HTTP")
+        .log(LogLevelError, "accept: " + ec.message());
     return;
   } else {
     // Start a new Session.
-    std::make_shared<Session>(std::move(socket), _context)->start();
+    std::make_shared<HTTPSession<Protocol>>(std::move(socket), _context)
+        ->start();
   }
 
-  std::cout << "accept again" << std::endl;
   doAccept();
 }
 
+template class BasicSemanticHTTPServer<tcp>;
+template class BasicSemanticHTTPServer<net::local::stream_protocol>;
+
 #pragma mark - Endpoint impl
 
+EndpointMap MakeEndpoints() {
+  EndpointMap endpoints;
+  auto insert_endpoint = [&](std::string named, EndpointImpl impl) {
+    endpoints.insert(std::pair<std::string, EndpointImpl>(named, impl));
+  };
+
+  insert_endpoint("/status", makeStatusEndpoint());
+  insert_endpoint("/metrics", makeMetricsEndpoint());
+  insert_endpoint("/debug/trace", makeTraceEndpoint());
+  insert_endpoint("/shutdown", makeShutdownEndpoint());
+  insert_endpoint("/detach", makeDetachEndpoint());
+  insert_endpoint("/completions", makeCompletionsEndpoint());
+  insert_endpoint("/diagnostics", makeDiagnosticsEndpoint());
+  insert_endpoint("/diagnostics/project", makeProjectDiagnosticsEndpoint());
+  insert_endpoint("/batch", makeBatchEndpoint());
+  insert_endpoint("/slow_test", makeSlowTestEndpoint());
+  return endpoints;
+}
+
+EndpointMap::iterator FindEndpoint(EndpointMap &endpoints,
+                                   beast::string_view target) {
+  // Endpoints are looked up without the query string
+  auto path = target.substr(0, target.find('?'));
+  return endpoints.find(std::string(path));
+}
+
+bool IsSemanticEndpoint(const std::string &path) {
+  return path == "/completions" || path == "/diagnostics" ||
+         path == "/diagnostics/project" || path == "/batch";
+}
+
+// Status reports whether startup warm-up has finished. Requests are served
+// while "cold" or "warming", but the first ones may be slow.
 EndpointImpl makeStatusEndpoint() {
+  return EndpointImpl([&](std::shared_ptr<Session> session) {
+    auto warmup = CurrentWarmupStatus();
+    std::ostringstream os;
+    os << "{\"readiness\": \"" << WarmupStateName(warmup.state) << "\""
+       << ", \"warmup_completed\": " << warmup.completed
+       << ", \"warmup_total\": " << warmup.total
+       << ", \"warmup_seconds\": " << warmup.seconds << "}";
+
+    resp_type res;
+    res.result(http::status::ok);
+    res.version(session->request().version());
+    res.set(HeaderKeyServer, HeaderValueServer);
+    res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
+    res.body() = os.str();
+    res.set(http::field::content_length, boost::lexical_cast<std::string>(res.body().size()));
+    session->write(std::move(res));
+  });
+}
+
+EndpointImpl makeMetricsEndpoint() {
   return EndpointImpl([&](std::shared_ptr<Session> session) {
+    resp_type res;
+    res.result(http::status::ok);
+    res.version(session->request().version());
+    res.set(HeaderKeyServer, HeaderValueServer);
+    res.set(HeaderKeyContentType, "text/plain; version=0.0.4");
+    res.body() = metrics::Registry::shared().prometheusText();
+    res.set(http::field::content_length, boost::lexical_cast<std::string>(res.body().size()));
+    session->write(std::move(res));
+  });
+}
+
+// Dump the spans of recent requests in the Chrome trace_event format.
+//
+// @param requests: the number of requests, defaults to 16
+EndpointImpl makeTraceEndpoint() {
+  return EndpointImpl([&](std::shared_ptr<Session> session) {
+    std::size_t requestCount = 16;
+    auto target = std::string(session->request().target());
+    auto param = target.find("requests=");
+    if (param != std::string::npos) {
+      requestCount = std::strtoul(target.c_str() + param + 9, nullptr, 10);
+    }
+
     resp_type res;
     res.result(http::status::ok);
     res.version(session->request().version());
     res.set(HeaderKeyServer, HeaderValueServer);
     res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
-    res.body() = std::string("{}");
+    res.body() = trace::ChromeTraceJSON(requestCount);
     res.set(http::field::content_length, boost::lexical_cast<std::string>(res.body().size()));
-    session->write(res);
+    session->write(std::move(res));
   });
 }
 
+// Detach the client of the request, dropping its buffers. A shared server
+// exits once the last client detached or idled out.
+static void DetachClient(std::shared_ptr<Session> session) {
+  auto client = std::string(session->request()[ClientHeader]);
+  auto detached = ClientRegistry::shared().detach(client);
+  resp_type res;
+  res.result(http::status::ok);
+  res.version(session->request().version());
+  res.set(HeaderKeyServer, HeaderValueServer);
+  res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.body() = std::string("{\"detached\": ") +
+               (detached ? "true" : "false") + "}";
+  session->write(std::move(res));
+}
+
+// Other editors use a daemon, so shutting it down only detaches the client.
 EndpointImpl makeShutdownEndpoint() {
   return EndpointImpl([&](std::shared_ptr<Session> session) {
+    if (ClientRegistry::shared().isDaemon()) {
+      session->logger() << "Detaching instead of shutting down the daemon";
+      DetachClient(session);
+      return;
+    }
     session->logger() << "Recieved Shutdown Request";
     resp_type res;
     res.result(http::status::ok);
@@ -267,61 +511,116 @@ EndpointImpl makeShutdownEndpoint() {
     res.set(HeaderKeyServer, HeaderValueServer);
     res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
     session->logger() << "Shutting down...";
-    session->write(res);
+    session->write(std::move(res));
     exit(0);
   });
 }
 
+EndpointImpl makeDetachEndpoint() {
+  return EndpointImpl(DetachClient);
+}
+
 EndpointImpl::EndpointImpl(EndpointFn start) : _start(start) {
 }
 
 void EndpointImpl::handleRequest(std::shared_ptr<Session> session) {
-  auto logger = session->logger();
+  auto &logger = session->logger();
   logger << "HANDLE_REQUEST";
   logger << session->request().target();
+  // Requests of a client use its buffers
+  ClientScope scope(std::string(session->request()[ClientHeader]));
   this->_start(session);
 }
 
-using boost::property_tree::ptree;
 using boost::property_tree::read_json;
 
-ptree readJSONPostBody(std::string body) {
+// A read-only stream over a string
+class StringViewBuffer : public std::streambuf {
+public:
+  StringViewBuffer(const std::string &string) {
+    auto begin = const_cast<char *>(string.data());
+    setg(begin, begin, begin + string.size());
+  }
+};
+
+ptree readJSONPostBody(const std::string &body) {
+  static auto &parseTime = metrics::StageHistogram("body_parse");
+  metrics::ScopedTimer timer(parseTime);
+  trace::Span span("body_parse");
   ptree pt;
-  std::istringstream is(body);
+  StringViewBuffer buffer(body);
+  std::istream is(&buffer);
   read_json(is, pt);
   return pt;
 }
 
-template <typename T>
-const std::vector<T> as_vector(ptree const &pt, ptree::key_type const &key) {
-  std::vector<T> r;
-  for (auto &item : pt.get_child(key))
-    r.push_back(item.second.get_value<T>());
-  return r;
+ptree Session::JSONBody() {
+  return readJSONPostBody(request().body());
+}
+
+// Flags of a request. When the editor doesn't send flags, they're looked up
+// in the file's compile database.
+static std::vector<std::string> FlagsForRequest(ptree &bodyJSON,
+                                                const std::string &fileName) {
+  if (bodyJSON.get_child_optional("flags")) {
+    return as_vector<std::string>(bodyJSON, "flags");
+  }
+  return CompileFlagsForFile(fileName);
+}
+
+// Contents of a request, either inline in `contents` or referenced by
+// `contents_ref`: {"path" or "shm", "mtime", "size", "crc32"}.
+static bool ContentsForRequest(ptree &bodyJSON, std::string *contents,
+                               std::string *error) {
+  auto referenceJSON = bodyJSON.get_child_optional("contents_ref");
+  if (!referenceJSON) {
+    // Take the string rather than copying it
+    contents->swap(bodyJSON.get_child("contents").data());
+    return true;
+  }
+  ContentReference reference;
+  reference.path = referenceJSON->get<std::string>("path", "");
+  reference.sharedMemoryName = referenceJSON->get<std::string>("shm", "");
+  reference.modificationTime = referenceJSON->get<long long>("mtime", -1);
+  reference.size = referenceJSON->get<long long>("size", -1);
+  reference.crc32 = referenceJSON->get<std::string>("crc32", "");
+  if (reference.sharedMemoryName.length() && reference.crc32.empty()) {
+    *error = "shared memory contents need a crc32";
+    return false;
+  }
+  return ReadContentReference(reference, contents, error);
 }
 
 // Make completions endpoint returns an endpoint that
 // handles basic completion requests
 //
-// @param flags: an array of string flags
-// @param contents: the current files
+// @param flags: an optional array of string flags
+// @param contents: the current files, or contents_ref to reference them
 // @param line: the users line
 // @param column: the users column
 // @param file_name: the name of the users file
+// @param result_id: optional, the last result set the client got, to
+// answer with the changes from it; 0 for none
 EndpointImpl makeCompletionsEndpoint() {
   return EndpointImpl([&](std::shared_ptr<Session> session) {
+    InteractiveRequestScope interactive;
     // Parse in data
-    auto logger = session->logger();
-    auto bodyString = session->request().body();
-    logger << bodyString;
-    auto bodyJSON = readJSONPostBody(bodyString);
+    auto &logger = session->logger();
+    logger << session->request().body();
+    auto bodyJSON = session->JSONBody();
 
     auto fileName = bodyJSON.get<std::string>("file_name");
     auto column = bodyJSON.get<int>("column") - 1;
     auto line = bodyJSON.get<int>("line");
-    auto contents = bodyJSON.get<std::string>("contents");
-    auto flags = as_vector<std::string>(bodyJSON, "flags");
+    std::string contents, error;
+    if (!ContentsForRequest(bodyJSON, &contents, &error)) {
+      session->write(badRequestResponse(session->request(), error));
+      return;
+    }
+    auto flags = FlagsForRequest(bodyJSON, fileName);
     auto query = bodyJSON.get<std::string>("query");
+    auto resultID = bodyJSON.get_optional<std::uint64_t>("result_id");
+    trace::RequestScope::setFile(fileName);
     logger << "file_name:" << fileName;
     logger << "column:" << column;
     logger << "line:" << line;
@@ -335,13 +634,13 @@ EndpointImpl makeCompletionsEndpoint() {
 
     auto files = std::vector<UnsavedFile>();
     auto unsaved = UnsavedFile();
-    unsaved.contents = contents;
+    unsaved.contents = std::move(contents);
     unsaved.fileName = fileName;
-    files.push_back(unsaved);
+    files.push_back(std::move(unsaved));
 
     logger << "SEND_REQ";
     auto candidates = completer.CandidatesForLocationInFile(
-        fileName, line, column, files, flags, query);
+        fileName, line, column, std::move(files), flags, query);
 
     logger << "GOT_CANDIDATES";
     session->logger().log(LogLevelExtreme, candidates);
@@ -351,27 +650,37 @@ EndpointImpl makeCompletionsEndpoint() {
     res.version(session->request().version());
     res.insert(HeaderKeyServer, HeaderValueServer);
     res.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
-    res.body() = candidates;
-    session->write(res);
+    if (resultID) {
+      res.body() = CompletionResultSets::shared().encode(candidates, *resultID);
+    } else {
+      res.body() = candidates;
+    }
+    session->write(std::move(res));
   });
 }
 
 // Make completions endpoint returns an endpoint that
 // handles basic completion requests
 //
-// @param flags: an array of string flags
-// @param contents: the current files
+// @param flags: an optional array of string flags
+// @param contents: the current files, or contents_ref to reference them
 // @param file_name: the name of the users file
+// @param line, column: optional, the cursor, to prefetch completions near
 EndpointImpl makeDiagnosticsEndpoint() {
   return EndpointImpl([&](std::shared_ptr<Session> session) {
+    InteractiveRequestScope interactive;
     // Parse in data
-    auto bodyString = session->request().body();
-    session->logger() << bodyString;
-    auto bodyJSON = readJSONPostBody(bodyString);
+    session->logger() << session->request().body();
+    auto bodyJSON = session->JSONBody();
 
     auto fileName = bodyJSON.get<std::string>("file_name");
-    auto contents = bodyJSON.get<std::string>("contents");
-    auto flags = as_vector<std::string>(bodyJSON, "flags");
+    std::string contents, error;
+    if (!ContentsForRequest(bodyJSON, &contents, &error)) {
+      session->write(badRequestResponse(session->request(), error));
+      return;
+    }
+    auto flags = FlagsForRequest(bodyJSON, fileName);
+    trace::RequestScope::setFile(fileName);
     session->logger() << "file_name:" << fileName;
     //for (auto &f : flags) {
       //session->logger().log(LogLevelInfo, "flags:", f);
@@ -380,17 +689,26 @@ EndpointImpl makeDiagnosticsEndpoint() {
     using namespace ssvim;
     SwiftCompleter completer(session->logger().level());
 
+    // The buffer is shared with the prefetcher below
+    auto buffer = std::make_shared<const std::string>(std::move(contents));
     auto files = std::vector<UnsavedFile>();
     auto unsaved = UnsavedFile();
-    unsaved.contents = contents;
+    unsaved.sharedContents = buffer;
     unsaved.fileName = fileName;
-    files.push_back(unsaved);
+    files.push_back(std::move(unsaved));
 
     session->logger() << "SEND_REQ";
-    auto diagnostics = completer.DiagnosticsForFile(fileName, files, flags);
+    auto diagnostics =
+        completer.DiagnosticsForFile(fileName, std::move(files), flags);
 
     session->logger() << "GOT_DIAGNOSTICS";
     session->logger().log(LogLevelExtreme, diagnostics);
+    auto line = bodyJSON.get<int>("line", 0);
+    if (line) {
+      CompletionPrefetcher::shared().documentUpdated(
+          session->logger().level(), fileName, *buffer, flags, line,
+          bodyJSON.get<int>("column", 1) - 1);
+    }
     // Build out response
     resp_type res;
     res.result(http::status::ok);
@@ -398,30 +716,244 @@ EndpointImpl makeDiagnosticsEndpoint() {
     res.insert(HeaderKeyServer, HeaderValueServer);
     res.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
     res.body() = diagnostics;
-    session->write(res);
+    session->write(std::move(res));
+  });
+}
+
+// Make project diagnostics endpoint returns an endpoint that checks every
+// Swift file of a compile database in the background. Results are streamed
+// as JSON lines, {"file_name", "diagnostics"}, as each file completes, and
+// end with a {"done", "files", "seconds"} line.
+//
+// @param root: a compile_commands.json or the directory containing it
+// @param parallelism: optional, the number of files checked at once
+EndpointImpl makeProjectDiagnosticsEndpoint() {
+  return EndpointImpl([](std::shared_ptr<Session> session) {
+    auto bodyJSON = session->JSONBody();
+    ProjectSweepOptions options;
+    options.root = bodyJSON.get<std::string>("root");
+    options.parallelism =
+        bodyJSON.get<unsigned>("parallelism", options.parallelism);
+    options.client = CurrentClient();
+    auto logLevel = session->logger().level();
+
+    // Files are checked as jobs on the pool. The session keeps its admission
+    // until the response is finished, which bounds concurrent sweeps.
+    static auto contentType = "application/x-ndjson";
+    struct Stream {
+      bool started = false;
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+    };
+    auto stream = std::make_shared<Stream>();
+    auto start = [session, stream] {
+      if (!stream->started) {
+        session->writeChunkedHeader(contentType);
+        stream->started = true;
+      }
+    };
+    std::string error;
+    auto ok = SweepProjectDiagnostics(
+        logLevel, options,
+        [session, start](const std::string &file, const std::string &JSON) {
+          start();
+          // Newlines in JSON are whitespace, so they're dropped to keep one
+          // line per file
+          auto diagnostics = JSON;
+          std::replace(diagnostics.begin(), diagnostics.end(), '\n', ' ');
+          // A client that went away stops the sweep
+          return session->writeChunk("{\"file_name\": " + JSONString(file) +
+                                     ", \"diagnostics\": " + diagnostics +
+                                     "}\n");
+        },
+        [session, start, stream](unsigned files) {
+          start();
+          std::chrono::duration<double> seconds =
+              std::chrono::steady_clock::now() - stream->start;
+          session->writeChunk("{\"done\": true, \"files\": " +
+                              std::to_string(files) + ", \"seconds\": " +
+                              std::to_string(seconds.count()) + "}\n");
+          session->finishChunks();
+        },
+        &error);
+    // Nothing was streamed yet
+    if (!ok) {
+      session->write(badRequestResponse(session->request(), error));
+    }
+  });
+}
+
+// A sub-request of a batch
+struct BatchItem {
+  std::string kind;
+  std::string fileName;
+  std::shared_ptr<const std::string> contents;
+  std::vector<std::string> flags;
+  int line = 0;
+  int column = 0;
+  std::string query;
+  std::string result;
+};
+
+// A batch in progress. The job finishing last responds.
+struct Batch {
+  std::shared_ptr<Session> session;
+  LogLevel logLevel;
+  std::string client;
+  std::vector<BatchItem> items;
+  std::atomic<std::size_t> remainingJobs{0};
+
+  void finishJob() {
+    if (--remainingJobs == 0) {
+      respond();
+    }
+  }
+
+  void respond() {
+    std::string body = "[";
+    for (std::size_t i = 0; i < items.size(); i++) {
+      body += i ? ",\n" : "\n";
+      body += "{\"kind\": " + JSONString(items[i].kind) +
+              ", \"file_name\": " + JSONString(items[i].fileName) +
+              ", \"result\": " + items[i].result + "}";
+    }
+    body += "\n]\n";
+
+    resp_type res;
+    res.result(http::status::ok);
+    res.version(session->request().version());
+    res.insert(HeaderKeyServer, HeaderValueServer);
+    res.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+    res.body() = body;
+    session->write(std::move(res));
+  }
+};
+
+// Run an item, reading the batch's buffer in place. A failed item gets an
+// error result rather than failing the batch.
+static void RunBatchItem(Batch &batch, BatchItem &item) {
+  InteractiveRequestScope interactive;
+  ClientScope scope(batch.client);
+  SwiftCompleter completer(batch.logLevel);
+  std::vector<UnsavedFile> files(1);
+  files[0].fileName = item.fileName;
+  files[0].sharedContents = item.contents;
+  try {
+    if (item.kind == "completions") {
+      item.result = completer.CandidatesForLocationInFile(
+          item.fileName, item.line, item.column, std::move(files),
+          item.flags, item.query);
+    } else if (item.kind == "diagnostics") {
+      item.result =
+          completer.DiagnosticsForFile(item.fileName, std::move(files),
+                                       item.flags);
+    } else {
+      item.result = "{\"error\": \"unknown kind\"}";
+    }
+  } catch (std::exception &e) {
+    item.result = "{\"error\": " + JSONString(e.what()) + "}";
+  }
+}
+
+// Make batch endpoint returns an endpoint that runs several requests on one
+// document payload, which is sent and parsed once. Results are returned as
+// an array of {"kind", "file_name", "result"} in request order.
+//
+// Items run as jobs on the pool, and the batch is answered when the last
+// one finishes. Every item sends its document's buffer to the backend, so
+// the items of a document run in order, in one job, and documents run in
+// parallel.
+//
+// @param file_name, contents or contents_ref, flags: the shared document
+// @param requests: an array of {"kind": "completions", "line", "column",
+// "query"} and {"kind": "diagnostics"}. Each may name another document with
+// its own file_name, contents and flags.
+EndpointImpl makeBatchEndpoint() {
+  return EndpointImpl([](std::shared_ptr<Session> session) {
+    InteractiveRequestScope interactive;
+    auto bodyJSON = session->JSONBody();
+    auto fileName = bodyJSON.get<std::string>("file_name");
+    auto contents = std::make_shared<std::string>();
+    std::string error;
+    if (!ContentsForRequest(bodyJSON, contents.get(), &error)) {
+      session->write(badRequestResponse(session->request(), error));
+      return;
+    }
+    auto flags = FlagsForRequest(bodyJSON, fileName);
+
+    auto batch = std::make_shared<Batch>();
+    batch->session = session;
+    batch->logLevel = session->logger().level();
+    batch->client = CurrentClient();
+    auto &items = batch->items;
+    for (auto &entry : bodyJSON.get_child("requests")) {
+      auto &itemJSON = entry.second;
+      BatchItem item;
+      item.kind = itemJSON.get<std::string>("kind");
+      item.fileName = itemJSON.get<std::string>("file_name", fileName);
+      item.contents = contents;
+      item.flags = flags;
+      if (item.fileName != fileName) {
+        auto itemContents = std::make_shared<std::string>();
+        if (!ContentsForRequest(itemJSON, itemContents.get(), &error)) {
+          session->write(badRequestResponse(session->request(), error));
+          return;
+        }
+        item.contents = itemContents;
+        item.flags = FlagsForRequest(itemJSON, item.fileName);
+      }
+      item.line = itemJSON.get<int>("line", 0);
+      item.column = itemJSON.get<int>("column", 1) - 1;
+      item.query = itemJSON.get<std::string>("query", "");
+      items.push_back(std::move(item));
+    }
+
+    // Items are chained per document
+    std::vector<std::function<void()>> jobs;
+    std::map<std::string, std::vector<std::size_t>> itemsByDocument;
+    for (std::size_t i = 0; i < items.size(); i++) {
+      itemsByDocument[items[i].fileName].push_back(i);
+    }
+    for (auto &document : itemsByDocument) {
+      auto indexes = document.second;
+      jobs.push_back([batch, indexes] {
+        for (auto i : indexes) {
+          RunBatchItem(*batch, batch->items[i]);
+        }
+        batch->finishJob();
+      });
+    }
+    if (jobs.empty()) {
+      batch->respond();
+      return;
+    }
+    batch->remainingJobs = jobs.size();
+    for (auto &job : jobs) {
+      JobPool::shared().submit(std::move(job));
+    }
   });
 }
 
 EndpointImpl makeSlowTestEndpoint() {
   return EndpointImpl([](std::shared_ptr<Session> session) {
     // Wait for 10 seconds to write hello world.
-    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC),
-                   dispatch_get_main_queue(), ^{
-                     session->logger() << "Enter main: ";
-                     session->logger() << session->request().target();
-
-                     resp_type res;
-                     res.result(http::status::ok);
-                     res.version(session->request().version());
-                     res.set(HeaderKeyServer, HeaderValueServer);
-                     res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
-                     res.body() = "Hello World";
-                     session->write(res);
-                   });
+    std::thread([session] {
+      std::this_thread::sleep_for(std::chrono::seconds(10));
+      session->logger() << "Enter main: ";
+      session->logger() << session->request().target();
+
+      resp_type res;
+      res.result(http::status::ok);
+      res.version(session->request().version());
+      res.set(HeaderKeyServer, HeaderValueServer);
+      res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
+      res.body() = "Hello World";
+      session->write(std::move(res));
+    }).detach();
   });
 }
 
-resp_type errorResponse(req_type request, std::string message) {
+resp_type errorResponse(const req_type &request, std::string message) {
   resp_type res;
   res.result(500);
   res.reason("Internal Error");
@@ -432,7 +964,44 @@ resp_type errorResponse(req_type request, std::string message) {
   return res;
 }
 
-resp_type notFoundResponse(req_type request) {
+resp_type badRequestResponse(const req_type &request, std::string message) {
+  resp_type res;
+  res.result(400);
+  res.reason("Bad Request");
+  res.version(request.version());
+  res.set(HeaderKeyServer, HeaderValueServer);
+  res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.body() = message;
+  return res;
+}
+
+resp_type payloadTooLargeResponse(const req_type &request) {
+  resp_type res;
+  res.result(413);
+  res.reason("Payload Too Large");
+  res.version(request.version());
+  res.set(HeaderKeyServer, HeaderValueServer);
+  res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.body() = "Request body exceeds the server's limit";
+  return res;
+}
+
+resp_type overloadedResponse(const req_type &request,
+                             const std::string &reason) {
+  auto retryAfter = AdmissionControl::shared().retryAfterSeconds();
+  resp_type res;
+  res.result(503);
+  res.reason("Service Unavailable");
+  res.version(request.version());
+  res.set(HeaderKeyServer, HeaderValueServer);
+  res.set(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.set(http::field::retry_after, std::to_string(retryAfter));
+  res.body() = "{\"error\": \"overloaded\", \"reason\": \"" + reason +
+               "\", \"retry_after\": " + std::to_string(retryAfter) + "}";
+  return res;
+}
+
+resp_type notFoundResponse(const req_type &request) {
   resp_type res;
   res.result(404);
   res.reason("Not Found");
@@ -1,3 +1,4 @@
+#import "JSON.hpp"
 #import "Logging.hpp"
 #include "boost/asio/strand.hpp"
 #include "boost/asio/io_context.hpp"
@@ -5,48 +6,68 @@
 #include "boost/asio/placeholders.hpp"
 #import <boost/beast.hpp>
 #import <boost/asio.hpp>
+#import <boost/property_tree/ptree.hpp>
 #import <cstddef>
+#import <cstdint>
 #import <cstdio>
+#import <functional>
 #import <iostream>
+#import <map>
 #import <memory>
 #import <mutex>
 #import <sstream>
+#import <string>
 #import <thread>
 #import <utility>
+#import <vector>
 
 namespace ssvim {
+
+class AdmissionTicket;
+
 namespace http {
 
 namespace beast = boost::beast;     // from <boost/beast.hpp>
+namespace websocket = beast::websocket;
 namespace net = boost::asio;        // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;               // from <boost/asio/ip/tcp.hpp>
 
+// The default limit of request bodies, large enough for generated sources
+static const std::uint64_t DefaultBodyLimit = 64 * 1024 * 1024;
+
 struct ServiceContext {
 public:
   const std::string secret;
   const LogLevel logLevel;
-  ServiceContext(std::string secret, LogLevel logLevel)
-      : secret(secret), logLevel(logLevel) {
+  // Requests with larger bodies are refused with a 413
+  const std::uint64_t bodyLimit;
+  ServiceContext(std::string secret, LogLevel logLevel,
+                 std::uint64_t bodyLimit = DefaultBodyLimit)
+      : secret(secret), logLevel(logLevel), bodyLimit(bodyLimit) {
   }
 };
 
 /**
  * SSVI HTTP Server is a HTTP front end for Swift Semantic
  * tasks.
+ *
+ * It serves TCP, or Unix domain sockets, which skip the loopback stack for
+ * local editors.
  */
-class SemanticHTTPServer: public std::enable_shared_from_this<SemanticHTTPServer> {
-  using endpoint_type = net::ip::tcp::endpoint;
-  using address_type = net::ip::address;
-  using socket_type = net::ip::tcp::socket;
+template <class Protocol>
+class BasicSemanticHTTPServer
+    : public std::enable_shared_from_this<BasicSemanticHTTPServer<Protocol>> {
+  using endpoint_type = typename Protocol::endpoint;
+  using socket_type = typename Protocol::socket;
 
   std::mutex _sharedMutex;
   net::io_context& ioc_;
-  net::ip::tcp::acceptor _acceptor;
+  typename Protocol::acceptor _acceptor;
   std::string _root_path;
   ServiceContext _context;
 
 public:
-  SemanticHTTPServer(
+  BasicSemanticHTTPServer(
     net::io_context& ioc,
     endpoint_type const &ep,
     std::string const &root,
@@ -63,7 +84,7 @@ public:
   }
 
 
-  ~SemanticHTTPServer() {}
+  ~BasicSemanticHTTPServer() {}
   void run();
 
 private:
@@ -71,5 +92,111 @@ private:
   void onAccept(beast::error_code ec, socket_type socket);
 };
 
+using SemanticHTTPServer = BasicSemanticHTTPServer<tcp>;
+using LocalSemanticHTTPServer =
+    BasicSemanticHTTPServer<net::local::stream_protocol>;
+
+// A stream on a Unix domain socket, like beast::tcp_stream
+using local_stream = beast::basic_stream<net::local::stream_protocol>;
+
+#pragma mark - Endpoints
+
+namespace http = beast::http;       // from <boost/beast/http.hpp>
+using req_type = http::request<http::string_body>;
+using resp_type = http::response<http::string_body>;
+using boost::property_tree::ptree;
+
+/**
+ * Session is a request being served, and the way to respond to it.
+ *
+ * Endpoints only use this interface, so they are served the same way over
+ * HTTP and over message transports.
+ */
+class Session : public std::enable_shared_from_this<Session> {
+public:
+  virtual ~Session() {
+  }
+
+  virtual const req_type &request() = 0;
+  virtual Logger &logger() = 0;
+
+  // The request's body parsed as JSON. Throws if it isn't JSON. Transports
+  // that parse their messages hand the body over without copying, so this
+  // may only be called once.
+  virtual ptree JSONBody();
+
+  // Respond with `res`. May be called from any thread.
+  virtual void write(resp_type res) = 0;
+
+  // Respond in parts, for endpoints that stream results as they complete.
+  // Chunks may be written from any thread, one at a time. A chunk returns
+  // false once the client is gone, and the response should be finished.
+  virtual void writeChunkedHeader(const char *contentType) = 0;
+  virtual bool writeChunk(const std::string &data) = 0;
+  virtual void finishChunks() = 0;
+
+  // Hold the admission of the request until its response is written, so
+  // jobs that respond asynchronously still count against the limits.
+  void holdTicket(std::shared_ptr<AdmissionTicket> ticket) {
+    std::lock_guard<std::mutex> lock(_ticketMutex);
+    _ticket = std::move(ticket);
+  }
+
+protected:
+  // Called once the whole response is written.
+  void releaseTicket() {
+    std::lock_guard<std::mutex> lock(_ticketMutex);
+    _ticket.reset();
+  }
+
+private:
+  std::mutex _ticketMutex;
+  std::shared_ptr<AdmissionTicket> _ticket;
+};
+
+using EndpointFn = std::function<void(std::shared_ptr<Session>)>;
+
+class EndpointImpl : public std::enable_shared_from_this<EndpointImpl> {
+  EndpointFn _start;
+
+public:
+  EndpointImpl(EndpointFn start);
+  void handleRequest(std::shared_ptr<Session> session);
+};
+
+using EndpointMap = std::map<std::string, EndpointImpl>;
+
+// All of the server's endpoints by path. Each session has its own.
+EndpointMap MakeEndpoints();
+
+// Find the endpoint for a request target, ignoring the query string.
+EndpointMap::iterator FindEndpoint(EndpointMap &endpoints,
+                                   beast::string_view target);
+
+// Whether an endpoint does semantic work, and so is subject to admission
+// control. Status and metrics stay available under load.
+bool IsSemanticEndpoint(const std::string &path);
+
+// 413, for a request with a body over the limit
+resp_type payloadTooLargeResponse(const req_type &request);
+
+// 503 with a Retry-After estimate, for a request turned away by admission
+// control because of `reason`.
+resp_type overloadedResponse(const req_type &request,
+                             const std::string &reason);
+
+#pragma mark - Request bodies
+
+// Parse a JSON body in place, without copying it.
+ptree readJSONPostBody(const std::string &body);
+
+template <typename T>
+const std::vector<T> as_vector(ptree const &pt, ptree::key_type const &key) {
+  std::vector<T> r;
+  for (auto &item : pt.get_child(key))
+    r.push_back(item.second.get_value<T>());
+  return r;
+}
+
 } // namespace http
 } // namespace ssvim
@@ -0,0 +1,248 @@
+#import <cstdio>
+#import <cstdlib>
+#import <cstring>
+#import <fstream>
+#import <functional>
+#import <mutex>
+#import <thread>
+#import <vector>
+
+#import "Clients.hpp"
+#import "CompletionDelta.hpp"
+#import "Metrics.hpp"
+#import "ModuleContext.hpp"
+#import "Snapshot.hpp"
+#import "SwiftCompleter.hpp"
+
+using namespace ssvim;
+
+static const char Magic[] = "SSVIMSN1";
+
+#pragma mark - Encoding
+
+static void WriteU32(std::string &out, std::uint32_t value) {
+  out.append((const char *)&value, sizeof(value));
+}
+
+static void WriteU64(std::string &out, std::uint64_t value) {
+  out.append((const char *)&value, sizeof(value));
+}
+
+static void WriteString(std::string &out, const std::string &value) {
+  WriteU32(out, value.length());
+  out += value;
+}
+
+// Reads a snapshot, failing from the first short read on.
+struct SnapshotReader {
+  const std::string &data;
+  std::size_t position = 0;
+  bool ok = true;
+
+  SnapshotReader(const std::string &data) : data(data) {
+  }
+
+  template <typename T> T read() {
+    T value = 0;
+    if (!ok || data.length() - position < sizeof(T)) {
+      ok = false;
+      return value;
+    }
+    memcpy(&value, data.data() + position, sizeof(T));
+    position += sizeof(T);
+    return value;
+  }
+
+  std::string readString() {
+    auto length = read<std::uint32_t>();
+    if (!ok || data.length() - position < length) {
+      ok = false;
+      return "";
+    }
+    position += length;
+    return data.substr(position - length, length);
+  }
+};
+
+#pragma mark - Snapshots
+
+// Clients and the default one, "", with their buffers
+using SavedBuffers = std::vector<ModuleContext::SavedBuffer>;
+using SavedClients = std::vector<std::pair<std::string, SavedBuffers>>;
+
+static SavedClients SaveClients() {
+  SavedClients clients;
+  clients.push_back({"", SharedModuleContext().save()});
+  for (auto &name : ClientRegistry::shared().names()) {
+    auto context = ClientRegistry::shared().context(name);
+    if (context) {
+      clients.push_back({name, context->save()});
+    }
+  }
+  return clients;
+}
+
+static std::string EncodeSnapshot() {
+  std::string out(Magic, sizeof(Magic) - 1);
+  auto clients = SaveClients();
+  WriteU32(out, clients.size());
+  for (auto &client : clients) {
+    WriteString(out, client.first);
+    WriteU32(out, client.second.size());
+    for (auto &buffer : client.second) {
+      WriteString(out, buffer.file);
+      WriteString(out, buffer.contents);
+      WriteU32(out, buffer.edited);
+    }
+  }
+  auto documents = OpenDocuments();
+  WriteU32(out, documents.size());
+  for (auto &document : documents) {
+    WriteString(out, document.name);
+    WriteU32(out, document.compilerArgs.size());
+    for (auto &arg : document.compilerArgs) {
+      WriteString(out, arg);
+    }
+  }
+  auto sets = CompletionResultSets::shared().save();
+  WriteU32(out, sets.size());
+  for (auto &set : sets) {
+    WriteU64(out, set.ID);
+    WriteU32(out, set.items.size());
+    for (auto &item : set.items) {
+      WriteString(out, item);
+    }
+  }
+  return out;
+}
+
+// Serializes writes from the periodic thread and exit
+static std::mutex WriteMutex;
+static std::size_t LastWrittenHash = 0;
+
+static bool WriteSnapshotFile(const std::string &path, bool onlyIfChanged) {
+  static auto &writes = metrics::Registry::shared().counter(
+      "ssvim_snapshot_writes_total", "", "Snapshots written");
+  static auto &size = metrics::Registry::shared().gauge(
+      "ssvim_snapshot_bytes", "", "Size of the last snapshot written");
+  static auto &timing = metrics::StageHistogram("snapshot_write");
+
+  std::lock_guard<std::mutex> lock(WriteMutex);
+  metrics::ScopedTimer timer(timing);
+  auto data = EncodeSnapshot();
+  auto hash = std::hash<std::string>()(data);
+  if (onlyIfChanged && hash == LastWrittenHash) {
+    return true;
+  }
+  // Written aside, so a crash never leaves half a snapshot
+  auto temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.write(data.data(), data.length())) {
+      return false;
+    }
+  }
+  if (rename(temporary.c_str(), path.c_str())) {
+    return false;
+  }
+  LastWrittenHash = hash;
+  writes.increment();
+  size.set(data.length());
+  return true;
+}
+
+bool ssvim::WriteSnapshot(const std::string &path) {
+  return WriteSnapshotFile(path, false);
+}
+
+bool ssvim::RestoreSnapshot(LogLevel logLevel, const std::string &path) {
+  Logger logger(logLevel, "SNAPSHOT");
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::string data((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  if (data.compare(0, sizeof(Magic) - 1, Magic)) {
+    logger << "Ignoring snapshot of another format: " + path;
+    return false;
+  }
+
+  // Decoded entirely before anything is restored
+  SnapshotReader reader(data);
+  reader.position = sizeof(Magic) - 1;
+  SavedClients clients;
+  auto clientCount = reader.read<std::uint32_t>();
+  for (std::uint32_t i = 0; reader.ok && i < clientCount; i++) {
+    clients.push_back({reader.readString(), {}});
+    auto count = reader.read<std::uint32_t>();
+    for (std::uint32_t j = 0; reader.ok && j < count; j++) {
+      ModuleContext::SavedBuffer buffer;
+      buffer.file = reader.readString();
+      buffer.contents = reader.readString();
+      buffer.edited = reader.read<std::uint32_t>();
+      clients.back().second.push_back(std::move(buffer));
+    }
+  }
+  std::vector<OpenDocument> documents;
+  auto documentCount = reader.read<std::uint32_t>();
+  for (std::uint32_t i = 0; reader.ok && i < documentCount; i++) {
+    OpenDocument document;
+    document.name = reader.readString();
+    auto count = reader.read<std::uint32_t>();
+    for (std::uint32_t j = 0; reader.ok && j < count; j++) {
+      document.compilerArgs.push_back(reader.readString());
+    }
+    documents.push_back(std::move(document));
+  }
+  std::vector<CompletionResultSets::SavedSet> sets;
+  auto setCount = reader.read<std::uint32_t>();
+  for (std::uint32_t i = 0; reader.ok && i < setCount; i++) {
+    CompletionResultSets::SavedSet set;
+    set.ID = reader.read<std::uint64_t>();
+    auto count = reader.read<std::uint32_t>();
+    for (std::uint32_t j = 0; reader.ok && j < count; j++) {
+      set.items.push_back(reader.readString());
+    }
+    sets.push_back(std::move(set));
+  }
+  if (!reader.ok) {
+    logger << "Ignoring truncated snapshot: " + path;
+    return false;
+  }
+
+  for (auto &client : clients) {
+    if (client.first.empty()) {
+      SharedModuleContext().restore(client.second);
+      continue;
+    }
+    // Attaches the client, which idles out if it doesn't come back
+    ClientScope scope(client.first);
+    SharedModuleContext().restore(client.second);
+  }
+  CompletionResultSets::shared().restore(sets);
+  logger << "Restored " + std::to_string(clients.size()) + " clients, " +
+                std::to_string(documents.size()) + " documents";
+  ReopenDocuments(logLevel, documents);
+  return true;
+}
+
+void ssvim::StartSnapshots(LogLevel logLevel, const std::string &path,
+                           std::chrono::seconds interval) {
+  static std::string atExitPath = path;
+  // Constructed before the handler is registered, so destroyed after it runs
+  SharedModuleContext();
+  std::atexit([] { WriteSnapshotFile(atExitPath, false); });
+  if (interval.count() == 0) {
+    return;
+  }
+  std::thread([logLevel, path, interval] {
+    Logger logger(logLevel, "SNAPSHOT");
+    while (true) {
+      std::this_thread::sleep_for(interval);
+      if (!WriteSnapshotFile(path, true)) {
+        logger << "Cannot write snapshot: " + path;
+      }
+    }
+  }).detach();
+}
@@ -0,0 +1,33 @@
+#import <chrono>
+#import <string>
+
+#import "Logging.hpp"
+
+namespace ssvim {
+
+/**
+ * Snapshots let a restarted server pick up where the last one stopped,
+ * instead of starting with nothing open.
+ *
+ * A snapshot is a compact binary file with the editor's buffers of each
+ * client, the documents open in the backend with the flags they were opened
+ * with, and the recent completion result sets. The module cache is already
+ * on disk, and prefetched completions are dropped by the next edit anyway.
+ *
+ * Integers are in host order: a snapshot is only read on the machine that
+ * wrote it. A file with another magic, e.g. of an older format, is ignored.
+ */
+
+// Write a snapshot to `path`, replacing it atomically.
+bool WriteSnapshot(const std::string &path);
+
+// Restore the snapshot at `path`, if there is one, and reopen its
+// documents in the backend in the background.
+bool RestoreSnapshot(LogLevel logLevel, const std::string &path);
+
+// Write a snapshot every `interval` when something changed, 0 for never,
+// and at exit.
+void StartSnapshots(LogLevel logLevel, const std::string &path,
+                    std::chrono::seconds interval);
+
+} // namespace ssvim
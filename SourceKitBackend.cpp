@@ -0,0 +1,335 @@
+#import <cstdlib>
+#import <dispatch/dispatch.h>
+#import <functional>
+#import <mutex>
+#import <sourcekitd/sourcekitd.h>
+#import <string>
+#import <vector>
+
+#import "Logging.hpp"
+#import "Metrics.hpp"
+#import "SemanticBackend.hpp"
+#import "Trace.hpp"
+
+#pragma mark - SourceKitD
+
+static auto KeyRequest = sourcekitd_uid_get_from_cstr("key.request");
+static auto KeyCompilerArgs = sourcekitd_uid_get_from_cstr("key.compilerargs");
+static auto KeyOffset = sourcekitd_uid_get_from_cstr("key.offset");
+static auto KeyLength = sourcekitd_uid_get_from_cstr("key.length");
+static auto KeyCodeCompleteOptions =
+    sourcekitd_uid_get_from_cstr("key.codecomplete.options");
+static auto KeyUseImportDepth =
+    sourcekitd_uid_get_from_cstr("key.codecomplete.sort.useimportdepth");
+static auto KeyFilterText =
+    sourcekitd_uid_get_from_cstr("key.codecomplete.filtertext");
+static auto KeyHideLowPriority =
+    sourcekitd_uid_get_from_cstr("key.codecomplete.hidelowpriority");
+static auto KeySourceFile = sourcekitd_uid_get_from_cstr("key.sourcefile");
+static auto KeySourceText = sourcekitd_uid_get_from_cstr("key.sourcetext");
+static auto KeyName = sourcekitd_uid_get_from_cstr("key.name");
+
+#pragma mark - SourceKitD Notifications
+
+using HandlerFunc = std::function<bool(sourcekitd_response_t)>;
+
+using namespace ssvim;
+
+static char *PrintResponse(sourcekitd_response_t resp) {
+  static auto &serializeTime =
+      ssvim::metrics::StageHistogram("response_serialization");
+  ssvim::metrics::ScopedTimer timer(serializeTime);
+  ssvim::trace::Span span("response_serialization");
+  auto dict = sourcekitd_response_get_value(resp);
+  auto JSONString = sourcekitd_variant_json_description_copy(dict);
+  return JSONString;
+}
+
+// The handler installed by SetNotificationHandler
+static std::mutex NotificationHandlerMutex;
+static SemanticNotificationHandler NotificationHandler;
+
+// There is a single notification receiver per sourcekitd session
+// and currently, there is a single session per server
+// @see MakeSourceKitBackend()
+static void NotificationReceiver(ssvim::Logger logger,
+                                 sourcekitd_response_t resp) {
+  ssvim::trace::Span span("sema_notification");
+  sourcekitd_variant_t payload = sourcekitd_response_get_value(resp);
+  if (logger.enabled(LogLevelExtreme)) {
+    auto description = PrintResponse(resp);
+    // One argument, so the label and payload share a line and a ring slot
+    logger.log(LogLevelExtreme, std::string("SEMA_RESP: ") + description);
+    free(description);
+  }
+  if (sourcekitd_variant_get_type(payload) == SOURCEKITD_VARIANT_TYPE_NULL) {
+    logger << "GARBAGE_SEMA_RESP";
+    return;
+  }
+
+  // In order to get the semantic info, we have to wait for the editor to be
+  // ready. It will notify us on the main thread and we can make another
+  // request. This needs to happen after various requests ( mainly only used
+  // for editor.replacetext now.
+  auto semaName = sourcekitd_variant_dictionary_get_string(payload, KeyName);
+  if (semaName == NULL || std::string(semaName).length() == 0) {
+    logger << "DID_GET_SEMA:''";
+    return;
+  }
+
+  logger << std::string("DID_GET_SEMA: ") + semaName;
+  sourcekitd_object_t edReq =
+      sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
+  sourcekitd_request_dictionary_set_uid(
+      edReq, KeyRequest,
+      sourcekitd_uid_get_from_cstr("source.request.editor.replacetext"));
+  sourcekitd_request_dictionary_set_string(edReq, KeyName, semaName);
+  sourcekitd_request_dictionary_set_string(edReq, KeySourceText, "");
+
+  // Send the request in the notification
+  auto semaResponse = sourcekitd_send_request_sync(edReq);
+  sourcekitd_request_release(edReq);
+  logger << "SEMA_DONE";
+  auto semaJSON = PrintResponse(semaResponse);
+  {
+    std::lock_guard<std::mutex> lock(NotificationHandlerMutex);
+    if (NotificationHandler) {
+      NotificationHandler(semaName, semaJSON);
+    }
+  }
+  free(semaJSON);
+  sourcekitd_response_dispose(semaResponse);
+}
+
+#pragma mark - SourceKit Completion Request Helper Functions
+
+static sourcekitd_object_t CreateBaseRequest(sourcekitd_uid_t requestUID,
+                                             const char *name,
+                                             unsigned offset) {
+  sourcekitd_object_t request =
+      sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
+  sourcekitd_request_dictionary_set_uid(request, KeyRequest, requestUID);
+  sourcekitd_request_dictionary_set_int64(request, KeyOffset, offset);
+  //sourcekitd_request_dictionary_set_string(request, KeyName, name);
+  return request;
+}
+
+static bool SendRequestSync(sourcekitd_object_t request, HandlerFunc func) {
+  static auto &sendTime = ssvim::metrics::StageHistogram("sourcekitd_send");
+  sourcekitd_response_t response;
+  {
+    ssvim::metrics::ScopedTimer timer(sendTime);
+    ssvim::trace::Span span("sourcekitd_send");
+    response = sourcekitd_send_request_sync(request);
+  }
+  bool result = func(response);
+  sourcekitd_response_dispose(response);
+  return result;
+}
+
+static bool CodeCompleteRequest(sourcekitd_uid_t requestUID, const char *name,
+                                unsigned offset, const char *sourceText,
+                                std::vector<std::string> compilerArgs,
+                                const char *filterText, HandlerFunc func) {
+  auto request = CreateBaseRequest(requestUID, name, offset);
+  sourcekitd_request_dictionary_set_string(request, KeySourceFile, name);
+  sourcekitd_request_dictionary_set_string(request, KeySourceText, sourceText);
+
+  auto opts = sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
+  //{ // not support by sourcekit
+    //if (filterText) {
+      //sourcekitd_request_dictionary_set_string(opts, KeyFilterText, filterText);
+      //sourcekitd_request_dictionary_set_value(request, KeyCodeCompleteOptions,
+                                          //opts);
+    //}
+  //}
+  sourcekitd_request_release(opts);
+
+  auto args = sourcekitd_request_array_create(nullptr, 0);
+  {
+    //sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND, name);
+
+    for (auto arg : compilerArgs)
+      sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND,
+                                          arg.c_str());
+  }
+  sourcekitd_request_dictionary_set_value(request, KeyCompilerArgs, args);
+  sourcekitd_request_release(args);
+  bool result = SendRequestSync(request, func);
+  sourcekitd_request_release(request);
+  return result;
+}
+
+static bool BasicRequest(sourcekitd_uid_t requestUID, const char *name,
+                         const char *sourceText,
+                         std::vector<std::string> compilerArgs,
+                         HandlerFunc func) {
+
+  auto request = sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
+  sourcekitd_request_dictionary_set_uid(request, KeyRequest, requestUID);
+  sourcekitd_request_dictionary_set_string(request, KeyName, name);
+  sourcekitd_request_dictionary_set_string(request, KeySourceText, sourceText);
+  auto KeySyntacticOnly = sourcekitd_uid_get_from_cstr("key.syntactic_only");
+  auto KeyEnableSubStructure =
+      sourcekitd_uid_get_from_cstr("key.enablesubstructure");
+
+  sourcekitd_request_dictionary_set_int64(request, KeyEnableSubStructure, 1);
+  sourcekitd_request_dictionary_set_int64(request, KeySyntacticOnly, 0);
+
+  auto args = sourcekitd_request_array_create(nullptr, 0);
+  {
+    sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND, name);
+
+    for (auto arg : compilerArgs)
+      sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND,
+                                          arg.c_str());
+  }
+  sourcekitd_request_dictionary_set_value(request, KeyCompilerArgs, args);
+  sourcekitd_request_release(args);
+  bool result = SendRequestSync(request, func);
+  sourcekitd_request_release(request);
+  return result;
+}
+
+// Handle a response: errors carry their description, and successful
+// responses their JSON.
+static bool ReadResponse(sourcekitd_response_t response,
+                         BackendResponse &out) {
+  if (sourcekitd_response_is_error(response)) {
+    out.isError = true;
+    out.JSON = sourcekitd_response_error_get_description(response);
+    return true;
+  }
+  auto JSON = PrintResponse(response);
+  out.JSON = JSON;
+  free(JSON);
+  return false;
+}
+
+#pragma mark - SourceKitBackend
+
+namespace ssvim {
+
+class SourceKitBackend : public SemanticBackend {
+  LogLevel _logLevel;
+
+public:
+  SourceKitBackend(LogLevel logLevel) : _logLevel(logLevel) {
+  }
+
+  void Initialize() override {
+    // Initialize SourceKitD resource
+    //
+    // Here, we are set the notification to register for callbacks around
+    // editor updates. This callback is invoked on the main thread.
+    //
+    // It is currently designed to have a single instance "initialized" for a
+    // given program. It is started by warm-up or the first request, and never
+    // torn down. It manages caching internally per session. There is an issue
+    // in SourceKitD that causes us to never tear it down.
+    static dispatch_once_t onceToken;
+    auto logLevel = _logLevel;
+    dispatch_once(&onceToken, ^{
+      ssvim::Logger sharedNotificationLogger(logLevel, "SKT");
+      sourcekitd_initialize();
+      // WARNING ( called on dispatch_main_queue ) by sourcekitd
+      sourcekitd_set_notification_handler(^(sourcekitd_response_t resp) {
+        dispatch_async(
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+              NotificationReceiver(sharedNotificationLogger, resp);
+            });
+      });
+    });
+  }
+
+  BackendResponse CompletionOpen(const BackendRequest &request) override {
+    Initialize();
+    BackendResponse out;
+    CodeCompleteRequest(
+        sourcekitd_uid_get_from_cstr("source.request.codecomplete"),
+        request.name.c_str(), request.offset, request.sourceText.c_str(),
+        request.compilerArgs, nullptr,
+        [&](sourcekitd_object_t response) -> bool {
+          return ReadResponse(response, out);
+        });
+    return out;
+  }
+
+  BackendResponse CompletionUpdate(const BackendRequest &request) override {
+    Initialize();
+    BackendResponse out;
+    CodeCompleteRequest(
+        sourcekitd_uid_get_from_cstr("source.request.codecomplete.update"),
+        request.name.c_str(), request.offset, request.sourceText.c_str(),
+        request.compilerArgs, nullptr,
+        [&](sourcekitd_object_t response) -> bool {
+          return ReadResponse(response, out);
+        });
+    return out;
+  }
+
+  BackendResponse CompletionClose(const BackendRequest &request) override {
+    Initialize();
+    BackendResponse out;
+    auto skRequest = CreateBaseRequest(
+        sourcekitd_uid_get_from_cstr("source.request.codecomplete.close"),
+        request.name.c_str(), request.offset);
+    SendRequestSync(skRequest, [&](sourcekitd_object_t response) -> bool {
+      out.isError = sourcekitd_response_is_error(response);
+      return out.isError;
+    });
+    sourcekitd_request_release(skRequest);
+    return out;
+  }
+
+  BackendResponse EditorOpen(const BackendRequest &request) override {
+    Initialize();
+    BackendResponse out;
+    BasicRequest(sourcekitd_uid_get_from_cstr("source.request.editor.open"),
+                 request.name.c_str(), request.sourceText.c_str(),
+                 request.compilerArgs,
+                 [&](sourcekitd_object_t response) -> bool {
+                   return ReadResponse(response, out);
+                 });
+    return out;
+  }
+
+  BackendResponse EditorReplaceText(const BackendRequest &request) override {
+    Initialize();
+    BackendResponse out;
+    BasicRequest(
+        sourcekitd_uid_get_from_cstr("source.request.editor.replacetext"),
+        request.name.c_str(), request.sourceText.c_str(),
+        request.compilerArgs, [&](sourcekitd_object_t response) -> bool {
+          return ReadResponse(response, out);
+        });
+    return out;
+  }
+
+  BackendResponse EditorClose(const BackendRequest &request) override {
+    Initialize();
+    BackendResponse out;
+    auto skRequest = CreateBaseRequest(
+        sourcekitd_uid_get_from_cstr("source.request.editor.close"),
+        request.name.c_str(), 0);
+    sourcekitd_request_dictionary_set_string(skRequest, KeyName,
+                                             request.name.c_str());
+    SendRequestSync(skRequest, [&](sourcekitd_object_t response) -> bool {
+      out.isError = sourcekitd_response_is_error(response);
+      return out.isError;
+    });
+    sourcekitd_request_release(skRequest);
+    return out;
+  }
+
+  void SetNotificationHandler(SemanticNotificationHandler handler) override {
+    std::lock_guard<std::mutex> lock(NotificationHandlerMutex);
+    NotificationHandler = handler;
+  }
+};
+
+std::shared_ptr<SemanticBackend> MakeSourceKitBackend(LogLevel logLevel) {
+  return std::make_shared<SourceKitBackend>(logLevel);
+}
+
+} // namespace ssvim
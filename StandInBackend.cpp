@@ -0,0 +1,144 @@
+#import <chrono>
+#import <mutex>
+#import <sstream>
+#import <string>
+#import <thread>
+
+#import "JSON.hpp"
+#import "Logging.hpp"
+#import "SemanticBackend.hpp"
+
+using namespace ssvim;
+
+// Results shaped like sourcekitd's codecomplete response.
+static std::string CannedCompletionJSON(unsigned candidateCount) {
+  std::ostringstream os;
+  os << "{\n  \"key.results\": [";
+  for (unsigned i = 0; i < candidateCount; i++) {
+    auto name = "standInCandidate" + std::to_string(i);
+    os << (i ? ",\n" : "\n");
+    os << "    {\n"
+       << "      \"key.kind\": "
+          "\"source.lang.swift.decl.function.method.instance\",\n"
+       << "      \"key.name\": \"" << name << "()\",\n"
+       << "      \"key.sourcetext\": \"" << name << "()\",\n"
+       << "      \"key.description\": \"" << name << "()\",\n"
+       << "      \"key.typename\": \"Void\",\n"
+       << "      \"key.context\": \"source.codecompletion.context.thisclass\",\n"
+       << "      \"key.num_bytes_to_erase\": 0,\n"
+       << "      \"key.associated_usrs\": \"s:7StandIn" << name << "yyF\",\n"
+       << "      \"key.modulename\": \"StandIn\"\n"
+       << "    }";
+  }
+  os << "\n  ]\n}";
+  return os.str();
+}
+
+static std::string ParseDiagnosticsJSON() {
+  return "{\n  \"key.diagnostic_stage\": "
+         "\"source.diagnostic.stage.swift.parse\"\n}";
+}
+
+static std::string SemaDiagnosticsJSON(const std::string &name) {
+  std::ostringstream os;
+  os << "{\n"
+     << "  \"key.diagnostic_stage\": \"source.diagnostic.stage.swift.sema\",\n"
+     << "  \"key.diagnostics\": [\n"
+     << "    {\n"
+     << "      \"key.line\": 1,\n"
+     << "      \"key.column\": 1,\n"
+     << "      \"key.offset\": 0,\n"
+     << "      \"key.filepath\": " << JSONString(name) << ",\n"
+     << "      \"key.severity\": \"source.diagnostic.severity.warning\",\n"
+     << "      \"key.description\": \"stand-in diagnostic\",\n"
+     << "      \"key.diagnostic_stage\": "
+        "\"source.diagnostic.stage.swift.sema\"\n"
+     << "    }\n"
+     << "  ]\n"
+     << "}";
+  return os.str();
+}
+
+namespace ssvim {
+
+class StandInBackend : public SemanticBackend {
+  Logger _logger;
+  StandInBackendOptions _options;
+  std::string _completionJSON;
+  std::mutex _handlerMutex;
+  SemanticNotificationHandler _handler;
+
+  void simulateLatency() {
+    if (_options.latencyMillis) {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(_options.latencyMillis));
+    }
+  }
+
+public:
+  StandInBackend(LogLevel logLevel, StandInBackendOptions options)
+      : _logger(logLevel, "STANDIN"), _options(options),
+        _completionJSON(CannedCompletionJSON(options.candidateCount)) {
+    _logger << "Using the stand-in semantic backend";
+  }
+
+  BackendResponse CompletionOpen(const BackendRequest &request) override {
+    simulateLatency();
+    BackendResponse out;
+    out.JSON = _completionJSON;
+    return out;
+  }
+
+  BackendResponse CompletionUpdate(const BackendRequest &request) override {
+    return CompletionOpen(request);
+  }
+
+  BackendResponse CompletionClose(const BackendRequest &request) override {
+    return BackendResponse();
+  }
+
+  BackendResponse EditorOpen(const BackendRequest &request) override {
+    simulateLatency();
+    BackendResponse out;
+    out.JSON = ParseDiagnosticsJSON();
+    return out;
+  }
+
+  // Like sourcekitd, semantic diagnostics are delivered later through the
+  // notification handler.
+  BackendResponse EditorReplaceText(const BackendRequest &request) override {
+    simulateLatency();
+    SemanticNotificationHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(_handlerMutex);
+      handler = _handler;
+    }
+    if (handler && !_options.notificationDelayMillis) {
+      // Without a delay, the notification comes before the response, as
+      // sourcekitd's may
+      handler(request.name, SemaDiagnosticsJSON(request.name));
+    } else if (handler) {
+      auto delay = std::chrono::milliseconds(_options.notificationDelayMillis);
+      auto name = request.name;
+      std::thread([handler, delay, name] {
+        std::this_thread::sleep_for(delay);
+        handler(name, SemaDiagnosticsJSON(name));
+      }).detach();
+    }
+    BackendResponse out;
+    out.JSON = ParseDiagnosticsJSON();
+    return out;
+  }
+
+  void SetNotificationHandler(SemanticNotificationHandler handler) override {
+    std::lock_guard<std::mutex> lock(_handlerMutex);
+    _handler = handler;
+  }
+};
+
+std::shared_ptr<SemanticBackend>
+MakeStandInBackend(LogLevel logLevel, StandInBackendOptions options) {
+  return std::make_shared<StandInBackend>(logLevel, options);
+}
+
+} // namespace ssvim
@@ -1,269 +1,112 @@
 #include "boost/core/ignore_unused.hpp"
 #include <algorithm>
+#import <algorithm>
 #import <assert.h>
-#import <dispatch/dispatch.h>
 #import <fstream>
 #import <functional>
 #import <future>
 #import <iostream>
 #import <map>
-#import <sourcekitd/sourcekitd.h>
+#import <mutex>
+#import <set>
 #import <sstream>
+#import <stdexcept>
 #import <string>
+#import <string_view>
 #import <thread>
 #import <vector>
 
+#import "Admission.hpp"
+#import "CompletionPrefetch.hpp"
+#import "FutureChannel.hpp"
 #import "Logging.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+#import "ModuleCache.hpp"
+#import "ModuleContext.hpp"
+#import "SemanticBackend.hpp"
 #import "SwiftCompleter.hpp"
-
-#pragma mark - Futures
-
-using promise_ty = std::promise<std::string> *;
-
-// future channel sets values on registered futures.
-// it operates in a shared key space.
-//
-// usage:
-// in the example of working with the document update notifications,
-// a key would be formed based on the name and notification
-//
-// {
-//  key.notification: source.notification.editor.documentupdate,
-//  key.name: "/Users/aprilmarino/swiftyswiftvim/Examples/some_swift.swift"
-//  }
-
-class FutureChannel {
-  std::map<std::string, std::vector<promise_ty>> _promises;
-  std::mutex _shared_mutex;
-
-public:
-  void set(std::string key, const std::string value) {
-    std::lock_guard<std::mutex> lock(_shared_mutex);
-    auto entries = _promises.find(key);
-    if (entries != _promises.end()) {
-      for (auto promise : entries->second) {
-        promise->set_value(value);
-        delete promise;
-      }
-      _promises.erase(key);
-    }
-  }
-
-  std::future<std::string> future(std::string key) {
-    auto promise = new std::promise<std::string>;
-    std::lock_guard<std::mutex> lock(_shared_mutex);
-    _promises[key].push_back(promise);
-    return promise->get_future();
-  }
-};
-
-#pragma mark - SourceKitD
-
-static auto KeyRequest = sourcekitd_uid_get_from_cstr("key.request");
-static auto KeyCompilerArgs = sourcekitd_uid_get_from_cstr("key.compilerargs");
-static auto KeyOffset = sourcekitd_uid_get_from_cstr("key.offset");
-static auto KeyLength = sourcekitd_uid_get_from_cstr("key.length");
-static auto KeyCodeCompleteOptions =
-    sourcekitd_uid_get_from_cstr("key.codecomplete.options");
-static auto KeyUseImportDepth =
-    sourcekitd_uid_get_from_cstr("key.codecomplete.sort.useimportdepth");
-static auto KeyFilterText =
-    sourcekitd_uid_get_from_cstr("key.codecomplete.filtertext");
-static auto KeyHideLowPriority =
-    sourcekitd_uid_get_from_cstr("key.codecomplete.hidelowpriority");
-static auto KeySourceFile = sourcekitd_uid_get_from_cstr("key.sourcefile");
-static auto KeySourceText = sourcekitd_uid_get_from_cstr("key.sourcetext");
-static auto KeyName = sourcekitd_uid_get_from_cstr("key.name");
-
-#pragma mark - SourceKitD Notifications
-
-using HandlerFunc = std::function<bool(sourcekitd_response_t)>;
+#import "Trace.hpp"
 
 namespace ssvim {
 
-// Context for a given completion
-struct CompletionContext {
-  // The current source source file's absolute path
-  std::string sourceFilename;
-  std::string completionToken;
-
-  // Position of the completion
-  unsigned line;
-  unsigned column;
-
-  std::vector<std::string> flags;
-
-  // Unsaved files
-  std::vector<UnsavedFile> unsavedFiles;
-
-  // Return the args based on the current flags
-  // and default to the OSX SDK if none.
-  std::vector<std::string> compilerArgs() {
-    if (flags.size() == 0) {
-      return DefaultOSXArgs();
-    }
-
-    return flags;
-  }
-
-  std::vector<std::string> DefaultOSXArgs() {
-    return {
-        "-sdk",
-        "/Applications/Xcode.app/Contents/Developer/Platforms/iPhoneOS.platform/Developer/SDKs/iPhoneOS.sdk",
-        "-target", "arm64-apple-ios14.3",
-    };
-  }
-};
-
+// SourceKitService prepares requests for the semantic backend.
 class SourceKitService {
   Logger _logger;
+  std::shared_ptr<SemanticBackend> _backend;
 
 public:
   SourceKitService(LogLevel logLevel);
-  int CompletionOpen(CompletionContext &ctx, char **oresponse);
-  int CompletionUpdate(CompletionContext &ctx, char **oresponse);
+  int CompletionOpen(CompletionContext &ctx, std::string *oresponse);
+  int CompletionUpdate(CompletionContext &ctx, std::string *oresponse);
   int CompletionClose(CompletionContext &ctx);
-  int EditorOpen(CompletionContext &ctx, char **oresponse);
-  int EditorReplaceText(CompletionContext &ctx, char **oresponse);
+  int EditorOpen(CompletionContext &ctx, std::string *oresponse);
+  int EditorReplaceText(CompletionContext &ctx, std::string *oresponse);
+  void SyncModule(CompletionContext &ctx);
 };
 } // namespace ssvim
 
-static char *PrintResponse(sourcekitd_response_t resp) {
-  auto dict = sourcekitd_response_get_value(resp);
-  auto JSONString = sourcekitd_variant_json_description_copy(dict);
-  return JSONString;
-}
+#pragma mark - Futures
 
 // A Future channel for Semantic notifications.
 // This channel is shared across all SourceKitService instances
 // and SwiftCompleter instances
-static FutureChannel SemaFutureChannel;
-
-// There is a single notification receiver per sourcekitd session
-// and currently, there is a single session per server
-// @see SourceKitService::SourceKitService()
-static void NotificationReceiver(ssvim::Logger logger,
-                                 sourcekitd_response_t resp) {
-  sourcekitd_response_description_dump(resp);
-  sourcekitd_variant_t payload = sourcekitd_response_get_value(resp);
-  logger << "SEMA_RESP: " << PrintResponse(resp);
-  if (sourcekitd_variant_get_type(payload) == SOURCEKITD_VARIANT_TYPE_NULL) {
-    logger << "GARBAGE_SEMA_RESP";
-    return;
-  }
+static FutureChannel
+    SemaFutureChannel(ssvim::metrics::Registry::shared().gauge(
+        "ssvim_sema_pending_waiters", "",
+        "Requests waiting on a semantic notification"));
 
-  // In order to get the semantic info, we have to wait for the editor to be
-  // ready. It will notify us on the main thread and we can make another
-  // request. This needs to happen after various requests ( mainly only used
-  // for editor.replacetext now.
-  auto semaName = sourcekitd_variant_dictionary_get_string(payload, KeyName);
-  if (semaName == NULL || std::string(semaName).length() == 0) {
-    logger << "DID_GET_SEMA:''";
-    return;
-  }
+// Documents opened in sourcekitd through editor.open, with their args.
+static std::mutex OpenDocumentsMutex;
+static std::map<std::string, std::vector<std::string>> OpenedDocuments;
 
-  logger << "DID_GET_SEMA: " << semaName;
-  sourcekitd_object_t edReq =
-      sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
-  sourcekitd_request_dictionary_set_uid(
-      edReq, KeyRequest,
-      sourcekitd_uid_get_from_cstr("source.request.editor.replacetext"));
-  sourcekitd_request_dictionary_set_string(edReq, KeyName, semaName);
-  sourcekitd_request_dictionary_set_string(edReq, KeySourceText, "");
-
-  // Send the request in the notification
-  auto semaResponse = sourcekitd_send_request_sync(edReq);
-  sourcekitd_response_description_dump(semaResponse);
-  sourcekitd_request_release(edReq);
-  logger << "SEMA_DONE";
-  SemaFutureChannel.set(semaName, PrintResponse(semaResponse));
-}
-
-#pragma mark - SourceKit Completion Request Helper Functions
-
-static sourcekitd_object_t CreateBaseRequest(sourcekitd_uid_t requestUID,
-                                             const char *name,
-                                             unsigned offset) {
-  sourcekitd_object_t request =
-      sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
-  sourcekitd_request_dictionary_set_uid(request, KeyRequest, requestUID);
-  sourcekitd_request_dictionary_set_int64(request, KeyOffset, offset);
-  //sourcekitd_request_dictionary_set_string(request, KeyName, name);
-  return request;
-}
+using namespace ssvim;
 
-static bool SendRequestSync(sourcekitd_object_t request, HandlerFunc func) {
-  auto response = sourcekitd_send_request_sync(request);
-  bool result = func(response);
-  sourcekitd_response_dispose(response);
-  return result;
-}
-
-static bool CodeCompleteRequest(sourcekitd_uid_t requestUID, const char *name,
-                                unsigned offset, const char *sourceText,
-                                std::vector<std::string> compilerArgs,
-                                const char *filterText, HandlerFunc func) {
-  auto request = CreateBaseRequest(requestUID, name, offset);
-  sourcekitd_request_dictionary_set_string(request, KeySourceFile, name);
-  sourcekitd_request_dictionary_set_string(request, KeySourceText, sourceText);
-
-  auto opts = sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
-  //{ // not support by sourcekit
-    //if (filterText) {
-      //sourcekitd_request_dictionary_set_string(opts, KeyFilterText, filterText);
-      //sourcekitd_request_dictionary_set_value(request, KeyCodeCompleteOptions,
-                                          //opts);
-    //}
-  //}
-  sourcekitd_request_release(opts);
-
-  auto args = sourcekitd_request_array_create(nullptr, 0);
-  {
-    //sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND, name);
+static metrics::Gauge &OpenDocumentsGauge() {
+  static auto &openDocuments = metrics::Registry::shared().gauge(
+      "ssvim_open_documents", "", "Documents open in sourcekitd");
+  return openDocuments;
+}
 
-    for (auto arg : compilerArgs)
-      sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND,
-                                          arg.c_str());
+// The unsaved contents of the context's file, or null.
+static const std::string *SourceContents(const CompletionContext &ctx) {
+  for (auto &unsavedFile : ctx.unsavedFiles) {
+    if (unsavedFile.fileName == ctx.sourceFilename) {
+      return &unsavedFile.text();
+    }
   }
-  sourcekitd_request_dictionary_set_value(request, KeyCompilerArgs, args);
-  sourcekitd_request_release(args);
-  bool result = SendRequestSync(request, func);
-  sourcekitd_request_release(request);
-  return result;
+  return nullptr;
 }
 
-static bool BasicRequest(sourcekitd_uid_t requestUID, const char *name,
-                         const char *sourceText,
-                         std::vector<std::string> compilerArgs,
-                         HandlerFunc func) {
-
-  auto request = sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
-  sourcekitd_request_dictionary_set_uid(request, KeyRequest, requestUID);
-  sourcekitd_request_dictionary_set_string(request, KeyName, name);
-  sourcekitd_request_dictionary_set_string(request, KeySourceText, sourceText);
-  auto KeySyntacticOnly = sourcekitd_uid_get_from_cstr("key.syntactic_only");
-  auto KeyEnableSubStructure =
-      sourcekitd_uid_get_from_cstr("key.enablesubstructure");
-
-  sourcekitd_request_dictionary_set_int64(request, KeyEnableSubStructure, 1);
-  sourcekitd_request_dictionary_set_int64(request, KeySyntacticOnly, 0);
-
-  auto args = sourcekitd_request_array_create(nullptr, 0);
-  {
-    sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND, name);
-
-    for (auto arg : compilerArgs)
-      sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND,
-                                          arg.c_str());
+// The unsaved contents of the context's file, shared so the module context
+// keeps them without a copy, or null.
+static std::shared_ptr<const std::string>
+ShareSourceContents(CompletionContext &ctx) {
+  for (auto &unsavedFile : ctx.unsavedFiles) {
+    if (unsavedFile.fileName == ctx.sourceFilename) {
+      if (!unsavedFile.sharedContents) {
+        unsavedFile.sharedContents = std::make_shared<const std::string>(
+            std::move(unsavedFile.contents));
+      }
+      return unsavedFile.sharedContents;
+    }
   }
-  sourcekitd_request_dictionary_set_value(request, KeyCompilerArgs, args);
-  sourcekitd_request_release(args);
-  bool result = SendRequestSync(request, func);
-  sourcekitd_request_release(request);
-  return result;
+  return nullptr;
 }
 
-using namespace ssvim;
+// Transform completion flags into diagnostic flags
+static std::vector<std::string>
+DiagnosticFlagsFromFlags(std::string filename,
+                         std::vector<std::string> flags) {
+  std::vector<std::string> outputFlags;
+  for (auto &f : flags) {
+    if (f == filename) {
+      continue;
+    }
+    outputFlags.push_back(f);
+  }
+  return outputFlags;
+}
 
 // Get a clean file and offset for completion.
 //
@@ -272,27 +115,27 @@ using namespace ssvim;
 //
 // This seemed necessary on Swift V2 when it was first written, but hopefully
 // it can be improved.
-static void GetOffset(CompletionContext &ctx, unsigned *offset,
+void ssvim::GetOffset(CompletionContext &ctx, unsigned *offset,
                       std::string *CleanFile) {
+  static auto &offsetTime = metrics::StageHistogram("get_offset");
+  metrics::ScopedTimer timer(offsetTime);
+  trace::Span span("get_offset");
   auto line = ctx.line;
   auto column = ctx.column;
-  auto fileName = ctx.sourceFilename;
 
-  std::string unsavedInput;
-
-  for (auto unsavedFile : ctx.unsavedFiles) {
-    if (unsavedFile.fileName == fileName) {
-      unsavedInput = unsavedFile.contents;
-      break;
-    }
+  // Lines are read in place, only the clean file is written
+  auto unsavedInput = SourceContents(ctx);
+  assert(unsavedInput && unsavedInput->length() && "Missing unsaved file");
+  if (!unsavedInput) {
+    return;
   }
 
-  assert(unsavedInput.length() && "Missing unsaved file");
-
-  std::istringstream sourceFile(unsavedInput);
-  std::string someLine;
+  auto &source = *unsavedInput;
   unsigned currentLine = 0;
-  while (std::getline(sourceFile, someLine)) {
+  for (std::size_t start = 0; start < source.length();) {
+    auto end = std::min(source.find('\n', start), source.length());
+    auto someLine = std::string_view(source).substr(start, end - start);
+    start = end + 1;
     if (currentLine + 1 == line) {
       // Enumerate from the column to an interesting point
       for (auto i = column;; i--) {
@@ -303,7 +146,7 @@ static void GetOffset(CompletionContext &ctx, unsigned *offset,
 
         if (someChar == ' ' || someChar == '.' || i == 0) {
           // Include the character in the partial file
-          std::string partialLine = "";
+          std::string_view partialLine;
           if (i == 0) {
             partialLine = someLine;
           } else if (someLine.length() > i) {
@@ -322,148 +165,284 @@ static void GetOffset(CompletionContext &ctx, unsigned *offset,
   }
 }
 
+#pragma mark - SemanticBackend
+
+static std::mutex SharedBackendMutex;
+static std::shared_ptr<SemanticBackend> SharedBackend;
+
+static std::mutex SemanticListenersMutex;
+static std::map<unsigned, SemanticListener> SemanticListeners;
+
+unsigned ssvim::AddSemanticListener(SemanticListener listener) {
+  static unsigned nextToken = 1;
+  std::lock_guard<std::mutex> lock(SemanticListenersMutex);
+  auto token = nextToken++;
+  SemanticListeners[token] = listener;
+  return token;
+}
+
+void ssvim::RemoveSemanticListener(unsigned token) {
+  std::lock_guard<std::mutex> lock(SemanticListenersMutex);
+  SemanticListeners.erase(token);
+}
+
+static void InstallNotificationHandler(SemanticBackend &backend) {
+  backend.SetNotificationHandler(
+      [](const std::string &name, const std::string &JSON) {
+        SemaFutureChannel.set(name, JSON);
+        std::map<unsigned, SemanticListener> listeners;
+        {
+          std::lock_guard<std::mutex> lock(SemanticListenersMutex);
+          listeners = SemanticListeners;
+        }
+        for (auto &listener : listeners) {
+          listener.second(name, JSON);
+        }
+      });
+  backend.SetFailureHandler(
+      [](const std::string &name, const std::string &error) {
+        SemaFutureChannel.fail(
+            name, std::make_exception_ptr(std::runtime_error(error)));
+      });
+}
+
+std::shared_ptr<SemanticBackend> ssvim::SharedSemanticBackend() {
+  std::lock_guard<std::mutex> lock(SharedBackendMutex);
+  if (!SharedBackend) {
+#if SSVIM_WITH_SOURCEKITD
+    SharedBackend = MakeSourceKitBackend(LogLevelInfo);
+#else
+    SharedBackend = MakeStandInBackend(LogLevelInfo, StandInBackendOptions());
+#endif
+    InstallNotificationHandler(*SharedBackend);
+  }
+  return SharedBackend;
+}
+
+void ssvim::SetSharedSemanticBackend(
+    std::shared_ptr<SemanticBackend> backend) {
+  std::lock_guard<std::mutex> lock(SharedBackendMutex);
+  SharedBackend = backend;
+  InstallNotificationHandler(*SharedBackend);
+}
+
+#pragma mark - SourceKitService
+
+// Documents evicted by the memory budget are closed in sourcekitd, which
+// frees their ASTs, and are opened again on their next use. Clients share
+// documents, so one stays open while another client has its buffer.
+static void CloseDocument(const std::string &file) {
+  if (ModuleBufferIsHeld(file)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(OpenDocumentsMutex);
+    if (!OpenedDocuments.erase(file)) {
+      return;
+    }
+    OpenDocumentsGauge().set(OpenedDocuments.size());
+  }
+  BackendRequest request;
+  request.name = file;
+  SharedSemanticBackend()->EditorClose(request);
+}
+
+static void EvictDocument(const std::string &key) {
+  std::string file;
+  if (EvictModuleBuffer(key, &file)) {
+    CloseDocument(file);
+  }
+}
+
 SourceKitService::SourceKitService(ssvim::LogLevel logLevel)
-    : _logger(logLevel, "SKT") {
-  // Initialize SourceKitD resource
-  //
-  // Here, we are set the notification to register for callbacks around editor
-  // updates. This callback is invoked on the main thread.
-  //
-  // It is currently designed to have a single instance "initialized" for a
-  // given program. It is lazily started, and never torn down. It manages
-  // caching internally per session. There is an issue in SourceKitD that
-  // causes us to never tear it down.
-  static dispatch_once_t onceToken;
-  dispatch_once(&onceToken, ^{
-    ssvim::Logger sharedNotificationLogger(logLevel, "SKT");
-    sourcekitd_initialize();
-    // WARNING ( called on dispatch_main_queue ) by sourcekitd
-    sourcekitd_set_notification_handler(^(sourcekitd_response_t resp) {
-      dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
-                     ^{
-                       NotificationReceiver(sharedNotificationLogger, resp);
-                     });
-    });
+    : _logger(logLevel, "SKT"), _backend(SharedSemanticBackend()) {
+  static std::once_flag registered;
+  std::call_once(registered, [] {
+    MemoryBudget::shared().registerPool("documents", EvictDocument);
   });
 }
 
+// Build a completion request at the current position
+static BackendRequest CompletionRequest(CompletionContext &ctx) {
+  BackendRequest request;
+  request.name = ctx.sourceFilename;
+  GetOffset(ctx, &request.offset, &request.sourceText);
+  request.compilerArgs = ctx.compilerArgs();
+  return request;
+}
+
+// Build an editor request for the whole file
+static BackendRequest EditorRequest(CompletionContext &ctx) {
+  BackendRequest request;
+  request.name = ctx.sourceFilename;
+  if (auto contents = SourceContents(ctx)) {
+    request.sourceText = *contents;
+  }
+  request.compilerArgs = ctx.compilerArgs();
+  return request;
+}
+
 // Update the file and get latest results.
 int SourceKitService::CompletionUpdate(CompletionContext &ctx,
-                                       char **oresponse) {
+                                       std::string *oresponse) {
   _logger << "WILL_COMPLETION_UPDATE";
-  sourcekitd_uid_t RequestCodeCompleteUpdate =
-      sourcekitd_uid_get_from_cstr("source.request.codecomplete.update");
-  unsigned CodeCompletionOffset = 0;
-  std::string CleanFile;
-  GetOffset(ctx, &CodeCompletionOffset, &CleanFile);
+  trace::Span span("completion_update");
   _logger << "token";
   _logger << ctx.completionToken;
 
-  bool isError = CodeCompleteRequest(
-      RequestCodeCompleteUpdate, ctx.sourceFilename.data(),
-      CodeCompletionOffset, CleanFile.c_str(), ctx.compilerArgs(), ctx.completionToken.c_str(),
-      [&](sourcekitd_object_t response) -> bool {
-        if (sourcekitd_response_is_error(response)) {
-          return true;
-        }
-        *oresponse = PrintResponse(response);
-        _logger.log(LogLevelExtreme, *oresponse);
-        return false;
-      });
+  auto response = _backend->CompletionUpdate(CompletionRequest(ctx));
+  if (!response.isError) {
+    *oresponse = std::move(response.JSON);
+    _logger.log(LogLevelExtreme, *oresponse);
+  }
   _logger << "DID_COMPLETION_UPDATE";
-  return isError;
+  return response.isError;
 }
 
 // Open the connection and get the first set of results.
-int SourceKitService::CompletionOpen(CompletionContext &ctx, char **oresponse) {
+int SourceKitService::CompletionOpen(CompletionContext &ctx,
+                                     std::string *oresponse) {
   _logger << "WILL_COMPLETION_OPEN";
-  sourcekitd_uid_t RequestCodeCompleteOpen =
-      sourcekitd_uid_get_from_cstr("source.request.codecomplete");
-  unsigned CodeCompletionOffset = 0;
-  std::string CleanFile;
-  GetOffset(ctx, &CodeCompletionOffset, &CleanFile);
-
-  _logger << "offset: " << CodeCompletionOffset;
-  bool isError = CodeCompleteRequest(
-      RequestCodeCompleteOpen, ctx.sourceFilename.data(), CodeCompletionOffset,
-      CleanFile.c_str(), ctx.compilerArgs(), nullptr,
-      [&](sourcekitd_object_t response) -> bool {
-        if (sourcekitd_response_is_error(response)) {
-          _logger.log(LogLevelExtreme, sourcekitd_response_error_get_description(response));
-          return true;
-        }
-        *oresponse = PrintResponse(response);
-        _logger.log(LogLevelExtreme, *oresponse);
-        return false;
-      });
+  trace::Span span("completion_open");
+  auto request = CompletionRequest(ctx);
+  _logger << "offset: " << request.offset;
+
+  auto response = _backend->CompletionOpen(request);
+  if (response.isError) {
+    _logger.log(LogLevelExtreme, response.JSON);
+  } else {
+    *oresponse = std::move(response.JSON);
+    _logger.log(LogLevelExtreme, *oresponse);
+  }
   _logger << "DID_COMPLETION_OPEN";
-  _logger << CodeCompletionOffset;
-  return isError;
+  _logger << request.offset;
+  return response.isError;
 }
 
 int SourceKitService::CompletionClose(CompletionContext &ctx) {
   _logger << "WILL_COMPLETION_CLOSE";
-  sourcekitd_uid_t RequestCodeCompleteOpen =
-      sourcekitd_uid_get_from_cstr("source.request.codecomplete.close");
-  unsigned CodeCompletionOffset = 0;
-  std::string CleanFile;
-  GetOffset(ctx, &CodeCompletionOffset, &CleanFile);
-
-  auto request = CreateBaseRequest(RequestCodeCompleteOpen, ctx.sourceFilename.data(), CodeCompletionOffset);
-  bool isError = SendRequestSync(request, [&](sourcekitd_object_t response) -> bool {
-        if (sourcekitd_response_is_error(response)) {
-          return true;
-        }
-        return false;
-      });
-  sourcekitd_request_release(request);
-
-  _logger << isError;
+  trace::Span span("completion_close");
+  auto response = _backend->CompletionClose(CompletionRequest(ctx));
+  _logger << response.isError;
   _logger << "DID_COMPLETION_CLOSE";
-  return isError;
+  return response.isError;
 }
+
 // Open sourcekit in editor mode
 // On success, this returns a list of after the contents have
 // gone through parsing.
-int SourceKitService::EditorOpen(CompletionContext &ctx, char **oresponse) {
+int SourceKitService::EditorOpen(CompletionContext &ctx,
+                                 std::string *oresponse) {
   _logger << "WILL_EDITOR_OPEN";
-  auto contents = ctx.unsavedFiles[0].contents.c_str();
-  bool isError =
-      BasicRequest(sourcekitd_uid_get_from_cstr("source.request.editor.open"),
-                   ctx.sourceFilename.data(), contents, ctx.compilerArgs(),
-                   [&](sourcekitd_object_t response) -> bool {
-                     if (sourcekitd_response_is_error(response)) {
-                       return true;
-                     }
-                     *oresponse = PrintResponse(response);
-                     //_logger.log(LogLevelExtreme, *oresponse);
-                     return false;
-                   });
+  trace::Span span("editor_open");
+  auto response = _backend->EditorOpen(EditorRequest(ctx));
+  if (!response.isError) {
+    *oresponse = std::move(response.JSON);
+  }
   _logger << "DID_EDITOR_OPEN";
-  return isError;
+  if (!response.isError) {
+    std::lock_guard<std::mutex> lock(OpenDocumentsMutex);
+    OpenedDocuments[ctx.sourceFilename] = ctx.compilerArgs();
+    OpenDocumentsGauge().set(OpenedDocuments.size());
+  }
+  return response.isError;
 }
 
 // Editor replace text.
 // This command puts sourcekitd into semantic mode to get full
 // diagnostics.
 int SourceKitService::EditorReplaceText(CompletionContext &ctx,
-                                        char **oresponse) {
-  std::string CleanFile;
+                                        std::string *oresponse) {
   _logger << "WILL_EDITOR_REPLACETEXT";
-  auto contents = ctx.unsavedFiles[0].contents.c_str();
-  bool isError = BasicRequest(
-      sourcekitd_uid_get_from_cstr("source.request.editor.replacetext"),
-      ctx.sourceFilename.data(), contents, ctx.compilerArgs(),
-      [&](sourcekitd_object_t response) -> bool {
-        if (sourcekitd_response_is_error(response)) {
-          return true;
-        }
-        *oresponse = PrintResponse(response);
-        //_logger.log(LogLevelExtreme, *oresponse);
-        return false;
-      });
+  trace::Span span("editor_replacetext");
+  auto response = _backend->EditorReplaceText(EditorRequest(ctx));
+  if (!response.isError) {
+    *oresponse = std::move(response.JSON);
+  }
   _logger << "DID_EDITOR_REPLACETEXT";
-  return isError;
+  return response.isError;
+}
+
+// Send the buffers of the module's other files that changed since the
+// backend last saw them, so a request on the context's file sees their
+// unsaved symbols. Buffers are sent as editor documents, which sourcekitd
+// reads in place of the files on disk.
+void SourceKitService::SyncModule(CompletionContext &ctx) {
+  static auto &synced = metrics::Registry::shared().counter(
+      "ssvim_module_buffer_syncs_total", "",
+      "Buffers of other module files sent to the backend");
+  auto args = ctx.compilerArgs();
+  auto changed = SharedModuleContext().takeChanged(
+      ctx.sourceFilename, ModuleFiles(ctx.sourceFilename, args));
+  if (changed.empty()) {
+    return;
+  }
+  trace::Span span("module_sync");
+  for (auto &file : changed) {
+    CompletionContext fileCtx;
+    fileCtx.sourceFilename = file.fileName;
+    fileCtx.unsavedFiles.push_back(std::move(file));
+    fileCtx.flags = DiagnosticFlagsFromFlags(fileCtx.sourceFilename, args);
+    fileCtx.line = 0;
+    fileCtx.column = 0;
+    bool isOpen;
+    {
+      std::lock_guard<std::mutex> lock(OpenDocumentsMutex);
+      isOpen = OpenedDocuments.count(fileCtx.sourceFilename);
+    }
+    std::string response;
+    if (isOpen) {
+      EditorReplaceText(fileCtx, &response);
+    } else {
+      EditorOpen(fileCtx, &response);
+    }
+    synced.increment();
+  }
+}
+
+std::vector<OpenDocument> ssvim::OpenDocuments() {
+  std::lock_guard<std::mutex> lock(OpenDocumentsMutex);
+  std::vector<OpenDocument> documents;
+  for (auto &document : OpenedDocuments) {
+    documents.push_back({document.first, document.second});
+  }
+  return documents;
+}
+
+void ssvim::ReopenDocuments(LogLevel logLevel,
+                            std::vector<OpenDocument> documents) {
+  std::thread([logLevel, documents] {
+    static auto &reopened = metrics::Registry::shared().counter(
+        "ssvim_reopened_documents_total", "",
+        "Documents opened again after a restart");
+    SourceKitService sktService(logLevel);
+    for (auto &document : documents) {
+      // Requests go first
+      while (AdmissionControl::shared().runningJobs()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      CompletionContext ctx;
+      ctx.sourceFilename = document.name;
+      ctx.flags = document.compilerArgs;
+      ctx.line = 0;
+      ctx.column = 0;
+      UnsavedFile unsaved;
+      unsaved.fileName = document.name;
+      if (!SharedModuleContext().contents(document.name, &unsaved.contents)) {
+        std::ifstream file(document.name, std::ios::binary);
+        if (!file) {
+          continue;
+        }
+        unsaved.contents.assign(std::istreambuf_iterator<char>(file),
+                                std::istreambuf_iterator<char>());
+      }
+      ctx.unsavedFiles.push_back(unsaved);
+      std::string response;
+      if (!sktService.EditorOpen(ctx, &response)) {
+        reopened.increment();
+      }
+    }
+  }).detach();
 }
 
 #pragma mark - SwiftCompleter
@@ -479,65 +458,197 @@ SwiftCompleter::SwiftCompleter(LogLevel logLevel)
 SwiftCompleter::~SwiftCompleter() {
 }
 
-// Transform completion flags into diagnostic flags
-auto DiagnosticFlagsFromFlags(std::string filename,
-                              std::vector<std::string> flags) {
-  std::vector<std::string> outputFlags;
-  for (auto &f : flags) {
-    if (f == filename) {
+static bool IsIdentifierChar(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+// The module a completion is on, like UIKit for `UIKit.` or `UIKit.UIV`, or
+// "" if the completion isn't on an imported module.
+static std::string CompletionModule(const CompletionContext &ctx) {
+  auto contents = SourceContents(ctx);
+  if (!contents) {
+    return "";
+  }
+
+  // Lines are read in place, only those with imports are split into words
+  auto &source = *contents;
+  std::set<std::string> imports;
+  std::string completionLine;
+  unsigned lineNumber = 0;
+  for (std::size_t start = 0; start < source.length();) {
+    auto end = std::min(source.find('\n', start), source.length());
+    auto line = std::string_view(source).substr(start, end - start);
+    start = end + 1;
+    lineNumber++;
+    if (lineNumber == ctx.line) {
+      completionLine = std::string(line);
+    }
+    if (line.find("import") == std::string_view::npos) {
       continue;
     }
-    outputFlags.push_back(f);
+    std::istringstream words{std::string(line)};
+    std::string word, module;
+    while (words >> word && word[0] == '@') {
+    }
+    if (word == "import" && words >> module) {
+      imports.insert(module);
+    }
   }
-  return outputFlags;
+
+  // Unless the column is on the dot, skip back over the query to it
+  auto i = std::min<std::size_t>(ctx.column, completionLine.length());
+  if (i == completionLine.length() || completionLine[i] != '.') {
+    while (i > 0 && IsIdentifierChar(completionLine[i - 1])) {
+      i--;
+    }
+    if (i == 0 || completionLine[i - 1] != '.') {
+      return "";
+    }
+    i--;
+  }
+  auto end = i;
+  while (i > 0 && IsIdentifierChar(completionLine[i - 1])) {
+    i--;
+  }
+  // Members like `foo.UIKit.` aren't modules
+  if (i == end || (i > 0 && completionLine[i - 1] == '.')) {
+    return "";
+  }
+  auto module = completionLine.substr(i, end - i);
+  return imports.count(module) ? module : "";
+}
+
+static ModuleCacheKey ModuleCacheKeyForContext(CompletionContext &ctx,
+                                               const std::string &module) {
+  ModuleCacheKey key;
+  key.module = module;
+  auto args = ctx.compilerArgs();
+  for (std::size_t i = 0; i + 1 < args.size(); i++) {
+    if (args[i] == "-sdk") {
+      key.sdkPath = args[i + 1];
+    } else if (args[i] == "-target") {
+      key.target = args[i + 1];
+    }
+  }
+  return key;
 }
 
 const std::string SwiftCompleter::CandidatesForLocationInFile(
     const std::string &filename, int line, int column,
-    const std::vector<UnsavedFile> &unsavedFiles,
+    std::vector<UnsavedFile> unsavedFiles,
     const std::vector<std::string> &flags,
     const std::string &completionToken) {
   CompletionContext ctx;
   ctx.sourceFilename = filename;
   ctx.line = line;
   ctx.column = column;
-  ctx.unsavedFiles = unsavedFiles;
+  ctx.unsavedFiles = std::move(unsavedFiles);
   ctx.flags = flags;
   ctx.completionToken = completionToken;
+  if (auto contents = ShareSourceContents(ctx)) {
+    SharedModuleContext().update(filename, contents, false);
+  }
+
+  std::string response;
+  if (CompletionPrefetcher::shared().take(ctx, &response)) {
+    _logger << "PREFETCH_HIT";
+    return response;
+  }
+
+  // Completions on SDK modules are served from disk when possible. The
+  // project's own modules change without the SDK, so they never are.
+  auto moduleCache = SharedModuleCache();
+  auto module = moduleCache ? CompletionModule(ctx) : "";
+  ModuleCacheKey cacheKey;
+  if (module.length()) {
+    cacheKey = ModuleCacheKeyForContext(ctx, module);
+    if (!IsSDKModule(cacheKey, ctx.compilerArgs())) {
+      module = "";
+    } else if (moduleCache->lookup(cacheKey, &response)) {
+      _logger << "MODULE_CACHE_HIT: " << module;
+      return response;
+    }
+  }
 
   SourceKitService sktService(_logger.level());
-  char *response = NULL;
-  sktService.CompletionOpen(ctx, &response);
+  sktService.SyncModule(ctx);
+  auto isError = sktService.CompletionOpen(ctx, &response);
   //sktService.CompletionUpdate(ctx, &response);
   //sktService.CompletionClose(ctx);
+  if (!isError && module.length()) {
+    moduleCache->store(cacheKey, response);
+  }
 
-  if (response == NULL) {
+  if (isError) {
     // FIXME: Propagate SourceKitService Errors
-    static auto EmptyResponse = "{ 'key.results':[] }";
+    static auto EmptyResponse = "{\"key.results\": []}";
     _logger << "Empty response";
     return EmptyResponse;
   }
   return response;
 }
 
+bool SwiftCompleter::SpeculativeCandidates(CompletionContext &ctx,
+                                           std::string *JSON) {
+  SourceKitService sktService(_logger.level());
+  sktService.SyncModule(ctx);
+  return !sktService.CompletionOpen(ctx, JSON);
+}
+
 const std::string
 SwiftCompleter::DiagnosticsForFile(const std::string &filename,
-                                   const std::vector<UnsavedFile> &unsavedFiles,
+                                   std::vector<UnsavedFile> unsavedFiles,
                                    const std::vector<std::string> &flags) {
+  return diagnostics(filename, std::move(unsavedFiles), flags, true);
+}
+
+const std::string SwiftCompleter::BackgroundDiagnostics(
+    const std::string &filename, std::vector<UnsavedFile> unsavedFiles,
+    const std::vector<std::string> &flags) {
+  return diagnostics(filename, std::move(unsavedFiles), flags, false);
+}
+
+const std::string
+SwiftCompleter::diagnostics(const std::string &filename,
+                            std::vector<UnsavedFile> unsavedFiles,
+                            const std::vector<std::string> &flags,
+                            bool editorBuffer) {
   CompletionContext ctx;
   ctx.sourceFilename = filename;
-  ctx.unsavedFiles = unsavedFiles;
+  ctx.unsavedFiles = std::move(unsavedFiles);
   ctx.flags = DiagnosticFlagsFromFlags(filename, flags);
   ctx.line = 0;
   ctx.column = 0;
 
+  // The semantic notification may arrive as soon as the document is opened,
+  // so wait on it before sending anything.
+  promise_ty registration;
+  auto future = SemaFutureChannel.future(filename, &registration);
+
+  // The whole buffer is sent below
+  if (editorBuffer) {
+    if (auto contents = ShareSourceContents(ctx)) {
+      SharedModuleContext().update(filename, contents, true);
+    }
+  }
+  // Documents the editor doesn't have open are closed again once checked,
+  // so they hold no memory
+  bool wasOpen;
+  {
+    std::lock_guard<std::mutex> lock(OpenDocumentsMutex);
+    wasOpen = OpenedDocuments.count(filename);
+  }
+
   SourceKitService sktService(_logger.level());
-  char *response = NULL;
-  sktService.EditorOpen(ctx, &response);
-  sktService.EditorReplaceText(ctx, &response);
-  if (response == NULL) {
+  sktService.SyncModule(ctx);
+  std::string response;
+  auto openError = sktService.EditorOpen(ctx, &response);
+  auto replaceError = sktService.EditorReplaceText(ctx, &response);
+  if (openError && replaceError) {
+    // No notification is coming
+    SemaFutureChannel.remove(filename, registration);
     // FIXME: Propagate SourceKitService Errors
-    static auto EmptyResponse = "{ 'key.diagnostics':[] }";
+    static auto EmptyResponse = "{\"key.diagnostics\": []}";
     _logger << "Empty response";
     return EmptyResponse;
   }
@@ -546,11 +657,25 @@ SwiftCompleter::DiagnosticsForFile(const std::string &filename,
   // - the document is updated ( NotificationReceiver fires )
   // - send a request for semantic info
   // - the semantic request completes
-  // FIXME: Add a resonable timeout. If SourceKit goes down async we won't ever
-  // get the message back ( somewhat workable for now because clients will
-  // timeout )
-  auto future = SemaFutureChannel.future(filename);
-  auto semaresult = future.get();
+  // A backend that loses the pass, e.g. when its worker exits, fails the
+  // future.
+  // FIXME: Add a resonable timeout. If an in-process SourceKit goes down
+  // async we won't ever get the message back ( somewhat workable for now
+  // because clients will timeout )
+  static auto &semaWaitTime = metrics::StageHistogram("sema_wait");
+  metrics::ScopedTimer timer(semaWaitTime);
+  trace::Span span("sema_wait");
+  std::string semaresult;
+  try {
+    semaresult = future.get();
+  } catch (std::runtime_error &e) {
+    // FIXME: Propagate SourceKitService Errors
+    _logger.log(LogLevelError, "Semantic pass failed: ", e.what());
+    semaresult = "{\"key.diagnostics\": []}";
+  }
+  if (!editorBuffer && !wasOpen) {
+    CloseDocument(filename);
+  }
   return semaresult;
 }
 } // namespace ssvim
@@ -1,4 +1,6 @@
 #import "Logging.hpp"
+#import <functional>
+#import <memory>
 #import <string>
 #import <vector>
 
@@ -15,8 +17,77 @@ class UnsavedFile {
 public:
   std::string contents;
   std::string fileName;
+  // Set instead of `contents` when several requests read the same buffer,
+  // like the items of a batch
+  std::shared_ptr<const std::string> sharedContents;
+
+  const std::string &text() const {
+    return sharedContents ? *sharedContents : contents;
+  }
 };
 
+// Context for a given completion
+struct CompletionContext {
+  // The current source source file's absolute path
+  std::string sourceFilename;
+  std::string completionToken;
+
+  // Position of the completion
+  unsigned line;
+  unsigned column;
+
+  std::vector<std::string> flags;
+
+  // Unsaved files
+  std::vector<UnsavedFile> unsavedFiles;
+
+  // Return the args based on the current flags
+  // and default to the OSX SDK if none.
+  std::vector<std::string> compilerArgs() {
+    if (flags.size() == 0) {
+      return DefaultOSXArgs();
+    }
+
+    return flags;
+  }
+
+  std::vector<std::string> DefaultOSXArgs() {
+    return {
+        "-sdk",
+        "/Applications/Xcode.app/Contents/Developer/Platforms/iPhoneOS.platform/Developer/SDKs/iPhoneOS.sdk",
+        "-target", "arm64-apple-ios14.3",
+    };
+  }
+};
+
+
+// Called with the name and JSON of each semantic notification, on any
+// thread.
+using SemanticListener =
+    std::function<void(const std::string &name, const std::string &JSON)>;
+
+// Listen to semantic notifications, e.g. to push diagnostics to clients.
+// Returns a token for RemoveSemanticListener.
+unsigned AddSemanticListener(SemanticListener listener);
+void RemoveSemanticListener(unsigned token);
+
+// A document open in the backend, with the args it was opened with.
+struct OpenDocument {
+  std::string name;
+  std::vector<std::string> compilerArgs;
+};
+
+// The documents open in the backend, for snapshots.
+std::vector<OpenDocument> OpenDocuments();
+
+// Open documents again after a restart, on a background thread, with the
+// editor's buffer or else the file on disk.
+void ReopenDocuments(LogLevel logLevel, std::vector<OpenDocument> documents);
+
+// Get a clean file and offset for completion.
+void GetOffset(CompletionContext &ctx, unsigned *offset,
+               std::string *CleanFile);
+
 /**
  * Yield complitions in the form of json string.
  *
@@ -31,13 +102,31 @@ public:
 
   const std::string
   CandidatesForLocationInFile(const std::string &filename, int line, int column,
-                              const std::vector<UnsavedFile> &unsavedFiles,
+                              std::vector<UnsavedFile> unsavedFiles,
                               const std::vector<std::string> &flags,
                               const std::string &completionToken);
 
+  // Completions at a speculative position, for the prefetcher and warm-up.
+  // The buffer isn't recorded as the editor's. Returns false on errors.
+  bool SpeculativeCandidates(CompletionContext &ctx, std::string *JSON);
+
   const std::string
   DiagnosticsForFile(const std::string &filename,
-                     const std::vector<UnsavedFile> &unsavedFiles,
+                     std::vector<UnsavedFile> unsavedFiles,
                      const std::vector<std::string> &flags);
+
+  // Diagnostics of a file outside the editor, for project sweeps. The
+  // buffer isn't recorded as the editor's, and the document is closed
+  // afterwards unless the editor has it open.
+  const std::string
+  BackgroundDiagnostics(const std::string &filename,
+                        std::vector<UnsavedFile> unsavedFiles,
+                        const std::vector<std::string> &flags);
+
+private:
+  const std::string diagnostics(const std::string &filename,
+                                std::vector<UnsavedFile> unsavedFiles,
+                                const std::vector<std::string> &flags,
+                                bool editorBuffer);
 };
 } // namespace ssvim
@@ -0,0 +1,187 @@
+#import "Trace.hpp"
+#import "JSON.hpp"
+#import <algorithm>
+#import <atomic>
+#import <chrono>
+#import <deque>
+#import <functional>
+#import <mutex>
+#import <sstream>
+#import <thread>
+#import <vector>
+
+using namespace ssvim::trace;
+
+namespace {
+struct Event {
+  const char *name;
+  std::uint64_t start;
+  std::uint64_t duration;
+  std::size_t thread;
+};
+
+struct Request {
+  std::uint64_t ID;
+  std::string name;
+  std::string file;
+  Event span;
+  std::vector<Event> events;
+};
+
+// State of the current thread
+struct ThreadBuffer {
+  std::uint64_t requestID = 0;
+  std::uint64_t start = 0;
+  std::string name;
+  std::string file;
+  std::vector<Event> events;
+};
+
+// Spans outside of requests are kept in a ring of this size.
+const std::size_t BackgroundEventLimit = 1024;
+
+struct Store {
+  std::mutex mutex;
+  std::size_t requestLimit = 64;
+  std::deque<Request> requests;
+  std::deque<Event> background;
+};
+} // namespace
+
+static Store &SharedStore() {
+  static Store *store = new Store();
+  return *store;
+}
+
+static thread_local ThreadBuffer CurrentThread;
+
+static std::atomic<std::uint64_t> NextRequestID{1};
+
+static std::uint64_t NowMicros() {
+  static auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - epoch)
+      .count();
+}
+
+static std::size_t ThreadID() {
+  static thread_local std::size_t ID =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000;
+  return ID;
+}
+
+#pragma mark - RequestScope
+
+RequestScope::RequestScope(const std::string &name) {
+  auto &buffer = CurrentThread;
+  buffer.requestID = NextRequestID.fetch_add(1, std::memory_order_relaxed);
+  buffer.start = NowMicros();
+  buffer.name = name;
+  buffer.file.clear();
+  buffer.events.clear();
+}
+
+RequestScope::~RequestScope() {
+  auto &buffer = CurrentThread;
+  Request request;
+  request.ID = buffer.requestID;
+  request.name = std::move(buffer.name);
+  request.file = std::move(buffer.file);
+  request.span = {"request", buffer.start, NowMicros() - buffer.start,
+                  ThreadID()};
+  request.events = std::move(buffer.events);
+  buffer.requestID = 0;
+  buffer.events.clear();
+
+  auto &store = SharedStore();
+  std::lock_guard<std::mutex> lock(store.mutex);
+  store.requests.push_back(std::move(request));
+  while (store.requests.size() > store.requestLimit) {
+    store.requests.pop_front();
+  }
+}
+
+std::uint64_t RequestScope::currentID() {
+  return CurrentThread.requestID;
+}
+
+void RequestScope::setFile(const std::string &file) {
+  CurrentThread.file = file;
+}
+
+#pragma mark - Span
+
+Span::Span(const char *name) : _name(name), _start(NowMicros()) {
+}
+
+Span::~Span() {
+  Event event{_name, _start, NowMicros() - _start, ThreadID()};
+  auto &buffer = CurrentThread;
+  if (buffer.requestID) {
+    buffer.events.push_back(event);
+    return;
+  }
+
+  auto &store = SharedStore();
+  std::lock_guard<std::mutex> lock(store.mutex);
+  store.background.push_back(event);
+  if (store.background.size() > BackgroundEventLimit) {
+    store.background.pop_front();
+  }
+}
+
+#pragma mark - Export
+
+void ssvim::trace::SetRecentRequestLimit(std::size_t limit) {
+  auto &store = SharedStore();
+  std::lock_guard<std::mutex> lock(store.mutex);
+  store.requestLimit = limit;
+}
+
+static void WriteEvent(std::ostringstream &os, const Event &event,
+                       const std::string &name, const Request *request,
+                       bool &first) {
+  if (!first) {
+    os << ",\n";
+  }
+  first = false;
+  os << "{\"name\":";
+  os << ssvim::JSONString(name);
+  os << ",\"cat\":\"ssvim\",\"ph\":\"X\",\"pid\":1"
+     << ",\"tid\":" << event.thread << ",\"ts\":" << event.start
+     << ",\"dur\":" << event.duration;
+  if (request) {
+    os << ",\"args\":{\"request_id\":" << request->ID << ",\"request\":";
+    os << ssvim::JSONString(request->name);
+    os << ",\"file\":";
+    os << ssvim::JSONString(request->file);
+    os << "}";
+  }
+  os << "}";
+}
+
+std::string ssvim::trace::ChromeTraceJSON(std::size_t requestCount) {
+  auto &store = SharedStore();
+  std::lock_guard<std::mutex> lock(store.mutex);
+  std::ostringstream os;
+  os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  bool first = true;
+  auto count = std::min(requestCount, store.requests.size());
+  std::uint64_t since = UINT64_MAX;
+  for (auto it = store.requests.end() - count; it != store.requests.end();
+       ++it) {
+    since = std::min(since, it->span.start);
+    WriteEvent(os, it->span, it->name, &*it, first);
+    for (auto &event : it->events) {
+      WriteEvent(os, event, event.name, &*it, first);
+    }
+  }
+  // Only include background work that overlaps the exported requests.
+  for (auto &event : store.background) {
+    if (event.start + event.duration >= since) {
+      WriteEvent(os, event, event.name, nullptr, first);
+    }
+  }
+  os << "\n]}";
+  return os.str();
+}
@@ -0,0 +1,54 @@
+#import <cstdint>
+#import <string>
+
+namespace ssvim {
+namespace trace {
+
+/**
+ * RequestScope marks the lifetime of a request on the current thread.
+ *
+ * Spans recorded on this thread while the scope is alive are tagged with the
+ * request's ID and file. They are buffered thread locally and handed to the
+ * shared store once, when the scope ends.
+ */
+class RequestScope {
+public:
+  RequestScope(const std::string &name);
+  ~RequestScope();
+
+  RequestScope(RequestScope const &) = delete;
+  RequestScope &operator=(RequestScope const &) = delete;
+
+  // The ID of the request traced on this thread, or 0.
+  static std::uint64_t currentID();
+
+  // Tag the request traced on this thread with a file.
+  static void setFile(const std::string &file);
+};
+
+/**
+ * Span records the start and end of a phase of work.
+ *
+ * `name` must outlive the process, in practice a string literal.
+ */
+class Span {
+  const char *_name;
+  std::uint64_t _start;
+
+public:
+  Span(const char *name);
+  ~Span();
+
+  Span(Span const &) = delete;
+  Span &operator=(Span const &) = delete;
+};
+
+// Keep at most this many finished requests. Defaults to 64.
+void SetRecentRequestLimit(std::size_t limit);
+
+// Spans of the most recent `requestCount` requests, along with spans
+// recorded outside of requests, in the Chrome trace_event JSON format.
+std::string ChromeTraceJSON(std::size_t requestCount);
+
+} // namespace trace
+} // namespace ssvim
@@ -0,0 +1,104 @@
+#import <atomic>
+#import <chrono>
+#import <mutex>
+#import <thread>
+
+#import "Metrics.hpp"
+#import "SemanticBackend.hpp"
+#import "SwiftCompleter.hpp"
+#import "Trace.hpp"
+#import "Warmup.hpp"
+
+using namespace ssvim;
+
+using clock_type = std::chrono::steady_clock;
+
+static std::mutex WarmupMutex;
+static WarmupStatus Status = {WarmupStateCold, 0, 0, 0};
+static clock_type::time_point StartTime;
+
+static void UpdateStatus(WarmupState state, unsigned completed) {
+  static auto &warm = metrics::Registry::shared().gauge(
+      "ssvim_warm", "", "Whether startup warm-up has finished");
+  std::lock_guard<std::mutex> lock(WarmupMutex);
+  Status.state = state;
+  Status.completed = completed;
+  std::chrono::duration<double> elapsed = clock_type::now() - StartTime;
+  Status.seconds = elapsed.count();
+  warm.set(state == WarmupStateWarm);
+}
+
+// Complete a member of the module, which makes sourcekitd load it and its
+// dependencies. The throwaway file isn't an editor buffer, so it's sent
+// like a prefetch: it isn't tracked, budgeted or snapshotted. That path
+// also skips the module cache, whose hits would leave the module unloaded.
+static void WarmModule(SwiftCompleter &completer, const std::string &module,
+                       const std::vector<std::string> &flags) {
+  CompletionContext ctx;
+  ctx.sourceFilename = "/ssvim-warmup/" + module + ".swift";
+  ctx.line = 2;
+  ctx.column = module.length();
+  ctx.flags = flags;
+  UnsavedFile file;
+  file.fileName = ctx.sourceFilename;
+  file.contents = "import " + module + "\n" + module + ".";
+  ctx.unsavedFiles.push_back(std::move(file));
+  std::string JSON;
+  completer.SpeculativeCandidates(ctx, &JSON);
+}
+
+void ssvim::StartWarmup(LogLevel logLevel, WarmupOptions options) {
+  if (options.flagSets.empty()) {
+    options.flagSets.push_back({});
+  }
+  {
+    std::lock_guard<std::mutex> lock(WarmupMutex);
+    StartTime = clock_type::now();
+    Status.state = WarmupStateWarming;
+    Status.total = options.modules.size() * options.flagSets.size();
+  }
+
+  std::thread([logLevel, options] {
+    Logger logger(logLevel, "WARMUP");
+    logger << "WILL_WARMUP";
+    {
+      trace::Span span("warmup_initialize");
+      SharedSemanticBackend()->Initialize();
+    }
+
+    SwiftCompleter completer(LogLevelError);
+    unsigned completed = 0;
+    for (auto &flags : options.flagSets) {
+      for (auto &module : options.modules) {
+        trace::Span span("warmup_module");
+        WarmModule(completer, module, flags);
+        UpdateStatus(WarmupStateWarming, ++completed);
+        logger << "WARMED: " << module;
+      }
+    }
+    UpdateStatus(WarmupStateWarm, completed);
+    logger << "DID_WARMUP: " << CurrentWarmupStatus().seconds << "s";
+  }).detach();
+}
+
+WarmupStatus ssvim::CurrentWarmupStatus() {
+  std::lock_guard<std::mutex> lock(WarmupMutex);
+  auto status = Status;
+  if (status.state == WarmupStateWarming) {
+    std::chrono::duration<double> elapsed = clock_type::now() - StartTime;
+    status.seconds = elapsed.count();
+  }
+  return status;
+}
+
+const char *ssvim::WarmupStateName(WarmupState state) {
+  switch (state) {
+  case WarmupStateCold:
+    return "cold";
+  case WarmupStateWarming:
+    return "warming";
+  case WarmupStateWarm:
+    return "warm";
+  }
+  return "cold";
+}
@@ -0,0 +1,43 @@
+#import "Logging.hpp"
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+typedef enum WarmupState {
+  // Warm-up hasn't started, or is disabled
+  WarmupStateCold,
+  WarmupStateWarming,
+  WarmupStateWarm
+} WarmupState;
+
+struct WarmupOptions {
+  // Modules to import in throwaway completions, e.g. Foundation
+  std::vector<std::string> modules;
+  // Each module is completed once per flag set. An empty set uses the
+  // default flags.
+  std::vector<std::vector<std::string>> flagSets;
+};
+
+struct WarmupStatus {
+  WarmupState state;
+  unsigned completed;
+  unsigned total;
+  // Time warm-up took, or has taken so far
+  double seconds;
+};
+
+/**
+ * Warm up the shared semantic backend on a background thread.
+ *
+ * The backend is initialized and then a completion is run for every module
+ * and flag set, so the first user request doesn't pay for loading the SDK.
+ * Should be called once, at startup.
+ */
+void StartWarmup(LogLevel logLevel, WarmupOptions options);
+
+WarmupStatus CurrentWarmupStatus();
+
+const char *WarmupStateName(WarmupState state);
+
+} // namespace ssvim
@@ -0,0 +1,566 @@
+#import <cerrno>
+#import <chrono>
+#import <csignal>
+#import <cstring>
+#import <fcntl.h>
+#import <functional>
+#import <future>
+#import <atomic>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <sstream>
+#import <string>
+#import <sys/socket.h>
+#import <sys/wait.h>
+#import <thread>
+#import <unistd.h>
+#import <vector>
+
+#import "Logging.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+#import "SemanticBackend.hpp"
+
+// Worker protocol
+//
+// The supervisor and a worker exchange messages over a socket pair, which is
+// the worker's stdin and stdout. Like backend traffic logs, a message is a
+// line of space separated fields followed by length prefixed strings:
+//
+// Q <id> <kind> <offset> <arg_count>      supervisor to worker
+// <len>:<name>
+// <len>:<arg>                             (arg_count times)
+// <len>:<source_text>
+//
+// A <id> <is_error>                       worker to supervisor
+// <len>:<response_json>
+//
+// N                                       worker to supervisor
+// <len>:<name>
+// <len>:<notification_json>
+//
+// Requests are answered out of order; an ID of 0 asks for no answer.
+
+using namespace ssvim;
+
+enum WorkerRequestKind {
+  WorkerRequestCompletionOpen,
+  WorkerRequestCompletionUpdate,
+  WorkerRequestCompletionClose,
+  WorkerRequestEditorOpen,
+  WorkerRequestEditorReplaceText,
+  WorkerRequestEditorClose,
+};
+
+static void AppendString(std::string &out, const std::string &value) {
+  out += std::to_string(value.length());
+  out += ':';
+  out += value;
+  out += '\n';
+}
+
+// Write all of `data`. SIGPIPE is ignored, so a closed peer is an error.
+static bool WriteAll(int fd, const std::string &data) {
+  std::size_t written = 0;
+  while (written < data.size()) {
+    auto n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+// Buffered reads of protocol messages from a file descriptor.
+class MessageReader {
+  int _fd;
+  std::string _buffer;
+  std::size_t _position = 0;
+
+  bool fill() {
+    if (_position) {
+      _buffer.erase(0, _position);
+      _position = 0;
+    }
+    char chunk[64 * 1024];
+    ssize_t n;
+    do {
+      n = read(_fd, chunk, sizeof(chunk));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return false;
+    }
+    _buffer.append(chunk, n);
+    return true;
+  }
+
+public:
+  MessageReader(int fd) : _fd(fd) {
+  }
+
+  bool readLine(std::string &line) {
+    for (;;) {
+      auto end = _buffer.find('\n', _position);
+      if (end != std::string::npos) {
+        line.assign(_buffer, _position, end - _position);
+        _position = end + 1;
+        return true;
+      }
+      if (!fill()) {
+        return false;
+      }
+    }
+  }
+
+  bool readString(std::string &value) {
+    std::string header;
+    for (;;) {
+      auto colon = _buffer.find(':', _position);
+      if (colon != std::string::npos) {
+        header.assign(_buffer, _position, colon - _position);
+        _position = colon + 1;
+        break;
+      }
+      if (!fill()) {
+        return false;
+      }
+    }
+    auto length = std::strtoull(header.c_str(), nullptr, 10);
+    while (_buffer.size() - _position < length + 1) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    value.assign(_buffer, _position, length);
+    _position += length + 1;
+    return true;
+  }
+};
+
+static std::string RequestMessage(std::uint64_t id, WorkerRequestKind kind,
+                                  const BackendRequest &request) {
+  std::string message = "Q " + std::to_string(id) + " " +
+                        std::to_string(kind) + " " +
+                        std::to_string(request.offset) + " " +
+                        std::to_string(request.compilerArgs.size()) + "\n";
+  AppendString(message, request.name);
+  for (auto &arg : request.compilerArgs) {
+    AppendString(message, arg);
+  }
+  AppendString(message, request.sourceText);
+  return message;
+}
+
+// Requests with the same flags go to the same worker, so its caches are
+// reused. Inputs are left out, since they differ between files of a module.
+static std::size_t FlagSetHash(const std::vector<std::string> &args) {
+  std::string key;
+  for (auto &arg : args) {
+    if (arg.size() > 6 && arg.compare(arg.size() - 6, 6, ".swift") == 0) {
+      continue;
+    }
+    key += arg;
+    key += '\0';
+  }
+  return std::hash<std::string>()(key);
+}
+
+namespace ssvim {
+
+#pragma mark - WorkerPoolBackend
+
+// Forks are serialized so a worker never inherits another worker's socket.
+static std::mutex SpawnMutex;
+
+class WorkerPoolBackend
+    : public SemanticBackend,
+      public std::enable_shared_from_this<WorkerPoolBackend> {
+  struct Worker {
+    unsigned index;
+    std::mutex mutex;
+    // Read without the mutex for memory accounting
+    std::atomic<pid_t> pid{-1};
+    int fd = -1;
+    std::uint64_t nextID = 1;
+    std::map<std::uint64_t, std::promise<BackendResponse>> pending;
+    // The latest text of each document opened on the worker, replayed when
+    // it restarts
+    std::map<std::string, BackendRequest> documents;
+  };
+
+  Logger _logger;
+  WorkerPoolOptions _options;
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::mutex _handlerMutex;
+  SemanticNotificationHandler _handler;
+  SemanticFailureHandler _failureHandler;
+  std::once_flag _accounted;
+
+  metrics::Counter &_restarts = metrics::Registry::shared().counter(
+      "ssvim_worker_restarts_total", "", "Semantic workers restarted");
+  metrics::Counter &_timeouts = metrics::Registry::shared().counter(
+      "ssvim_worker_timeouts_total", "",
+      "Semantic workers killed for not answering a request in time");
+
+  // Start the worker's process. Called with the worker's mutex held.
+  bool spawn(Worker &worker) {
+    std::vector<char *> argv;
+    for (auto &arg : _options.command) {
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int fds[2];
+    pid_t pid;
+    {
+      std::lock_guard<std::mutex> lock(SpawnMutex);
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        _logger.log(LogLevelError, "socketpair: ", strerror(errno));
+        return false;
+      }
+      fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+      pid = fork();
+      if (pid == 0) {
+        dup2(fds[1], STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execvp(argv[0], argv.data());
+        _exit(127);
+      }
+      close(fds[1]);
+    }
+    if (pid < 0) {
+      _logger.log(LogLevelError, "fork: ", strerror(errno));
+      close(fds[0]);
+      return false;
+    }
+    worker.pid = pid;
+    worker.fd = fds[0];
+    _logger << "Started worker " + std::to_string(worker.index) + " pid " +
+                   std::to_string(pid);
+
+    auto fd = fds[0];
+    auto self = shared_from_this();
+    std::thread([self, &worker, fd] { self->readResponses(worker, fd); })
+        .detach();
+
+    for (auto &document : worker.documents) {
+      WriteAll(fd, RequestMessage(0, WorkerRequestEditorOpen,
+                                  document.second));
+    }
+    return true;
+  }
+
+  void readResponses(Worker &worker, int fd) {
+    MessageReader reader(fd);
+    std::string line;
+    while (reader.readLine(line)) {
+      std::istringstream fields(line);
+      char type;
+      fields >> type;
+      if (type == 'A') {
+        std::uint64_t id;
+        BackendResponse response;
+        fields >> id >> response.isError;
+        if (!reader.readString(response.JSON)) {
+          break;
+        }
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        auto waiting = worker.pending.find(id);
+        if (waiting != worker.pending.end()) {
+          waiting->second.set_value(response);
+          worker.pending.erase(waiting);
+        }
+      } else if (type == 'N') {
+        std::string name, JSON;
+        if (!reader.readString(name) || !reader.readString(JSON)) {
+          break;
+        }
+        SemanticNotificationHandler handler;
+        {
+          std::lock_guard<std::mutex> lock(_handlerMutex);
+          handler = _handler;
+        }
+        if (handler) {
+          handler(name, JSON);
+        }
+      }
+    }
+    workerExited(worker, fd);
+  }
+
+  // Fail the requests in flight and the semantic passes of its documents,
+  // and restart the worker with its documents. The worker is reaped and
+  // restarted without its mutex held, so requests to it fail fast meanwhile.
+  void workerExited(Worker &worker, int fd) {
+    pid_t pid;
+    std::vector<std::string> documents;
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      if (worker.fd != fd) {
+        return;
+      }
+      close(fd);
+      worker.fd = -1;
+      pid = worker.pid;
+      worker.pid = -1;
+      for (auto &waiting : worker.pending) {
+        BackendResponse response;
+        response.isError = true;
+        response.JSON = "{\"error\": \"semantic worker exited\"}";
+        waiting.second.set_value(response);
+      }
+      worker.pending.clear();
+      for (auto &document : worker.documents) {
+        documents.push_back(document.first);
+      }
+    }
+    SemanticFailureHandler failureHandler;
+    {
+      std::lock_guard<std::mutex> lock(_handlerMutex);
+      failureHandler = _failureHandler;
+    }
+    if (failureHandler) {
+      for (auto &document : documents) {
+        failureHandler(document, "semantic worker exited");
+      }
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    _logger.log(LogLevelError, "Worker exited: ",
+                std::to_string(worker.index) + " status " +
+                    std::to_string(status));
+    _restarts.increment();
+    // Don't spin if the worker can't start at all
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    // A request may have started it meanwhile
+    if (worker.fd < 0) {
+      spawn(worker);
+    }
+  }
+
+  // Kill a worker that didn't answer request `id` in time. It's restarted
+  // once its output closes, which fails the request.
+  void requestTimedOut(Worker &worker, std::uint64_t id) {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (!worker.pending.count(id) || worker.pid <= 0) {
+      return;
+    }
+    _logger.log(LogLevelError, "Worker timed out: ",
+                std::to_string(worker.index) + " pid " +
+                    std::to_string(worker.pid));
+    _timeouts.increment();
+    kill(worker.pid, SIGKILL);
+  }
+
+  BackendResponse send(WorkerRequestKind kind, const BackendRequest &request) {
+    auto &worker =
+        *_workers[FlagSetHash(request.compilerArgs) % _workers.size()];
+    std::future<BackendResponse> response;
+    std::uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      if (kind == WorkerRequestEditorOpen ||
+          kind == WorkerRequestEditorReplaceText) {
+        worker.documents[request.name] = request;
+      } else if (kind == WorkerRequestEditorClose) {
+        worker.documents.erase(request.name);
+      }
+      if (worker.fd < 0 && !spawn(worker)) {
+        BackendResponse out;
+        out.isError = true;
+        out.JSON = "{\"error\": \"cannot start semantic worker\"}";
+        return out;
+      }
+      id = worker.nextID++;
+      response = worker.pending[id].get_future();
+      // A failed write shows up as the worker exiting
+      WriteAll(worker.fd, RequestMessage(id, kind, request));
+    }
+    auto timeout = _options.requestTimeout;
+    if (timeout.count() &&
+        response.wait_for(timeout) == std::future_status::timeout) {
+      requestTimedOut(worker, id);
+    }
+    return response.get();
+  }
+
+public:
+  // Workers run until the end of their input, so they exit with the server.
+  // The pool lives as long as its workers.
+  WorkerPoolBackend(LogLevel logLevel, WorkerPoolOptions options)
+      : _logger(logLevel, "WORKERS"), _options(options) {
+    signal(SIGPIPE, SIG_IGN);
+    for (unsigned i = 0; i < std::max(1u, options.workers); i++) {
+      _workers.emplace_back(new Worker());
+      _workers.back()->index = i;
+    }
+  }
+
+  // The resident memory of the running workers
+  std::uint64_t residentBytes() {
+    std::uint64_t bytes = 0;
+    for (auto &worker : _workers) {
+      pid_t pid = worker->pid;
+      if (pid > 0) {
+        bytes += ResidentMemoryBytes(pid);
+      }
+    }
+    return bytes;
+  }
+
+  void Initialize() override {
+    std::call_once(_accounted, [this] {
+      std::weak_ptr<WorkerPoolBackend> weak = shared_from_this();
+      auto resident = [weak]() -> std::uint64_t {
+        auto self = weak.lock();
+        return self ? self->residentBytes() : 0;
+      };
+      // Workers hold sourcekitd's memory, so they count against the budget
+      MemoryBudget::shared().addResidentSource(resident);
+      metrics::Registry::shared().gaugeFunction(
+          "ssvim_worker_resident_bytes", "",
+          "Resident memory of semantic workers",
+          [resident] { return (double)resident(); });
+    });
+    for (auto &worker : _workers) {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      if (worker->fd < 0) {
+        spawn(*worker);
+      }
+    }
+  }
+
+  BackendResponse CompletionOpen(const BackendRequest &request) override {
+    return send(WorkerRequestCompletionOpen, request);
+  }
+
+  BackendResponse CompletionUpdate(const BackendRequest &request) override {
+    return send(WorkerRequestCompletionUpdate, request);
+  }
+
+  BackendResponse CompletionClose(const BackendRequest &request) override {
+    return send(WorkerRequestCompletionClose, request);
+  }
+
+  BackendResponse EditorOpen(const BackendRequest &request) override {
+    return send(WorkerRequestEditorOpen, request);
+  }
+
+  BackendResponse EditorReplaceText(const BackendRequest &request) override {
+    return send(WorkerRequestEditorReplaceText, request);
+  }
+
+  // A close goes to the worker that has the document open.
+  BackendResponse EditorClose(const BackendRequest &request) override {
+    for (auto &worker : _workers) {
+      BackendRequest document;
+      {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        auto entry = worker->documents.find(request.name);
+        if (entry == worker->documents.end()) {
+          continue;
+        }
+        document = entry->second;
+      }
+      document.sourceText.clear();
+      return send(WorkerRequestEditorClose, document);
+    }
+    return BackendResponse();
+  }
+
+  void SetNotificationHandler(SemanticNotificationHandler handler) override {
+    std::lock_guard<std::mutex> lock(_handlerMutex);
+    _handler = handler;
+  }
+
+  void SetFailureHandler(SemanticFailureHandler handler) override {
+    std::lock_guard<std::mutex> lock(_handlerMutex);
+    _failureHandler = handler;
+  }
+};
+
+std::shared_ptr<SemanticBackend>
+MakeWorkerPoolBackend(LogLevel logLevel, WorkerPoolOptions options) {
+  return std::make_shared<WorkerPoolBackend>(logLevel, options);
+}
+
+#pragma mark - Worker
+
+void ServeSemanticWorker(std::shared_ptr<SemanticBackend> backend) {
+  signal(SIGPIPE, SIG_IGN);
+  auto outputMutex = std::make_shared<std::mutex>();
+  auto write = [outputMutex](const std::string &message) {
+    std::lock_guard<std::mutex> lock(*outputMutex);
+    WriteAll(STDOUT_FILENO, message);
+  };
+  backend->SetNotificationHandler(
+      [write](const std::string &name, const std::string &JSON) {
+        std::string message = "N\n";
+        AppendString(message, name);
+        AppendString(message, JSON);
+        write(message);
+      });
+  backend->Initialize();
+
+  MessageReader reader(STDIN_FILENO);
+  std::string line;
+  while (reader.readLine(line)) {
+    std::istringstream fields(line);
+    char type;
+    std::uint64_t id;
+    int kind;
+    std::size_t argCount;
+    BackendRequest request;
+    fields >> type >> id >> kind >> request.offset >> argCount;
+    if (type != 'Q' || !reader.readString(request.name)) {
+      break;
+    }
+    request.compilerArgs.resize(argCount);
+    for (auto &arg : request.compilerArgs) {
+      reader.readString(arg);
+    }
+    if (!reader.readString(request.sourceText)) {
+      break;
+    }
+
+    // Requests run concurrently, like in the supervisor
+    std::thread([backend, write, id, kind, request] {
+      BackendResponse response;
+      switch (kind) {
+      case WorkerRequestCompletionOpen:
+        response = backend->CompletionOpen(request);
+        break;
+      case WorkerRequestCompletionUpdate:
+        response = backend->CompletionUpdate(request);
+        break;
+      case WorkerRequestCompletionClose:
+        response = backend->CompletionClose(request);
+        break;
+      case WorkerRequestEditorOpen:
+        response = backend->EditorOpen(request);
+        break;
+      case WorkerRequestEditorReplaceText:
+        response = backend->EditorReplaceText(request);
+        break;
+      case WorkerRequestEditorClose:
+        response = backend->EditorClose(request);
+        break;
+      }
+      if (id) {
+        std::string message = "A " + std::to_string(id) + " " +
+                              std::to_string(response.isError) + "\n";
+        AppendString(message, response.JSON);
+        write(message);
+      }
+    }).detach();
+  }
+}
+
+} // namespace ssvim
@@ -23,31 +23,35 @@ from __future__ import absolute_import
 # Not installing aliases from python-future; it's unreliable and slow.
 from builtins import *  # noqa
 
-from ycmd.utils import ToBytes, ToUnicode, ProcessIsRunning, urljoin
+from ycmd.utils import ToBytes, ToUnicode, ProcessIsRunning
 from ycmd.completers.completer import Completer
 from ycmd import responses, utils, hmac_utils
-from ycmd.completers.swift.swift_flags import Flags
-
-from tempfile import NamedTemporaryFile
 
 from base64 import b64encode
-from future.utils import native
 import json
 import logging
-import requests
+import socket
 import threading
 import os
 import time
 import re
+import uuid
+
+try:
+  import http.client as http_client
+except ImportError:
+  import httplib as http_client
 
 
 HMAC_SECRET_LENGTH = 16
 SSVIMHTTP_HMAC_HEADER = 'x-http-hmac'
-LOGFILE_FORMAT = 'swiftyswift_http_{port}_{std}_'
+# Names the editor instance, so the shared daemon keeps its buffers apart
+SSVIMHTTP_CLIENT_HEADER = 'X-SSVIM-Client'
+LOGFILE_FORMAT = 'swiftyswift_http_{client}_{std}_'
+LISTENING_PREFIX = '__LISTENINGON: '
 PATH_TO_SSVIMHTTP = os.path.abspath(
   os.path.join( os.path.dirname( __file__ ), '..', '..', '..',
                 'third_party', 'swiftyswiftvim', 'build', 'http_server' ) )
-SSVIM_IP = "127.0.0.1"
 
 DIAGNOSTIC_PHASE_PARSE = 'source.diagnostic.stage.swift.parse'
 
@@ -56,6 +60,28 @@ def ShouldEnableSwiftCompleter():
   return os.path.isfile( PATH_TO_SSVIMHTTP )
 
 
+class UnixHTTPConnection( http_client.HTTPConnection ):
+  '''
+  An HTTP connection over the Unix domain socket of the daemon.
+  '''
+
+  def __init__( self, socket_path, timeout = None ):
+    http_client.HTTPConnection.__init__( self, 'localhost', timeout = timeout )
+    self._socket_path = socket_path
+
+
+  def connect( self ):
+    sock = socket.socket( socket.AF_UNIX, socket.SOCK_STREAM )
+    if self.timeout is not None:
+      sock.settimeout( self.timeout )
+    sock.connect( self._socket_path )
+    self.sock = sock
+
+
+class SSVIMRequestError( Exception ):
+  pass
+
+
 class SwiftCompleter( Completer ):
   '''
   A Completer that uses the Swifty Swift Vim semantic engine for Swift.
@@ -65,14 +91,15 @@ class SwiftCompleter( Completer ):
   def __init__( self, user_options ):
     super( SwiftCompleter, self ).__init__( user_options )
     self._server_lock = threading.RLock()
-    self._http_port = None
+    self._socket_path = None
     self._http_phandle = None
+    # Editor instances share one daemon, each with its own buffers
+    self._client_id = uuid.uuid4().hex
     self._logger = logging.getLogger( __name__ )
     self._logfile_stdout = None
     self._logfile_stderr = None
     self._keep_logfiles = user_options[ 'server_keep_logfiles' ]
     self._hmac_secret = ''
-    self._flags = Flags()
     self._StartServer()
 
 
@@ -93,7 +120,7 @@ class SwiftCompleter( Completer ):
       self._logger.info( 'SSVIM not running.' )
       try:
         return bool( self._GetResponse( '/status', timeout = 0.2 ) )
-      except requests.exceptions.ConnectionError as e:
+      except ( socket.error, SSVIMRequestError ) as e:
         self._logger.error( 'Failed Ready' )
         self._logger.exception( e )
         return False
@@ -104,10 +131,13 @@ class SwiftCompleter( Completer ):
     '''
     Check if the server is alive. That doesn't necessarily mean it's ready to
     serve requests; that's checked by ServerIsHealthy.
+
+    The process started by this instance may have only attached to a running
+    daemon and exited, so the daemon's socket is checked.
     '''
     with self._server_lock:
-      status = ( bool( self._http_port ) and
-                 ProcessIsRunning( self._http_phandle ) )
+      status = ( bool( self._socket_path ) and
+                 os.path.exists( self._socket_path ) )
       self._logger.debug( 'Healthy Status ' + str( status ) )
       return status
 
@@ -118,25 +148,25 @@ class SwiftCompleter( Completer ):
     self._StartServer()
 
 
+  # Other editor instances may still use the daemon, so this instance only
+  # detaches. The daemon exits once no instance is attached.
   def _StopServer( self ):
     with self._server_lock:
       if self._ServerIsRunning():
-        self._logger.info( 'Stopping SSVIM server with PID {0}'.format(
-                                 self._http_phandle.pid ) )
-        self._GetResponse( '/shutdown' )
+        self._logger.info( 'Detaching from SSVIM daemon at {0}'.format(
+                                 self._socket_path ) )
         try:
-          utils.WaitUntilProcessIsTerminated( self._http_phandle,
-                                              timeout = 5 )
-          self._logger.info( 'SSVIM server stopped' )
-        except RuntimeError:
-          self._logger.exception( 'Error while stopping SSVIM server' )
+          self._GetResponse( '/detach', retry = False )
+          self._logger.info( 'SSVIM daemon detached' )
+        except ( socket.error, SSVIMRequestError ):
+          self._logger.exception( 'Error while detaching from SSVIM daemon' )
 
-        self._CleanUp()
+      self._CleanUp()
 
 
   def _CleanUp( self ):
     self._http_phandle = None
-    self._http_port = None
+    self._socket_path = None
     if not self._keep_logfiles:
       utils.RemoveIfExists( self._logfile_stdout )
       self._logfile_stdout = None
@@ -144,39 +174,30 @@ class SwiftCompleter( Completer ):
       self._logfile_stderr = None
 
 
+  # Start the shared daemon, or attach to the one that is running. Either
+  # way the process prints the daemon's socket; an attaching one then exits.
   def _StartServer( self ):
     with self._server_lock:
-      self._logger.info( 'Starting SSVIM server' )
-      self._http_port = utils.GetUnusedLocalhostPort()
-      self._http_host = ToBytes( 'http://{0}:{1}'.format(
-        SSVIM_IP, self._http_port ) )
-      self._logger.info( 'using port {0}'.format( self._http_port ) )
+      self._logger.info( 'Starting SSVIM daemon' )
       self._hmac_secret = self._GenerateHmacSecret()
+      command = [ PATH_TO_SSVIMHTTP,
+                  '--daemon',
+                  '--log', self._GetLoggingLevel() ]
 
-      # The server will delete the secret_file after it's done reading it
-      with NamedTemporaryFile( delete = False, mode = 'w+' ) as hmac_file:
-        json.dump( { 'hmac_secret': ToUnicode(
-                      b64encode( self._hmac_secret ) ) },
-                       hmac_file )
-        command = [ PATH_TO_SSVIMHTTP,
-                    '--ip', SSVIM_IP,
-                    '--port', str( self._http_port ),
-                    '--log', self._GetLoggingLevel(),
-                    '--hmac-file-secret', hmac_file.name ]
-
-        self._logfile_stdout = utils.CreateLogfile(
-          LOGFILE_FORMAT.format( port = self._http_port, std = 'stdout' ) )
-        self._logfile_stderr = utils.CreateLogfile(
-          LOGFILE_FORMAT.format( port = self._http_port, std = 'stderr' ) )
+      self._logfile_stdout = utils.CreateLogfile(
+        LOGFILE_FORMAT.format( client = self._client_id, std = 'stdout' ) )
+      self._logfile_stderr = utils.CreateLogfile(
+        LOGFILE_FORMAT.format( client = self._client_id, std = 'stderr' ) )
 
-        with utils.OpenForStdHandle( self._logfile_stdout ) as logout:
-          with utils.OpenForStdHandle( self._logfile_stderr ) as logerr:
-            self._http_phandle = utils.SafePopen( command,
-                                                  stdout = logout,
-                                                  stderr = logerr )
+      with utils.OpenForStdHandle( self._logfile_stdout ) as logout:
+        with utils.OpenForStdHandle( self._logfile_stderr ) as logerr:
+          self._http_phandle = utils.SafePopen( command,
+                                                stdout = logout,
+                                                stderr = logerr )
 
-      self._WaitForInitialSwiftySwiftVimBoot()
-      self._logger.info( 'Started SSVIM server' )
+      self._socket_path = self._WaitForInitialSwiftySwiftVimBoot()
+      self._logger.info( 'Using SSVIM daemon at {0}'.format(
+                           self._socket_path ) )
 
 
   # Wait for initial Swifty Swift Vim Boot. Wait until the process writes
@@ -184,19 +205,27 @@ class SwiftCompleter( Completer ):
   # dynamic linking and setting up the HTTP stack ) make it impossible for the
   # backend to respond to requests after immediately launching the process. If
   # the process isn't ready, YCMD will fail.
+  #
+  # Returns the daemon's socket, from the startup message.
   def _WaitForInitialSwiftySwiftVimBoot( self ):
     # Timeout: in profiling runs on a 2014 MBA, I observed booting to take less
     # than 100ms. After starting the service once it was dramatically reduced.
-    timeout = 5.0
+    # Attaching waits up to 10 seconds for a daemon that is starting.
+    timeout = 15.0
     expiration = time.time() + timeout
     while True:
       if time.time() > expiration:
         raise RuntimeError( 'Waited SSVIM to boot for {0} seconds, '
                             'aborting.'.format( timeout ) )
-      if os.stat( self._logfile_stdout ).st_size != 0:
-        break
-      if os.stat( self._logfile_stderr ).st_size != 0:
-        break
+      # Checked before reading, as an attaching process exits once it printed
+      exited = not ProcessIsRunning( self._http_phandle )
+      with open( self._logfile_stdout ) as logout:
+        for line in logout:
+          if line.startswith( LISTENING_PREFIX ):
+            return line[ len( LISTENING_PREFIX ): ].strip()
+      if exited:
+        raise RuntimeError( 'SSVIM exited without a socket, see {0}'.format(
+                              self._logfile_stderr ) )
       time.sleep( 0.1 )
 
 
@@ -211,33 +240,50 @@ class SwiftCompleter( Completer ):
     return logging.getLevelName( log_level ).lower()
 
 
-  def _GetResponse( self, handler, request_data = {}, timeout = None ):
-    '''POST JSON requests and return JSON response.'''
-    handler = ToBytes( handler )
-    url = urljoin( self._http_host, handler )
+  def _GetResponse( self, handler, request_data = {}, timeout = None,
+                    retry = True ):
+    '''POST JSON requests and return JSON response.
+
+    A daemon that exited, e.g. after idling out, is started again once.'''
+    try:
+      return self._Post( handler, request_data, timeout )
+    except socket.error:
+      if not retry:
+        raise
+      self._logger.info( 'SSVIM daemon is gone, starting it again' )
+      self._StartServer()
+      return self._Post( handler, request_data, timeout )
+
+
+  def _Post( self, handler, request_data, timeout ):
     parameters = self._PrepareRequestBody( request_data )
     body = ToBytes( json.dumps( parameters ) ) if parameters else bytes()
-    extra_headers = self._ExtraHeaders( handler, body )
+    extra_headers = self._ExtraHeaders( ToBytes( handler ), body )
 
-    self._logger.debug( 'Making SSVIM request: %s %s %s %s', 'POST', url,
-                         extra_headers, body )
+    self._logger.debug( 'Making SSVIM request: %s %s %s %s', 'POST',
+                        handler, extra_headers, body )
 
-    response = requests.request( native( bytes( b'POST' ) ),
-                                 native( url ),
-                                 data = body,
-                                 headers = extra_headers,
-                                 timeout = timeout )
-    response.raise_for_status()
+    connection = UnixHTTPConnection( self._socket_path, timeout = timeout )
     try:
-      value = response.json()
+      connection.request( 'POST', handler, body = body,
+                          headers = extra_headers )
+      response = connection.getresponse()
+      data = response.read()
+    finally:
+      connection.close()
+    if response.status >= 400:
+      raise SSVIMRequestError( '{0} {1}: {2}'.format(
+        response.status, handler, ToUnicode( data ) ) )
+    try:
+      value = json.loads( ToUnicode( data ) )
 
       self._logger.debug( 'Got SSVIM response: %s %s %s %s',
-                          'POST', url, value, value.keys() )
+                          'POST', handler, value, value.keys() )
       return value
     except:
       value = {}
       self._logger.debug( 'Got SSVIM response: %s %s %s %s',
-                          'POST', url, value, value.keys() )
+                          'POST', handler, value, value.keys() )
       return value
 
 
@@ -249,6 +295,7 @@ class SwiftCompleter( Completer ):
 
     extra_headers = { 'content-type': 'application/json' }
     extra_headers[ SSVIMHTTP_HMAC_HEADER ] = b64encode( hmac )
+    extra_headers[ SSVIMHTTP_CLIENT_HEADER ] = self._client_id
     return extra_headers
 
 
@@ -262,16 +309,12 @@ class SwiftCompleter( Completer ):
     col = request_data[ 'start_codepoint' ]
     query = request_data[ 'query' ]
 
-    filename = request_data[ 'filepath' ]
-    flags = self._flags.FlagsForFile( filename )
-
-    logging.debug("SSVIM Prepared request with flags:" + str( flags ) )
+    # Flags are looked up by the server, in the file's compile_commands.json
     return {
       'contents': source,
       'line': line,
       'column': col,
       'file_name': path,
-      'flags': flags,
       'query': query
     }
 
@@ -298,8 +341,7 @@ class SwiftCompleter( Completer ):
       name = 'SwiftySwiftVim',
       handle = self._http_phandle,
       executable = PATH_TO_SSVIMHTTP,
-      address = SSVIM_IP,
-      port = self._http_port,
+      address = self._socket_path,
       logfiles = [ self._logfile_stdout, self._logfile_stderr ] )
 
     return responses.BuildDebugInfoResponse(